@@ -0,0 +1,223 @@
+/* ----------------------------------------------------------------------
+ * open8055rec2csv.c
+ *
+ *	Convert a recording made with Open8055_StartRecording() into CSV.
+ *
+ *	    open8055rec2csv recording.bin [output.csv]
+ *
+ *	Every report becomes one line
+ *
+ *	    time_ns,direction,type,values
+ *
+ *	where values are the fields of the report in the same order and
+ *	representation as in the network protocol's RECV/SEND lines.
+ * ----------------------------------------------------------------------
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "open8055_hid_protocol.h"
+#include "open8055_recording.h"
+
+
+static uint16_t
+GetLE16(unsigned char *p)
+{
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t
+GetLE32(unsigned char *p)
+{
+	return (uint32_t)GetLE16(p) | ((uint32_t)GetLE16(p + 2) << 16);
+}
+
+static uint64_t
+GetLE64(unsigned char *p)
+{
+	return (uint64_t)GetLE32(p) | ((uint64_t)GetLE32(p + 4) << 32);
+}
+
+/* HID reports carry 16 bit values big endian */
+static int
+GetBE16(unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+
+/* ----
+ * PrintReport()
+ *
+ *	Write the type name and the decoded values of one report.
+ * ----
+ */
+static void
+PrintReport(FILE *out, unsigned char *msg)
+{
+	int		i;
+
+	switch (msg[0])
+	{
+		case OPEN8055_HID_MESSAGE_INPUT:
+			fprintf(out, "INPUT,%d", msg[1]);
+			for (i = 0; i < 7; i++)
+				fprintf(out, " %d", GetBE16(msg + 2 + i * 2));
+			break;
+
+		case OPEN8055_HID_MESSAGE_OUTPUT:
+			fprintf(out, "OUTPUT,%d", msg[1]);
+			for (i = 0; i < 10; i++)
+				fprintf(out, " %d", GetBE16(msg + 2 + i * 2));
+			fprintf(out, " %d", msg[22]);
+			break;
+
+		case OPEN8055_HID_MESSAGE_SETCONFIG1:
+			fprintf(out, "SETCONFIG1,");
+			for (i = 1; i < 18; i++)
+				fprintf(out, "%s%d", (i == 1) ? "" : " ", msg[i]);
+			for (i = 0; i < 5; i++)
+				fprintf(out, " %d", GetBE16(msg + 18 + i * 2));
+			fprintf(out, " %d", msg[28]);
+			break;
+
+		case OPEN8055_HID_MESSAGE_GETINPUT:		fprintf(out, "GETINPUT,");
+												break;
+		case OPEN8055_HID_MESSAGE_GETCONFIG:	fprintf(out, "GETCONFIG,");
+												break;
+		case OPEN8055_HID_MESSAGE_SAVECONFIG:	fprintf(out, "SAVECONFIG,");
+												break;
+		case OPEN8055_HID_MESSAGE_SAVEALL:		fprintf(out, "SAVEALL,");
+												break;
+		case OPEN8055_HID_MESSAGE_RESET:		fprintf(out, "RESET,");
+												break;
+
+		default:
+			fprintf(out, "0x%02x,", msg[0]);
+			for (i = 1; i < OPEN8055_HID_MESSAGE_SIZE; i++)
+				fprintf(out, "%s%d", (i == 1) ? "" : " ", msg[i]);
+			break;
+	}
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	FILE			*in;
+	FILE			*out = stdout;
+	unsigned char	header[OPEN8055_RECORDING_HEADER_SIZE];
+	unsigned char	block[OPEN8055_RECORDING_BLOCK_SIZE];
+	unsigned char	record[OPEN8055_RECORDING_RECORD_SIZE];
+	static char		*direction[] = {"recv", "sent", "state"};
+	int				recordSize;
+	uint32_t		nrecords;
+	uint32_t		dropped;
+	uint32_t		blocks = 0;
+	uint32_t		total = 0;
+	uint32_t		totalDropped = 0;
+	uint32_t		i;
+
+	if (argc < 2 || argc > 3)
+	{
+		fprintf(stderr, "usage: %s recording [output.csv]\n", argv[0]);
+		return 2;
+	}
+
+	if ((in = fopen(argv[1], "rb")) == NULL)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	if (argc > 2 && (out = fopen(argv[2], "w")) == NULL)
+	{
+		perror(argv[2]);
+		return 1;
+	}
+
+	/* ----
+	 * Check the file header.
+	 * ----
+	 */
+	if (fread(header, sizeof(header), 1, in) != 1 ||
+		memcmp(header, OPEN8055_RECORDING_MAGIC, 8) != 0)
+	{
+		fprintf(stderr, "%s: not an Open8055 recording\n", argv[1]);
+		return 1;
+	}
+	if (GetLE16(header + 8) != OPEN8055_RECORDING_VERSION)
+	{
+		fprintf(stderr, "%s: unsupported format version %d\n", argv[1],
+				GetLE16(header + 8));
+		return 1;
+	}
+	recordSize = GetLE16(header + 10);
+	if (recordSize < OPEN8055_RECORDING_RECORD_SIZE)
+	{
+		fprintf(stderr, "%s: invalid record size %d\n", argv[1], recordSize);
+		return 1;
+	}
+	header[OPEN8055_RECORDING_HEADER_SIZE - 1] = '\0';
+	fprintf(stderr, "recording of %s\n", (char *)header + 16);
+
+	fprintf(out, "time_ns,direction,type,values\n");
+
+	/* ----
+	 * Convert all blocks. A short last block is what a crash leaves
+	 * behind, so we convert what is there and stop.
+	 * ----
+	 */
+	while (fread(block, sizeof(block), 1, in) == 1)
+	{
+		if (memcmp(block, OPEN8055_RECORDING_BLOCK_MAGIC, 4) != 0)
+		{
+			fprintf(stderr, "%s: bad block header after %u blocks\n",
+					argv[1], blocks);
+			break;
+		}
+		if (GetLE32(block + 4) != blocks)
+			fprintf(stderr, "block %u has sequence number %u\n",
+					blocks, GetLE32(block + 4));
+		nrecords = GetLE32(block + 8);
+		dropped = GetLE32(block + 12);
+		if (dropped > 0)
+		{
+			fprintf(stderr, "%u reports were not recorded before block %u\n",
+					dropped, blocks);
+			totalDropped += dropped;
+		}
+
+		for (i = 0; i < nrecords; i++)
+		{
+			if (fread(record, OPEN8055_RECORDING_RECORD_SIZE, 1, in) != 1)
+				break;
+			if (recordSize > OPEN8055_RECORDING_RECORD_SIZE)
+				fseek(in, recordSize - OPEN8055_RECORDING_RECORD_SIZE, SEEK_CUR);
+
+			fprintf(out, "%llu,%s,", (unsigned long long)GetLE64(record),
+					(record[8] <= OPEN8055_RECORD_STATE) ?
+						direction[record[8]] : "unknown");
+			PrintReport(out, record + 16);
+			fprintf(out, "\n");
+			total++;
+		}
+		if (i < nrecords)
+		{
+			fprintf(stderr, "%s: block %u is truncated\n", argv[1], blocks);
+			break;
+		}
+		blocks++;
+	}
+
+	fprintf(stderr, "%u reports in %u blocks, %u dropped\n",
+			total, blocks, totalDropped);
+
+	fclose(in);
+	if (out != stdout)
+		fclose(out);
+
+	return 0;
+}
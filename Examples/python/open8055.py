@@ -298,6 +298,9 @@ class Open8055:
     all_defaults() -- set all configuration and outputs to defaults
     request_input() -- request a forced input report, even if nothing changed
     reset() -- send a reset signal to the card causing the PIC to reboot
+    set_input_delta() -- have the server send only changed input fields
+    request_keyframe() -- request a full input report from the server
+    subscribe() -- limit the input report rate and ignore small ADC changes
 
     Methods related to digital inputs:
 
@@ -350,6 +353,7 @@ class Open8055:
 
         self.input_buffer = ''          # Input buffer used in poll()
         self.socket = None              # Connection to the server
+        self.input_delta = 0            # Keyframe interval of deltas
 
     def __del__(self):
         try:
@@ -501,7 +505,42 @@ class Open8055:
                 raise Exception(
                         'received unknown HID type 0x{0:02X}'.format(hid_type))
         
+        elif msg[0] == 'DELTA':
+            # ----
+            # Delta encoded INPUT report. The mask tells which of the
+            # input bits, counters and ADC values follow. Without a
+            # full INPUT to apply it to, ask for one and wait.
+            # ----
+            if self.cur_input is None:
+                self.request_keyframe()
+                return
+            mask = int(msg[1])
+            values = [int(x) for x in msg[2:]]
+            fields = ([self.cur_input['input_bits']] +
+                    self.cur_input['input_counter'] +
+                    self.cur_input['input_adc_value'])
+            for i in range(0, 8):
+                if mask & (1 << i):
+                    fields[i] = values.pop(0)
+            self.cur_input = dict((
+                        ('msg_type', INPUT),
+                        ('input_bits', fields[0]),
+                        ('input_counter', fields[1:6]),
+                        ('input_adc_value', fields[6:8]),
+                    ))
+
         elif msg[0] == 'ERROR':
+            # ----
+            # A server without delta support keeps sending full
+            # reports, so that is not worth an exception.
+            # ----
+            if ' '.join(msg[1:]) in ("unknown command 'INPUTDELTA'",
+                    "unknown command 'KEYFRAME'"):
+                self.input_delta = 0
+                return
+            if ' '.join(msg[1:]) == "unknown command 'SUBSCRIBE'":
+                return
+
             # ----
             # Report the server ERROR without the message type.
             # ----
@@ -601,6 +640,32 @@ class Open8055:
         if error is not None:
             raise error
 
+    def set_input_delta(self, keyframe_ms):
+        """
+        Ask the server to send only the changed fields of input reports,
+        with a full report every keyframe_ms milliseconds. The deltas
+        are applied to the cached input state, so the get_...()
+        methods work as before. 0 switches back to full reports.
+        """
+        self._send_message('INPUTDELTA ' + str(int(keyframe_ms)))
+        self.input_delta = int(keyframe_ms)
+
+    def request_keyframe(self):
+        """
+        Ask the server for a full input report right away.
+        """
+        self._send_message('KEYFRAME')
+
+    def subscribe(self, max_rate, adc1_deadband = 0, adc2_deadband = 0):
+        """
+        Ask the server to send at most max_rate input reports per second,
+        always the newest state, and to ignore ADC changes up to the
+        given deadbands. Changes of the digital inputs are still sent
+        right away. A max_rate of 0 means no limit.
+        """
+        self._send_message('SUBSCRIBE {0} {1} {2}'.format(float(max_rate),
+                int(adc1_deadband), int(adc2_deadband)))
+
     def fileno(self):
         """
         Returns the small integer system file number for the receiving
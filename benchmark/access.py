@@ -0,0 +1,85 @@
+#!/usr/bin/env python
+# ----------------------------------------------------------------------
+# access.py
+#
+#	Server CPU per connect and per OPEN access check, as done by
+#	open8055server.py for every client. Writes a config file with an
+#	access list of the given number of networks and a users file with
+#	the given number of users, then checks clients against them.
+#
+#	    python access.py [checks] [networks] [users]
+#
+#	Needs the server's modules (open8055device, netaddr) importable.
+# ----------------------------------------------------------------------
+
+import hashlib
+import os
+import shutil
+import sys
+import tempfile
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.realpath(__file__)),
+        '..', 'open8055server'))
+import open8055server
+
+
+def main(argv):
+    checks = int(argv[1]) if len(argv) > 1 else 100000
+    networks = int(argv[2]) if len(argv) > 2 else 100
+    users = int(argv[3]) if len(argv) > 3 else 100
+
+    # ----
+    # An access list of /24 networks in 10.0.0.0/8, each for its own
+    # user, followed by the usual private network and deny entries.
+    # The checked client matches the last user entry.
+    # ----
+    tmpdir = tempfile.mkdtemp()
+    lines = ['10.{0}.{1}.0/24 user{2} md5'.format(i // 256, i % 256, i)
+            for i in range(networks)]
+    lines += ['192.168.0.0/16 all md5', '10.0.0.0/8 all plain',
+            '0.0.0.0/0 all deny', '::/0 all deny']
+    conf = open(os.path.join(tmpdir, 'open8055.conf'), 'w')
+    conf.write('[General]\nusers_file = open8055.users\n[Access]\n')
+    conf.write('connect = ' + '\n    '.join(lines) + '\n')
+    conf.write('default = ' + '\n    '.join(lines) + '\n')
+    conf.close()
+
+    fd = open(os.path.join(tmpdir, 'open8055.users'), 'w')
+    for i in range(users):
+        fd.write('user{0}::md5{1}\n'.format(i,
+                hashlib.md5('password{0}'.format(i)).hexdigest()))
+    fd.close()
+
+    server = open8055server.Open8055Server()
+    server.load_config([os.path.join(tmpdir, 'open8055.conf')])
+
+    n = min(networks, users) - 1
+    user = 'user{0}'.format(n)
+    addr = ('::ffff:10.{0}.{1}.17'.format(n // 256, n % 256), 40000)
+    salt = '0123456789abcdef'
+    password = 'md5' + hashlib.md5(salt + hashlib.md5(
+            'password{0}'.format(n)).hexdigest()).hexdigest()
+    if not server.check_open_access(0, addr, user, password, salt):
+        print 'access: check failed, benchmark broken'
+        return 1
+
+    t0 = os.times()
+    for i in xrange(checks):
+        server.check_connect_access(addr)
+    t1 = os.times()
+    for i in xrange(checks):
+        server.check_open_access(0, addr, user, password, salt)
+    t2 = os.times()
+
+    shutil.rmtree(tmpdir)
+
+    connect_cpu = (t1[0] - t0[0]) + (t1[1] - t0[1])
+    open_cpu = (t2[0] - t1[0]) + (t2[1] - t1[1])
+    print 'access: networks={0} users={1} connect_us={2:.1f} open_us={3:.1f}'.format(
+            networks, users, connect_cpu * 1000000.0 / checks,
+            open_cpu * 1000000.0 / checks)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
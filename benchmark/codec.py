@@ -0,0 +1,67 @@
+#!/usr/bin/env python
+# ----------------------------------------------------------------------
+# codec.py
+#
+#	Server CPU per report for the text protocol conversions, once with
+#	the Python versions in open8055proto and once with the C versions
+#	from the device module (open8055devicemodule.so must be built in
+#	../open8055server).
+#
+#	    python codec.py [reports] [clients]
+#
+#	Each report is formatted as RECV line once per client, like the
+#	server does for every channel watching the card, and one SEND line
+#	is parsed per report.
+# ----------------------------------------------------------------------
+
+import os
+import struct
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.realpath(__file__)),
+        '..', 'open8055server'))
+import open8055proto
+
+
+def run(name, format_recv, parse_send, reports, clients):
+    fmt = open8055proto.RECV_FORMATS[open8055proto.HID_INPUT]
+    data = [fmt.pack(0x81, i & 0x1F, i & 0xFFFF, 0, 0, 0, 0,
+            (i * 7) & 0x3FF, 512).ljust(open8055proto.HID_REPORT_SIZE, '\0')
+            for i in range(1024)]
+    send = [['SEND', '1', str(i & 0x1F), str(i & 0xFF), '0', '0', '0',
+            '0', '0', '0', str(i & 0x3FF), '0', '0']
+            for i in range(1024)]
+
+    t0 = os.times()
+    for i in xrange(reports):
+        report = data[i & 1023]
+        for c in xrange(clients):
+            format_recv(report)
+    t1 = os.times()
+    for i in xrange(reports):
+        parse_send(send[i & 1023])
+    t2 = os.times()
+
+    recv_cpu = (t1[0] - t0[0]) + (t1[1] - t0[1])
+    send_cpu = (t2[0] - t1[0]) + (t2[1] - t1[1])
+    print 'codec: {0:6s} clients={1} recv_us_per_report={2:.2f} send_us_per_line={3:.2f}'.format(
+            name, clients, recv_cpu * 1000000.0 / reports,
+            send_cpu * 1000000.0 / reports)
+
+
+def main(argv):
+    reports = int(argv[1]) if len(argv) > 1 else 200000
+    clients = int(argv[2]) if len(argv) > 2 else 1
+
+    run('python', open8055proto.format_recv_text_python,
+            open8055proto.parse_send_text_python, reports, clients)
+    if open8055proto.format_recv_text is open8055proto.format_recv_text_python:
+        print 'codec: C versions not available, open8055device not built'
+        return 1
+    run('C', open8055proto.format_recv_text,
+            open8055proto.parse_send_text, reports, clients)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,136 @@
+/* ----------------------------------------------------------------------
+ * latency_client.c
+ *
+ *	Command round trip latency of a running open8055server, to
+ *	compare the transports. For every destination given it connects,
+ *	then repeatedly sets the digital outputs and waits for the
+ *	server's ACK, one command at a time, and prints the distribution
+ *	of the wall clock time each round trip took.
+ *
+ *	    latency_client [-n rounds] destination ...
+ *
+ *	For example, with unix_socket = /tmp/open8055.sock configured:
+ *
+ *	    latency_client open8055://127.0.0.1/card0 \
+ *	                   open8055:///tmp/open8055.sock/card0
+ * ----------------------------------------------------------------------
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "open8055.h"
+
+
+static double
+NowUsec(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+
+static int
+CompareDouble(const void *a, const void *b)
+{
+	double			da = *(const double *)a;
+	double			db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+
+/* ----
+ * Measure()
+ *
+ *	Run the round trips against one destination and print the result.
+ * ----
+ */
+static int
+Measure(char *destination, double *samples, int rounds)
+{
+	int				card;
+	int				i;
+	double			start;
+	double			sum = 0.0;
+
+	if ((card = Open8055_Connect(destination, NULL)) < 0)
+	{
+		fprintf(stderr, "%s: %s\n", destination, Open8055_LastError(-1));
+		return -1;
+	}
+	if (Open8055_SetAckWindow(card, 1) < 0)
+	{
+		fprintf(stderr, "%s: %s\n", destination, Open8055_LastError(card));
+		Open8055_Close(card);
+		return -1;
+	}
+
+	/* ----
+	 * Warm up the connection and the card before timing anything.
+	 * ----
+	 */
+	for (i = -100; i < rounds; i++)
+	{
+		start = NowUsec();
+		if (Open8055_SetOutputAll(card, i & 0x7F) < 0 ||
+			Open8055_WaitAck(card, 5000) < 0)
+		{
+			fprintf(stderr, "%s: %s\n", destination, Open8055_LastError(card));
+			Open8055_Close(card);
+			return -1;
+		}
+		if (i >= 0)
+		{
+			samples[i] = NowUsec() - start;
+			sum += samples[i];
+		}
+	}
+	Open8055_Close(card);
+
+	qsort(samples, rounds, sizeof(double), CompareDouble);
+	printf("%-40s min %7.1f  median %7.1f  p99 %7.1f  mean %7.1f usec\n",
+		   destination, samples[0], samples[rounds / 2],
+		   samples[rounds * 99 / 100], sum / rounds);
+	return 0;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	double		   *samples;
+	int				rounds = 10000;
+	int				rc = 0;
+	int				i = 1;
+
+	if (argc > 2 && strcmp(argv[1], "-n") == 0)
+	{
+		rounds = atoi(argv[2]);
+		i = 3;
+	}
+	if (i >= argc || rounds <= 0)
+	{
+		fprintf(stderr, "usage: %s [-n rounds] destination ...\n", argv[0]);
+		return 2;
+	}
+	if ((samples = (double *)malloc(sizeof(double) * rounds)) == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return 2;
+	}
+
+	for (; i < argc; i++)
+	{
+		if (Measure(argv[i], samples, rounds) < 0)
+			rc = 1;
+	}
+
+	free(samples);
+	return rc;
+}
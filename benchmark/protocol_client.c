@@ -0,0 +1,91 @@
+/* ----------------------------------------------------------------------
+ * protocol_client.c
+ *
+ *	Client side of the protocol benchmark. Connects to
+ *	protocol_server.py through libopen8055, consumes all reports and
+ *	prints the client CPU time per report. The protocol is selected
+ *	with OPEN8055_PROTOCOL=text or binary (the default).
+ *
+ *	    protocol_client [destination] [reports]
+ * ----------------------------------------------------------------------
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "open8055.h"
+
+
+static double
+CpuSeconds(void)
+{
+	struct rusage	ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0 +
+		   ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	char			*destination = "open8055://localhost:18055/card0";
+	char			*protocol;
+	int				reports = 50000;
+	int				card;
+	int				last = 0;
+	int				counter;
+	double			cpuStart;
+	double			cpu;
+	struct pollfd	pfd;
+
+	if (argc > 1)
+		destination = argv[1];
+	if (argc > 2)
+		reports = atoi(argv[2]);
+
+	if ((card = Open8055_Connect(destination, NULL)) < 0)
+	{
+		fprintf(stderr, "%s: %s\n", destination, Open8055_LastError(-1));
+		return 2;
+	}
+
+	/* ----
+	 * Consume reports until counter 1 says we have seen all of them.
+	 * ----
+	 */
+	cpuStart = CpuSeconds();
+	pfd.fd = Open8055_GetPollFd(card);
+	pfd.events = POLLIN;
+	while (last < reports)
+	{
+		if (poll(&pfd, 1, 5000) <= 0)
+		{
+			fprintf(stderr, "timeout after %d reports\n", last);
+			return 1;
+		}
+		if (Open8055_Dispatch(card) < 0)
+		{
+			fprintf(stderr, "%s\n", Open8055_LastError(card));
+			return 1;
+		}
+		counter = Open8055_GetCounter(card, 0);
+		while (counter < (last & 0xFFFF))
+			counter += 0x10000;
+		last = (last & ~0xFFFF) + counter;
+	}
+	cpu = CpuSeconds() - cpuStart;
+
+	protocol = getenv("OPEN8055_PROTOCOL");
+	printf("client: protocol=%s reports=%d cpu_us_per_report=%.2f\n",
+		   (protocol != NULL) ? protocol : "binary", reports,
+		   cpu * 1000000.0 / reports);
+
+	Open8055_Close(card);
+	return 0;
+}
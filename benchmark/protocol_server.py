@@ -0,0 +1,112 @@
+#!/usr/bin/env python
+# ----------------------------------------------------------------------
+# protocol_server.py
+#
+#	Stand-in for open8055server.py that streams INPUT reports as fast
+#	as possible, to measure the per report cost of the text and the
+#	binary protocol without a card. It encodes reports with the same
+#	open8055proto functions the real server uses.
+#
+#	    python protocol_server.py [port] [reports]
+#
+#	Serves one client, prints server CPU and bytes on the wire per
+#	report and exits.
+# ----------------------------------------------------------------------
+
+import os
+import socket
+import struct
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.realpath(__file__)),
+        '..', 'open8055server'))
+import open8055proto
+
+
+def main(argv):
+    port = int(argv[1]) if len(argv) > 1 else 18055
+    reports = int(argv[2]) if len(argv) > 2 else 50000
+
+    lsock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    lsock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    lsock.bind(('127.0.0.1', port))
+    lsock.listen(1)
+
+    conn, _addr = lsock.accept()
+    rfile = conn.makefile('rb', 0)
+    conn.sendall('HELLO Open8055Server benchmark\nSALT 0000000000000000\n')
+
+    # ----
+    # Handshake: optional BINARY, then OPEN.
+    # ----
+    binary = False
+    while True:
+        args = rfile.readline().strip().split(' ')
+        if args[0].upper() == 'BINARY':
+            conn.sendall('BINARY {0}\n'.format(open8055proto.BINARY_VERSION))
+            binary = True
+            # In binary mode the OPEN arrives as TEXT frame
+            hdr = rfile.read(open8055proto.FRAME_HEADER.size)
+            length = open8055proto.FRAME_HEADER.unpack(hdr)[0]
+            args = rfile.read(length).split(' ')
+        if args[0].upper() == 'OPEN':
+            break
+
+    seq = [0]
+    def encode(data):
+        if binary:
+            seq[0] += 1
+            return open8055proto.pack_frame(open8055proto.FRAME_RECV,
+                    seq[0], data)
+        return open8055proto.format_recv_text(data)
+
+    def report(fmt, *vals):
+        data = fmt.pack(*vals)
+        return data + '\0' * (open8055proto.HID_REPORT_SIZE - len(data))
+
+    fmts = open8055proto.RECV_FORMATS
+    conn.sendall(encode(report(fmts[open8055proto.HID_SETCONFIG1],
+            0x03, 10, 10, 20, 20, 20, 20, 20, 30, 30, 30, 30, 30, 30, 30, 30,
+            40, 40, 11, 11, 11, 11, 11, 0)))
+    conn.sendall(encode(report(fmts[open8055proto.HID_OUTPUT],
+            0x01, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)))
+
+    # ----
+    # Stream the INPUT reports, one sendall() per report like the
+    # server's reader thread does. Counter 1 carries the report number
+    # so the client knows when it has seen all of them.
+    # ----
+    fmt = fmts[open8055proto.HID_INPUT]
+    nbytes = 0
+    t0 = os.times()
+    for i in range(1, reports + 1):
+        msg = encode(report(fmt, 0x81, i & 0x1F, i & 0xFFFF, 0, 0, 0, 0,
+                (i * 7) & 0x3FF, 512))
+        conn.sendall(msg)
+        nbytes += len(msg)
+    t1 = os.times()
+
+    cpu = (t1[0] - t0[0]) + (t1[1] - t0[1])
+    print 'server: protocol={0} reports={1} cpu_us_per_report={2:.2f} bytes_per_report={3:.1f}'.format(
+            'binary' if binary else 'text', reports,
+            cpu * 1000000.0 / reports, float(nbytes) / reports)
+
+    # ----
+    # Wait for the client's QUIT (or disconnect) and close. Anything
+    # else it sends, like PINGs, is ignored.
+    # ----
+    data = ''
+    try:
+        while 'quit' not in data:
+            buf = conn.recv(4096)
+            if not buf:
+                break
+            data = data[-8:] + buf
+    except socket.error:
+        pass
+    conn.close()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
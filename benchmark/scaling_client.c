@@ -0,0 +1,366 @@
+/* ----------------------------------------------------------------------
+ * scaling_client.c
+ *
+ *	How open8055server copes with many connections. For every count
+ *	given it opens that many text protocol connections that WATCH one
+ *	card, next to one libopen8055 connection that has it OPEN. The
+ *	controller then sets the digital outputs over and over, and each
+ *	time waits until every watcher got the OUTPUT report. Printed are
+ *	the distribution of that fan-out time, the INPUT reports per
+ *	second delivered to all watchers together and, given the server's
+ *	process ID on Linux, its thread count and CPU use.
+ *
+ *	    scaling_client [-t seconds] [-p server_pid] host port card count ...
+ *
+ *	For example, to compare two servers, run it against each:
+ *
+ *	    scaling_client -p 1234 127.0.0.1 8055 0 10 100 500
+ * ----------------------------------------------------------------------
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "open8055.h"
+
+
+typedef struct
+{
+	int				sock;
+	int				len;
+	int				inputs;
+	int				seenOutput;
+	char			buf[4096];
+} Watcher;
+
+
+static char	   *host;
+static char	   *port;
+static int		cardid;
+static int		seconds = 5;
+static int		serverPid = 0;
+
+
+static double
+NowUsec(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+
+static int
+CompareDouble(const void *a, const void *b)
+{
+	double			da = *(const double *)a;
+	double			db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+
+/* ----
+ * ServerUsage()
+ *
+ *	CPU seconds used by the server process so far and its number of
+ *	threads, from /proc. Both are -1 if unknown.
+ * ----
+ */
+static void
+ServerUsage(double *cpu, int *threads)
+{
+	char			path[64];
+	char			line[1024];
+	char		   *cp;
+	unsigned long	utime;
+	unsigned long	stime;
+	FILE		   *fp;
+
+	*cpu = -1.0;
+	*threads = -1;
+	if (serverPid <= 0)
+		return;
+
+	sprintf(path, "/proc/%d/stat", serverPid);
+	if ((fp = fopen(path, "r")) != NULL)
+	{
+		if (fgets(line, sizeof(line), fp) != NULL &&
+			(cp = strrchr(line, ')')) != NULL &&
+			sscanf(cp + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+				   &utime, &stime) == 2)
+			*cpu = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+		fclose(fp);
+	}
+
+	sprintf(path, "/proc/%d/status", serverPid);
+	if ((fp = fopen(path, "r")) != NULL)
+	{
+		while (fgets(line, sizeof(line), fp) != NULL)
+			if (sscanf(line, "Threads: %d", threads) == 1)
+				break;
+		fclose(fp);
+	}
+}
+
+
+/* ----
+ * WatcherConnect()
+ *
+ *	Connect one watcher and send its WATCH command. The server's
+ *	HELLO and SALT are skipped along with the reports.
+ * ----
+ */
+static int
+WatcherConnect(Watcher *w)
+{
+	struct addrinfo	hints;
+	struct addrinfo *ai;
+	char			cmd[64];
+
+	memset(w, 0, sizeof(Watcher));
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &ai) != 0)
+		return -1;
+	w->sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (w->sock < 0 || connect(w->sock, ai->ai_addr, ai->ai_addrlen) < 0)
+	{
+		freeaddrinfo(ai);
+		return -1;
+	}
+	freeaddrinfo(ai);
+
+	sprintf(cmd, "WATCH %d bench bench\n", cardid);
+	if (send(w->sock, cmd, strlen(cmd), 0) != strlen(cmd))
+		return -1;
+	return 0;
+}
+
+
+/* ----
+ * WatcherRead()
+ *
+ *	Consume what arrived for one watcher. Counts INPUT reports and
+ *	remembers if the OUTPUT report with the expected bits was there.
+ * ----
+ */
+static int
+WatcherRead(Watcher *w, int expect)
+{
+	char			prefix[32];
+	char		   *line;
+	char		   *nl;
+	int				n;
+
+	if ((n = recv(w->sock, w->buf + w->len, sizeof(w->buf) - 1 - w->len, 0)) <= 0)
+		return -1;
+	w->len += n;
+	w->buf[w->len] = '\0';
+
+	sprintf(prefix, "RECV 1 %d ", expect);
+	line = w->buf;
+	while ((nl = strchr(line, '\n')) != NULL)
+	{
+		if (strncmp(line, "RECV 129 ", 9) == 0)
+			w->inputs++;
+		else if (strncmp(line, prefix, strlen(prefix)) == 0)
+			w->seenOutput = 1;
+		else if (strncmp(line, "ERROR", 5) == 0)
+		{
+			*nl = '\0';
+			fprintf(stderr, "watcher: %s\n", line);
+			return -1;
+		}
+		line = nl + 1;
+	}
+	w->len -= line - w->buf;
+	memmove(w->buf, line, w->len);
+	return 0;
+}
+
+
+/* ----
+ * Measure()
+ *
+ *	Run the benchmark with count watchers and print the result.
+ * ----
+ */
+static int
+Measure(int count)
+{
+	char			destination[256];
+	Watcher		   *watchers;
+	struct pollfd  *pfds;
+	double		   *samples;
+	int				maxSamples = 100000;
+	int				nsamples = 0;
+	int				card;
+	int				value = 0;
+	int				inputs = 0;
+	int				seen;
+	int				threads;
+	int				rc = -1;
+	int				i;
+	double			start;
+	double			end;
+	double			cpuStart;
+	double			cpuEnd;
+
+	sprintf(destination, "open8055://%s:%s/card%d", host, port, cardid);
+	if ((card = Open8055_Connect(destination, NULL)) < 0)
+	{
+		fprintf(stderr, "%s: %s\n", destination, Open8055_LastError(-1));
+		return -1;
+	}
+
+	watchers = (Watcher *)calloc(count, sizeof(Watcher));
+	pfds = (struct pollfd *)calloc(count, sizeof(struct pollfd));
+	samples = (double *)malloc(sizeof(double) * maxSamples);
+	if (watchers == NULL || pfds == NULL || samples == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		goto done;
+	}
+	for (i = 0; i < count; i++)
+	{
+		if (WatcherConnect(&watchers[i]) < 0)
+		{
+			perror("watcher connect");
+			count = i;
+			goto done;
+		}
+		pfds[i].fd = watchers[i].sock;
+		pfds[i].events = POLLIN;
+	}
+
+	ServerUsage(&cpuStart, &threads);
+	start = NowUsec();
+	end = start + seconds * 1000000.0;
+	while (NowUsec() < end && nsamples < maxSamples)
+	{
+		double			sent;
+
+		/* ----
+		 * Change the outputs and wait until all watchers have seen it.
+		 * ----
+		 */
+		value = (value + 1) & 0x7F;
+		for (i = 0; i < count; i++)
+			watchers[i].seenOutput = 0;
+		sent = NowUsec();
+		if (Open8055_SetOutputAll(card, value) < 0)
+		{
+			fprintf(stderr, "%s: %s\n", destination, Open8055_LastError(card));
+			goto done;
+		}
+
+		for (seen = 0; seen < count; )
+		{
+			if (NowUsec() - sent > 5000000.0 || poll(pfds, count, 5000) <= 0)
+			{
+				fprintf(stderr, "timeout waiting for watchers\n");
+				goto done;
+			}
+			for (seen = 0, i = 0; i < count; i++)
+			{
+				if ((pfds[i].revents & (POLLIN | POLLERR | POLLHUP)) != 0 &&
+					WatcherRead(&watchers[i], value) < 0)
+				{
+					fprintf(stderr, "watcher %d disconnected\n", i);
+					goto done;
+				}
+				seen += watchers[i].seenOutput;
+			}
+		}
+		samples[nsamples++] = NowUsec() - sent;
+	}
+	end = NowUsec();
+	ServerUsage(&cpuEnd, &threads);
+
+	for (i = 0; i < count; i++)
+		inputs += watchers[i].inputs;
+	qsort(samples, nsamples, sizeof(double), CompareDouble);
+	printf("%5d watchers  fan-out median %8.1f  p99 %8.1f usec  "
+		   "inputs %8.0f/s",
+		   count, samples[nsamples / 2], samples[nsamples * 99 / 100],
+		   inputs * 1000000.0 / (end - start));
+	if (cpuStart >= 0.0 && cpuEnd >= 0.0)
+		printf("  server cpu %5.1f%%  threads %d",
+			   (cpuEnd - cpuStart) * 100000000.0 / (end - start), threads);
+	printf("\n");
+	rc = 0;
+
+done:
+	for (i = 0; i < count; i++)
+		close(watchers[i].sock);
+	free(watchers);
+	free(pfds);
+	free(samples);
+	Open8055_Close(card);
+	return rc;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	struct rlimit	rl;
+	int				opt;
+	int				rc = 0;
+	int				i;
+
+	while ((opt = getopt(argc, argv, "t:p:")) != -1)
+	{
+		switch (opt)
+		{
+			case 't':
+				seconds = atoi(optarg);
+				break;
+			case 'p':
+				serverPid = atoi(optarg);
+				break;
+			default:
+				optind = argc;
+				break;
+		}
+	}
+	if (argc - optind < 4 || seconds <= 0)
+	{
+		fprintf(stderr, "usage: %s [-t seconds] [-p server_pid] "
+				"host port card count ...\n", argv[0]);
+		return 2;
+	}
+	host = argv[optind];
+	port = argv[optind + 1];
+	cardid = atoi(argv[optind + 2]);
+
+	/* ----
+	 * Every watcher is a socket. Allow as many as we may.
+	 * ----
+	 */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	for (i = optind + 3; i < argc; i++)
+	{
+		if (Measure(atoi(argv[i])) < 0)
+			rc = 1;
+		/* Let the server close the last round's connections */
+		sleep(1);
+	}
+	return rc;
+}
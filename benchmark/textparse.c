@@ -0,0 +1,185 @@
+/* ----------------------------------------------------------------------
+ * textparse.c
+ *
+ *	Microbenchmark of the libopen8055 text protocol receive path.
+ *	A thread in this program plays the server: it answers the
+ *	handshake and then writes pre-formatted RECV lines as fast as
+ *	the socket takes them. The main thread consumes them through
+ *	Open8055_Dispatch() and reports its own CPU time per report, so
+ *	neither the Python server nor the writer side is measured.
+ *
+ *	    textparse [reports]
+ * ----------------------------------------------------------------------
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "open8055.h"
+
+
+static int		listenSock;
+static int		reports = 1000000;
+
+
+static double
+ThreadCpuSeconds(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+
+static int
+SendAll(int sock, char *buf, int len)
+{
+	int				n;
+
+	while (len > 0)
+	{
+		if ((n = send(sock, buf, len, 0)) <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+
+/* ----
+ * ServerMain()
+ *
+ *	Fake server. Waits for OPEN, sends CONFIG1 and OUTPUT, then all
+ *	INPUT reports numbered 1 to reports in counters 1 (low 16 bits)
+ *	and 2 (high bits).
+ * ----
+ */
+static void *
+ServerMain(void *arg)
+{
+	static char		chunk[65536];
+	char			line[256];
+	int				sock;
+	int				len = 0;
+	int				n;
+	int				i;
+
+	if ((sock = accept(listenSock, NULL, NULL)) < 0)
+		return NULL;
+
+	strcpy(line, "HELLO Open8055Server textparse\nSALT 0000000000000000\n");
+	SendAll(sock, line, strlen(line));
+	for (;;)
+	{
+		if ((n = recv(sock, line + len, sizeof(line) - 1 - len, 0)) <= 0)
+			return NULL;
+		len += n;
+		line[len] = '\0';
+		if (strchr(line, '\n') != NULL)
+			break;
+	}
+
+	len = sprintf(chunk,
+			"RECV 3 1 1 1 1 1 1 1 0 0 0 0 0 0 0 0 0 0 10 10 10 10 10 0\n"
+			"RECV 1 0 0 0 0 0 0 0 0 0 0 0 0\n");
+	for (i = 1; i <= reports; i++)
+	{
+		len += sprintf(chunk + len, "RECV 129 %d %d %d 0 0 0 %d %d\n",
+				i & 0x1F, i & 0xFFFF, i >> 16, i % 1024, 1023 - i % 1024);
+		if (len > sizeof(chunk) - 128 || i == reports)
+		{
+			if (SendAll(sock, chunk, len) < 0)
+				return NULL;
+			len = 0;
+		}
+	}
+
+	/* ----
+	 * Stay connected until the client says QUIT.
+	 * ----
+	 */
+	while ((n = recv(sock, line, sizeof(line) - 1, 0)) > 0)
+	{
+		line[n] = '\0';
+		if (strstr(line, "quit") != NULL)
+			break;
+	}
+	close(sock);
+	return NULL;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_in	addr;
+	socklen_t		addrlen = sizeof(addr);
+	char			destination[256];
+	pthread_t		server;
+	struct pollfd	pfd;
+	int				card;
+	int				last = 0;
+	double			cpuStart;
+	double			cpu;
+
+	if (argc > 1)
+		reports = atoi(argv[1]);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	listenSock = socket(AF_INET, SOCK_STREAM, 0);
+	if (bind(listenSock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(listenSock, 1) < 0 ||
+		getsockname(listenSock, (struct sockaddr *)&addr, &addrlen) < 0)
+	{
+		perror("listen");
+		return 2;
+	}
+	pthread_create(&server, NULL, ServerMain, NULL);
+
+	setenv("OPEN8055_PROTOCOL", "text", 1);
+	sprintf(destination, "open8055://127.0.0.1:%d/card0", ntohs(addr.sin_port));
+	if ((card = Open8055_Connect(destination, NULL)) < 0)
+	{
+		fprintf(stderr, "%s: %s\n", destination, Open8055_LastError(-1));
+		return 2;
+	}
+
+	cpuStart = ThreadCpuSeconds();
+	pfd.fd = Open8055_GetPollFd(card);
+	pfd.events = POLLIN;
+	while (last < reports)
+	{
+		if (poll(&pfd, 1, 5000) <= 0)
+		{
+			fprintf(stderr, "timeout after %d reports\n", last);
+			return 1;
+		}
+		if (Open8055_Dispatch(card) < 0)
+		{
+			fprintf(stderr, "%s\n", Open8055_LastError(card));
+			return 1;
+		}
+		last = (Open8055_GetCounter(card, 1) << 16) | Open8055_GetCounter(card, 0);
+	}
+	cpu = ThreadCpuSeconds() - cpuStart;
+
+	printf("textparse: reports=%d client_ns_per_report=%.1f\n",
+		   reports, cpu * 1000000000.0 / reports);
+
+	Open8055_Close(card);
+	pthread_join(server, NULL);
+	return 0;
+}
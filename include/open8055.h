@@ -108,6 +108,36 @@ extern "C" {
  * ----
  */
 
+/* ----
+ * Counters returned by Open8055_GetStats(). Latencies are in
+ * milliseconds. commandsSent counts the commands this side wrote to
+ * the card or the server, whether or not the server took them; with
+ * an ACK window, commandsAcked and commandsFailed tell which it did.
+ * ackLatency is the time from sending a command to the server until
+ * its ACK arrived, usbWriteLast the time the server's last USB write
+ * took. reportsDelta counts INPUT reports that arrived
+ * delta encoded. udpReceived counts INPUT reports that arrived over
+ * UDP, udpLost the gaps in their sequence numbers and udpStale those
+ * dropped because a newer one had already arrived.
+ * ----
+ */
+typedef struct {
+    unsigned int    commandsSent;
+    unsigned int    commandsAcked;
+    unsigned int    commandsFailed;
+    unsigned int    commandsOutstanding;
+    double          ackLatencyLast;
+    double          ackLatencyMin;
+    double          ackLatencyAvg;
+    double          ackLatencyMax;
+    double          usbWriteLast;
+    unsigned int    reportsDropped;
+    unsigned int    reportsDelta;
+    unsigned int    udpReceived;
+    unsigned int    udpLost;
+    unsigned int    udpStale;
+} Open8055_stats_t;
+
 
 /* ----
  * Public functions in open8055.c
@@ -117,16 +147,38 @@ OPEN8055_EXTERN char    *OPEN8055_CDECL Open8055_LastError(int h);
 OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_CardPresent(int cardNumber);
 
 OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_Connect(char *destination, char *password);
+OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_ConnectMany(const char **destinations, int n, int *handles, int timeout);
+OPEN8055_EXTERN char    *OPEN8055_CDECL Open8055_ConnectManyError(int index);
 OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_Close(int h);
 OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_Reset(int h);
 
 OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_Wait(int h);
 OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_WaitTimeout(int h, int timeout);
 OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_WaitEx(int h, int timeout, int skipMessages);
+OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_GetPollFd(int h);
+OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_Dispatch(int h);
+OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_GetPending(int h);
 OPEN8055_EXTERN void    OPEN8055_CDECL Open8055_Sleep(int ms);
 OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_GetAutoFlush(int h);
 OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_SetAutoFlush(int h, int flag);
 OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_Flush(int h);
+OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_StartRecording(int h, char *path);
+OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_StopRecording(int h);
+OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_GetBusyPoll(int h);
+OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_SetBusyPoll(int h, int usec);
+OPEN8055_EXTERN double  OPEN8055_CDECL Open8055_GetRemoteRTT(int h);
+OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_GetAckWindow(int h);
+OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_SetAckWindow(int h, int window);
+OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_WaitAck(int h, int timeout);
+OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_GetStats(int h, Open8055_stats_t *stats);
+OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_GetInputDelta(int h);
+OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_SetInputDelta(int h, int keyframeMs);
+OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_RequestKeyframe(int h);
+OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_GetUDPInput(int h);
+OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_SetUDPInput(int h, int flag);
+OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_GetUDPPollFd(int h);
+OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_Subscribe(int h, double maxRate, int deadbandAdc1, int deadbandAdc2);
+OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_Reconnect(int h, int timeout);
 
 OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_GetInput(int h, int port);
 OPEN8055_EXTERN int     OPEN8055_CDECL Open8055_GetInputAll(int h);
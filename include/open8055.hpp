@@ -0,0 +1,682 @@
+/* ----------------------------------------------------------------------
+ * open8055.hpp
+ *
+ *  Header only C++11 binding for libopen8055. Everything is inline
+ *  over the C API in open8055.h. Operations throw open8055::error on
+ *  failure; the get/set paths do not allocate.
+ *
+ * ----------------------------------------------------------------------
+ *  Copyright (c) 2012, Jan Wieck
+ *  All rights reserved.
+ *  
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of the <organization> nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *  
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *  
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef _OPEN8055_HPP
+#define _OPEN8055_HPP
+
+#include "open8055.h"
+
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <exception>
+#include <utility>
+
+namespace open8055
+{
+
+/* ----
+ * error
+ *
+ *  Exception thrown by all card operations. The message returned by
+ *  Open8055_LastError() is copied into a fixed buffer, so throwing
+ *  does not allocate beyond the exception object itself.
+ * ----
+ */
+class error : public std::exception
+{
+public:
+    explicit error(const char *message) noexcept
+    {
+        std::strncpy(m_message, message ? message : "unknown error",
+                     sizeof(m_message) - 1);
+        m_message[sizeof(m_message) - 1] = '\0';
+    }
+
+    const char *what() const noexcept override
+    {
+        return m_message;
+    }
+
+private:
+    char    m_message[1024];
+};
+
+
+/* ----
+ * Port enums
+ *
+ *  The enumerators are the zero based port numbers of the C API.
+ *  Use the enumerators directly, or the input<N>(), output<N>(),
+ *  adc<N>() and pwm<N>() helpers with the board's one based labels;
+ *  an invalid N is a compile time error.
+ * ----
+ */
+enum class input_port  : int { I1 = 0, I2, I3, I4, I5 };
+enum class output_port : int { O1 = 0, O2, O3, O4, O5, O6, O7, O8 };
+enum class adc_port    : int { A1 = 0, A2 };
+enum class pwm_port    : int { PWM1 = 0, PWM2 };
+
+template <int N> constexpr input_port input() noexcept
+{
+    static_assert(N >= 1 && N <= 5, "Open8055 digital inputs are I1..I5");
+    return static_cast<input_port>(N - 1);
+}
+
+template <int N> constexpr output_port output() noexcept
+{
+    static_assert(N >= 1 && N <= 8, "Open8055 digital outputs are O1..O8");
+    return static_cast<output_port>(N - 1);
+}
+
+template <int N> constexpr adc_port adc() noexcept
+{
+    static_assert(N >= 1 && N <= 2, "Open8055 analog inputs are A1..A2");
+    return static_cast<adc_port>(N - 1);
+}
+
+template <int N> constexpr pwm_port pwm() noexcept
+{
+    static_assert(N >= 1 && N <= 2, "Open8055 PWM outputs are PWM1..PWM2");
+    return static_cast<pwm_port>(N - 1);
+}
+
+/* ----
+ * Range checked conversions for port numbers only known at runtime.
+ * Used in a constant expression, an invalid number fails to compile.
+ * ----
+ */
+constexpr input_port input_at(int n)
+{
+    return (n >= 1 && n <= 5) ? static_cast<input_port>(n - 1)
+                              : throw error("digital input out of range");
+}
+
+constexpr output_port output_at(int n)
+{
+    return (n >= 1 && n <= 8) ? static_cast<output_port>(n - 1)
+                              : throw error("digital output out of range");
+}
+
+constexpr adc_port adc_at(int n)
+{
+    return (n >= 1 && n <= 2) ? static_cast<adc_port>(n - 1)
+                              : throw error("analog input out of range");
+}
+
+constexpr pwm_port pwm_at(int n)
+{
+    return (n >= 1 && n <= 2) ? static_cast<pwm_port>(n - 1)
+                              : throw error("PWM output out of range");
+}
+
+
+/* ----
+ * Port modes
+ * ----
+ */
+enum class adc_mode : int
+{
+    adc10       = OPEN8055_MODE_ADC10,
+    adc9        = OPEN8055_MODE_ADC9,
+    adc8        = OPEN8055_MODE_ADC8
+};
+
+enum class input_mode : int
+{
+    input       = OPEN8055_MODE_INPUT,
+    frequency   = OPEN8055_MODE_FREQUENCY
+};
+
+enum class output_mode : int
+{
+    output      = OPEN8055_MODE_OUTPUT,
+    servo       = OPEN8055_MODE_SERVO,
+    iservo      = OPEN8055_MODE_ISERVO
+};
+
+
+/* ----
+ * Input change masks as returned by card::dispatch().
+ * ----
+ */
+constexpr int input_mask(input_port p) noexcept
+{
+    return OPEN8055_INPUT_I1 << static_cast<int>(p);
+}
+
+constexpr int counter_mask(input_port p) noexcept
+{
+    return OPEN8055_INPUT_COUNT1 << static_cast<int>(p);
+}
+
+constexpr int adc_mask(adc_port p) noexcept
+{
+    return OPEN8055_INPUT_ADC1 << static_cast<int>(p);
+}
+
+
+/* ----
+ * Snapshots of the card state, returned by value.
+ * ----
+ */
+struct input_snapshot
+{
+    int     bits;               /* I1..I5 as bits 0..4 */
+    int     counter[5];
+    int     adc[2];
+
+    bool operator[](input_port p) const noexcept
+    {
+        return (bits & input_mask(p)) != 0;
+    }
+};
+
+struct output_snapshot
+{
+    int     bits;               /* O1..O8 as bits 0..7 */
+    int     value[8];
+    int     pwm[2];
+
+    bool operator[](output_port p) const noexcept
+    {
+        return (bits & (1 << static_cast<int>(p))) != 0;
+    }
+};
+
+
+/* ----
+ * card
+ *
+ *  Owns one Open8055 handle. The card is closed when the object is
+ *  destroyed. It can be moved but not copied.
+ * ----
+ */
+class card
+{
+public:
+    using milliseconds = std::chrono::milliseconds;
+    using debounce_duration = std::chrono::duration<double, std::milli>;
+
+    card() noexcept : m_handle(-1) {}
+
+    explicit card(const char *destination, const char *password = nullptr)
+        : m_handle(Open8055_Connect(const_cast<char *>(destination),
+                                    const_cast<char *>(password)))
+    {
+        if (m_handle < 0)
+            throw error(Open8055_LastError(-1));
+    }
+
+    /* ----
+     * Adopt a handle obtained from the C API, e.g. Open8055_ConnectMany().
+     * ----
+     */
+    static card adopt(int handle) noexcept
+    {
+        card c;
+        c.m_handle = handle;
+        return c;
+    }
+
+    card(const card &) = delete;
+    card &operator=(const card &) = delete;
+
+    card(card &&other) noexcept : m_handle(other.m_handle)
+    {
+        other.m_handle = -1;
+    }
+
+    card &operator=(card &&other) noexcept
+    {
+        if (this != &other)
+        {
+            close_noexcept();
+            m_handle = other.m_handle;
+            other.m_handle = -1;
+        }
+        return *this;
+    }
+
+    ~card()
+    {
+        close_noexcept();
+    }
+
+    int handle() const noexcept { return m_handle; }
+    explicit operator bool() const noexcept { return m_handle >= 0; }
+
+    /* ----
+     * Give up ownership of the handle without closing it.
+     * ----
+     */
+    int release() noexcept
+    {
+        int h = m_handle;
+        m_handle = -1;
+        return h;
+    }
+
+    void close()
+    {
+        int h = release();
+        if (h >= 0 && Open8055_Close(h) < 0)
+            throw error(Open8055_LastError(-1));
+    }
+
+    /* ----
+     * Reset the card. This closes the handle as well.
+     * ----
+     */
+    void reset()
+    {
+        int h = release();
+        if (h >= 0 && Open8055_Reset(h) < 0)
+            throw error(Open8055_LastError(-1));
+    }
+
+    /* ----
+     * Waiting for and consuming input reports
+     * ----
+     */
+    void wait()
+    {
+        check(Open8055_Wait(m_handle));
+    }
+
+    template <class Rep, class Period>
+    bool wait_for(const std::chrono::duration<Rep, Period> &timeout, bool skip_messages = false)
+    {
+        return check(Open8055_WaitEx(m_handle, to_ms(timeout), skip_messages)) > 0;
+    }
+
+    int poll_fd()
+    {
+        return check(Open8055_GetPollFd(m_handle));
+    }
+
+    int udp_poll_fd()
+    {
+        return check(Open8055_GetUDPPollFd(m_handle));
+    }
+
+    int dispatch()
+    {
+        return check(Open8055_Dispatch(m_handle));
+    }
+
+    int pending()
+    {
+        return check(Open8055_GetPending(m_handle));
+    }
+
+    /* ----
+     * Remote transport. remote_rtt() is the smoothed round trip
+     * time to the server.
+     * ----
+     */
+    std::chrono::microseconds busy_poll() const
+    {
+        return std::chrono::microseconds(check(Open8055_GetBusyPoll(m_handle)));
+    }
+
+    template <class Rep, class Period>
+    void busy_poll(const std::chrono::duration<Rep, Period> &spin)
+    {
+        check(Open8055_SetBusyPoll(m_handle, static_cast<int>(
+                std::chrono::duration_cast<std::chrono::microseconds>(spin).count())));
+    }
+
+    std::chrono::duration<double, std::milli> remote_rtt()
+    {
+        double ms = Open8055_GetRemoteRTT(m_handle);
+        if (ms < 0.0)
+            throw error(Open8055_LastError(m_handle));
+        return std::chrono::duration<double, std::milli>(ms);
+    }
+
+    int ack_window() const
+    {
+        return check(Open8055_GetAckWindow(m_handle));
+    }
+
+    void ack_window(int window)
+    {
+        check(Open8055_SetAckWindow(m_handle, window));
+    }
+
+    template <class Rep, class Period>
+    bool wait_ack(const std::chrono::duration<Rep, Period> &timeout)
+    {
+        return check(Open8055_WaitAck(m_handle, to_ms(timeout))) > 0;
+    }
+
+    Open8055_stats_t stats() const
+    {
+        Open8055_stats_t s;
+        check(Open8055_GetStats(m_handle, &s));
+        return s;
+    }
+
+    template <class Rep, class Period>
+    void input_delta(const std::chrono::duration<Rep, Period> &keyframe_interval)
+    {
+        check(Open8055_SetInputDelta(m_handle, to_ms(keyframe_interval)));
+    }
+
+    void request_keyframe()
+    {
+        check(Open8055_RequestKeyframe(m_handle));
+    }
+
+    bool udp_input() const
+    {
+        return check(Open8055_GetUDPInput(m_handle)) != 0;
+    }
+
+    void udp_input(bool flag)
+    {
+        check(Open8055_SetUDPInput(m_handle, flag ? 1 : 0));
+    }
+
+    void subscribe(double max_rate, int deadband_adc1 = 0, int deadband_adc2 = 0)
+    {
+        check(Open8055_Subscribe(m_handle, max_rate, deadband_adc1, deadband_adc2));
+    }
+
+    /* ----
+     * Connect again after the connection to the server was lost.
+     * Returns 0 if it was not, 1 if the session was resumed and 2
+     * if the card had to be opened again.
+     * ----
+     */
+    template <class Rep, class Period>
+    int reconnect(const std::chrono::duration<Rep, Period> &timeout)
+    {
+        return check(Open8055_Reconnect(m_handle, to_ms(timeout)));
+    }
+
+    /* ----
+     * Flush control. See also class batch.
+     * ----
+     */
+    bool auto_flush() const
+    {
+        return check(Open8055_GetAutoFlush(m_handle)) != 0;
+    }
+
+    void auto_flush(bool flag)
+    {
+        check(Open8055_SetAutoFlush(m_handle, flag));
+    }
+
+    void flush()
+    {
+        check(Open8055_Flush(m_handle));
+    }
+
+    /* ----
+     * Inputs
+     * ----
+     */
+    bool get(input_port p) const
+    {
+        return check(Open8055_GetInput(m_handle, static_cast<int>(p))) != 0;
+    }
+
+    int inputs() const
+    {
+        return check(Open8055_GetInputAll(m_handle));
+    }
+
+    int counter(input_port p) const
+    {
+        return check(Open8055_GetCounter(m_handle, static_cast<int>(p)));
+    }
+
+    void reset_counter(input_port p)
+    {
+        check(Open8055_ResetCounter(m_handle, static_cast<int>(p)));
+    }
+
+    void reset_counters()
+    {
+        check(Open8055_ResetCounterAll(m_handle));
+    }
+
+    debounce_duration debounce(input_port p) const
+    {
+        double ms = Open8055_GetDebounce(m_handle, static_cast<int>(p));
+        if (ms < 0.0)
+            throw error(Open8055_LastError(m_handle));
+        return debounce_duration(ms);
+    }
+
+    template <class Rep, class Period>
+    void debounce(input_port p, const std::chrono::duration<Rep, Period> &value)
+    {
+        check(Open8055_SetDebounce(m_handle, static_cast<int>(p),
+                std::chrono::duration_cast<debounce_duration>(value).count()));
+    }
+
+    int get(adc_port p) const
+    {
+        return check(Open8055_GetADC(m_handle, static_cast<int>(p)));
+    }
+
+    input_snapshot read_inputs() const
+    {
+        input_snapshot s;
+
+        s.bits = inputs();
+        for (int i = 0; i < 5; i++)
+            s.counter[i] = counter(static_cast<input_port>(i));
+        for (int i = 0; i < 2; i++)
+            s.adc[i] = get(static_cast<adc_port>(i));
+        return s;
+    }
+
+    /* ----
+     * Outputs
+     * ----
+     */
+    bool get(output_port p) const
+    {
+        return check(Open8055_GetOutput(m_handle, static_cast<int>(p))) != 0;
+    }
+
+    int outputs() const
+    {
+        return check(Open8055_GetOutputAll(m_handle));
+    }
+
+    int value(output_port p) const
+    {
+        return check(Open8055_GetOutputValue(m_handle, static_cast<int>(p)));
+    }
+
+    int get(pwm_port p) const
+    {
+        return check(Open8055_GetPWM(m_handle, static_cast<int>(p)));
+    }
+
+    void set(output_port p, bool on)
+    {
+        check(Open8055_SetOutput(m_handle, static_cast<int>(p), on));
+    }
+
+    void set_outputs(int bits)
+    {
+        check(Open8055_SetOutputAll(m_handle, bits));
+    }
+
+    void set_value(output_port p, int value)
+    {
+        check(Open8055_SetOutputValue(m_handle, static_cast<int>(p), value));
+    }
+
+    void set(pwm_port p, int value)
+    {
+        check(Open8055_SetPWM(m_handle, static_cast<int>(p), value));
+    }
+
+    output_snapshot read_outputs() const
+    {
+        output_snapshot s;
+
+        s.bits = outputs();
+        for (int i = 0; i < 8; i++)
+            s.value[i] = value(static_cast<output_port>(i));
+        for (int i = 0; i < 2; i++)
+            s.pwm[i] = get(static_cast<pwm_port>(i));
+        return s;
+    }
+
+    /* ----
+     * Port modes
+     * ----
+     */
+    adc_mode mode(adc_port p) const
+    {
+        return static_cast<adc_mode>(check(Open8055_GetModeADC(m_handle, static_cast<int>(p))));
+    }
+
+    void mode(adc_port p, adc_mode m)
+    {
+        check(Open8055_SetModeADC(m_handle, static_cast<int>(p), static_cast<int>(m)));
+    }
+
+    input_mode mode(input_port p) const
+    {
+        return static_cast<input_mode>(check(Open8055_GetModeInput(m_handle, static_cast<int>(p))));
+    }
+
+    void mode(input_port p, input_mode m)
+    {
+        check(Open8055_SetModeInput(m_handle, static_cast<int>(p), static_cast<int>(m)));
+    }
+
+    output_mode mode(output_port p) const
+    {
+        return static_cast<output_mode>(check(Open8055_GetModeOutput(m_handle, static_cast<int>(p))));
+    }
+
+    void mode(output_port p, output_mode m)
+    {
+        check(Open8055_SetModeOutput(m_handle, static_cast<int>(p), static_cast<int>(m)));
+    }
+
+private:
+    int     m_handle;
+
+    int check(int rc) const
+    {
+        if (rc < 0)
+            throw error(Open8055_LastError(m_handle));
+        return rc;
+    }
+
+    void close_noexcept() noexcept
+    {
+        if (m_handle >= 0)
+            Open8055_Close(m_handle);
+        m_handle = -1;
+    }
+
+    template <class Rep, class Period>
+    static int to_ms(const std::chrono::duration<Rep, Period> &timeout)
+    {
+        auto ms = std::chrono::duration_cast<milliseconds>(timeout).count();
+        if (ms < 0)
+            return 0;
+        if (ms > INT_MAX)
+            return INT_MAX;
+        return static_cast<int>(ms);
+    }
+};
+
+
+/* ----
+ * batch
+ *
+ *  Turns autoFlush off for its lifetime, so that a group of changes
+ *  goes to the card in one OUTPUT and/or SETCONFIG1 report. Call
+ *  commit() to send and see errors; the destructor sends whatever is
+ *  still pending but cannot report failure.
+ * ----
+ */
+class batch
+{
+public:
+    explicit batch(card &c)
+        : m_card(&c), m_restore(c.auto_flush())
+    {
+        if (m_restore)
+            c.auto_flush(false);
+    }
+
+    batch(const batch &) = delete;
+    batch &operator=(const batch &) = delete;
+
+    ~batch()
+    {
+        if (m_card == nullptr)
+            return;
+        if (m_restore)
+            Open8055_SetAutoFlush(m_card->handle(), 1);
+        else
+            Open8055_Flush(m_card->handle());
+    }
+
+    void commit()
+    {
+        card *c = m_card;
+
+        m_card = nullptr;
+        if (m_restore)
+            c->auto_flush(true);
+        else
+            c->flush();
+    }
+
+private:
+    card    *m_card;
+    bool    m_restore;
+};
+
+} /* namespace open8055 */
+
+#endif /* _OPEN8055_HPP */
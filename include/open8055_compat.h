@@ -42,6 +42,7 @@ extern "C" {
 #ifdef _WIN32
 
 #include <winsock2.h>
+#include <ws2tcpip.h>
 #include <windows.h>
 #include <basetyps.h>
 #include <setupapi.h>
@@ -64,7 +65,9 @@ typedef int     socklen_t;
 #include <errno.h>
 #include <libusb.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
@@ -94,6 +97,15 @@ typedef struct sockaddr_in  SOCKADDR_IN;
 #include <math.h>
 //#include <unistd.h>
 
+/* ----
+ * A lost server connection must show up as an error, not kill the
+ * process with SIGPIPE. Windows never raises it.
+ * ----
+ */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL        0
+#endif
+
 #ifndef FALSE
 #define FALSE 0
 #endif
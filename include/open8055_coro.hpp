@@ -0,0 +1,575 @@
+/* ----------------------------------------------------------------------
+ * open8055_coro.hpp
+ *
+ *  C++20 coroutine support on top of open8055.hpp and the per-card
+ *  poll descriptor. One reactor thread can drive any number of
+ *  concurrent test sequences across many cards.
+ *
+ * ----------------------------------------------------------------------
+ *  Copyright (c) 2012, Jan Wieck
+ *  All rights reserved.
+ *  
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of the <organization> nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *  
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *  
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef _OPEN8055_CORO_HPP
+#define _OPEN8055_CORO_HPP
+
+#include "open8055.hpp"
+
+#if !defined(__cpp_impl_coroutine)
+#error "open8055_coro.hpp requires C++20 coroutine support"
+#endif
+
+#include <cerrno>
+#include <coroutine>
+#include <exception>
+#include <vector>
+
+#ifndef _WIN32
+#include <poll.h>
+#endif
+
+namespace open8055
+{
+
+class reactor;
+class async_card;
+
+namespace detail
+{
+
+/* ----
+ * waiter
+ *
+ *  One suspended co_await. Waiters live in the coroutine frame and are
+ *  linked into their async_card, so suspending does not allocate.
+ * ----
+ */
+struct waiter
+{
+    waiter                                  *prev = nullptr;
+    waiter                                  *next = nullptr;
+    waiter                                  *ready_next = nullptr;
+    std::coroutine_handle<>                 handle;
+    bool                                    has_deadline = false;
+    std::chrono::steady_clock::time_point   deadline;
+    bool                                    failed = false;
+
+    virtual ~waiter() = default;
+
+    /* Called after each dispatch, return true to be resumed. */
+    virtual bool check(async_card &c, int changed) = 0;
+
+    /* Called when the deadline passed. */
+    virtual void expire() = 0;
+};
+
+/* ----
+ * Exception that escaped a task, rethrown by reactor::run().
+ * ----
+ */
+inline std::exception_ptr &pending_exception()
+{
+    static thread_local std::exception_ptr ptr;
+    return ptr;
+}
+
+} /* namespace detail */
+
+
+/* ----
+ * task
+ *
+ *  Detached, eagerly started coroutine. A test sequence is written as
+ *
+ *      open8055::task sequence(open8055::async_card &c) { ... }
+ *
+ *  and runs until its first co_await, after which the reactor resumes
+ *  it. Exceptions escaping a task are rethrown from reactor::run().
+ * ----
+ */
+struct task
+{
+    struct promise_type
+    {
+        task get_return_object() noexcept { return task(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept
+        {
+            if (!detail::pending_exception())
+                detail::pending_exception() = std::current_exception();
+        }
+    };
+};
+
+
+/* ----
+ * async_card
+ *
+ *  Binds a card to a reactor. The card must outlive the async_card,
+ *  and the async_card must outlive all coroutines waiting on it.
+ * ----
+ */
+class async_card
+{
+public:
+    async_card(reactor &r, card &c);
+    ~async_card();
+
+    async_card(const async_card &) = delete;
+    async_card &operator=(const async_card &) = delete;
+
+    open8055::card &card() noexcept { return *m_card; }
+
+    /* ----
+     * co_await changed(mask)
+     *
+     *  Resumes once an input in mask (OPEN8055_INPUT_* bits) changes
+     *  and yields the changed bits within mask. With a timeout it
+     *  yields 0 if nothing changed in time.
+     * ----
+     */
+    class changed_awaiter : public detail::waiter
+    {
+    public:
+        changed_awaiter(async_card &c, int mask) noexcept
+            : m_card(c), m_mask(mask), m_result(0) {}
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) { handle = h; m_card.add(this); }
+        int await_resume() const
+        {
+            if (failed)
+                throw error(Open8055_LastError(m_card.card().handle()));
+            return m_result;
+        }
+
+        bool check(async_card &, int changed) override
+        {
+            m_result = changed & m_mask;
+            return m_result != 0;
+        }
+        void expire() override { m_result = 0; }
+
+    private:
+        async_card  &m_card;
+        int         m_mask;
+        int         m_result;
+    };
+
+    changed_awaiter changed(int mask = OPEN8055_INPUT_ANY) noexcept
+    {
+        return changed_awaiter(*this, mask);
+    }
+
+    template <class Rep, class Period>
+    changed_awaiter changed(int mask, const std::chrono::duration<Rep, Period> &timeout)
+    {
+        changed_awaiter w(*this, mask);
+        set_deadline(w, timeout);
+        return w;
+    }
+
+    /* ----
+     * co_await wait_for(port, value, timeout)
+     *
+     *  For a digital input, resumes once the input equals value. For an
+     *  analog input, resumes once the reading reaches value from the
+     *  side it was on when the wait started. Yields true on success
+     *  and false on timeout. Does not suspend if the condition holds
+     *  already.
+     * ----
+     */
+    class input_awaiter : public detail::waiter
+    {
+    public:
+        input_awaiter(async_card &c, input_port p, bool value) noexcept
+            : m_card(c), m_port(p), m_value(value), m_result(false) {}
+
+        bool await_ready()
+        {
+            m_result = (m_card.card().get(m_port) == m_value);
+            return m_result;
+        }
+        void await_suspend(std::coroutine_handle<> h) { handle = h; m_card.add(this); }
+        bool await_resume() const
+        {
+            if (failed)
+                throw error(Open8055_LastError(m_card.card().handle()));
+            return m_result;
+        }
+
+        bool check(async_card &c, int changed) override
+        {
+            if ((changed & input_mask(m_port)) == 0)
+                return false;
+            m_result = (c.card().get(m_port) == m_value);
+            return m_result;
+        }
+        void expire() override { m_result = false; }
+
+    private:
+        async_card  &m_card;
+        input_port  m_port;
+        bool        m_value;
+        bool        m_result;
+    };
+
+    class adc_awaiter : public detail::waiter
+    {
+    public:
+        adc_awaiter(async_card &c, adc_port p, int value) noexcept
+            : m_card(c), m_port(p), m_value(value), m_rising(true), m_result(false) {}
+
+        bool await_ready()
+        {
+            int v = m_card.card().get(m_port);
+
+            m_rising = (v < m_value);
+            m_result = (v == m_value);
+            return m_result;
+        }
+        void await_suspend(std::coroutine_handle<> h) { handle = h; m_card.add(this); }
+        bool await_resume() const
+        {
+            if (failed)
+                throw error(Open8055_LastError(m_card.card().handle()));
+            return m_result;
+        }
+
+        bool check(async_card &c, int changed) override
+        {
+            if ((changed & adc_mask(m_port)) == 0)
+                return false;
+            int v = c.card().get(m_port);
+            m_result = m_rising ? (v >= m_value) : (v <= m_value);
+            return m_result;
+        }
+        void expire() override { m_result = false; }
+
+    private:
+        async_card  &m_card;
+        adc_port    m_port;
+        int         m_value;
+        bool        m_rising;
+        bool        m_result;
+    };
+
+    input_awaiter wait_for(input_port p, bool value) noexcept
+    {
+        return input_awaiter(*this, p, value);
+    }
+
+    template <class Rep, class Period>
+    input_awaiter wait_for(input_port p, bool value, const std::chrono::duration<Rep, Period> &timeout)
+    {
+        input_awaiter w(*this, p, value);
+        set_deadline(w, timeout);
+        return w;
+    }
+
+    adc_awaiter wait_for(adc_port p, int value) noexcept
+    {
+        return adc_awaiter(*this, p, value);
+    }
+
+    template <class Rep, class Period>
+    adc_awaiter wait_for(adc_port p, int value, const std::chrono::duration<Rep, Period> &timeout)
+    {
+        adc_awaiter w(*this, p, value);
+        set_deadline(w, timeout);
+        return w;
+    }
+
+private:
+    friend class reactor;
+
+    reactor         &m_reactor;
+    open8055::card  *m_card;
+    int             m_fd;
+    int             m_udp_fd;
+    detail::waiter  *m_waiters;
+    async_card      *m_prev;
+    async_card      *m_next;
+
+    template <class Rep, class Period>
+    static void set_deadline(detail::waiter &w, const std::chrono::duration<Rep, Period> &timeout)
+    {
+        w.has_deadline = true;
+        w.deadline = std::chrono::steady_clock::now() +
+                std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout);
+    }
+
+    void add(detail::waiter *w)
+    {
+        if (m_fd < 0)
+            m_fd = m_card->poll_fd();
+        w->prev = nullptr;
+        w->next = m_waiters;
+        if (m_waiters != nullptr)
+            m_waiters->prev = w;
+        m_waiters = w;
+    }
+
+    void remove(detail::waiter *w) noexcept
+    {
+        if (w->prev != nullptr)
+            w->prev->next = w->next;
+        else
+            m_waiters = w->next;
+        if (w->next != nullptr)
+            w->next->prev = w->prev;
+        w->prev = w->next = nullptr;
+    }
+};
+
+
+/* ----
+ * reactor
+ *
+ *  Single threaded event loop. It polls the descriptors of all cards
+ *  that have waiters, calls Open8055_Dispatch() for every card on a
+ *  readable one and for cards that have reports queued already, and
+ *  resumes the coroutines whose condition is met or whose deadline
+ *  passed. Cards sharing a server connection share its descriptor,
+ *  and dispatching one of them can queue reports for the others. With
+ *  UDP input the connection's UDP socket is polled as well.
+ * ----
+ */
+class reactor
+{
+public:
+    reactor() = default;
+    reactor(const reactor &) = delete;
+    reactor &operator=(const reactor &) = delete;
+
+    /* ----
+     * Run until no coroutine is waiting any more.
+     * ----
+     */
+    void run()
+    {
+        rethrow_pending();
+        while (has_waiters())
+            run_once(-1);
+    }
+
+    /* ----
+     * Wait at most timeout_ms (-1 for no limit) for events and resume
+     * what became ready. Returns the number of resumed coroutines.
+     * ----
+     */
+    int run_once(int timeout_ms)
+    {
+        detail::waiter  *ready = nullptr;
+        int             nready = 0;
+        auto            now = std::chrono::steady_clock::now();
+
+        m_pollfds.clear();
+        for (async_card *c = m_cards; c != nullptr; c = c->m_next)
+        {
+            if (c->m_waiters == nullptr)
+                continue;
+            for (detail::waiter *w = c->m_waiters; w != nullptr; w = w->next)
+            {
+                if (!w->has_deadline)
+                    continue;
+                auto ms = std::chrono::ceil<std::chrono::milliseconds>(w->deadline - now).count();
+                if (ms < 0)
+                    ms = 0;
+                if (timeout_ms < 0 || ms < timeout_ms)
+                    timeout_ms = (int)ms;
+            }
+
+            /* Reports queued by dispatching another card are ready now. */
+            if (c->m_card->pending() > 0)
+                timeout_ms = 0;
+            add_pollfd(c->m_fd);
+            c->m_udp_fd = c->m_card->udp_input() ? c->m_card->udp_poll_fd() : -1;
+            if (c->m_udp_fd >= 0)
+                add_pollfd(c->m_udp_fd);
+        }
+
+#ifdef _WIN32
+        int rc = WSAPoll(m_pollfds.data(), (ULONG)m_pollfds.size(), timeout_ms);
+#else
+        int rc = poll(m_pollfds.data(), m_pollfds.size(), timeout_ms);
+        if (rc < 0 && errno == EINTR)
+            rc = 0;
+#endif
+        if (rc < 0)
+            throw error("poll() failed");
+
+        /* ----
+         * Dispatch all cards on readable descriptors, and those with
+         * reports queued, and collect satisfied waiters.
+         * ----
+         */
+        for (async_card *c = m_cards; c != nullptr; c = c->m_next)
+        {
+            if (!(rc > 0 && c->m_fd >= 0 && readable(c->m_fd)) &&
+                !(rc > 0 && c->m_udp_fd >= 0 && readable(c->m_udp_fd)) &&
+                !(c->m_waiters != nullptr && c->m_card->pending() > 0))
+                continue;
+
+            int         changed = Open8055_Dispatch(c->m_card->handle());
+            detail::waiter *w = c->m_waiters;
+
+            while (w != nullptr)
+            {
+                detail::waiter *next = w->next;
+
+                if (changed < 0)
+                    w->failed = true;
+                if (w->failed || (changed > 0 && w->check(*c, changed)))
+                {
+                    c->remove(w);
+                    w->ready_next = ready;
+                    ready = w;
+                }
+                w = next;
+            }
+        }
+
+        /* ----
+         * Expire waiters whose deadline passed.
+         * ----
+         */
+        now = std::chrono::steady_clock::now();
+        for (async_card *c = m_cards; c != nullptr; c = c->m_next)
+        {
+            detail::waiter *w = c->m_waiters;
+
+            while (w != nullptr)
+            {
+                detail::waiter *next = w->next;
+
+                if (w->has_deadline && w->deadline <= now)
+                {
+                    w->expire();
+                    c->remove(w);
+                    w->ready_next = ready;
+                    ready = w;
+                }
+                w = next;
+            }
+        }
+
+        /* ----
+         * Resume. The coroutines may add new waiters while we do this.
+         * ----
+         */
+        while (ready != nullptr)
+        {
+            detail::waiter *w = ready;
+
+            ready = w->ready_next;
+            w->handle.resume();
+            nready++;
+        }
+        rethrow_pending();
+
+        return nready;
+    }
+
+    bool has_waiters() const noexcept
+    {
+        for (async_card *c = m_cards; c != nullptr; c = c->m_next)
+        {
+            if (c->m_waiters != nullptr)
+                return true;
+        }
+        return false;
+    }
+
+private:
+    friend class async_card;
+
+    async_card                  *m_cards = nullptr;
+    std::vector<struct pollfd>  m_pollfds;
+
+    void add_pollfd(int fd)
+    {
+        for (const struct pollfd &p : m_pollfds)
+        {
+            if (p.fd == fd)
+                return;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        m_pollfds.push_back(pfd);
+    }
+
+    bool readable(int fd) const noexcept
+    {
+        for (const struct pollfd &p : m_pollfds)
+        {
+            if (p.fd == fd)
+                return p.revents != 0;
+        }
+        return false;
+    }
+
+    static void rethrow_pending()
+    {
+        std::exception_ptr ptr;
+
+        std::swap(ptr, detail::pending_exception());
+        if (ptr)
+            std::rethrow_exception(ptr);
+    }
+};
+
+
+inline
+async_card::async_card(reactor &r, open8055::card &c)
+    : m_reactor(r), m_card(&c), m_fd(-1), m_udp_fd(-1), m_waiters(nullptr),
+      m_prev(nullptr), m_next(r.m_cards)
+{
+    if (m_next != nullptr)
+        m_next->m_prev = this;
+    r.m_cards = this;
+}
+
+inline
+async_card::~async_card()
+{
+    if (m_prev != nullptr)
+        m_prev->m_next = m_next;
+    else
+        m_reactor.m_cards = m_next;
+    if (m_next != nullptr)
+        m_next->m_prev = m_prev;
+}
+
+} /* namespace open8055 */
+
+#endif /* _OPEN8055_CORO_HPP */
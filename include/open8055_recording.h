@@ -0,0 +1,81 @@
+/* ----------------------------------------------------------------------
+ * open8055_recording.h
+ *
+ *  File format written by Open8055_StartRecording().
+ * ----------------------------------------------------------------------
+ *
+ *  Copyright (c) 2012, Jan Wieck
+ *  All rights reserved.
+ *  
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of the <organization> nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *  
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *  
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef _OPEN8055_RECORDING_H
+#define _OPEN8055_RECORDING_H
+
+
+/* ----
+ * A recording consists of one file header followed by any number of
+ * blocks. Each block is a block header followed by nRecords records.
+ * All integers are stored little endian, independent of the host.
+ *
+ *  File header (128 bytes)
+ *      0   char[8]     magic "O8055REC"
+ *      8   uint16      format version
+ *      10  uint16      record size
+ *      12  uint32      reserved
+ *      16  char[112]   destination of the card, NUL terminated
+ *
+ *  Block header (16 bytes)
+ *      0   char[4]     magic "BLK1"
+ *      4   uint32      block sequence number, starting at 0
+ *      8   uint32      number of records in this block
+ *      12  uint32      records dropped before this block because
+ *                      the writer thread could not keep up
+ *
+ *  Record (48 bytes)
+ *      0   uint64      timestamp, nanoseconds since the Unix epoch
+ *      8   uint8       direction, OPEN8055_RECORD_*
+ *      9   uint8[7]    reserved
+ *      16  uint8[32]   the HID report exactly as sent/received
+ * ----
+ */
+#define OPEN8055_RECORDING_MAGIC        "O8055REC"
+#define OPEN8055_RECORDING_VERSION      1
+#define OPEN8055_RECORDING_HEADER_SIZE  128
+#define OPEN8055_RECORDING_DEST_SIZE    112
+
+#define OPEN8055_RECORDING_BLOCK_MAGIC  "BLK1"
+#define OPEN8055_RECORDING_BLOCK_SIZE   16
+#define OPEN8055_RECORDING_BLOCK_MAX    1024    // max records per block
+
+#define OPEN8055_RECORDING_RECORD_SIZE  48
+
+#define OPEN8055_RECORD_RECEIVED        0       // report from the card
+#define OPEN8055_RECORD_SENT            1       // report sent to the card
+#define OPEN8055_RECORD_STATE           2       // card state at start
+
+
+#endif /* _OPEN8055_RECORDING_H */
@@ -37,13 +37,22 @@
  */
 
 #include <unistd.h>
+#include <stdint.h>
 
 #include "open8055_compat.h"
 #include "open8055.h"
+#include "open8055_recording.h"
 #include "open8055_hid_protocol.h"
 
-#ifndef _WIN32
+#ifdef _WIN32
+#include <wincrypt.h>
+#else
 #include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 #endif
 
 /* ----------------------------------------------------------------------
@@ -51,17 +60,171 @@
  * ----------------------------------------------------------------------
  */
 
+#define OPEN8055_REPORT_QUEUE_SIZE  64
+#define OPEN8055_NET_BUFFER_SIZE    16384   // bytes taken from the socket at once
+
+
+/* ----
+ * Binary framing of the server protocol, negotiated with "BINARY 1"
+ * after HELLO/SALT. Each frame is
+ *
+ *      uint16  payload length
+ *      uint8   frame type
+ *      uint8   channel
+ *      uint32  sequence number, per direction
+ *      payload
+ *
+ * with all integers in network byte order. See also open8055proto.py.
+ * ----
+ */
+#define OPEN8055_BINARY_VERSION     1
+#define OPEN8055_FRAME_HEADER_SIZE  8
+#define OPEN8055_FRAME_TEXT         0x01    // protocol line without newline
+#define OPEN8055_FRAME_RECV         0x02    // server->client raw HID report
+#define OPEN8055_FRAME_SEND         0x03    // client->server raw HID report
+#define OPEN8055_FRAME_SENDACK      0x04    // same, to be acknowledged with ACK
+#define OPEN8055_FRAME_ACK          0x05    // server->client result of SENDACK
+#define OPEN8055_FRAME_DELTA        0x06    // server->client changed INPUT fields
+#define OPEN8055_DELTA_FIELDS       8       // input bits, 5 counters, 2 ADCs
+#define OPEN8055_ACK_WINDOW_MAX     64
+#define OPEN8055_ACK_TIMEOUT        5000    // ms to wait for room in the window
+#define OPEN8055_RECORDER_RING_SIZE 4096    // must be a power of 2
+#define OPEN8055_PING_INTERVAL      1000000 // usec between automatic PINGs
+#define OPEN8055_PING_TIMEOUT       2000    // ms Open8055_GetRemoteRTT() waits
+#define OPEN8055_LINK_CHANNELS      256
+#define OPEN8055_LINK_SLICE         5       // ms a reader on a shared link waits at once
+
+
+/* ----
+ * INPUT reports over UDP, enabled with "UDP <port> <token>". Each
+ * datagram is
+ *
+ *      uint32  token
+ *      uint8   channel
+ *      uint32  sequence number, starting at 1
+ *      raw HID report
+ *
+ * in network byte order. See also open8055proto.py.
+ * ----
+ */
+#define OPEN8055_UDP_HEADER_SIZE    9
+
+
+/* ----
+ * A report waiting in the recorder's ring for the writer thread.
+ * ----
+ */
 typedef struct {
-    int                     isLocal;
-    int                     idLocal;
-    char                    destination[1024];
+    uint64_t                timestamp;
+    int                     direction;
+    Open8055_hidMessage_t   message;
+} Open8055_recordEntry_t;
+
+
+/* ----
+ * State of an active recording.
+ *
+ *  The ring is single producer (whoever holds the card lock) and
+ *  single consumer (the writer thread). ringHead and ringTail are
+ *  free running counters; neither side ever waits for the other.
+ * ----
+ */
+typedef struct {
+    FILE                   *fp;
+    volatile uint32_t       ringHead;       // next entry the writer takes
+    volatile uint32_t       ringTail;       // next entry the card fills
+    volatile uint32_t       ringDropped;    // entries lost on a full ring
+    volatile int            stop;
+    volatile int            failed;
+    uint32_t                blockSeq;
+    uint32_t                droppedWritten;
+    char                    errorMessage[1024];
+#ifdef _WIN32
+    HANDLE                  thread;
+#else
+    pthread_t               thread;
+#endif
+    unsigned char           block[OPEN8055_RECORDING_BLOCK_SIZE +
+                                  OPEN8055_RECORDING_BLOCK_MAX *
+                                  OPEN8055_RECORDING_RECORD_SIZE];
+    Open8055_recordEntry_t  ring[OPEN8055_RECORDER_RING_SIZE];
+} Open8055_recorder_t;
+
+/* ----
+ * A connection to an Open8055Server. If the server supports channels,
+ * all remote cards opened on the same server as the same user share
+ * one link, each on its own channel. The link's lock is then the card
+ * lock of all of them, so whoever receives a frame for another card
+ * can process it on that card's behalf.
+ * ----
+ */
+#define LINK_STATE_PENDING          1   // handshake in progress, may be shared
+#define LINK_STATE_READY            2   // shared, channels supported
+#define LINK_STATE_PRIVATE          3   // one card only
+#define LINK_STATE_FAILED           4
+#define LINK_STATE_CLOSED           5
+#define LINK_STATE_BROKEN           6   // connection lost, see Open8055_Reconnect()
+
+typedef struct Open8055_link {
+    char                    host[256];
+    int                     port;
+    char                    user[256];
+    volatile int            state;
+    int                     refcount;       // protected by linksLock
+    struct Open8055_link   *next;
 
     SOCKET		    sock;
-    char		    net_input_buffer[1024];
+    char		    net_input_buffer[OPEN8055_NET_BUFFER_SIZE];
     char		   *net_input_pos;
     int			    net_input_have;
     char		    net_input_line[1024];
     char		   *net_input_out;
+    int                     binaryProtocol;
+    int                     multiplex;      // server supports channels
+    uint32_t                sendSeq;
+    uint32_t                recvSeq;
+    int                     cardCount;
+    int                     nextChannel;
+    struct Open8055_card   *channels[OPEN8055_LINK_CHANNELS];
+    char                    errorMessage[1024];
+    SOCKET                  udpSock;        // INPUT datagrams, if enabled
+    uint32_t                udpToken;
+    int                     udpLoss;        // percent dropped on purpose
+
+#ifdef _WIN32
+    CRITICAL_SECTION        linkLock;
+#else
+    pthread_mutex_t         linkLock;
+#endif
+} Open8055_link_t;
+
+typedef struct Open8055_card {
+    int                     isLocal;
+    int                     idLocal;
+    char                    destination[1024];
+
+    Open8055_link_t        *link;
+    int                     channel;
+    int                     channelFailed;  // error received by another card
+    int                     busyPoll;       // usec to spin before select()
+    int                     pingUnsupported;
+    int64_t                 pingSentAt;
+    int64_t                 rttSmoothed;    // usec
+    int                     rttSamples;
+    int                     ackWindow;      // max unacknowledged SENDs, 0 = off
+    int                     ackOutstanding;
+    uint32_t                ackId[OPEN8055_ACK_WINDOW_MAX];
+    int64_t                 ackSentAt[OPEN8055_ACK_WINDOW_MAX];
+    int                     ackFailed;
+    char                    ackErrorMessage[256];
+    double                  ackLatencySum;
+    Open8055_stats_t        stats;
+    int                     inputDelta;     // keyframe interval ms, 0 = off
+    Open8055_hidMessage_t   streamInput;    // last INPUT received
+    int                     udpInput;       // INPUT reports come over UDP
+    uint32_t                udpLastSeq;
+    char                    resumeToken[64];    // from the server's HOLD
+    int                     readOnly;       // opened with WATCH
 
     char                    errorMessage[1024];
 
@@ -76,6 +239,19 @@ typedef struct {
     int                     cardClosed;
     int                     cardRefcount;
 
+    Open8055_hidMessage_t   reportQueue[OPEN8055_REPORT_QUEUE_SIZE];
+    int                     reportQueueHead;
+    int                     reportQueueCount;
+    int                     reportQueueDropped;
+
+    Open8055_recorder_t    *recorder;
+
+#ifdef _WIN32
+    CRITICAL_SECTION       *lock;
+#else
+    pthread_mutex_t        *lock;           // &cardLock or the link's lock
+#endif
+
 #ifdef _WIN32
     unsigned char           writeBuffer[OPEN8055_HID_MESSAGE_SIZE + 1];
     unsigned char           readBuffer[OPEN8055_HID_MESSAGE_SIZE + 1];
@@ -91,11 +267,48 @@ typedef struct {
     int                     transferPending;
     int                     transferDone;
     pthread_mutex_t         cardLock;
+
+    int                     pollFd;
+    int                     pollFdWrite;
+    int                     pollThreadStarted;
+    int                     pollThreadRunning;
+    pthread_t               pollThread;
+    pthread_cond_t          pollCond;
 #endif
 
 } Open8055_card_t;
 
 
+/* ----
+ * Progress of one destination in ConnectCards().
+ * ----
+ */
+#define CONNECT_STATE_CONNECTING    1   // non-blocking connect() in progress
+#define CONNECT_STATE_HELLO         2   // waiting for server HELLO
+#define CONNECT_STATE_SALT          3   // waiting for server SALT
+#define CONNECT_STATE_BINARY        4   // waiting for BINARY response
+#define CONNECT_STATE_LINK          5   // waiting for another card's handshake
+#define CONNECT_STATE_REPORTS       6   // waiting for CONFIG1, OUTPUT and INPUT
+#define CONNECT_STATE_DONE          7
+#define CONNECT_STATE_FAILED        8
+
+typedef struct {
+    Open8055_card_t        *card;
+    int                     state;
+    int                     deviceOpen;
+    int                     linkLeader;     // this card does the link's handshake
+    int                     cardNumber;
+    char                    user[256];
+    char                    host[256];
+    int                     port;
+    struct addrinfo        *addrList;
+    struct addrinfo        *addrNext;
+    char                    resumeToken[64];    // RESUME instead of OPEN
+    int                     readOnly;       // WATCH instead of OPEN
+    char                    errorMessage[1024];
+} Open8055_connect_t;
+
+
 /* ----------------------------------------------------------------------
  * Local functions
  * ----------------------------------------------------------------------
@@ -104,24 +317,119 @@ static Open8055_card_t *LockAndRefcount(int h);
 static void UnlockAndRefcount(Open8055_card_t *card);
 #ifdef _WIN32
 #define LockCreate(_c)      InitializeCriticalSection((_c))
+#define LockCreateRecursive(_c) InitializeCriticalSection((_c))
 #define LockDestroy(_c)     DeleteCriticalSection((_c))
 #define LockAcquire(_c)     EnterCriticalSection((_c))
 #define LockRelease(_c)     LeaveCriticalSection((_c))
 #else
 #define LockCreate(_c)      pthread_mutex_init((_c), NULL)
+#define LockCreateRecursive(_c) pthread_mutex_init((_c), &recursiveMutexAttr)
 #define LockDestroy(_c)     pthread_mutex_destroy((_c))
 #define LockAcquire(_c)     pthread_mutex_lock((_c))
 #define LockRelease(_c)     pthread_mutex_unlock((_c))
 #endif
 
+#ifdef _WIN32
+#define AtomicLoad(_p)      ((uint32_t)InterlockedCompareExchange((volatile LONG *)(_p), 0, 0))
+#define AtomicStore(_p,_v)  InterlockedExchange((volatile LONG *)(_p), (LONG)(_v))
+#else
+#define AtomicLoad(_p)      __atomic_load_n((_p), __ATOMIC_ACQUIRE)
+#define AtomicStore(_p,_v)  __atomic_store_n((_p), (_v), __ATOMIC_RELEASE)
+#endif
+
 static int Open8055_Init(void);
 static void SetError(Open8055_card_t *card, char *fmt, ...);
+static int64_t TimeNowUsec(void);
+static uint64_t TimeNowRealNsec(void);
+static int RandomBytes(void *buf, int len);
+
+static int ConnectCards(const char **destinations, int n, int *handles,
+            int timeout, Open8055_connect_t *pending);
+static void ConnectStart(Open8055_connect_t *conn, const char *destination);
+static void ConnectWait(Open8055_connect_t *pending, int n, int timeout);
+static void ConnectNextAddress(Open8055_connect_t *conn);
+static void ConnectLocal(Open8055_connect_t *conn);
+static void ConnectCompleted(Open8055_connect_t *conn);
+static void ConnectProgress(Open8055_connect_t *conn, int timeout);
+static int ConnectSendOpen(Open8055_connect_t *conn);
+static void ConnectFail(Open8055_connect_t *conn, char *fmt, ...);
+static int ConnectParseRemote(Open8055_connect_t *conn, const char *destination,
+            char *host, int hostlen, int *port);
+static void ConnectRemote(Open8055_connect_t *conn, int share);
+static void ConnectFollow(Open8055_connect_t *conn);
+static int AddConnection(Open8055_card_t *card);
+static Open8055_link_t *LinkFind(Open8055_connect_t *conn);
+static Open8055_link_t *LinkCreate(Open8055_connect_t *conn, int share);
+static int LinkAddChannel(Open8055_card_t *card);
+static int LinkDetach(Open8055_card_t *card);
+static void LinkRelease(Open8055_link_t *link);
+static void LinkBroken(Open8055_link_t *link);
+static void LinkTransfer(Open8055_card_t *card, Open8055_card_t *fresh,
+            int reopened);
+static int LinkOpenUDP(Open8055_card_t *card);
+static int LinkRecvUDP(Open8055_card_t *card);
+static int SocketSetNonBlocking(SOCKET sock, int flag);
+static int SocketWouldBlock(void);
 
 static int CardRead(Open8055_card_t *card, void *buffer, int timeout);
+static int CardReceive(Open8055_card_t *card, void *buffer, int timeout);
+static int CardReceiveMessage(Open8055_card_t *card, void *buffer, int timeout);
 static int CardReadLine(Open8055_card_t *card, char *buffer, int len, int timeout);
+static int ParseInts(char *cp, int *values, int maxValues);
+static int CardReadFrame(Open8055_card_t *card, int *type, int *channel,
+            unsigned char **payload, int *len, int timeout);
+static int CardFillInput(Open8055_card_t *card, int timeout);
+static int CardRecvInput(Open8055_card_t *card);
+static int CardSendPing(Open8055_card_t *card);
+static int CardHandlePong(Open8055_card_t *card, char *line);
+static int CardPump(Open8055_card_t *card, int timeout);
+static int CardAckWait(Open8055_card_t *card, int limit, int timeout);
+static int CardAckCheck(Open8055_card_t *card);
+static void CardHandleAck(Open8055_card_t *card, uint32_t id, uint32_t usec,
+                          char *error);
+static int CardHandleAckLine(Open8055_card_t *card, char *line);
+static int CardHandleDeltaLine(Open8055_card_t *card, char *line, void *buffer);
+static int CardHandleUnsupported(Open8055_card_t *card, char *line);
+static int CardHandleHold(Open8055_card_t *card, char *line);
+static int CardHandleFrame(Open8055_card_t *card, int type,
+            unsigned char *payload, int len, void *buffer);
+static int CardApplyDelta(Open8055_card_t *card, int mask, int *values,
+                          void *buffer);
+static int CardSendFrame(Open8055_card_t *card, int type, int channel,
+            void *payload, int len);
 static int CardWrite(Open8055_card_t *card, void *buffer);
+static void CardMirror(Open8055_card_t *card, Open8055_hidMessage_t *message);
+static int CardSend(Open8055_card_t *card, void *buffer);
+static int CardSendText(Open8055_card_t *card, char *verb, void *buffer);
 static int CardWriteLine(Open8055_card_t *card, char *fmt, ...);
+static int CardSendAll(Open8055_card_t *card, char *buf, int len);
 static int CardClose(Open8055_card_t *card);
+static int InputChangedMask(Open8055_hidMessage_t *oldInput,
+            Open8055_hidMessage_t *newInput);
+
+static void ReportQueuePut(Open8055_card_t *card, void *buffer);
+static int ReportQueueGet(Open8055_card_t *card, void *buffer);
+
+static void RecorderPut(Open8055_recorder_t *rec, int direction, void *buffer);
+static int RecorderStop(Open8055_card_t *card);
+static void RecorderRun(Open8055_recorder_t *rec);
+static int RecorderWriteBlock(Open8055_recorder_t *rec, int nrecords);
+static void PutLE16(unsigned char *p, uint16_t val);
+static void PutLE32(unsigned char *p, uint32_t val);
+static void PutLE64(unsigned char *p, uint64_t val);
+#ifdef _WIN32
+static DWORD WINAPI RecorderThreadMain(LPVOID arg);
+#else
+static void *RecorderThreadMain(void *arg);
+#endif
+#ifndef _WIN32
+static int PollStart(Open8055_card_t *card);
+static void PollStop(Open8055_card_t *card);
+static void *PollThreadMain(void *arg);
+static int PollWait(Open8055_card_t *card, void *buffer, int timeout);
+static void PollSignal(Open8055_card_t *card);
+static void PollDrain(Open8055_card_t *card);
+#endif
 
 static int DeviceInit(void);
 static int DevicePresent(int cardNumber);
@@ -144,11 +452,22 @@ static int              openLocalCards[OPEN8055_MAX_CARDS];
 static Open8055_card_t  **connections = NULL;
 static int              connectionsSize = 0;
 static int              connectionsUsed = 0;
+
+static Open8055_connect_t *connectManyResult = NULL;
+static int              connectManyResultSize = 0;
+static char             connectManyError[1024] = {'\0'};
+
+static Open8055_link_t  *links = NULL;
 #ifdef _WIN32
 static CRITICAL_SECTION connectionsLock;
+static CRITICAL_SECTION linksLock;
+static CRITICAL_SECTION connectLock;
 WSADATA			WSAData;
 #else
 static pthread_mutex_t  connectionsLock;
+static pthread_mutex_t  linksLock;
+static pthread_mutex_t  connectLock;
+static pthread_mutexattr_t recursiveMutexAttr;
 #endif
 
 
@@ -214,10 +533,8 @@ Open8055_CardPresent(int cardNumber)
 OPEN8055_EXTERN int OPEN8055_CDECL
 Open8055_Connect(char *destination, char *password)
 {
-    int                     cardNumber;
-    Open8055_card_t        *card;
-    Open8055_hidMessage_t   outputMessage;
-    Open8055_hidMessage_t   inputMessage;
+    Open8055_connect_t      pending;
+    const char             *destinations[1];
     int                     handle;
 
     /* ----
@@ -231,358 +548,114 @@ Open8055_Connect(char *destination, char *password)
     }
 
     /* ----
-     * Allocate the card status data.
+     * A single connect is just a ConnectMany with one destination.
      * ----
      */
-    card = (Open8055_card_t *)malloc(sizeof(Open8055_card_t));
-    if (card == NULL)
+    destinations[0] = destination;
+    if (ConnectCards(destinations, 1, &handle, 60000, &pending) < 0)
+        return -1;
+
+    if (handle < 0)
     {
-        SetError(NULL, "out of memory");
+        strncpy(lastErrorMessage, pending.errorMessage, sizeof(lastErrorMessage));
         return -1;
     }
-    memset(card, 0, sizeof(Open8055_card_t));
-    strncpy(card->destination, destination, sizeof(card->destination));
-    card->autoFlush = TRUE;
 
     /* ----
-     * Parse the destination. We first check for the remote
-     * format of open8055://user@host/cardN.
+     * Success.
      * ----
      */
-    if (strncasecmp(destination, "open8055://", 11) == 0)
-    {
-    	char           *destcopy = strdup(&destination[11]);
-	char           *user = "nobody";
-	char           *host = "localhost";
-	int	        port = 8055;
-	char           *parsepos = destcopy;
-	char           *pos;
-	struct hostent *hent;
-	struct sockaddr_in	addr;
-	char		line[256];
-	char		salt[256];
-	int		rc;
-
-	/* ----
-	 * If present, extract the USER@ part at the beginning of the destination.
-	 * ----
-	 */
-	if ((pos = strchr(parsepos, '@')) != NULL)
-	{
-	    user = parsepos;
-	    *pos++ = '\0';
-	    parsepos = pos;
-	}
-
-	/* ----
-	 * We now expect either "host:port/cardN" or "host/cardN".
-	 * ----
-	 */
-	if ((pos = strchr(parsepos, ':')) != NULL)
-	{
-	    /* ----
-	     * There is a colon, so get the host and port.
-	     * ----
-	     */
-	    host = parsepos;
-	    *pos++ = '\0';
-	    parsepos = pos;
-	    if ((pos = strchr(parsepos, '/')) == NULL)
-	    {
-	    	SetError(NULL, "Invalid destination");
-		free(card);
-		free(destcopy);
-		return -1;
-	    }
-	    *pos++ = '\0';
-	    if (sscanf(parsepos, "%d", &port) != 1)
-	    {
-	    	SetError(NULL, "Invalid destination");
-		free(card);
-		free(destcopy);
-		return -1;
-	    }
-	    parsepos = pos;
-	}
-	else
-	{
-	    /* ----
-	     * No colon, so it is just going to be a host name
-	     * followed by /cardN.
-	     * ----
-	     */
-	    if ((pos = strchr(parsepos, '/')) == NULL)
-	    {
-	    	SetError(NULL, "Invalid destination");
-		free(card);
-		free(destcopy);
-		return -1;
-	    }
-	    *pos++ = '\0';
-	    host = parsepos;
-	    parsepos = pos;
-	}
-
-	/* ----
-	 * The final element in the remote card address must be "cardN".
-	 * ----
-	 */
-	if (sscanf(parsepos, "card%d", &cardNumber) != 1)
-	{
-	    SetError(NULL, "Invalid destination");
-	    free(card);
-	    free(destcopy);
-	    return -1;
-	}
-
-	/* ----
-	 * Get the actual host address.
-	 * ----
-	 */
-	hent = gethostbyname(host);
-	if (hent == NULL)
-	{
-	    SetError(NULL, "%s: unknown host", host);
-	    free(card);
-	    free(destcopy);
-	    return -1;
-	}
-	free(destcopy);
-
-	/* ----
-	 * Connect to the Open8055Server.
-	 * ----
-	 */
-	addr.sin_family = AF_INET;
-	addr.sin_addr = *((struct in_addr *)(hent->h_addr));
-	addr.sin_port = htons(port);
-	card->sock = socket(AF_INET, SOCK_STREAM, 0);
-	if (card->sock == INVALID_SOCKET)
-	{
-	    SetError(NULL, "%s", ErrorString());
-	    free(card);
-	    return -1;
-	}
-	if (connect(card->sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
-	{
-	    SetError(NULL, "%s", ErrorString());
-	    closesocket(card->sock);
-	    free(card);
-	    return -1;
-	}
-
-	/* ----
-	 * Create and acquire the card lock and mark the card being remote.
-	 * ----
-	 */
-	LockCreate(&(card->cardLock));
-	LockAcquire(&(card->cardLock));
-	card->isLocal   = FALSE;
-	card->idLocal   = -1;
-	card->net_input_pos = card->net_input_buffer;
-	card->net_input_out = card->net_input_line;
-
-	/* ----
-	 * Get the HELLO and SALT messages.
-	 * ----
-	 */
-	if ((rc = CardReadLine(card, line, sizeof(line), 60000)) <= 0)
-	{
-	    if (rc < 0)
-		strncpy(lastErrorMessage, card->errorMessage, sizeof(lastErrorMessage));
-	    else
-	        SetError(NULL, "timeout receiving HELLO");
-	    CardClose(card);
-	    LockRelease(&(card->cardLock));
-	    LockDestroy(&(card->cardLock));
-	    free(card);
-	    return -1;
-	}
-	if (strncmp(line, "HELLO Open8055Server ", 21) != 0)
-	{
-	    SetError(NULL, "Expected HELLO, got '%s'", line);
-	    CardClose(card);
-	    LockRelease(&(card->cardLock));
-	    LockDestroy(&(card->cardLock));
-	    free(card);
-	    return -1;
-	}
-
-	if ((rc = CardReadLine(card, line, sizeof(line), 60000)) <= 0)
-	{
-	    if (rc < 0)
-		strncpy(lastErrorMessage, card->errorMessage, sizeof(lastErrorMessage));
-	    else
-	        SetError(NULL, "timeout receiving SALT");
-	    CardClose(card);
-	    LockRelease(&(card->cardLock));
-	    LockDestroy(&(card->cardLock));
-	    free(card);
-	    return -1;
-	}
-	if (sscanf(line, "SALT %s", salt) != 1)
-	{
-	    SetError(NULL, "Expected SALT, got '%s'", line);
-	    CardClose(card);
-	    LockRelease(&(card->cardLock));
-	    LockDestroy(&(card->cardLock));
-	    free(card);
-	    return -1;
-	}
-
-	/* ----
-	 * Send the OPEN command with username and password.
-	 * TODO: MD5 hashing
-	 * ----
-	 */
-    	if (CardWriteLine(card, "open %d %s %s\n", cardNumber, user, "dummy") < 0)
-	{
-	    strncpy(lastErrorMessage, card->errorMessage, sizeof(lastErrorMessage));
-	    CardClose(card);
-	    LockRelease(&(card->cardLock));
-	    LockDestroy(&(card->cardLock));
-	    free(card);
-	    return -1;
-	}
-    }
-    else
-    {
-	/* ----
-	 * Destination does not start with "open8055://". The requested card must be a local card.
-	 * ----
-	 */
-	if (sscanf(destination, "card%d", &cardNumber) != 1)
-	{
-	    SetError(NULL, "Syntax error in local card address '%s'", destination);
-	    free(card);
-	    return -1;
-	}
-
-	/* ----
-	 * Check the card number for validity and make sure it isn't open yet.
-	 * ----
-	 */
-	if (cardNumber < 0 || cardNumber >= OPEN8055_MAX_CARDS)
-	{
-	    SetError(NULL, "Card number %d out of bounds", cardNumber);
-	    free(card);
-	    return -1;
-	}
-	if (openLocalCards[cardNumber] != 0)
-	{
-	    SetError(NULL, "Local card %d already open", cardNumber);
-	    free(card);
-	    return -1;
-	}
-
-	/* ----
-	 * Try to open the actual local card.
-	 * ----
-	 */
-	if (DeviceOpen(card) < 0)
-	{
-	    strncpy(lastErrorMessage, card->errorMessage, sizeof(lastErrorMessage));
-	    free(card);
-	    return -1;
-	}
+    return handle;
+}
 
-	/* ----
-	 * Create and acquire the card lock.
-	 * ----
-	 */
-	LockCreate(&(card->cardLock));
-	LockAcquire(&(card->cardLock));
 
-	card->isLocal   = TRUE;
-	card->idLocal   = cardNumber;
-    }
+/* ----
+ * Open8055_ConnectMany()
+ *
+ *  Opens a number of local and/or remote Open8055 cards at once.
+ *  The TCP/IP connects and server handshakes of all remote cards
+ *  are done concurrently, so the whole operation takes about as
+ *  long as the slowest destination, limited by timeout (in ms,
+ *  OPEN8055_INFINITE waits forever).
+ *
+ *  The handle of every card is stored in handles[], or -1 if that
+ *  destination failed. Open8055_ConnectManyError() returns the
+ *  reason for the failure. The return value is the number of
+ *  cards opened or -1 if the call failed as a whole.
+ * ----
+ */
+OPEN8055_EXTERN int OPEN8055_CDECL
+Open8055_ConnectMany(const char **destinations, int n, int *handles, int timeout)
+{
+    Open8055_connect_t *result = NULL;
+    Open8055_connect_t *old;
+    int             connected = 0;
 
-    /* ----
-     * Query current card status. When connecting to an Open8055Server,
-     * The OPEN command automatically responds with those messages.
-     * ----
-     */
-    if (card->isLocal)
+    if (!initialized)
     {
-	memset(&outputMessage, 0, sizeof(outputMessage));
-	outputMessage.msgType = OPEN8055_HID_MESSAGE_GETCONFIG;
-	if (CardWrite(card, &outputMessage) < 0)
-	{
-	    strncpy(lastErrorMessage, card->errorMessage, sizeof(lastErrorMessage));
-	    CardClose(card);
-	    LockRelease(&(card->cardLock));
-	    LockDestroy(&(card->cardLock));
-	    free(card);
-	    return -1;
-	}
-    }
-    while (card->currentConfig1.msgType == 0x00 
-        || card->currentOutput.msgType == 0x00
-        || card->currentInput.msgType == 0x00)
-    {
-        if (CardRead(card, &inputMessage, 1000) < 0)
-        {
-	    strncpy(lastErrorMessage, card->errorMessage, sizeof(lastErrorMessage));
-            CardClose(card);
-            LockRelease(&(card->cardLock));
-            LockDestroy(&(card->cardLock));
-            free(card);
+        if (Open8055_Init() < 0)
             return -1;
-        }
-        switch(inputMessage.msgType)
-        {
-            case OPEN8055_HID_MESSAGE_SETCONFIG1:
-                memcpy(&(card->currentConfig1), &inputMessage, 
-                    sizeof(card->currentConfig1));
-                break;
-
-            case OPEN8055_HID_MESSAGE_OUTPUT:
-                memcpy(&(card->currentOutput), &inputMessage, 
-                    sizeof(card->currentOutput));
-                break;
-
-            case OPEN8055_HID_MESSAGE_INPUT:
-                card->currentInputUnconsumed = OPEN8055_INPUT_ANY;
-                memcpy(&(card->currentInput), &inputMessage, 
-                    sizeof(card->currentInput));
-                break;
-        }
     }
 
-    /* ----
-     * Find a free connection slot or allocate a new one.
-     * ----
-     */
-    for (handle = 0; handle < connectionsUsed; handle++)
+    if (n < 0 || (n > 0 && (destinations == NULL || handles == NULL)))
     {
-        if (connections[handle] == NULL)
-            break;
+        SetError(NULL, "parameter invalid");
+        return -1;
     }
-    if (handle == connectionsSize)
+
+    if (n > 0)
     {
-        connectionsSize *= 2;
-        connections = (Open8055_card_t **)realloc(connections, sizeof(Open8055_card_t *) * connectionsSize);
-        if (connections == NULL)
+        result = (Open8055_connect_t *)malloc(sizeof(Open8055_connect_t) * n);
+        if (result == NULL)
         {
-            initialized = 0;
             SetError(NULL, "out of memory");
-            CardClose(card);
-            LockRelease(&(card->cardLock));
-            LockDestroy(&(card->cardLock));
-            free(card);
             return -1;
         }
+        connected = ConnectCards(destinations, n, handles, timeout, result);
     }
-    if (handle == connectionsUsed)
-        connectionsUsed++;
-    connections[handle] = card;
-    LockRelease(&(card->cardLock));
 
     /* ----
-     * Success.
+     * Replace the per destination results of the previous call. Other
+     * threads may be reading them in Open8055_ConnectManyError().
      * ----
      */
-    return handle;
+    LockAcquire(&connectLock);
+    old = connectManyResult;
+    connectManyResult = result;
+    connectManyResultSize = n;
+    LockRelease(&connectLock);
+    free(old);
+
+    return connected;
+}
+
+
+/* ----
+ * Open8055_ConnectManyError()
+ *
+ *  Returns the error message for one destination of the last call
+ *  to Open8055_ConnectMany(), or an empty string if it succeeded.
+ * ----
+ */
+OPEN8055_EXTERN char * OPEN8055_CDECL
+Open8055_ConnectManyError(int index)
+{
+    if (!initialized)
+        return "";
+
+    /* ----
+     * The results go away with the next Open8055_ConnectMany(), so
+     * hand out a copy of the message.
+     * ----
+     */
+    LockAcquire(&connectLock);
+    if (index < 0 || index >= connectManyResultSize)
+        connectManyError[0] = '\0';
+    else
+        strcpy(connectManyError, connectManyResult[index].errorMessage);
+    LockRelease(&connectLock);
+
+    return connectManyError;
 }
 
 
@@ -620,9 +693,9 @@ Open8055_Close(int h)
      * card lock.
      * ----
      */
-    LockRelease(&(card->cardLock));
+    LockRelease(card->lock);
     LockAcquire(&connectionsLock);
-    LockAcquire(&(card->cardLock));
+    LockAcquire(card->lock);
 
     /* ----
      * We now can safely mark the handle slot empty, so that no other calls
@@ -652,9 +725,9 @@ Open8055_Close(int h)
             return -1;
         }
 
-        LockRelease(&(card->cardLock));
+        LockRelease(card->lock);
         usleep(1000);
-        LockAcquire(&(card->cardLock));
+        LockAcquire(card->lock);
     }
 
     /* ----
@@ -670,6 +743,8 @@ Open8055_Close(int h)
     }
 
     UnlockAndRefcount(card);
+    if (card->link != NULL)
+        LinkRelease(card->link);
     LockDestroy(&(card->cardLock));
     free(card);
 
@@ -713,9 +788,9 @@ Open8055_Reset(int h)
      * card lock.
      * ----
      */
-    LockRelease(&(card->cardLock));
+    LockRelease(card->lock);
     LockAcquire(&connectionsLock);
-    LockAcquire(&(card->cardLock));
+    LockAcquire(card->lock);
 
     /* ----
      * We now can safely mark the handle slot empty, so that no other calls
@@ -745,9 +820,9 @@ Open8055_Reset(int h)
             return -1;
         }
 
-        LockRelease(&(card->cardLock));
+        LockRelease(card->lock);
         usleep(1000);
-        LockAcquire(&(card->cardLock));
+        LockAcquire(card->lock);
     }
 
     /* ----
@@ -775,6 +850,8 @@ Open8055_Reset(int h)
     }
 
     UnlockAndRefcount(card);
+    if (card->link != NULL)
+        LinkRelease(card->link);
     LockDestroy(&(card->cardLock));
     free(card);
 
@@ -872,6 +949,7 @@ Open8055_WaitEx(int h, int timeout, int skipMessages)
 
                 case OPEN8055_HID_MESSAGE_SETCONFIG1:
                 case OPEN8055_HID_MESSAGE_OUTPUT:
+                    CardMirror(card, &inputMessage);
                     rc = 0;
                     break;
 
@@ -919,7 +997,7 @@ Open8055_WaitEx(int h, int timeout, int skipMessages)
         }
 
         if (rc == 0)
-            return 0;
+            break;
 
         /* ----
          * Handle by message type.
@@ -935,6 +1013,7 @@ Open8055_WaitEx(int h, int timeout, int skipMessages)
 
             case OPEN8055_HID_MESSAGE_SETCONFIG1:
             case OPEN8055_HID_MESSAGE_OUTPUT:
+                CardMirror(card, &inputMessage);
                 rc = 0;
                 break;
 
@@ -950,94 +1029,141 @@ Open8055_WaitEx(int h, int timeout, int skipMessages)
 
 
 /* ----
- * Open8055_GetAutoFlush()
+ * Open8055_GetPollFd()
  *
- *  Return the current autoFlush setting.
+ *  Returns a file descriptor that becomes readable when new reports
+ *  may be available for this card, for use with select(), poll(),
+ *  epoll and friends. Once it signals, call Open8055_Dispatch().
+ *
+ *  For a remote card this is the server socket. For a local card
+ *  the first call starts an I/O thread that keeps reading the card
+ *  and signals an eventfd (a pipe where that doesn't exist).
+ *
+ *  Remote cards sharing a server connection return the same socket.
+ *  Since reading for one of them may receive reports for the others,
+ *  call Open8055_Dispatch() for all of them when it signals, and for
+ *  any card Open8055_GetPending() finds reports queued for.
  * ----
  */
-OPEN8055_EXTERN void OPEN8055_CDECL
-Open8055_Sleep(int ms)
+OPEN8055_EXTERN int OPEN8055_CDECL
+Open8055_GetPollFd(int h)
 {
-#ifdef _WIN32
-    if (ms < 0)
-        ms = 0;
-
-    Sleep((DWORD)ms);
-#else
-    struct timeval  tv;
+    Open8055_card_t *card;
+    int             rc;
 
-    if (ms < 0)
-        ms = 0;
+    if ((card = LockAndRefcount(h)) == NULL)
+        return -1;
 
-    tv.tv_sec = ms / 1000;
-    tv.tv_usec = (ms % 1000) * 1000;
+    if (!card->isLocal)
+    {
+        rc = (int)card->link->sock;
+        UnlockAndRefcount(card);
+        return rc;
+    }
 
-    select (0, NULL, NULL, NULL, &tv);
+#ifdef _WIN32
+    SetError(card, "Open8055_GetPollFd() not supported for local cards on Windows");
+    rc = -1;
+#else
+    if (card->pollThreadStarted)
+        rc = card->pollFd;
+    else if (PollStart(card) < 0)
+        rc = -1;
+    else
+        rc = card->pollFd;
 #endif
+
+    UnlockAndRefcount(card);
+    return rc;
 }
 
 
 /* ----
- * Open8055_GetAutoFlush()
+ * Open8055_Dispatch()
  *
- *  Return the current autoFlush setting.
+ *  Consume all reports that are ready for the card without blocking.
+ *  Returns a bitmask of the OPEN8055_INPUT_* items whose value has
+ *  changed, 0 if nothing changed and -1 on error.
  * ----
  */
 OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_GetAutoFlush(int h)
+Open8055_Dispatch(int h)
 {
-    Open8055_card_t *card;
-    int             rc = 0;
+    Open8055_card_t         *card;
+    Open8055_hidMessage_t   inputMessage;
+    int                     changed = 0;
+    int                     rc;
 
     if ((card = LockAndRefcount(h)) == NULL)
         return -1;
 
-    if(card->autoFlush)
-        rc = 1;
+#ifndef _WIN32
+    if (card->pollThreadStarted)
+        PollDrain(card);
+#endif
+
+    for (;;)
+    {
+        memset(&inputMessage, 0, sizeof(inputMessage));
+        rc = CardRead(card, &inputMessage, 0);
+
+        if (rc < 0 || card->cardClosed)
+        {
+            UnlockAndRefcount(card);
+            return -1;
+        }
+        if (rc == 0)
+            break;
+
+        /* ----
+         * Handle by message type.
+         * ----
+         */
+        switch (inputMessage.msgType)
+        {
+            case OPEN8055_HID_MESSAGE_INPUT:
+                changed |= InputChangedMask(&(card->currentInput), &inputMessage);
+                memcpy(&(card->currentInput), &inputMessage, sizeof(card->currentInput));
+                card->currentInputUnconsumed = OPEN8055_INPUT_ANY;
+                break;
+
+            case OPEN8055_HID_MESSAGE_SETCONFIG1:
+            case OPEN8055_HID_MESSAGE_OUTPUT:
+                CardMirror(card, &inputMessage);
+                break;
+
+            default:
+                SetError(card, "Received unknown message type 0x%02x (3)", inputMessage.msgType);
+                UnlockAndRefcount(card);
+                return -1;
+        }
+    }
 
     UnlockAndRefcount(card);
-    return rc;
+    return changed;
 }
 
 
 /* ----
- * Open8055_SetAutoFlush()
+ * Open8055_GetPending()
  *
- *  Set the auto flush feature.
+ *  Returns the number of reports received for the card that have not
+ *  been consumed yet. On a shared server connection, dispatching one
+ *  card can queue reports for the others without their descriptor
+ *  signalling again. An event loop should call Open8055_Dispatch()
+ *  for a card with pending reports without waiting.
  * ----
  */
 OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_SetAutoFlush(int h, int flag)
+Open8055_GetPending(int h)
 {
     Open8055_card_t *card;
-    int             rc = 0;
+    int             rc;
 
     if ((card = LockAndRefcount(h)) == NULL)
         return -1;
 
-    card->autoFlush = (flag != FALSE);
-
-    if (card->autoFlush)
-    {
-        if (card->pendingConfig1)
-        {
-            if (CardWrite(card, &(card->currentConfig1)) < 0)
-                rc = -1;
-            else
-                card->pendingConfig1 = FALSE;
-        }
-
-        if (rc == 0 && card->pendingOutput)
-        {
-            if (CardWrite(card, &(card->currentOutput)) < 0)
-                rc = -1;
-            else
-            {
-                card->pendingOutput = FALSE;
-                card->currentOutput.resetCounter = 0x00;
-            }
-        }
-    }
+    rc = card->reportQueueCount;
 
     UnlockAndRefcount(card);
     return rc;
@@ -1045,71 +1171,117 @@ Open8055_SetAutoFlush(int h, int flag)
 
 
 /* ----
- * Open8055_Flush()
+ * Open8055_StartRecording()
  *
- *  Send pending changes to the card.
+ *  Append every report received from and sent to the card, with a
+ *  nanosecond timestamp, to the file at path. The format is described
+ *  in open8055_recording.h. File I/O is done by a separate thread so
+ *  that the card is never held up by the disk.
  * ----
  */
 OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_Flush(int h)
+Open8055_StartRecording(int h, char *path)
 {
-    Open8055_card_t *card;
-    int         rc = 0;
+    Open8055_card_t     *card;
+    Open8055_recorder_t *rec;
+    unsigned char       header[OPEN8055_RECORDING_HEADER_SIZE];
+    size_t              len;
 
     if ((card = LockAndRefcount(h)) == NULL)
         return -1;
 
-    if (card->pendingConfig1)
+    if (card->recorder != NULL)
     {
-        if (CardWrite(card, &(card->currentConfig1)) < 0)
-            rc = -1;
-        else
-            card->pendingConfig1 = FALSE;
+        SetError(card, "card is already being recorded");
+        UnlockAndRefcount(card);
+        return -1;
     }
 
-    if (rc == 0 && card->pendingOutput)
+    if ((rec = (Open8055_recorder_t *)malloc(sizeof(Open8055_recorder_t))) == NULL)
     {
-        if (CardWrite(card, &(card->currentOutput)) < 0)
-            return -1;
-        else
-        {
-            card->pendingOutput = FALSE;
-            card->currentOutput.resetCounter = 0x00;
-        }
+        SetError(card, "out of memory");
+        UnlockAndRefcount(card);
+        return -1;
     }
+    memset(rec, 0, sizeof(Open8055_recorder_t));
 
-    return rc;
+    if ((rec->fp = fopen(path, "wb")) == NULL)
+    {
+        SetError(card, "cannot open %s: %s", path, strerror(errno));
+        free(rec);
+        UnlockAndRefcount(card);
+        return -1;
+    }
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, OPEN8055_RECORDING_MAGIC, 8);
+    PutLE16(header + 8, OPEN8055_RECORDING_VERSION);
+    PutLE16(header + 10, OPEN8055_RECORDING_RECORD_SIZE);
+    len = strlen(card->destination);
+    if (len > OPEN8055_RECORDING_DEST_SIZE - 1)
+        len = OPEN8055_RECORDING_DEST_SIZE - 1;
+    memcpy(header + 16, card->destination, len);
+    if (fwrite(header, sizeof(header), 1, rec->fp) != 1)
+    {
+        SetError(card, "cannot write %s: %s", path, strerror(errno));
+        fclose(rec->fp);
+        free(rec);
+        UnlockAndRefcount(card);
+        return -1;
+    }
+
+    /* ----
+     * Start with the state we know, so the recording is readable
+     * without what happened before it.
+     * ----
+     */
+    RecorderPut(rec, OPEN8055_RECORD_STATE, &(card->currentConfig1));
+    RecorderPut(rec, OPEN8055_RECORD_STATE, &(card->currentOutput));
+    RecorderPut(rec, OPEN8055_RECORD_STATE, &(card->currentInput));
+
+#ifdef _WIN32
+    if ((rec->thread = CreateThread(NULL, 0, RecorderThreadMain, rec, 0, NULL)) == NULL)
+#else
+    if (pthread_create(&(rec->thread), NULL, RecorderThreadMain, rec) != 0)
+#endif
+    {
+        SetError(card, "cannot create recorder thread: %s", ErrorString());
+        fclose(rec->fp);
+        free(rec);
+        UnlockAndRefcount(card);
+        return -1;
+    }
+
+    card->recorder = rec;
+
+    UnlockAndRefcount(card);
+    return 0;
 }
 
 
 /* ----
- * Open8055_GetInput()
+ * Open8055_StopRecording()
  *
- *  Read a digital input port.
+ *  Write out everything still pending and close the recording.
  * ----
  */
 OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_GetInput(int h, int port)
+Open8055_StopRecording(int h)
 {
-    Open8055_card_t *card;
-    int         rc = 0;
+    Open8055_card_t     *card;
+    int                 rc;
 
     if ((card = LockAndRefcount(h)) == NULL)
         return -1;
 
-    if (port < 0 || port > 4)
+    if (card->recorder == NULL)
     {
-        SetError(card, "parameter invalid");
+        SetError(card, "card is not being recorded");
         UnlockAndRefcount(card);
         return -1;
     }
 
-    /* ----
-     * Mark all digital inputs as consumed and return the current state.
-     * ----
-     */
-    rc = (card->currentInput.inputBits & (1 << port)) ? 1 : 0;
-    card->currentInputUnconsumed &= ~(OPEN8055_INPUT_I1 << port);
+    rc = RecorderStop(card);
 
     UnlockAndRefcount(card);
     return rc;
@@ -1117,26 +1289,21 @@ Open8055_GetInput(int h, int port)
 
 
 /* ----
- * Open8055_GetInputAll()
+ * Open8055_GetBusyPoll()
  *
- *  Read the 5 digital input ports
+ *  Return the busy-poll time of a remote card in microseconds.
  * ----
  */
 OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_GetInputAll(int h)
+Open8055_GetBusyPoll(int h)
 {
     Open8055_card_t *card;
-    int         rc = 0;
+    int             rc;
 
     if ((card = LockAndRefcount(h)) == NULL)
         return -1;
 
-    /* ----
-     * Mark all digital inputs as consumed and return the current state.
-     * ----
-     */
-    card->currentInputUnconsumed &= ~OPEN8055_INPUT_I_ANY;
-    rc = card->currentInput.inputBits;
+    rc = card->busyPoll;
 
     UnlockAndRefcount(card);
     return rc;
@@ -1144,120 +1311,126 @@ Open8055_GetInputAll(int h)
 
 
 /* ----
- * Open8055_GetCounter()
+ * Open8055_SetBusyPoll()
  *
- *  Read the current value of a counter.
+ *  When waiting for a report from the server, spin on the socket for
+ *  up to usec microseconds before going to sleep in select(). This
+ *  burns a CPU but avoids the wakeup latency when reports are expected
+ *  soon. Zero (the default) turns it off.
  * ----
  */
 OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_GetCounter(int h, int port)
+Open8055_SetBusyPoll(int h, int usec)
 {
     Open8055_card_t *card;
-    int         rc = 0;
 
     if ((card = LockAndRefcount(h)) == NULL)
         return -1;
 
-    if (port < 0 || port > 4)
+    if (card->isLocal)
+    {
+        SetError(card, "busy-poll is only supported for remote cards");
+        UnlockAndRefcount(card);
+        return -1;
+    }
+    if (usec < 0)
     {
         SetError(card, "parameter invalid");
         UnlockAndRefcount(card);
         return -1;
     }
 
-    /* ----
-     * Mark the counter consumed.
-     * ----
-     */
-    card->currentInputUnconsumed &= ~(OPEN8055_INPUT_COUNT1 << port);
-    rc = ntohs(card->currentInput.inputCounter[port]);
+    card->busyPoll = usec;
 
     UnlockAndRefcount(card);
-    return rc;
+    return 0;
 }
 
 
 /* ----
- * Open8055_ResetCounter()
+ * Open8055_GetRemoteRTT()
  *
- *  Reset an individual input counter.
+ *  Return the smoothed round trip time to the server in milliseconds.
+ *  The library sends a PING about once per second while reports are
+ *  being read. If there is no measurement yet, one is taken now;
+ *  reports arriving in the meantime are queued for the next
+ *  Open8055_Wait() or Open8055_Dispatch().
  * ----
  */
-OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_ResetCounter(int h, int port)
+OPEN8055_EXTERN double OPEN8055_CDECL
+Open8055_GetRemoteRTT(int h)
 {
-    Open8055_card_t *card;
-    int         rc = 0;
+    Open8055_card_t         *card;
+    int64_t                 deadline;
+    int64_t                 now;
+    double                  rtt;
 
     if ((card = LockAndRefcount(h)) == NULL)
-        return -1;
+        return -1.0;
 
-    if (port < 0 || port > 4)
+    if (card->isLocal)
     {
-        SetError(card, "parameter invalid");
+        SetError(card, "RTT is only available for remote cards");
         UnlockAndRefcount(card);
-        return -1;
+        return -1.0;
     }
 
-    /* ----
-     * Set the value and send it if in autoFlush mode.
-     * ----
-     */
-    card->currentOutput.resetCounter |= (1 << port);
-    if (card->autoFlush)
+    if (card->rttSamples == 0 && !card->pingUnsupported)
     {
-        if (CardWrite(card, &(card->currentOutput)) < 0)
-            rc = -1;
-        else
+        if (CardSendPing(card) < 0)
         {
-            card->pendingOutput = FALSE;
-            card->currentOutput.resetCounter = 0x00;
+            UnlockAndRefcount(card);
+            return -1.0;
+        }
+
+        deadline = TimeNowUsec() + OPEN8055_PING_TIMEOUT * 1000;
+        while (card->rttSamples == 0 && !card->pingUnsupported)
+        {
+            if ((now = TimeNowUsec()) >= deadline)
+            {
+                SetError(card, "timeout waiting for PONG");
+                UnlockAndRefcount(card);
+                return -1.0;
+            }
+
+            if (CardPump(card, (int)((deadline - now + 999) / 1000)) < 0)
+            {
+                UnlockAndRefcount(card);
+                return -1.0;
+            }
         }
     }
-    else
+
+    if (card->pingUnsupported)
     {
-        card->pendingOutput = TRUE;
+        SetError(card, "server does not support PING");
+        UnlockAndRefcount(card);
+        return -1.0;
     }
 
+    rtt = (double)card->rttSmoothed / 1000.0;
+
     UnlockAndRefcount(card);
-    return rc;
+    return rtt;
 }
 
 
 /* ----
- * Open8055_ResetCounterAll()
+ * Open8055_GetAckWindow()
  *
- *  Reset all input counters.
+ *  Return how many acknowledged commands may be outstanding.
  * ----
  */
 OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_ResetCounterAll(int h)
+Open8055_GetAckWindow(int h)
 {
     Open8055_card_t *card;
-    int         rc = 0;
+    int             rc;
 
     if ((card = LockAndRefcount(h)) == NULL)
         return -1;
 
-    /* ----
-     * Set the value and send it if in autoFlush mode.
-     * ----
-     */
-    card->currentOutput.resetCounter |= 0x1F;
-    if (card->autoFlush)
-    {
-        if (CardWrite(card, &(card->currentOutput)) < 0)
-            rc = -1;
-        else
-        {
-            card->pendingOutput = FALSE;
-            card->currentOutput.resetCounter = 0x00;
-        }
-    }
-    else
-    {
-        card->pendingOutput = TRUE;
-    }
+    rc = card->ackWindow;
 
     UnlockAndRefcount(card);
     return rc;
@@ -1265,76 +1438,69 @@ Open8055_ResetCounterAll(int h)
 
 
 /* ----
- * Open8055_GetDebounce()
+ * Open8055_SetAckWindow()
  *
- *  Set the debounce value of a digital input.
+ *  With a window greater than zero, every command is sent to the server
+ *  as SENDACK and the server answers with an ACK once the report has
+ *  been written to the card, or with the error that occurred. Up to
+ *  window commands can be on the way at the same time, so writes are
+ *  pipelined instead of waiting for each ACK. A failed command is
+ *  reported by the next write or Open8055_WaitAck(). Zero (the
+ *  default) sends plain SEND commands.
  * ----
  */
-OPEN8055_EXTERN double OPEN8055_CDECL
-Open8055_GetDebounce(int h, int port)
+OPEN8055_EXTERN int OPEN8055_CDECL
+Open8055_SetAckWindow(int h, int window)
 {
     Open8055_card_t *card;
-    double      rc;
 
     if ((card = LockAndRefcount(h)) == NULL)
         return -1;
 
-    if (port < 0 || port > 4)
+    if (card->isLocal)
+    {
+        SetError(card, "acknowledged commands are only supported for remote cards");
+        UnlockAndRefcount(card);
+        return -1;
+    }
+    if (window < 0 || window > OPEN8055_ACK_WINDOW_MAX)
     {
         SetError(card, "parameter invalid");
         UnlockAndRefcount(card);
-        return -1.0;
+        return -1;
     }
 
-    rc = (double)(ntohs(card->currentConfig1.debounceValue[port]) - 1) / 10.0;
+    card->ackWindow = window;
 
     UnlockAndRefcount(card);
-    return rc;
+    return 0;
 }
 
 
 /* ----
- * Open8055_SetDebounce()
+ * Open8055_WaitAck()
  *
- *  Set the debounce value of a digital input.
+ *  Wait up to timeout milliseconds until all commands sent so far
+ *  have been acknowledged. Returns 1 if they have, 0 on timeout and
+ *  -1 on error, including a command that failed on the server.
  * ----
  */
 OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_SetDebounce(int h, int port, double ms)
+Open8055_WaitAck(int h, int timeout)
 {
     Open8055_card_t *card;
-    int         rc = 0;
+    int             rc = 1;
 
     if ((card = LockAndRefcount(h)) == NULL)
         return -1;
 
-    if (port < 0 || port > 4)
-    {
-        SetError(card, "parameter invalid");
-        UnlockAndRefcount(card);
-        return -1;
-    }
-
-    if (ms < 0.0)
-        ms = 0.0;
-    if (ms > 5000.0)
-        ms = 5000.0;
-
-    /* ----
-     * Set the value and send it if in autoFlush mode.
-     * ----
-     */
-    card->currentConfig1.debounceValue[port] = htons((uint16_t)floor(ms * 10.0) + 1);
-    if (card->autoFlush)
+    if (!card->isLocal)
     {
-        if (CardWrite(card, &(card->currentConfig1)) < 0)
+        if (timeout < 0)
+            timeout = 0;
+        rc = CardAckWait(card, 0, timeout);
+        if (CardAckCheck(card) < 0)
             rc = -1;
-        else
-            card->pendingConfig1 = FALSE;
-    }
-    else
-    {
-        card->pendingConfig1 = TRUE;
     }
 
     UnlockAndRefcount(card);
@@ -1343,40 +1509,53 @@ Open8055_SetDebounce(int h, int port, double ms)
 
 
 /* ----
- * Open8055_GetADC()
+ * Open8055_GetStats()
  *
- *  Read the current value of an ADC
+ *  Copy the card's counters into *stats.
  * ----
  */
 OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_GetADC(int h, int port)
+Open8055_GetStats(int h, Open8055_stats_t *stats)
 {
     Open8055_card_t *card;
-    int         rc = 0;
 
     if ((card = LockAndRefcount(h)) == NULL)
         return -1;
 
-    if (port < 0 || port > 1)
+    if (stats == NULL)
     {
-        SetError(card, "parameter error");
+        SetError(card, "parameter invalid");
         UnlockAndRefcount(card);
         return -1;
     }
 
-    /* ----
-     * Mark the counter consumed.
-     * ----
-     */
-    card->currentInputUnconsumed &= ~(OPEN8055_INPUT_ADC1 << port);
-    rc = ntohs(card->currentInput.inputAdcValue[port]);
-    switch(card->currentConfig1.modeADC[port])
-    {
-        case OPEN8055_MODE_ADC9:        rc >>= 1;
-                                        break;
-        case OPEN8055_MODE_ADC8:        rc >>= 2;
-                                        break;
-    }
+    memcpy(stats, &(card->stats), sizeof(Open8055_stats_t));
+    stats->commandsOutstanding = card->ackOutstanding;
+    stats->reportsDropped = card->reportQueueDropped;
+    if (card->stats.commandsAcked > 0)
+        stats->ackLatencyAvg = card->ackLatencySum / card->stats.commandsAcked;
+
+    UnlockAndRefcount(card);
+    return 0;
+}
+
+
+/* ----
+ * Open8055_GetInputDelta()
+ *
+ *  Return the keyframe interval of delta encoded input, 0 if off.
+ * ----
+ */
+OPEN8055_EXTERN int OPEN8055_CDECL
+Open8055_GetInputDelta(int h)
+{
+    Open8055_card_t *card;
+    int             rc;
+
+    if ((card = LockAndRefcount(h)) == NULL)
+        return -1;
+
+    rc = card->inputDelta;
 
     UnlockAndRefcount(card);
     return rc;
@@ -1384,127 +1563,146 @@ Open8055_GetADC(int h, int port)
 
 
 /* ----
- * Open8055_GetOutput()
+ * Open8055_SetInputDelta()
  *
- *  Return one current digital output settings.
+ *  Ask the server to send only the changed fields of INPUT reports,
+ *  with a full report every keyframeMs milliseconds. The library
+ *  turns the deltas back into complete reports, so nothing else
+ *  changes for the application. Zero switches back to full reports.
  * ----
  */
 OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_GetOutput(int h, int port)
+Open8055_SetInputDelta(int h, int keyframeMs)
 {
     Open8055_card_t *card;
-    int         rc = 0;
+    int             rc = 0;
 
     if ((card = LockAndRefcount(h)) == NULL)
         return -1;
 
-    if (port < 0 || port > 7)
+    if (card->isLocal)
+    {
+        SetError(card, "delta encoded input is only supported for remote cards");
+        UnlockAndRefcount(card);
+        return -1;
+    }
+    if (keyframeMs < 0)
     {
         SetError(card, "parameter invalid");
         UnlockAndRefcount(card);
         return -1;
     }
 
-    /* ----
-     * We have queried them at Connect and tracked them all the time.
-     * ----
-     */
-    rc = (card->currentOutput.outputBits & (1 << port)) ? 1 : 0;
+    if (CardWriteLine(card, "inputdelta %d\n", keyframeMs) < 0)
+        rc = -1;
+    else
+        card->inputDelta = keyframeMs;
 
     UnlockAndRefcount(card);
     return rc;
 }
 
 
-
 /* ----
- * Open8055_GetOutputAll()
+ * Open8055_RequestKeyframe()
  *
- *  Return the current digital output settings.
+ *  Ask the server for a full INPUT report right away.
  * ----
  */
 OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_GetOutputAll(int h)
+Open8055_RequestKeyframe(int h)
 {
     Open8055_card_t *card;
-    int         rc = 0;
+    int             rc = 0;
 
     if ((card = LockAndRefcount(h)) == NULL)
         return -1;
 
-    /* ----
-     * We have queried them at Connect and tracked them all the time.
-     * ----
-     */
-    rc = card->currentOutput.outputBits;
+    if (card->isLocal)
+    {
+        SetError(card, "delta encoded input is only supported for remote cards");
+        rc = -1;
+    }
+    else if (CardWriteLine(card, "keyframe\n") < 0)
+        rc = -1;
 
     UnlockAndRefcount(card);
     return rc;
 }
 
 
-
 /* ----
- * Open8055_GetOutputValue()
+ * Open8055_GetUDPInput()
  *
- *  Return the current digital output value used for modes like SERVO.
+ *  Return 1 if INPUT reports are received over UDP, 0 if not.
  * ----
  */
 OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_GetOutputValue(int h, int port)
+Open8055_GetUDPInput(int h)
 {
     Open8055_card_t *card;
-    int         rc = 0;
+    int             rc;
 
     if ((card = LockAndRefcount(h)) == NULL)
         return -1;
 
-    if (port < 0 || port > 7)
-    {
-        SetError(card, "parameter invalid");
-        UnlockAndRefcount(card);
-        return -1;
-    }
-
-    /* ----
-     * We have queried them at Connect and tracked them all the time.
-     * ----
-     */
-    rc = ntohs(card->currentOutput.outputValue[port]);
+    rc = (card->udpInput) ? 1 : 0;
 
     UnlockAndRefcount(card);
     return rc;
 }
 
 
-
 /* ----
- * Open8055_GetPWM()
+ * Open8055_SetUDPInput()
  *
- *  Return the current setting of a PWM output
+ *  Have the server send INPUT reports as UDP datagrams, so that a lost
+ *  TCP segment does not hold up newer input behind its retransmission.
+ *  Commands, OUTPUT and CONFIG1 reports stay on the TCP connection.
+ *  A datagram older than the newest one received is dropped; lost ones
+ *  are counted in the stats. If the server does not support UDP, input
+ *  keeps coming over TCP and Open8055_GetUDPInput() goes back to 0.
+ *
+ *  Setting OPEN8055_UDP_LOSS in the environment to a percentage drops
+ *  that many datagrams on arrival, for testing.
  * ----
  */
 OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_GetPWM(int h, int port)
+Open8055_SetUDPInput(int h, int flag)
 {
     Open8055_card_t *card;
-    int         rc = 0;
+    int             port;
+    int             rc = 0;
 
     if ((card = LockAndRefcount(h)) == NULL)
         return -1;
 
-    if (port < 0 || port > 1)
+    if (card->isLocal)
     {
-        SetError(card, "parameter invalid");
+        SetError(card, "UDP input is only supported for remote cards");
         UnlockAndRefcount(card);
         return -1;
     }
 
-    /* ----
-     * We have queried them at Connect and tracked them all the time.
-     * ----
-     */
-    rc = ntohs(card->currentOutput.outputPwmValue[port]);
+    if (flag)
+    {
+        if ((port = LinkOpenUDP(card)) < 0 ||
+            CardWriteLine(card, "udp %d %lu\n", port,
+                          (unsigned long)card->link->udpToken) < 0)
+            rc = -1;
+        else
+        {
+            card->udpInput = TRUE;
+            card->udpLastSeq = 0;
+        }
+    }
+    else
+    {
+        if (CardWriteLine(card, "udp 0\n") < 0)
+            rc = -1;
+        else
+            card->udpInput = FALSE;
+    }
 
     UnlockAndRefcount(card);
     return rc;
@@ -1512,21 +1710,33 @@ Open8055_GetPWM(int h, int port)
 
 
 /* ----
- * Open8055_SetOutput()
+ * Open8055_Subscribe()
  *
- *  Change one digital output.
+ *  Ask the server to send no more than maxRate INPUT reports per
+ *  second, holding back all but the newest in between, and to not
+ *  send ADC changes up to the given deadbands at all. Changes of the
+ *  digital inputs are still sent right away. A maxRate of 0 means
+ *  no limit.
  * ----
  */
 OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_SetOutput(int h, int port, int val)
+Open8055_Subscribe(int h, double maxRate, int deadbandAdc1, int deadbandAdc2)
 {
     Open8055_card_t *card;
-    int         rc = 0;
+    long            milliHz;
+    int             rc = 0;
 
     if ((card = LockAndRefcount(h)) == NULL)
         return -1;
 
-    if (port < 0 || port > 7)
+    if (card->isLocal)
+    {
+        SetError(card, "subscriptions are only supported for remote cards");
+        UnlockAndRefcount(card);
+        return -1;
+    }
+    if (maxRate < 0.0 || maxRate > 1000000.0 ||
+        deadbandAdc1 < 0 || deadbandAdc2 < 0)
     {
         SetError(card, "parameter invalid");
         UnlockAndRefcount(card);
@@ -1534,28 +1744,15 @@ Open8055_SetOutput(int h, int port, int val)
     }
 
     /* ----
-     * Set or clear the bit and send the new info if in autoFlush mode.
+     * The rate goes out as integer parts, since %f would write the
+     * decimal point of the application's LC_NUMERIC locale.
      * ----
      */
-    if (val)
-        card->currentOutput.outputBits |= (1 << port);
-    else
-        card->currentOutput.outputBits &= ~(1 << port);
-
-    if (card->autoFlush)
-    {
-        if (CardWrite(card, &(card->currentOutput)) < 0)
-            rc = -1;
-        else
-        {
-            card->pendingOutput = FALSE;
-            card->currentOutput.resetCounter = 0x00;
-        }
-    }
-    else
-    {
-        card->pendingOutput = TRUE;
-    }
+    milliHz = (long)(maxRate * 1000.0 + 0.5);
+    if (CardWriteLine(card, "subscribe %ld.%03ld %d %d\n",
+                      milliHz / 1000, milliHz % 1000,
+                      deadbandAdc1, deadbandAdc2) < 0)
+        rc = -1;
 
     UnlockAndRefcount(card);
     return rc;
@@ -1563,41 +1760,29 @@ Open8055_SetOutput(int h, int port, int val)
 
 
 /* ----
- * Open8055_SetOutputAll()
+ * Open8055_GetUDPPollFd()
  *
- *  Change all 8 digital outputs.
+ *  Returns the UDP socket INPUT reports arrive on once UDP input is
+ *  enabled. Applications using Open8055_GetPollFd() must watch this
+ *  one as well and call Open8055_Dispatch() when it signals.
  * ----
  */
 OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_SetOutputAll(int h, int bits)
+Open8055_GetUDPPollFd(int h)
 {
     Open8055_card_t *card;
-    int         rc = 0;
+    int             rc;
 
     if ((card = LockAndRefcount(h)) == NULL)
         return -1;
 
-    bits &= 0xff;
-
-    /* ----
-     * Set the bits and send them if in autoFlush mode.
-     * ----
-     */
-    card->currentOutput.outputBits = bits;
-    if (card->autoFlush)
+    if (card->isLocal || card->link->udpSock == INVALID_SOCKET)
     {
-        if (CardWrite(card, &(card->currentOutput)) < 0)
-            rc = -1;
-        else
-        {
-            card->pendingOutput = FALSE;
-            card->currentOutput.resetCounter = 0x00;
-        }
+        SetError(card, "UDP input is not enabled");
+        rc = -1;
     }
     else
-    {
-        card->pendingOutput = TRUE;
-    }
+        rc = (int)card->link->udpSock;
 
     UnlockAndRefcount(card);
     return rc;
@@ -1605,148 +1790,212 @@ Open8055_SetOutputAll(int h, int bits)
 
 
 /* ----
- * Open8055_SetOutputValue()
+ * Open8055_Reconnect()
  *
- *  Change one digital output value used in modes like SERVO.
+ *  Connect a remote card again after its connection to the server was
+ *  lost. For a while after the drop the server holds the card for us,
+ *  and we resume the session with the token it gave us. That skips the
+ *  password check and the card's GETCONFIG round trip. After that the
+ *  card is opened anew. Either way the handle stays valid and keeps
+ *  its settings. A reopened card gets them written again, unless
+ *  autoflush is off; then the next Open8055_Flush() does it. Only a
+ *  resume keeps a subscription.
+ *
+ *  Returns 0 if the connection was not lost, 1 if the session was
+ *  resumed, 2 if the card was opened again and -1 on error. The
+ *  timeout applies to each of the two attempts.
  * ----
  */
 OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_SetOutputValue(int h, int port, int val)
+Open8055_Reconnect(int h, int timeout)
 {
-    Open8055_card_t *card;
-    int         rc = 0;
+    Open8055_card_t    *card;
+    Open8055_card_t    *fresh;
+    Open8055_link_t    *oldLink;
+    Open8055_connect_t  conn;
+    char                token[64];
+    int                 port;
+    int                 rc = 1;
 
     if ((card = LockAndRefcount(h)) == NULL)
         return -1;
 
-    if (port < 0 || port > 7)
+    if (card->isLocal)
     {
-        SetError(card, "parameter invalid");
+        SetError(card, "only remote cards can be reconnected");
+        UnlockAndRefcount(card);
+        return -1;
+    }
+    if (AtomicLoad(&(card->link->state)) != LINK_STATE_BROKEN)
+    {
+        UnlockAndRefcount(card);
+        return 0;
+    }
+    if (card->cardRefcount > 1)
+    {
+        SetError(card, "card is in use by another thread");
         UnlockAndRefcount(card);
         return -1;
     }
+    strcpy(token, card->resumeToken);
 
-    switch(card->currentConfig1.modeOutput[port])
+    /* ----
+     * Close what is left of the old connection, unless other cards
+     * still use it. The server sees the loss right away then and
+     * holds the card for us.
+     * ----
+     */
+    if (card->link->cardCount == 1 && card->link->sock != INVALID_SOCKET)
     {
-        case OPEN8055_MODE_OUTPUT:      // value makes no sense in OUTPUT mode.
-            val = 0;
-            break;
+        closesocket(card->link->sock);
+        card->link->sock = INVALID_SOCKET;
+    }
 
-        case OPEN8055_MODE_SERVO:       // limit value to 500..2500ms in SERVO modes.
-        case OPEN8055_MODE_ISERVO:
-            if (val < 6000)
-                val = 6000;
-            if (val > 30000)
-                val = 30000;
-            break;
+    /* ----
+     * Connect like Open8055_Connect() does, but into a card structure
+     * of our own. Our reference keeps the card around meanwhile.
+     * ----
+     */
+    LockRelease(card->lock);
+    LockAcquire(&connectLock);
+
+    memset(&conn, 0, sizeof(conn));
+    strcpy(conn.resumeToken, token);
+    ConnectStart(&conn, card->destination);
+    ConnectWait(&conn, 1, timeout);
+    if (conn.state != CONNECT_STATE_DONE && token[0] != '\0')
+    {
+        memset(&conn, 0, sizeof(conn));
+        ConnectStart(&conn, card->destination);
+        ConnectWait(&conn, 1, timeout);
+        rc = 2;
+    }
+    if (token[0] == '\0')
+        rc = 2;
 
-        default:
-            val = 0;
-            break;
+    if (conn.state != CONNECT_STATE_DONE)
+    {
+        LockRelease(&connectLock);
+        LockAcquire(card->lock);
+        SetError(card, "%s", conn.errorMessage);
+        UnlockAndRefcount(card);
+        return -1;
     }
 
     /* ----
-     * Set the value in currentOutput and send the new info if in autoFlush mode.
+     * Move the card onto the new link. Its lock changes with it, so
+     * nobody may look the card up while we do that.
      * ----
      */
-    card->currentOutput.outputValue[port] = htons(val);
+    fresh = conn.card;
+    LockRelease(fresh->lock);
+    LockAcquire(&connectionsLock);
+    LockAcquire(card->lock);
+    LockAcquire(fresh->lock);
+    if (card->cardRefcount > 1 || card->cardClosed)
+    {
+        ConnectFail(&conn, "card is in use by another thread");
+        LockRelease(&connectionsLock);
+        SetError(card, "%s", conn.errorMessage);
+        UnlockAndRefcount(card);
+        LockRelease(&connectLock);
+        return -1;
+    }
 
-    if (card->autoFlush)
+    oldLink = card->link;
+    LinkTransfer(card, fresh, rc == 2);
+    LockRelease(&(oldLink->linkLock));
+    LockRelease(&connectionsLock);
+
+    /* ----
+     * Set up again what the server does not keep for a card that is
+     * opened anew, or ever for a new connection.
+     * ----
+     */
+    if (rc == 2 && card->autoFlush && !card->readOnly)
     {
-        if (CardWrite(card, &(card->currentOutput)) < 0)
+        if (CardWrite(card, &(card->currentConfig1)) < 0 ||
+            CardWrite(card, &(card->currentOutput)) < 0)
             rc = -1;
         else
         {
+            card->pendingConfig1 = FALSE;
             card->pendingOutput = FALSE;
             card->currentOutput.resetCounter = 0x00;
         }
     }
-    else
+    if (rc == 2 && card->inputDelta > 0 &&
+        CardWriteLine(card, "inputdelta %d\n", card->inputDelta) < 0)
+        rc = -1;
+    if (rc > 0 && card->udpInput)
     {
-        card->pendingOutput = TRUE;
+        card->udpLastSeq = 0;
+        if ((port = LinkOpenUDP(card)) < 0 ||
+            CardWriteLine(card, "udp %d %lu\n", port,
+                          (unsigned long)card->link->udpToken) < 0)
+        {
+            card->udpInput = FALSE;
+            rc = -1;
+        }
     }
 
+    if (conn.addrList != NULL)
+        freeaddrinfo(conn.addrList);
+    LockDestroy(&(fresh->cardLock));
+    free(fresh);
+
     UnlockAndRefcount(card);
+    LinkRelease(oldLink);
+    LockRelease(&connectLock);
     return rc;
 }
 
 
 /* ----
- * Open8055_SetPWM()
+ * Open8055_GetAutoFlush()
  *
- *  Change one of the PWM outputs.
+ *  Return the current autoFlush setting.
  * ----
  */
-OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_SetPWM(int h, int port, int value)
+OPEN8055_EXTERN void OPEN8055_CDECL
+Open8055_Sleep(int ms)
 {
-    Open8055_card_t *card;
-    int         rc = 0;
-
-    if ((card = LockAndRefcount(h)) == NULL)
-        return -1;
+#ifdef _WIN32
+    if (ms < 0)
+        ms = 0;
 
-    if (port < 0 || port > 1)
-    {
-        SetError(card, "parameter invalid");
-        UnlockAndRefcount(card);
-        return 0;
-    }
+    Sleep((DWORD)ms);
+#else
+    struct timeval  tv;
 
-    if (value < 0)
-        value = 0;
-    if (value > 1023)
-        value = 1023;
+    if (ms < 0)
+        ms = 0;
 
-    /* ----
-     * Set the new PWM value and send it if in autoFlush mode.
-     * ----
-     */
-    card->currentOutput.outputPwmValue[port] = htons(value);
-    if (card->autoFlush)
-    {
-        if (CardWrite(card, &(card->currentOutput)) < 0)
-            rc = -1;
-        else
-        {
-            card->pendingOutput = FALSE;
-            card->currentOutput.resetCounter = 0x00;
-        }
-    }
-    else
-    {
-        card->pendingOutput = TRUE;
-    }
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
 
-    UnlockAndRefcount(card);
-    return rc;
+    select (0, NULL, NULL, NULL, &tv);
+#endif
 }
 
 
-
 /* ----
- * Open8055_GetModeADC()
+ * Open8055_GetAutoFlush()
  *
- *  Return the operation mode of an analog input.
+ *  Return the current autoFlush setting.
  * ----
  */
 OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_GetModeADC(int h, int port)
+Open8055_GetAutoFlush(int h)
 {
     Open8055_card_t *card;
-    int             rc;
+    int             rc = 0;
 
     if ((card = LockAndRefcount(h)) == NULL)
         return -1;
 
-    if (port < 0 || port > 1)
-    {
-        SetError(card, "parameter invalid");
-        UnlockAndRefcount(card);
-        return -1;
-    }
-
-    rc = card->currentConfig1.modeADC[port];
+    if(card->autoFlush)
+        rc = 1;
 
     UnlockAndRefcount(card);
     return rc;
@@ -1754,13 +2003,13 @@ Open8055_GetModeADC(int h, int port)
 
 
 /* ----
- * Open8055_SetModeADC()
+ * Open8055_SetAutoFlush()
  *
- *  Set the operation mode of an analog input.
+ *  Set the auto flush feature.
  * ----
  */
 OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_SetModeADC(int h, int port, int mode)
+Open8055_SetAutoFlush(int h, int flag)
 {
     Open8055_card_t *card;
     int             rc = 0;
@@ -1768,26 +2017,27 @@ Open8055_SetModeADC(int h, int port, int mode)
     if ((card = LockAndRefcount(h)) == NULL)
         return -1;
 
-    if (port < 0 || port > 1)
-    {
-        SetError(card, "parameter error");
-        UnlockAndRefcount(card);
-        return -1;
-    }
+    card->autoFlush = (flag != FALSE);
 
-    if (mode == OPEN8055_MODE_ADC10 || mode == OPEN8055_MODE_ADC9 || mode == OPEN8055_MODE_ADC8)
+    if (card->autoFlush)
     {
-        card->currentConfig1.modeADC[port] = mode;
-        if (card->autoFlush)
+        if (card->pendingConfig1)
         {
             if (CardWrite(card, &(card->currentConfig1)) < 0)
                 rc = -1;
             else
                 card->pendingConfig1 = FALSE;
         }
-        else
+
+        if (rc == 0 && card->pendingOutput)
         {
-            card->pendingConfig1 = TRUE;
+            if (CardWrite(card, &(card->currentOutput)) < 0)
+                rc = -1;
+            else
+            {
+                card->pendingOutput = FALSE;
+                card->currentOutput.resetCounter = 0x00;
+            }
         }
     }
 
@@ -1797,28 +2047,38 @@ Open8055_SetModeADC(int h, int port, int mode)
 
 
 /* ----
- * Open8055_GetModeInput()
+ * Open8055_Flush()
  *
- *  Return the operation mode of a digital input.
+ *  Send pending changes to the card.
  * ----
  */
 OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_GetModeInput(int h, int port)
+Open8055_Flush(int h)
 {
     Open8055_card_t *card;
-    int             rc;
+    int         rc = 0;
 
     if ((card = LockAndRefcount(h)) == NULL)
         return -1;
 
-    if (port < 0 || port > 4)
+    if (card->pendingConfig1)
     {
-        SetError(card, "parameter invalid");
-        UnlockAndRefcount(card);
-        return -1;
+        if (CardWrite(card, &(card->currentConfig1)) < 0)
+            rc = -1;
+        else
+            card->pendingConfig1 = FALSE;
     }
 
-    rc = card->currentConfig1.modeInput[port];
+    if (rc == 0 && card->pendingOutput)
+    {
+        if (CardWrite(card, &(card->currentOutput)) < 0)
+            rc = -1;
+        else
+        {
+            card->pendingOutput = FALSE;
+            card->currentOutput.resetCounter = 0x00;
+        }
+    }
 
     UnlockAndRefcount(card);
     return rc;
@@ -1826,61 +2086,33 @@ Open8055_GetModeInput(int h, int port)
 
 
 /* ----
- * Open8055_SetModeInput()
+ * Open8055_GetInput()
  *
- *  Set the operation mode of a digital input.
+ *  Read a digital input port.
  * ----
  */
 OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_SetModeInput(int h, int port, int mode)
+Open8055_GetInput(int h, int port)
 {
     Open8055_card_t *card;
-    int             rc = 0;
+    int         rc = 0;
 
     if ((card = LockAndRefcount(h)) == NULL)
         return -1;
 
     if (port < 0 || port > 4)
     {
-        SetError(card, "parameter error");
+        SetError(card, "parameter invalid");
         UnlockAndRefcount(card);
         return -1;
     }
 
-    if (mode == OPEN8055_MODE_INPUT || mode == OPEN8055_MODE_FREQUENCY)
-    {
-        card->currentConfig1.modeInput[port] = mode;
-        if (card->autoFlush)
-        {
-            if (CardWrite(card, &(card->currentConfig1)) < 0)
-                rc = -1;
-            else
-                card->pendingConfig1 = FALSE;
-        }
-        else
-        {
-            card->pendingConfig1 = TRUE;
-        }
-        /* ----
-         * Changing input mode also causes a counter reset.
-         * ----
-         */
-        card->currentOutput.resetCounter |= (1 << port);
-        if (card->autoFlush)
-        {
-            if (CardWrite(card, &(card->currentOutput)) < 0)
-                rc = -1;
-            else
-            {
-                card->pendingOutput = FALSE;
-                card->currentOutput.resetCounter = 0x00;
-            }
-        }
-        else
-        {
-            card->pendingOutput = TRUE;
-        }
-    }
+    /* ----
+     * Mark all digital inputs as consumed and return the current state.
+     * ----
+     */
+    rc = (card->currentInput.inputBits & (1 << port)) ? 1 : 0;
+    card->currentInputUnconsumed &= ~(OPEN8055_INPUT_I1 << port);
 
     UnlockAndRefcount(card);
     return rc;
@@ -1888,28 +2120,26 @@ Open8055_SetModeInput(int h, int port, int mode)
 
 
 /* ----
- * Open8055_GetModeOutput()
+ * Open8055_GetInputAll()
  *
- *  Return the operation mode of a digital output.
+ *  Read the 5 digital input ports
  * ----
  */
 OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_GetModeOutput(int h, int port)
+Open8055_GetInputAll(int h)
 {
     Open8055_card_t *card;
-    int             rc;
+    int         rc = 0;
 
     if ((card = LockAndRefcount(h)) == NULL)
         return -1;
 
-    if (port < 0 || port > 7)
-    {
-        SetError(card, "parameter invalid");
-        UnlockAndRefcount(card);
-        return -1;
-    }
-
-    rc = card->currentConfig1.modeOutput[port];
+    /* ----
+     * Mark all digital inputs as consumed and return the current state.
+     * ----
+     */
+    card->currentInputUnconsumed &= ~OPEN8055_INPUT_I_ANY;
+    rc = card->currentInput.inputBits;
 
     UnlockAndRefcount(card);
     return rc;
@@ -1917,525 +2147,4285 @@ Open8055_GetModeOutput(int h, int port)
 
 
 /* ----
- * Open8055_SetModeOutput()
+ * Open8055_GetCounter()
  *
- *  Set the operation mode of a digital output.
+ *  Read the current value of a counter.
  * ----
  */
 OPEN8055_EXTERN int OPEN8055_CDECL
-Open8055_SetModeOutput(int h, int port, int mode)
+Open8055_GetCounter(int h, int port)
 {
     Open8055_card_t *card;
-    int             rc = 0;
-    int             val;
+    int         rc = 0;
 
     if ((card = LockAndRefcount(h)) == NULL)
         return -1;
 
-    if (port < 0 || port > 7)
+    if (port < 0 || port > 4)
     {
         SetError(card, "parameter invalid");
         UnlockAndRefcount(card);
         return -1;
     }
 
-    val = ntohs(card->currentOutput.outputValue[port]);
-    switch (mode)
-    {
-        case OPEN8055_MODE_OUTPUT:
-            val = 0;
-            break;
+    /* ----
+     * Mark the counter consumed.
+     * ----
+     */
+    card->currentInputUnconsumed &= ~(OPEN8055_INPUT_COUNT1 << port);
+    rc = ntohs(card->currentInput.inputCounter[port]);
+
+    UnlockAndRefcount(card);
+    return rc;
+}
+
+
+/* ----
+ * Open8055_ResetCounter()
+ *
+ *  Reset an individual input counter.
+ * ----
+ */
+OPEN8055_EXTERN int OPEN8055_CDECL
+Open8055_ResetCounter(int h, int port)
+{
+    Open8055_card_t *card;
+    int         rc = 0;
+
+    if ((card = LockAndRefcount(h)) == NULL)
+        return -1;
+
+    if (port < 0 || port > 4)
+    {
+        SetError(card, "parameter invalid");
+        UnlockAndRefcount(card);
+        return -1;
+    }
+
+    /* ----
+     * Set the value and send it if in autoFlush mode.
+     * ----
+     */
+    card->currentOutput.resetCounter |= (1 << port);
+    if (card->autoFlush)
+    {
+        if (CardWrite(card, &(card->currentOutput)) < 0)
+            rc = -1;
+        else
+        {
+            card->pendingOutput = FALSE;
+            card->currentOutput.resetCounter = 0x00;
+        }
+    }
+    else
+    {
+        card->pendingOutput = TRUE;
+    }
+
+    UnlockAndRefcount(card);
+    return rc;
+}
+
+
+/* ----
+ * Open8055_ResetCounterAll()
+ *
+ *  Reset all input counters.
+ * ----
+ */
+OPEN8055_EXTERN int OPEN8055_CDECL
+Open8055_ResetCounterAll(int h)
+{
+    Open8055_card_t *card;
+    int         rc = 0;
+
+    if ((card = LockAndRefcount(h)) == NULL)
+        return -1;
+
+    /* ----
+     * Set the value and send it if in autoFlush mode.
+     * ----
+     */
+    card->currentOutput.resetCounter |= 0x1F;
+    if (card->autoFlush)
+    {
+        if (CardWrite(card, &(card->currentOutput)) < 0)
+            rc = -1;
+        else
+        {
+            card->pendingOutput = FALSE;
+            card->currentOutput.resetCounter = 0x00;
+        }
+    }
+    else
+    {
+        card->pendingOutput = TRUE;
+    }
+
+    UnlockAndRefcount(card);
+    return rc;
+}
+
+
+/* ----
+ * Open8055_GetDebounce()
+ *
+ *  Set the debounce value of a digital input.
+ * ----
+ */
+OPEN8055_EXTERN double OPEN8055_CDECL
+Open8055_GetDebounce(int h, int port)
+{
+    Open8055_card_t *card;
+    double      rc;
+
+    if ((card = LockAndRefcount(h)) == NULL)
+        return -1;
+
+    if (port < 0 || port > 4)
+    {
+        SetError(card, "parameter invalid");
+        UnlockAndRefcount(card);
+        return -1.0;
+    }
+
+    rc = (double)(ntohs(card->currentConfig1.debounceValue[port]) - 1) / 10.0;
+
+    UnlockAndRefcount(card);
+    return rc;
+}
+
+
+/* ----
+ * Open8055_SetDebounce()
+ *
+ *  Set the debounce value of a digital input.
+ * ----
+ */
+OPEN8055_EXTERN int OPEN8055_CDECL
+Open8055_SetDebounce(int h, int port, double ms)
+{
+    Open8055_card_t *card;
+    int         rc = 0;
+
+    if ((card = LockAndRefcount(h)) == NULL)
+        return -1;
+
+    if (port < 0 || port > 4)
+    {
+        SetError(card, "parameter invalid");
+        UnlockAndRefcount(card);
+        return -1;
+    }
+
+    if (ms < 0.0)
+        ms = 0.0;
+    if (ms > 5000.0)
+        ms = 5000.0;
+
+    /* ----
+     * Set the value and send it if in autoFlush mode.
+     * ----
+     */
+    card->currentConfig1.debounceValue[port] = htons((uint16_t)floor(ms * 10.0) + 1);
+    if (card->autoFlush)
+    {
+        if (CardWrite(card, &(card->currentConfig1)) < 0)
+            rc = -1;
+        else
+            card->pendingConfig1 = FALSE;
+    }
+    else
+    {
+        card->pendingConfig1 = TRUE;
+    }
+
+    UnlockAndRefcount(card);
+    return rc;
+}
+
+
+/* ----
+ * Open8055_GetADC()
+ *
+ *  Read the current value of an ADC
+ * ----
+ */
+OPEN8055_EXTERN int OPEN8055_CDECL
+Open8055_GetADC(int h, int port)
+{
+    Open8055_card_t *card;
+    int         rc = 0;
+
+    if ((card = LockAndRefcount(h)) == NULL)
+        return -1;
+
+    if (port < 0 || port > 1)
+    {
+        SetError(card, "parameter error");
+        UnlockAndRefcount(card);
+        return -1;
+    }
+
+    /* ----
+     * Mark the counter consumed.
+     * ----
+     */
+    card->currentInputUnconsumed &= ~(OPEN8055_INPUT_ADC1 << port);
+    rc = ntohs(card->currentInput.inputAdcValue[port]);
+    switch(card->currentConfig1.modeADC[port])
+    {
+        case OPEN8055_MODE_ADC9:        rc >>= 1;
+                                        break;
+        case OPEN8055_MODE_ADC8:        rc >>= 2;
+                                        break;
+    }
+
+    UnlockAndRefcount(card);
+    return rc;
+}
+
+
+/* ----
+ * Open8055_GetOutput()
+ *
+ *  Return one current digital output settings.
+ * ----
+ */
+OPEN8055_EXTERN int OPEN8055_CDECL
+Open8055_GetOutput(int h, int port)
+{
+    Open8055_card_t *card;
+    int         rc = 0;
+
+    if ((card = LockAndRefcount(h)) == NULL)
+        return -1;
+
+    if (port < 0 || port > 7)
+    {
+        SetError(card, "parameter invalid");
+        UnlockAndRefcount(card);
+        return -1;
+    }
+
+    /* ----
+     * We have queried them at Connect and tracked them all the time.
+     * ----
+     */
+    rc = (card->currentOutput.outputBits & (1 << port)) ? 1 : 0;
+
+    UnlockAndRefcount(card);
+    return rc;
+}
+
+
+
+/* ----
+ * Open8055_GetOutputAll()
+ *
+ *  Return the current digital output settings.
+ * ----
+ */
+OPEN8055_EXTERN int OPEN8055_CDECL
+Open8055_GetOutputAll(int h)
+{
+    Open8055_card_t *card;
+    int         rc = 0;
+
+    if ((card = LockAndRefcount(h)) == NULL)
+        return -1;
+
+    /* ----
+     * We have queried them at Connect and tracked them all the time.
+     * ----
+     */
+    rc = card->currentOutput.outputBits;
+
+    UnlockAndRefcount(card);
+    return rc;
+}
+
+
+
+/* ----
+ * Open8055_GetOutputValue()
+ *
+ *  Return the current digital output value used for modes like SERVO.
+ * ----
+ */
+OPEN8055_EXTERN int OPEN8055_CDECL
+Open8055_GetOutputValue(int h, int port)
+{
+    Open8055_card_t *card;
+    int         rc = 0;
+
+    if ((card = LockAndRefcount(h)) == NULL)
+        return -1;
+
+    if (port < 0 || port > 7)
+    {
+        SetError(card, "parameter invalid");
+        UnlockAndRefcount(card);
+        return -1;
+    }
+
+    /* ----
+     * We have queried them at Connect and tracked them all the time.
+     * ----
+     */
+    rc = ntohs(card->currentOutput.outputValue[port]);
+
+    UnlockAndRefcount(card);
+    return rc;
+}
+
+
+
+/* ----
+ * Open8055_GetPWM()
+ *
+ *  Return the current setting of a PWM output
+ * ----
+ */
+OPEN8055_EXTERN int OPEN8055_CDECL
+Open8055_GetPWM(int h, int port)
+{
+    Open8055_card_t *card;
+    int         rc = 0;
+
+    if ((card = LockAndRefcount(h)) == NULL)
+        return -1;
+
+    if (port < 0 || port > 1)
+    {
+        SetError(card, "parameter invalid");
+        UnlockAndRefcount(card);
+        return -1;
+    }
+
+    /* ----
+     * We have queried them at Connect and tracked them all the time.
+     * ----
+     */
+    rc = ntohs(card->currentOutput.outputPwmValue[port]);
+
+    UnlockAndRefcount(card);
+    return rc;
+}
+
+
+/* ----
+ * Open8055_SetOutput()
+ *
+ *  Change one digital output.
+ * ----
+ */
+OPEN8055_EXTERN int OPEN8055_CDECL
+Open8055_SetOutput(int h, int port, int val)
+{
+    Open8055_card_t *card;
+    int         rc = 0;
+
+    if ((card = LockAndRefcount(h)) == NULL)
+        return -1;
+
+    if (port < 0 || port > 7)
+    {
+        SetError(card, "parameter invalid");
+        UnlockAndRefcount(card);
+        return -1;
+    }
+
+    /* ----
+     * Set or clear the bit and send the new info if in autoFlush mode.
+     * ----
+     */
+    if (val)
+        card->currentOutput.outputBits |= (1 << port);
+    else
+        card->currentOutput.outputBits &= ~(1 << port);
+
+    if (card->autoFlush)
+    {
+        if (CardWrite(card, &(card->currentOutput)) < 0)
+            rc = -1;
+        else
+        {
+            card->pendingOutput = FALSE;
+            card->currentOutput.resetCounter = 0x00;
+        }
+    }
+    else
+    {
+        card->pendingOutput = TRUE;
+    }
+
+    UnlockAndRefcount(card);
+    return rc;
+}
+
+
+/* ----
+ * Open8055_SetOutputAll()
+ *
+ *  Change all 8 digital outputs.
+ * ----
+ */
+OPEN8055_EXTERN int OPEN8055_CDECL
+Open8055_SetOutputAll(int h, int bits)
+{
+    Open8055_card_t *card;
+    int         rc = 0;
+
+    if ((card = LockAndRefcount(h)) == NULL)
+        return -1;
+
+    bits &= 0xff;
+
+    /* ----
+     * Set the bits and send them if in autoFlush mode.
+     * ----
+     */
+    card->currentOutput.outputBits = bits;
+    if (card->autoFlush)
+    {
+        if (CardWrite(card, &(card->currentOutput)) < 0)
+            rc = -1;
+        else
+        {
+            card->pendingOutput = FALSE;
+            card->currentOutput.resetCounter = 0x00;
+        }
+    }
+    else
+    {
+        card->pendingOutput = TRUE;
+    }
+
+    UnlockAndRefcount(card);
+    return rc;
+}
+
+
+/* ----
+ * Open8055_SetOutputValue()
+ *
+ *  Change one digital output value used in modes like SERVO.
+ * ----
+ */
+OPEN8055_EXTERN int OPEN8055_CDECL
+Open8055_SetOutputValue(int h, int port, int val)
+{
+    Open8055_card_t *card;
+    int         rc = 0;
+
+    if ((card = LockAndRefcount(h)) == NULL)
+        return -1;
+
+    if (port < 0 || port > 7)
+    {
+        SetError(card, "parameter invalid");
+        UnlockAndRefcount(card);
+        return -1;
+    }
+
+    switch(card->currentConfig1.modeOutput[port])
+    {
+        case OPEN8055_MODE_OUTPUT:      // value makes no sense in OUTPUT mode.
+            val = 0;
+            break;
+
+        case OPEN8055_MODE_SERVO:       // limit value to 500..2500ms in SERVO modes.
+        case OPEN8055_MODE_ISERVO:
+            if (val < 6000)
+                val = 6000;
+            if (val > 30000)
+                val = 30000;
+            break;
+
+        default:
+            val = 0;
+            break;
+    }
+
+    /* ----
+     * Set the value in currentOutput and send the new info if in autoFlush mode.
+     * ----
+     */
+    card->currentOutput.outputValue[port] = htons(val);
+
+    if (card->autoFlush)
+    {
+        if (CardWrite(card, &(card->currentOutput)) < 0)
+            rc = -1;
+        else
+        {
+            card->pendingOutput = FALSE;
+            card->currentOutput.resetCounter = 0x00;
+        }
+    }
+    else
+    {
+        card->pendingOutput = TRUE;
+    }
+
+    UnlockAndRefcount(card);
+    return rc;
+}
+
+
+/* ----
+ * Open8055_SetPWM()
+ *
+ *  Change one of the PWM outputs.
+ * ----
+ */
+OPEN8055_EXTERN int OPEN8055_CDECL
+Open8055_SetPWM(int h, int port, int value)
+{
+    Open8055_card_t *card;
+    int         rc = 0;
+
+    if ((card = LockAndRefcount(h)) == NULL)
+        return -1;
+
+    if (port < 0 || port > 1)
+    {
+        SetError(card, "parameter invalid");
+        UnlockAndRefcount(card);
+        return 0;
+    }
+
+    if (value < 0)
+        value = 0;
+    if (value > 1023)
+        value = 1023;
+
+    /* ----
+     * Set the new PWM value and send it if in autoFlush mode.
+     * ----
+     */
+    card->currentOutput.outputPwmValue[port] = htons(value);
+    if (card->autoFlush)
+    {
+        if (CardWrite(card, &(card->currentOutput)) < 0)
+            rc = -1;
+        else
+        {
+            card->pendingOutput = FALSE;
+            card->currentOutput.resetCounter = 0x00;
+        }
+    }
+    else
+    {
+        card->pendingOutput = TRUE;
+    }
+
+    UnlockAndRefcount(card);
+    return rc;
+}
+
+
+
+/* ----
+ * Open8055_GetModeADC()
+ *
+ *  Return the operation mode of an analog input.
+ * ----
+ */
+OPEN8055_EXTERN int OPEN8055_CDECL
+Open8055_GetModeADC(int h, int port)
+{
+    Open8055_card_t *card;
+    int             rc;
+
+    if ((card = LockAndRefcount(h)) == NULL)
+        return -1;
+
+    if (port < 0 || port > 1)
+    {
+        SetError(card, "parameter invalid");
+        UnlockAndRefcount(card);
+        return -1;
+    }
+
+    rc = card->currentConfig1.modeADC[port];
+
+    UnlockAndRefcount(card);
+    return rc;
+}
+
+
+/* ----
+ * Open8055_SetModeADC()
+ *
+ *  Set the operation mode of an analog input.
+ * ----
+ */
+OPEN8055_EXTERN int OPEN8055_CDECL
+Open8055_SetModeADC(int h, int port, int mode)
+{
+    Open8055_card_t *card;
+    int             rc = 0;
+
+    if ((card = LockAndRefcount(h)) == NULL)
+        return -1;
+
+    if (port < 0 || port > 1)
+    {
+        SetError(card, "parameter error");
+        UnlockAndRefcount(card);
+        return -1;
+    }
+
+    if (mode == OPEN8055_MODE_ADC10 || mode == OPEN8055_MODE_ADC9 || mode == OPEN8055_MODE_ADC8)
+    {
+        card->currentConfig1.modeADC[port] = mode;
+        if (card->autoFlush)
+        {
+            if (CardWrite(card, &(card->currentConfig1)) < 0)
+                rc = -1;
+            else
+                card->pendingConfig1 = FALSE;
+        }
+        else
+        {
+            card->pendingConfig1 = TRUE;
+        }
+    }
+
+    UnlockAndRefcount(card);
+    return rc;
+}
+
+
+/* ----
+ * Open8055_GetModeInput()
+ *
+ *  Return the operation mode of a digital input.
+ * ----
+ */
+OPEN8055_EXTERN int OPEN8055_CDECL
+Open8055_GetModeInput(int h, int port)
+{
+    Open8055_card_t *card;
+    int             rc;
+
+    if ((card = LockAndRefcount(h)) == NULL)
+        return -1;
+
+    if (port < 0 || port > 4)
+    {
+        SetError(card, "parameter invalid");
+        UnlockAndRefcount(card);
+        return -1;
+    }
+
+    rc = card->currentConfig1.modeInput[port];
+
+    UnlockAndRefcount(card);
+    return rc;
+}
+
+
+/* ----
+ * Open8055_SetModeInput()
+ *
+ *  Set the operation mode of a digital input.
+ * ----
+ */
+OPEN8055_EXTERN int OPEN8055_CDECL
+Open8055_SetModeInput(int h, int port, int mode)
+{
+    Open8055_card_t *card;
+    int             rc = 0;
+
+    if ((card = LockAndRefcount(h)) == NULL)
+        return -1;
+
+    if (port < 0 || port > 4)
+    {
+        SetError(card, "parameter error");
+        UnlockAndRefcount(card);
+        return -1;
+    }
+
+    if (mode == OPEN8055_MODE_INPUT || mode == OPEN8055_MODE_FREQUENCY)
+    {
+        card->currentConfig1.modeInput[port] = mode;
+        if (card->autoFlush)
+        {
+            if (CardWrite(card, &(card->currentConfig1)) < 0)
+                rc = -1;
+            else
+                card->pendingConfig1 = FALSE;
+        }
+        else
+        {
+            card->pendingConfig1 = TRUE;
+        }
+        /* ----
+         * Changing input mode also causes a counter reset.
+         * ----
+         */
+        card->currentOutput.resetCounter |= (1 << port);
+        if (card->autoFlush)
+        {
+            if (CardWrite(card, &(card->currentOutput)) < 0)
+                rc = -1;
+            else
+            {
+                card->pendingOutput = FALSE;
+                card->currentOutput.resetCounter = 0x00;
+            }
+        }
+        else
+        {
+            card->pendingOutput = TRUE;
+        }
+    }
+
+    UnlockAndRefcount(card);
+    return rc;
+}
+
+
+/* ----
+ * Open8055_GetModeOutput()
+ *
+ *  Return the operation mode of a digital output.
+ * ----
+ */
+OPEN8055_EXTERN int OPEN8055_CDECL
+Open8055_GetModeOutput(int h, int port)
+{
+    Open8055_card_t *card;
+    int             rc;
+
+    if ((card = LockAndRefcount(h)) == NULL)
+        return -1;
+
+    if (port < 0 || port > 7)
+    {
+        SetError(card, "parameter invalid");
+        UnlockAndRefcount(card);
+        return -1;
+    }
+
+    rc = card->currentConfig1.modeOutput[port];
+
+    UnlockAndRefcount(card);
+    return rc;
+}
+
+
+/* ----
+ * Open8055_SetModeOutput()
+ *
+ *  Set the operation mode of a digital output.
+ * ----
+ */
+OPEN8055_EXTERN int OPEN8055_CDECL
+Open8055_SetModeOutput(int h, int port, int mode)
+{
+    Open8055_card_t *card;
+    int             rc = 0;
+    int             val;
+
+    if ((card = LockAndRefcount(h)) == NULL)
+        return -1;
+
+    if (port < 0 || port > 7)
+    {
+        SetError(card, "parameter invalid");
+        UnlockAndRefcount(card);
+        return -1;
+    }
+
+    val = ntohs(card->currentOutput.outputValue[port]);
+    switch (mode)
+    {
+        case OPEN8055_MODE_OUTPUT:
+            val = 0;
+            break;
+
+        case OPEN8055_MODE_SERVO:
+        case OPEN8055_MODE_ISERVO:
+            /* ----
+             * When we enter SERVO mode, we set the pulse width to center.
+             * Otherwise we constrain the pulse width to 0.5 .. 2.5 ms.
+             * ----
+             */
+            if (card->currentConfig1.modeOutput[port] != OPEN8055_MODE_SERVO &&
+                card->currentConfig1.modeOutput[port] != OPEN8055_MODE_ISERVO)
+            {
+                val = 18000;
+            }
+            else
+            {
+                if (val < 6000)
+                    val = 6000;
+                if (val > 30000)
+                    val = 30000;
+            }
+            break;
+
+        default:
+            val = 0;
+            break;
+    }
+    val = htons(val);
+
+    if (mode == OPEN8055_MODE_OUTPUT || mode == OPEN8055_MODE_SERVO || mode == OPEN8055_MODE_ISERVO)
+    {
+        card->currentConfig1.modeOutput[port] = mode;
+        if (card->autoFlush)
+        {
+            if (CardWrite(card, &(card->currentConfig1)) < 0)
+                rc = -1;
+            else
+                card->pendingConfig1 = FALSE;
+        }
+        else
+        {
+            card->pendingConfig1 = TRUE;
+        }
+
+        if (val != card->currentOutput.outputValue[port])
+        {
+            card->currentOutput.outputValue[port] = val;
+            if (card->autoFlush)
+            {
+                if (CardWrite(card, &(card->currentOutput)) < 0)
+                    rc = -1;
+                else
+                    card->pendingOutput = FALSE;
+            }
+            else
+            {
+                card->pendingOutput = TRUE;
+            }
+        }
+    }
+
+    UnlockAndRefcount(card);
+    return rc;
+}
+
+
+/* ----------------------------------------------------------------------
+ * Local functions follow
+ * ----------------------------------------------------------------------
+ */
+
+static int
+Open8055_Init(void)
+{
+    if (initialized)
+        return 0;
+
+#ifndef _WIN32
+    pthread_mutexattr_init(&recursiveMutexAttr);
+    pthread_mutexattr_settype(&recursiveMutexAttr, PTHREAD_MUTEX_RECURSIVE);
+#endif
+    LockCreate(&connectionsLock);
+    LockCreate(&linksLock);
+    LockCreate(&connectLock);
+
+    connectionsSize = 16;
+    connections = (Open8055_card_t **)malloc(sizeof(Open8055_card_t *) * 16);
+    if (connections == NULL)
+    {
+        SetError(NULL, "out of memory");
+        return -1;
+    }
+
+    if (DeviceInit() < 0)
+        return -1;
+
+#ifdef _WIN32
+    if (WSAStartup(MAKEWORD(2,2), &WSAData) != 0)
+    {
+    	SetError(NULL, "WSAStartup() failed");
+	return -1;
+    }
+#endif
+
+    initialized = TRUE;
+    return 0;
+}
+
+
+static Open8055_card_t *
+LockAndRefcount(int h)
+{
+    Open8055_card_t     *card;
+
+    if (!initialized)
+    {
+        if (Open8055_Init() < 0)
+            return NULL;
+    }
+
+    LockAcquire(&connectionsLock);
+
+    if (h < 0 || h >= connectionsUsed || connections[h] == NULL)
+    {
+        SetError(NULL, "invalid card handle %d", h);
+        LockRelease(&connectionsLock);
+        return NULL;
+    }
+
+    card = connections[h];
+    LockAcquire(card->lock);
+    LockRelease(&connectionsLock);
+    card->cardRefcount++;
+
+    return card;
+}
+
+
+static void
+UnlockAndRefcount(Open8055_card_t *card)
+{
+    card->cardRefcount--;
+    LockRelease(card->lock);
+    return;
+}
+
+
+/* ----
+ * ConnectCards()
+ *
+ *  The work horse behind Open8055_Connect() and Open8055_ConnectMany().
+ *  All remote destinations are resolved and their non-blocking connects
+ *  started first. Local cards are then opened one after another, which
+ *  only takes a USB round trip each. Finally a select() loop drives the
+ *  HELLO/SALT/OPEN handshakes of all remote cards until they are done,
+ *  failed or the timeout expires.
+ *
+ *  Remote cards on the same server share one connection where the
+ *  server supports it. The first of them does the handshake, the
+ *  others wait in CONNECT_STATE_LINK and then only send their OPEN.
+ * ----
+ */
+static int
+ConnectCards(const char **destinations, int n, int *handles, int timeout,
+             Open8055_connect_t *pending)
+{
+    int             connected = 0;
+    int             i;
+
+    /* ----
+     * A connect holds the locks of all links it uses. Only one thread
+     * may do that at a time, or two of them could deadlock.
+     * ----
+     */
+    LockAcquire(&connectLock);
+
+    /* ----
+     * Parse all destinations and get the remote connects going.
+     * ----
+     */
+    memset(pending, 0, sizeof(Open8055_connect_t) * n);
+    for (i = 0; i < n; i++)
+    {
+        handles[i] = -1;
+        ConnectStart(&pending[i], destinations[i]);
+    }
+    ConnectWait(pending, n, timeout);
+
+    /* ----
+     * Register the cards that made it. Their locks may be shared with
+     * cards that are open already, so all of them must be released
+     * before we take connectionsLock.
+     * ----
+     */
+    for (i = 0; i < n; i++)
+    {
+        if (pending[i].state == CONNECT_STATE_DONE)
+            LockRelease(pending[i].card->lock);
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (pending[i].state != CONNECT_STATE_DONE)
+            continue;
+
+        if ((handles[i] = AddConnection(pending[i].card)) < 0)
+        {
+            LockAcquire(pending[i].card->lock);
+            ConnectFail(&pending[i], "%s", lastErrorMessage);
+            continue;
+        }
+        if (pending[i].addrList != NULL)
+            freeaddrinfo(pending[i].addrList);
+        pending[i].addrList = NULL;
+        pending[i].card = NULL;
+        connected++;
+    }
+
+    LockRelease(&connectLock);
+    return connected;
+}
+
+
+/* ----
+ * ConnectWait()
+ *
+ *  Drive the destinations started by ConnectStart() until all of them
+ *  are done or failed, or the timeout expires. Called with connectLock
+ *  held. The cards that made it are returned locked.
+ * ----
+ */
+static void
+ConnectWait(Open8055_connect_t *pending, int n, int timeout)
+{
+    int64_t         deadline = 0;
+    int64_t         now;
+    fd_set          rfds;
+    fd_set          wfds;
+    SOCKET          maxfd;
+    struct timeval  tv;
+    int             waiting;
+    int             sliced;
+    int             rc;
+    int             i;
+
+    if (timeout >= 0)
+        deadline = TimeNowUsec() + (int64_t)timeout * 1000;
+
+    /* ----
+     * Collect the initial reports of the local cards while the
+     * remote ones are connecting.
+     * ----
+     */
+    for (i = 0; i < n; i++)
+    {
+        if (pending[i].state != CONNECT_STATE_REPORTS || !pending[i].card->isLocal)
+            continue;
+
+        while (pending[i].state == CONNECT_STATE_REPORTS)
+        {
+            if (timeout >= 0 && TimeNowUsec() >= deadline)
+                break;
+            ConnectProgress(&pending[i], 1000);
+        }
+    }
+
+    /* ----
+     * Multiplex all remote handshakes.
+     * ----
+     */
+    for (;;)
+    {
+        /* ----
+         * Cards waiting for the handshake of a shared link go on once
+         * it is done. Reports may have been received for a card while
+         * reading for another one and are in its queue already.
+         * ----
+         */
+        for (i = 0; i < n; i++)
+        {
+            if (pending[i].state == CONNECT_STATE_LINK)
+                ConnectFollow(&pending[i]);
+            if (pending[i].state == CONNECT_STATE_REPORTS &&
+                !pending[i].card->isLocal &&
+                (pending[i].card->reportQueueCount > 0 ||
+                 pending[i].card->channelFailed))
+                ConnectProgress(&pending[i], 0);
+        }
+
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        maxfd = 0;
+        waiting = 0;
+        sliced = FALSE;
+
+        for (i = 0; i < n; i++)
+        {
+            if (pending[i].card == NULL || pending[i].card->isLocal)
+                continue;
+
+            switch (pending[i].state)
+            {
+                case CONNECT_STATE_CONNECTING:
+                    FD_SET(pending[i].card->link->sock, &wfds);
+                    break;
+
+                case CONNECT_STATE_HELLO:
+                case CONNECT_STATE_SALT:
+                case CONNECT_STATE_BINARY:
+                case CONNECT_STATE_REPORTS:
+                    FD_SET(pending[i].card->link->sock, &rfds);
+                    break;
+
+                case CONNECT_STATE_LINK:
+                    waiting++;
+                    continue;
+
+                default:
+                    continue;
+            }
+            if (pending[i].card->link->sock > maxfd)
+                maxfd = pending[i].card->link->sock;
+            if (pending[i].card->link->multiplex)
+                sliced = TRUE;
+            waiting++;
+        }
+        if (waiting == 0)
+            break;
+
+        if (timeout >= 0)
+        {
+            now = TimeNowUsec();
+            if (now >= deadline)
+                break;
+            tv.tv_sec  = (long)((deadline - now) / 1000000);
+            tv.tv_usec = (long)((deadline - now) % 1000000);
+        }
+
+        /* ----
+         * Cards already open on a shared link keep running while we
+         * wait, and may receive our reports. Look at our queues
+         * every so often.
+         * ----
+         */
+        if (sliced && (timeout < 0 || deadline - now > OPEN8055_LINK_SLICE * 1000))
+        {
+            tv.tv_sec  = 0;
+            tv.tv_usec = OPEN8055_LINK_SLICE * 1000;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            if (pending[i].card != NULL)
+                LockRelease(pending[i].card->lock);
+        }
+        rc = select(maxfd + 1, &rfds, &wfds, NULL,
+                (timeout >= 0 || sliced) ? &tv : NULL);
+        for (i = 0; i < n; i++)
+        {
+            if (pending[i].card != NULL)
+                LockAcquire(pending[i].card->lock);
+        }
+        if (rc < 0)
+        {
+#ifndef _WIN32
+            if (errno == EINTR)
+                continue;
+#endif
+            for (i = 0; i < n; i++)
+            {
+                if (pending[i].state < CONNECT_STATE_DONE)
+                    ConnectFail(&pending[i], "select(): %s", ErrorString());
+            }
+            break;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            if (pending[i].card == NULL || pending[i].card->isLocal)
+                continue;
+
+            if (pending[i].state == CONNECT_STATE_CONNECTING)
+            {
+                if (FD_ISSET(pending[i].card->link->sock, &wfds))
+                    ConnectCompleted(&pending[i]);
+            }
+            else if (pending[i].state < CONNECT_STATE_DONE)
+            {
+                if (FD_ISSET(pending[i].card->link->sock, &rfds))
+                    ConnectProgress(&pending[i], 0);
+            }
+        }
+    }
+
+    /* ----
+     * Fail the ones that timed out.
+     * ----
+     */
+    for (i = 0; i < n; i++)
+    {
+        switch (pending[i].state)
+        {
+            case CONNECT_STATE_CONNECTING:
+            case CONNECT_STATE_LINK:
+                ConnectFail(&pending[i], "timeout connecting to server");
+                break;
+
+            case CONNECT_STATE_HELLO:
+                ConnectFail(&pending[i], "timeout receiving HELLO");
+                break;
+
+            case CONNECT_STATE_SALT:
+                ConnectFail(&pending[i], "timeout receiving SALT");
+                break;
+
+            case CONNECT_STATE_BINARY:
+                ConnectFail(&pending[i], "timeout negotiating protocol");
+                break;
+
+            case CONNECT_STATE_REPORTS:
+                ConnectFail(&pending[i], "timeout receiving initial card status");
+                break;
+        }
+    }
+}
+
+
+/* ----
+ * ConnectStart()
+ *
+ *  Parse one destination. Local cards are opened and asked for their
+ *  current status. For remote cards the server address is resolved
+ *  and a non-blocking connect() is started.
+ * ----
+ */
+static void
+ConnectStart(Open8055_connect_t *conn, const char *destination)
+{
+    Open8055_card_t        *card;
+    Open8055_hidMessage_t   outputMessage;
+    char                   *env;
+
+    /* ----
+     * Allocate the card status data. The card lock is held until
+     * the card is either registered or destroyed again.
+     * ----
+     */
+    card = (Open8055_card_t *)malloc(sizeof(Open8055_card_t));
+    if (card == NULL)
+    {
+        ConnectFail(conn, "out of memory");
+        return;
+    }
+    memset(card, 0, sizeof(Open8055_card_t));
+    strncpy(card->destination, destination, sizeof(card->destination) - 1);
+    card->autoFlush = TRUE;
+    card->lock = &(card->cardLock);
+    LockCreate(card->lock);
+    LockAcquire(card->lock);
+    conn->card = card;
+
+    /* ----
+     * Parse the destination. We first check for the remote
+     * format of open8055://user@host/cardN.
+     * ----
+     */
+    if (strncasecmp(destination, "open8055://", 11) == 0)
+    {
+        if (ConnectParseRemote(conn, &destination[11], conn->host,
+                sizeof(conn->host), &(conn->port)) < 0)
+            return;
+
+        card->isLocal   = FALSE;
+        card->idLocal   = -1;
+        card->readOnly  = conn->readOnly;
+
+        /* ----
+         * Only binary framing has channels, so with the text protocol
+         * every card needs its own connection.
+         * ----
+         */
+        env = getenv("OPEN8055_PROTOCOL");
+        ConnectRemote(conn, env == NULL || stricmp(env, "text") != 0);
+        return;
+    }
+
+    /* ----
+     * Destination does not start with "open8055://". The requested card must be a local card.
+     * ----
+     */
+    if (sscanf(destination, "card%d", &(conn->cardNumber)) != 1)
+    {
+        ConnectFail(conn, "Syntax error in local card address '%s'", destination);
+        return;
+    }
+
+    /* ----
+     * Check the card number for validity and make sure it isn't open yet.
+     * ----
+     */
+    if (conn->cardNumber < 0 || conn->cardNumber >= OPEN8055_MAX_CARDS)
+    {
+        ConnectFail(conn, "Card number %d out of bounds", conn->cardNumber);
+        return;
+    }
+    if (openLocalCards[conn->cardNumber] != 0)
+    {
+        ConnectFail(conn, "Local card %d already open", conn->cardNumber);
+        return;
+    }
+
+    /* ----
+     * Try to open the actual local card.
+     * ----
+     */
+    card->isLocal   = TRUE;
+    card->idLocal   = conn->cardNumber;
+    if (DeviceOpen(card) < 0)
+    {
+        ConnectFail(conn, "%s", card->errorMessage);
+        return;
+    }
+    conn->deviceOpen = TRUE;
+
+    /* ----
+     * Query current card status. When connecting to an Open8055Server,
+     * The OPEN command automatically responds with those messages.
+     * ----
+     */
+    memset(&outputMessage, 0, sizeof(outputMessage));
+    outputMessage.msgType = OPEN8055_HID_MESSAGE_GETCONFIG;
+    if (CardWrite(card, &outputMessage) < 0)
+    {
+        ConnectFail(conn, "%s", card->errorMessage);
+        return;
+    }
+    conn->state = CONNECT_STATE_REPORTS;
+}
+
+
+/* ----
+ * ConnectRemote()
+ *
+ *  Get a remote card a connection to its server. If share is set we
+ *  use the link another card has to the same server as the same user,
+ *  or start a new one that later cards can use too. Otherwise the card
+ *  gets a connection of its own.
+ * ----
+ */
+static void
+ConnectRemote(Open8055_connect_t *conn, int share)
+{
+    Open8055_card_t    *card = conn->card;
+    Open8055_link_t    *link = NULL;
+    struct addrinfo     hints;
+    char                service[16];
+    int                 found = FALSE;
+    int                 rc;
+
+    if (share && (link = LinkFind(conn)) != NULL)
+        found = TRUE;
+    else if ((link = LinkCreate(conn, share)) == NULL)
+    {
+        ConnectFail(conn, "out of memory");
+        return;
+    }
+
+    /* ----
+     * From now on the link's lock is the card lock. A link that is
+     * already in use by open cards may be busy in another thread.
+     * ----
+     */
+    LockRelease(card->lock);
+    LockAcquire(&(link->linkLock));
+    card->lock = &(link->linkLock);
+    card->link = link;
+    link->cardCount++;
+
+    if (found)
+    {
+        if (AtomicLoad(&(link->state)) == LINK_STATE_READY)
+            ConnectSendOpen(conn);
+        else
+            conn->state = CONNECT_STATE_LINK;
+        return;
+    }
+    conn->linkLeader = TRUE;
+
+    /* ----
+     * A host that is a path names the server's Unix domain socket.
+     * ----
+     */
+    if (conn->host[0] == '/')
+    {
+        ConnectLocal(conn);
+        return;
+    }
+
+    /* ----
+     * Get the server addresses. Each of them is tried in turn
+     * until one accepts the connection.
+     * ----
+     */
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    sprintf(service, "%d", conn->port);
+    if ((rc = getaddrinfo(conn->host, service, &hints, &(conn->addrList))) != 0)
+    {
+        ConnectFail(conn, "%s: %s", conn->host, gai_strerror(rc));
+        return;
+    }
+    conn->addrNext = conn->addrList;
+    ConnectNextAddress(conn);
+}
+
+
+/* ----
+ * ConnectFollow()
+ *
+ *  Check on the link a card is waiting for in CONNECT_STATE_LINK.
+ *  Once its handshake is done we open the card on it. If the server
+ *  turned out not to support channels, or the link has been closed
+ *  again, the card connects on its own.
+ * ----
+ */
+static void
+ConnectFollow(Open8055_connect_t *conn)
+{
+    Open8055_card_t    *card = conn->card;
+    Open8055_link_t    *link = card->link;
+    int                 state = AtomicLoad(&(link->state));
+
+    switch (state)
+    {
+        case LINK_STATE_PENDING:
+            return;
+
+        case LINK_STATE_READY:
+            ConnectSendOpen(conn);
+            return;
+
+        case LINK_STATE_FAILED:
+            ConnectFail(conn, "%s", link->errorMessage);
+            return;
+    }
+
+    if (LinkDetach(card) == 0 && link->sock != INVALID_SOCKET)
+    {
+        closesocket(link->sock);
+        link->sock = INVALID_SOCKET;
+    }
+    LockAcquire(&(card->cardLock));
+    card->lock = &(card->cardLock);
+    card->link = NULL;
+    LockRelease(&(link->linkLock));
+    LinkRelease(link);
+
+    ConnectRemote(conn, state != LINK_STATE_PRIVATE);
+}
+
+
+/* ----
+ * ConnectNextAddress()
+ *
+ *  Start a non-blocking connect() to the next address of the server.
+ * ----
+ */
+static void
+ConnectNextAddress(Open8055_connect_t *conn)
+{
+    Open8055_card_t    *card = conn->card;
+    struct addrinfo    *addr;
+    int                 nodelay;
+
+    while ((addr = conn->addrNext) != NULL)
+    {
+        conn->addrNext = addr->ai_next;
+
+        if (card->link->sock != INVALID_SOCKET)
+            closesocket(card->link->sock);
+
+        card->link->sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (card->link->sock == INVALID_SOCKET)
+        {
+            SetError(card, "socket(): %s", ErrorString());
+            continue;
+        }
+        if (SocketSetNonBlocking(card->link->sock, TRUE) < 0)
+        {
+            SetError(card, "%s", ErrorString());
+            continue;
+        }
+
+        /* ----
+         * Our messages are tiny and each one matters on its own.
+         * Don't let Nagle hold them back waiting for an ACK.
+         * ----
+         */
+        nodelay = 1;
+        if (setsockopt(card->link->sock, IPPROTO_TCP, TCP_NODELAY,
+                (char *)&nodelay, sizeof(nodelay)) != 0)
+        {
+            SetError(card, "setsockopt(TCP_NODELAY): %s", ErrorString());
+            continue;
+        }
+
+        if (connect(card->link->sock, addr->ai_addr, addr->ai_addrlen) == 0)
+        {
+            ConnectCompleted(conn);
+            return;
+        }
+#ifdef _WIN32
+        if (WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+        if (errno == EINPROGRESS)
+#endif
+        {
+            conn->state = CONNECT_STATE_CONNECTING;
+            return;
+        }
+        SetError(card, "%s", ErrorString());
+    }
+
+    /* ----
+     * No address left to try. Report the last error we got.
+     * ----
+     */
+    ConnectFail(conn, "%s", card->errorMessage);
+}
+
+
+/* ----
+ * ConnectLocal()
+ *
+ *  Connect to a server on this machine through its Unix domain socket.
+ *  Such a connect() either succeeds or fails right away, so there is
+ *  no CONNECT_STATE_CONNECTING for it.
+ * ----
+ */
+static void
+ConnectLocal(Open8055_connect_t *conn)
+{
+#ifdef _WIN32
+    ConnectFail(conn, "%s: Unix domain sockets are not supported", conn->host);
+#else
+    Open8055_card_t    *card = conn->card;
+    struct sockaddr_un  addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, conn->host);
+
+    card->link->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (card->link->sock == INVALID_SOCKET)
+    {
+        ConnectFail(conn, "socket(): %s", ErrorString());
+        return;
+    }
+    if (connect(card->link->sock, (SOCKADDR *)&addr, sizeof(addr)) != 0)
+    {
+        ConnectFail(conn, "%s: %s", conn->host, ErrorString());
+        return;
+    }
+    if (SocketSetNonBlocking(card->link->sock, TRUE) < 0)
+    {
+        ConnectFail(conn, "%s", ErrorString());
+        return;
+    }
+    conn->state = CONNECT_STATE_HELLO;
+#endif
+}
+
+
+/* ----
+ * ConnectCompleted()
+ *
+ *  Called when the socket of a connecting destination became writable.
+ *  Checks the outcome of the connect() and either moves on to the
+ *  server handshake or tries the next address.
+ * ----
+ */
+static void
+ConnectCompleted(Open8055_connect_t *conn)
+{
+    Open8055_card_t    *card = conn->card;
+    int                 err = 0;
+    socklen_t           errlen = sizeof(err);
+
+    if (getsockopt(card->link->sock, SOL_SOCKET, SO_ERROR, (char *)&err, &errlen) != 0)
+        err = -1;
+    if (err != 0)
+    {
+        if (err > 0)
+        {
+#ifdef _WIN32
+            WSASetLastError(err);
+#else
+            errno = err;
+#endif
+        }
+        SetError(card, "%s", ErrorString());
+        ConnectNextAddress(conn);
+        return;
+    }
+
+    /* ----
+     * The socket stays non-blocking. CardFillInput() and CardSendAll()
+     * do their own waiting.
+     * ----
+     */
+    conn->state = CONNECT_STATE_HELLO;
+}
+
+
+/* ----
+ * ConnectProgress()
+ *
+ *  Process whatever a destination has received so far. This advances
+ *  remote cards through HELLO, SALT and the OPEN command, and collects
+ *  the initial CONFIG1, OUTPUT and INPUT reports of all cards.
+ * ----
+ */
+static void
+ConnectProgress(Open8055_connect_t *conn, int timeout)
+{
+    Open8055_card_t        *card = conn->card;
+    Open8055_hidMessage_t   inputMessage;
+    char                    line[256];
+    char                    salt[256];
+    char                   *env;
+    int                     rc;
+
+    for (;;)
+    {
+        switch (conn->state)
+        {
+            case CONNECT_STATE_HELLO:
+                if ((rc = CardReadLine(card, line, sizeof(line), timeout)) <= 0)
+                {
+                    if (rc < 0)
+                        ConnectFail(conn, "%s", card->errorMessage);
+                    return;
+                }
+                if (strncmp(line, "HELLO Open8055Server ", 21) != 0)
+                {
+                    ConnectFail(conn, "Expected HELLO, got '%s'", line);
+                    return;
+                }
+                conn->state = CONNECT_STATE_SALT;
+                break;
+
+            case CONNECT_STATE_SALT:
+                if ((rc = CardReadLine(card, line, sizeof(line), timeout)) <= 0)
+                {
+                    if (rc < 0)
+                        ConnectFail(conn, "%s", card->errorMessage);
+                    return;
+                }
+                if (sscanf(line, "SALT %s", salt) != 1)
+                {
+                    ConnectFail(conn, "Expected SALT, got '%s'", line);
+                    return;
+                }
+
+                /* ----
+                 * Ask for binary framing unless the environment says
+                 * otherwise. A server that does not know it answers
+                 * with ERROR and we stay with the text protocol.
+                 * ----
+                 */
+                env = getenv("OPEN8055_PROTOCOL");
+                if (env == NULL || stricmp(env, "text") != 0)
+                {
+                    if (CardWriteLine(card, "binary %d\n", OPEN8055_BINARY_VERSION) < 0)
+                    {
+                        ConnectFail(conn, "%s", card->errorMessage);
+                        return;
+                    }
+                    conn->state = CONNECT_STATE_BINARY;
+                    break;
+                }
+                if (AtomicLoad(&(card->link->state)) == LINK_STATE_PENDING)
+                    AtomicStore(&(card->link->state), LINK_STATE_PRIVATE);
+                if (ConnectSendOpen(conn) < 0)
+                    return;
+                break;
+
+            case CONNECT_STATE_BINARY:
+                if ((rc = CardReadLine(card, line, sizeof(line), timeout)) <= 0)
+                {
+                    if (rc < 0)
+                        ConnectFail(conn, "%s", card->errorMessage);
+                    return;
+                }
+                if (strncmp(line, "BINARY ", 7) == 0)
+                {
+                    card->link->binaryProtocol = TRUE;
+                    card->link->multiplex = (strstr(line, " CHANNELS") != NULL);
+                }
+                else if (strncmp(line, "ERROR ", 6) != 0)
+                {
+                    ConnectFail(conn, "Expected BINARY, got '%s'", line);
+                    return;
+                }
+
+                /* ----
+                 * Now we know if other cards can share this link.
+                 * ----
+                 */
+                if (AtomicLoad(&(card->link->state)) == LINK_STATE_PENDING)
+                    AtomicStore(&(card->link->state), card->link->multiplex ?
+                            LINK_STATE_READY : LINK_STATE_PRIVATE);
+                if (ConnectSendOpen(conn) < 0)
+                    return;
+                break;
+
+            case CONNECT_STATE_REPORTS:
+                if ((rc = CardRead(card, &inputMessage, timeout)) <= 0)
+                {
+                    if (rc < 0)
+                        ConnectFail(conn, "%s", card->errorMessage);
+                    return;
+                }
+                switch(inputMessage.msgType)
+                {
+                    case OPEN8055_HID_MESSAGE_SETCONFIG1:
+                        memcpy(&(card->currentConfig1), &inputMessage, 
+                            sizeof(card->currentConfig1));
+                        break;
+
+                    case OPEN8055_HID_MESSAGE_OUTPUT:
+                        memcpy(&(card->currentOutput), &inputMessage, 
+                            sizeof(card->currentOutput));
+                        break;
+
+                    case OPEN8055_HID_MESSAGE_INPUT:
+                        card->currentInputUnconsumed = OPEN8055_INPUT_ANY;
+                        memcpy(&(card->currentInput), &inputMessage, 
+                            sizeof(card->currentInput));
+                        break;
+                }
+                if (card->currentConfig1.msgType != 0x00 
+                    && card->currentOutput.msgType != 0x00
+                    && card->currentInput.msgType != 0x00)
+                {
+                    /* ----
+                     * Ask the server to hold the card for us should
+                     * the connection drop. The token comes back
+                     * while the card is in use.
+                     * ----
+                     */
+                    if (!card->isLocal && CardWriteLine(card, "hold\n") < 0)
+                    {
+                        ConnectFail(conn, "%s", card->errorMessage);
+                        return;
+                    }
+                    conn->state = CONNECT_STATE_DONE;
+                    return;
+                }
+                break;
+
+            default:
+                return;
+        }
+    }
+}
+
+
+/* ----
+ * ConnectSendOpen()
+ *
+ *  Send the OPEN command with username and password, on a channel
+ *  of its own if the link supports that. A read-only card is opened
+ *  with WATCH instead. When reconnecting with a resume token, RESUME
+ *  takes the place of either.
+ *  TODO: MD5 hashing
+ * ----
+ */
+static int
+ConnectSendOpen(Open8055_connect_t *conn)
+{
+    int         rc;
+
+    if ((rc = LinkAddChannel(conn->card)) == 0)
+    {
+        if (conn->resumeToken[0] != '\0')
+            rc = CardWriteLine(conn->card, "resume %s\n", conn->resumeToken);
+        else
+            rc = CardWriteLine(conn->card, "%s %d %s %s\n",
+                    conn->readOnly ? "watch" : "open", conn->cardNumber,
+                    conn->user, "dummy");
+    }
+    if (rc < 0)
+    {
+        ConnectFail(conn, "%s", conn->card->errorMessage);
+        return -1;
+    }
+    conn->state = CONNECT_STATE_REPORTS;
+    return 0;
+}
+
+
+/* ----
+ * ConnectFail()
+ *
+ *  Record the error for a destination and release everything
+ *  that was allocated for it so far.
+ * ----
+ */
+static void
+ConnectFail(Open8055_connect_t *conn, char *fmt, ...)
+{
+    Open8055_card_t    *card = conn->card;
+    Open8055_link_t    *link = NULL;
+    va_list             ap;
+
+    va_start(ap, fmt);
+    vsnprintf(conn->errorMessage, sizeof(conn->errorMessage), fmt, ap);
+    va_end(ap);
+
+    if (card != NULL)
+    {
+        if (card->isLocal)
+        {
+            if (conn->deviceOpen)
+                DeviceClose(card);
+        }
+        else if ((link = card->link) != NULL)
+        {
+            /* ----
+             * If the handshake of a link fails, the cards waiting
+             * for it fail with the same error.
+             * ----
+             */
+            if (conn->linkLeader &&
+                AtomicLoad(&(link->state)) == LINK_STATE_PENDING)
+            {
+                strcpy(link->errorMessage, conn->errorMessage);
+                AtomicStore(&(link->state), LINK_STATE_FAILED);
+            }
+            if (link->multiplex && card->channel > 0 && link->cardCount > 1)
+                CardWriteLine(card, "close\n");
+            if ((LinkDetach(card) == 0 ||
+                 AtomicLoad(&(link->state)) == LINK_STATE_FAILED) &&
+                link->sock != INVALID_SOCKET)
+            {
+                closesocket(link->sock);
+                link->sock = INVALID_SOCKET;
+            }
+        }
+        LockRelease(card->lock);
+        if (link != NULL)
+            LinkRelease(link);
+        LockDestroy(&(card->cardLock));
+        free(card);
+    }
+    if (conn->addrList != NULL)
+        freeaddrinfo(conn->addrList);
+
+    conn->card = NULL;
+    conn->addrList = NULL;
+    conn->addrNext = NULL;
+    conn->deviceOpen = FALSE;
+    conn->state = CONNECT_STATE_FAILED;
+}
+
+
+/* ----
+ * ConnectParseRemote()
+ *
+ *  Split a remote destination of the form [user@]host[:port]/cardN,
+ *  without the leading open8055://, into its components. A host
+ *  starting with a slash is the path of the server's Unix domain
+ *  socket, as in [user@]/run/open8055.sock/cardN, and has no port.
+ *  Either can end in ?readonly to watch a card that another client
+ *  may be controlling.
+ * ----
+ */
+static int
+ConnectParseRemote(Open8055_connect_t *conn, const char *destination,
+                   char *host, int hostlen, int *port)
+{
+    char           *destcopy = strdup(destination);
+    char           *parsepos = destcopy;
+    char           *pos;
+    char           *colon;
+
+    if (destcopy == NULL)
+    {
+        ConnectFail(conn, "out of memory");
+        return -1;
+    }
+
+    strcpy(conn->user, "nobody");
+    strncpy(host, "localhost", hostlen);
+    *port = 8055;
+
+    if ((pos = strrchr(parsepos, '?')) != NULL)
+    {
+        if (stricmp(pos, "?readonly") != 0)
+        {
+            ConnectFail(conn, "Invalid destination option '%s'", pos);
+            free(destcopy);
+            return -1;
+        }
+        *pos = '\0';
+        conn->readOnly = TRUE;
+    }
+
+    /* ----
+     * If present, extract the USER@ part at the beginning of the destination.
+     * ----
+     */
+    if ((pos = strchr(parsepos, '@')) != NULL)
+    {
+        *pos++ = '\0';
+        strncpy(conn->user, parsepos, sizeof(conn->user) - 1);
+        parsepos = pos;
+    }
+
+    /* ----
+     * For a socket path the card is everything after the last slash.
+     * ----
+     */
+    if (parsepos[0] == '/')
+    {
+        pos = strrchr(parsepos, '/');
+        *pos++ = '\0';
+#ifndef _WIN32
+        if (strlen(parsepos) >= sizeof(((struct sockaddr_un *)NULL)->sun_path))
+        {
+            ConnectFail(conn, "Socket path too long");
+            free(destcopy);
+            return -1;
+        }
+#endif
+        if (parsepos[0] == '\0' ||
+            sscanf(pos, "card%d", &(conn->cardNumber)) != 1)
+        {
+            ConnectFail(conn, "Invalid destination");
+            free(destcopy);
+            return -1;
+        }
+        strncpy(host, parsepos, hostlen - 1);
+        host[hostlen - 1] = '\0';
+        *port = 0;
+        free(destcopy);
+        return 0;
+    }
+
+    /* ----
+     * We now expect either "host:port/cardN" or "host/cardN".
+     * ----
+     */
+    if ((pos = strchr(parsepos, '/')) == NULL)
+    {
+        ConnectFail(conn, "Invalid destination");
+        free(destcopy);
+        return -1;
+    }
+    *pos++ = '\0';
+    if ((colon = strchr(parsepos, ':')) != NULL)
+    {
+        /* ----
+         * There is a colon, so get the host and port.
+         * ----
+         */
+        *colon++ = '\0';
+        if (sscanf(colon, "%d", port) != 1)
+        {
+            ConnectFail(conn, "Invalid destination");
+            free(destcopy);
+            return -1;
+        }
+    }
+    strncpy(host, parsepos, hostlen - 1);
+    host[hostlen - 1] = '\0';
+
+    /* ----
+     * The final element in the remote card address must be "cardN".
+     * ----
+     */
+    if (sscanf(pos, "card%d", &(conn->cardNumber)) != 1)
+    {
+        ConnectFail(conn, "Invalid destination");
+        free(destcopy);
+        return -1;
+    }
+
+    free(destcopy);
+    return 0;
+}
+
+
+/* ----
+ * AddConnection()
+ *
+ *  Find a free connection slot or allocate a new one for a card
+ *  that finished connecting. Called without the card lock.
+ * ----
+ */
+static int
+AddConnection(Open8055_card_t *card)
+{
+    Open8055_card_t   **newConnections;
+    int                 handle;
+
+    LockAcquire(&connectionsLock);
+
+    for (handle = 0; handle < connectionsUsed; handle++)
+    {
+        if (connections[handle] == NULL)
+            break;
+    }
+    if (handle == connectionsSize)
+    {
+        newConnections = (Open8055_card_t **)realloc(connections,
+                sizeof(Open8055_card_t *) * connectionsSize * 2);
+        if (newConnections == NULL)
+        {
+            LockRelease(&connectionsLock);
+            SetError(NULL, "out of memory");
+            return -1;
+        }
+        connections = newConnections;
+        connectionsSize *= 2;
+    }
+    if (handle == connectionsUsed)
+        connectionsUsed++;
+    connections[handle] = card;
+
+    LockRelease(&connectionsLock);
+
+    return handle;
+}
+
+
+/* ----
+ * LinkFind()
+ *
+ *  Look for a link to the server and user of a remote destination
+ *  that another card can use. The link is returned with a reference
+ *  for the caller.
+ * ----
+ */
+static Open8055_link_t *
+LinkFind(Open8055_connect_t *conn)
+{
+    Open8055_link_t    *link;
+    int                 state;
+
+    LockAcquire(&linksLock);
+    for (link = links; link != NULL; link = link->next)
+    {
+        state = AtomicLoad(&(link->state));
+        if ((state == LINK_STATE_PENDING || state == LINK_STATE_READY) &&
+            link->port == conn->port &&
+            stricmp(link->host, conn->host) == 0 &&
+            strcmp(link->user, conn->user) == 0)
+        {
+            link->refcount++;
+            break;
+        }
+    }
+    LockRelease(&linksLock);
+
+    return link;
+}
+
+
+/* ----
+ * LinkCreate()
+ *
+ *  Allocate a new link for a remote destination. Unless share is set
+ *  it is never found by LinkFind() and stays with the one card.
+ * ----
+ */
+static Open8055_link_t *
+LinkCreate(Open8055_connect_t *conn, int share)
+{
+    Open8055_link_t    *link;
+
+    link = (Open8055_link_t *)malloc(sizeof(Open8055_link_t));
+    if (link == NULL)
+        return NULL;
+    memset(link, 0, sizeof(Open8055_link_t));
+
+    strcpy(link->host, conn->host);
+    link->port = conn->port;
+    strcpy(link->user, conn->user);
+    link->state = share ? LINK_STATE_PENDING : LINK_STATE_PRIVATE;
+    link->refcount = 1;
+    link->sock = INVALID_SOCKET;
+    link->net_input_pos = link->net_input_buffer;
+    link->net_input_out = link->net_input_line;
+    link->udpSock = INVALID_SOCKET;
+    LockCreateRecursive(&(link->linkLock));
+
+    if (share)
+    {
+        LockAcquire(&linksLock);
+        link->next = links;
+        links = link;
+        LockRelease(&linksLock);
+    }
+
+    return link;
+}
+
+
+/* ----
+ * LinkAddChannel()
+ *
+ *  Give a card the next free channel on its link, so that frames
+ *  can be told apart. Without channels support the card is alone
+ *  on channel 0.
+ * ----
+ */
+static int
+LinkAddChannel(Open8055_card_t *card)
+{
+    Open8055_link_t    *link = card->link;
+    int                 channel;
+    int                 i;
+
+    if (!link->multiplex)
+    {
+        card->channel = 0;
+        link->channels[0] = card;
+        return 0;
+    }
+
+    /* ----
+     * Channel 0 is left alone. The server ends the whole session on
+     * some errors there, for the sake of old clients.
+     * ----
+     */
+    for (i = 0; i < OPEN8055_LINK_CHANNELS - 1; i++)
+    {
+        channel = (link->nextChannel + i) % (OPEN8055_LINK_CHANNELS - 1) + 1;
+        if (link->channels[channel] == NULL)
+        {
+            card->channel = channel;
+            link->channels[channel] = card;
+            link->nextChannel = channel;
+            return 0;
+        }
+    }
+
+    SetError(card, "no free channel on the connection to %s", link->host);
+    return -1;
+}
+
+
+/* ----
+ * LinkDetach()
+ *
+ *  Take a card off its link. Called with the link locked. Returns
+ *  the number of cards still using the link; if that is 0 it is up
+ *  to the caller to close the socket.
+ * ----
+ */
+static int
+LinkDetach(Open8055_card_t *card)
+{
+    Open8055_link_t    *link = card->link;
+
+    if (link->channels[card->channel] == card)
+        link->channels[card->channel] = NULL;
+    if (--link->cardCount > 0)
+        return link->cardCount;
+
+    if (AtomicLoad(&(link->state)) == LINK_STATE_READY)
+        AtomicStore(&(link->state), LINK_STATE_CLOSED);
+    return 0;
+}
+
+
+/* ----
+ * LinkRelease()
+ *
+ *  Drop a reference to a link and free it with the last one.
+ *  Called without the link locked.
+ * ----
+ */
+static void
+LinkRelease(Open8055_link_t *link)
+{
+    Open8055_link_t   **prev;
+    int                 refcount;
+
+    LockAcquire(&linksLock);
+    refcount = --link->refcount;
+    if (refcount == 0)
+    {
+        for (prev = &links; *prev != NULL; prev = &((*prev)->next))
+        {
+            if (*prev == link)
+            {
+                *prev = link->next;
+                break;
+            }
+        }
+    }
+    LockRelease(&linksLock);
+
+    if (refcount == 0)
+    {
+        if (link->udpSock != INVALID_SOCKET)
+            closesocket(link->udpSock);
+        LockDestroy(&(link->linkLock));
+        free(link);
+    }
+}
+
+
+/* ----
+ * LinkBroken()
+ *
+ *  Note that the connection of an established link is gone. No new
+ *  card joins it from now on, and its cards can be reconnected. A
+ *  link still in its handshake fails the usual way instead.
+ * ----
+ */
+static void
+LinkBroken(Open8055_link_t *link)
+{
+    int         state = AtomicLoad(&(link->state));
+
+    if (state == LINK_STATE_READY || state == LINK_STATE_PRIVATE)
+        AtomicStore(&(link->state), LINK_STATE_BROKEN);
+}
+
+
+/* ----
+ * LinkTransfer()
+ *
+ *  Move a card onto the link of a fresh connection to the same card,
+ *  made by Open8055_Reconnect(), and take over the card state that
+ *  came with it. Called with both links locked. The card keeps its
+ *  handle and everything the application set up for it; fresh only
+ *  has to be freed afterwards. A card that was reopened has been
+ *  reset by the server meanwhile, so its settings become pending
+ *  again.
+ * ----
+ */
+static void
+LinkTransfer(Open8055_card_t *card, Open8055_card_t *fresh, int reopened)
+{
+    Open8055_link_t    *link = card->link;
+
+    if (LinkDetach(card) == 0 && link->sock != INVALID_SOCKET)
+    {
+        closesocket(link->sock);
+        link->sock = INVALID_SOCKET;
+    }
+
+    card->link = fresh->link;
+    card->channel = fresh->channel;
+    card->lock = fresh->lock;
+    card->link->channels[card->channel] = card;
+    card->channelFailed = FALSE;
+
+    /* ----
+     * Changes not flushed yet are kept, to be sent by the next
+     * Open8055_Flush().
+     * ----
+     */
+    if (reopened && !card->readOnly)
+    {
+        card->pendingConfig1 = TRUE;
+        card->pendingOutput = TRUE;
+    }
+    if (!card->pendingConfig1)
+        memcpy(&(card->currentConfig1), &(fresh->currentConfig1), sizeof(card->currentConfig1));
+    if (!card->pendingOutput)
+        memcpy(&(card->currentOutput), &(fresh->currentOutput), sizeof(card->currentOutput));
+    memcpy(&(card->currentInput), &(fresh->currentInput), sizeof(card->currentInput));
+    memcpy(&(card->streamInput), &(fresh->streamInput), sizeof(card->streamInput));
+    card->currentInputUnconsumed = OPEN8055_INPUT_ANY;
+    memcpy(card->reportQueue, fresh->reportQueue, sizeof(card->reportQueue));
+    card->reportQueueHead = fresh->reportQueueHead;
+    card->reportQueueCount = fresh->reportQueueCount;
+
+    card->pingUnsupported = fresh->pingUnsupported;
+    card->pingSentAt = 0;
+    card->rttSamples = 0;
+    strcpy(card->resumeToken, fresh->resumeToken);
+
+    /* ----
+     * Commands still waiting for their ACK may or may not have made
+     * it to the card. They count as failed.
+     * ----
+     */
+    if (card->ackOutstanding > 0)
+    {
+        card->stats.commandsFailed += card->ackOutstanding;
+        if (!card->ackFailed)
+        {
+            snprintf(card->ackErrorMessage, sizeof(card->ackErrorMessage),
+                    "%d commands lost with the connection", card->ackOutstanding);
+            card->ackFailed = TRUE;
+        }
+        card->ackOutstanding = 0;
+    }
+}
+
+
+/* ----
+ * LinkOpenUDP()
+ *
+ *  Create the link's UDP socket for INPUT datagrams, bound to the
+ *  local address of the TCP connection. Returns the port number
+ *  to give to the server.
+ * ----
+ */
+static int
+LinkOpenUDP(Open8055_card_t *card)
+{
+    Open8055_link_t        *link = card->link;
+    struct sockaddr_storage addr;
+    socklen_t               addrlen = sizeof(addr);
+    char                   *env;
+
+    if (link->udpSock == INVALID_SOCKET)
+    {
+        if (getsockname(link->sock, (struct sockaddr *)&addr, &addrlen) != 0)
+        {
+            SetError(card, "getsockname(): %s", ErrorString());
+            return -1;
+        }
+        if (addr.ss_family != AF_INET && addr.ss_family != AF_INET6)
+        {
+            SetError(card, "UDP input needs a network connection");
+            return -1;
+        }
+        if (addr.ss_family == AF_INET6)
+            ((struct sockaddr_in6 *)&addr)->sin6_port = 0;
+        else
+            ((struct sockaddr_in *)&addr)->sin_port = 0;
+
+        if ((link->udpSock = socket(addr.ss_family, SOCK_DGRAM, 0)) == INVALID_SOCKET)
+        {
+            SetError(card, "socket(): %s", ErrorString());
+            return -1;
+        }
+        if (bind(link->udpSock, (struct sockaddr *)&addr, addrlen) != 0 ||
+            SocketSetNonBlocking(link->udpSock, TRUE) != 0)
+        {
+            SetError(card, "bind(): %s", ErrorString());
+            closesocket(link->udpSock);
+            link->udpSock = INVALID_SOCKET;
+            return -1;
+        }
+
+        /* ----
+         * Datagrams carrying any other token are dropped, so it must
+         * not be guessable by someone spoofing the server's address.
+         * ----
+         */
+        if (RandomBytes(&(link->udpToken), sizeof(link->udpToken)) != 0)
+        {
+            SetError(card, "cannot create UDP token: %s", ErrorString());
+            closesocket(link->udpSock);
+            link->udpSock = INVALID_SOCKET;
+            return -1;
+        }
+        if ((env = getenv("OPEN8055_UDP_LOSS")) != NULL)
+            link->udpLoss = atoi(env);
+    }
+
+    addrlen = sizeof(addr);
+    if (getsockname(link->udpSock, (struct sockaddr *)&addr, &addrlen) != 0)
+    {
+        SetError(card, "getsockname(): %s", ErrorString());
+        return -1;
+    }
+    if (addr.ss_family == AF_INET6)
+        return ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+    return ntohs(((struct sockaddr_in *)&addr)->sin_port);
+}
+
+
+/* ----
+ * LinkRecvUDP()
+ *
+ *  Receive all waiting INPUT datagrams and queue them as reports for
+ *  the cards they are for. Only a datagram newer than the last one a
+ *  card got is used. Returns the number of reports queued for card.
+ * ----
+ */
+static int
+LinkRecvUDP(Open8055_card_t *card)
+{
+    Open8055_link_t        *link = card->link;
+    Open8055_card_t        *owner;
+    Open8055_hidMessage_t   message;
+    unsigned char           buf[OPEN8055_UDP_HEADER_SIZE + OPEN8055_HID_MESSAGE_SIZE];
+    uint32_t                seq;
+    int                     len;
+    int                     rc = 0;
+
+    for (;;)
+    {
+        /* ----
+         * Errors, like an ICMP unreachable reported on the next
+         * receive under Windows, are no reason to give up on UDP.
+         * The server just sends another report.
+         * ----
+         */
+        len = recv(link->udpSock, (char *)buf, sizeof(buf), 0);
+        if (len < 0)
+            return rc;
+
+        if (len <= OPEN8055_UDP_HEADER_SIZE || (link->udpLoss > 0 &&
+            rand() % 100 < link->udpLoss))
+            continue;
+        if ((((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+             ((uint32_t)buf[2] << 8) | (uint32_t)buf[3]) != link->udpToken)
+            continue;
+        if ((owner = link->channels[buf[4]]) == NULL || !owner->udpInput)
+            continue;
+
+        seq = ((uint32_t)buf[5] << 24) | ((uint32_t)buf[6] << 16) |
+              ((uint32_t)buf[7] << 8) | (uint32_t)buf[8];
+        if ((int32_t)(seq - owner->udpLastSeq) <= 0)
+        {
+            owner->stats.udpStale++;
+            continue;
+        }
+        owner->stats.udpLost += seq - owner->udpLastSeq - 1;
+        owner->stats.udpReceived++;
+        owner->udpLastSeq = seq;
+
+        memset(&message, 0, sizeof(message));
+        memcpy(&message, buf + OPEN8055_UDP_HEADER_SIZE,
+               len - OPEN8055_UDP_HEADER_SIZE);
+        if (message.msgType == OPEN8055_HID_MESSAGE_INPUT)
+            memcpy(&(owner->streamInput), &message, OPEN8055_HID_MESSAGE_SIZE);
+        ReportQueuePut(owner, &message);
+        if (owner == card)
+            rc++;
+    }
+}
+
+
+/* ----
+ * SocketSetNonBlocking()
+ *
+ *  Switch a socket between blocking and non-blocking mode.
+ * ----
+ */
+static int
+SocketSetNonBlocking(SOCKET sock, int flag)
+{
+#ifdef _WIN32
+    u_long      mode = (flag) ? 1 : 0;
+
+    if (ioctlsocket(sock, FIONBIO, &mode) != 0)
+        return -1;
+#else
+    int         flags;
+
+    if ((flags = fcntl(sock, F_GETFL, 0)) < 0)
+        return -1;
+    if (flag)
+        flags |= O_NONBLOCK;
+    else
+        flags &= ~O_NONBLOCK;
+    if (fcntl(sock, F_SETFL, flags) < 0)
+        return -1;
+#endif
+
+    return 0;
+}
+
+
+/* ----
+ * SocketWouldBlock()
+ *
+ *  Check if the last socket call failed only because it would have
+ *  had to wait.
+ * ----
+ */
+static int
+SocketWouldBlock(void)
+{
+#ifdef _WIN32
+    return (WSAGetLastError() == WSAEWOULDBLOCK);
+#else
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+#endif
+}
+
+
+/* ----
+ * SetError()
+ *
+ *  Save an error message in the lastErrorMessage buffer.
+ * ----
+ */
+static void
+SetError(Open8055_card_t *card, char *fmt, ...)
+{
+    va_list     ap;
+
+    va_start(ap, fmt);
+    if (card == NULL)
+        vsnprintf(lastErrorMessage, sizeof(lastErrorMessage), fmt, ap);
+    else
+        vsnprintf(card->errorMessage, sizeof(card->errorMessage), fmt, ap);
+    va_end(ap);
+}
+
+
+/* ----
+ * TimeNowUsec()
+ *
+ *  Monotonic clock in microseconds.
+ * ----
+ */
+static int64_t
+TimeNowUsec(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER    frequency;
+    LARGE_INTEGER           now;
+
+    if (frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+
+    return (int64_t)(now.QuadPart / frequency.QuadPart) * 1000000 +
+           (int64_t)(now.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#else
+    struct timespec         ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+
+/* ----
+ * TimeNowRealNsec()
+ *
+ *  Wall clock in nanoseconds since the Unix epoch, for recordings.
+ * ----
+ */
+static uint64_t
+TimeNowRealNsec(void)
+{
+#ifdef _WIN32
+    FILETIME                ft;
+    uint64_t                t;
+
+    GetSystemTimeAsFileTime(&ft);
+    t = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+
+    /* 100ns units since 1601-01-01 */
+    return (t - 116444736000000000ULL) * 100;
+#else
+    struct timespec         ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+
+/* ----
+ * RandomBytes()
+ *
+ *  Fill buf with len bytes from the system's cryptographic random
+ *  number generator. Returns 0 on success or -1 with errno (or
+ *  GetLastError()) telling why.
+ * ----
+ */
+static int
+RandomBytes(void *buf, int len)
+{
+#ifdef _WIN32
+    HCRYPTPROV              prov;
+    BOOL                    ok;
+
+    if (!CryptAcquireContext(&prov, NULL, NULL, PROV_RSA_FULL,
+                             CRYPT_VERIFYCONTEXT | CRYPT_SILENT))
+        return -1;
+    ok = CryptGenRandom(prov, (DWORD)len, (BYTE *)buf);
+    CryptReleaseContext(prov, 0);
+
+    return (ok) ? 0 : -1;
+#else
+    unsigned char          *p = (unsigned char *)buf;
+    ssize_t                 rc;
+    int                     fd;
+
+    if ((fd = open("/dev/urandom", O_RDONLY)) < 0)
+        return -1;
+    while (len > 0)
+    {
+        if ((rc = read(fd, p, len)) <= 0)
+        {
+            if (rc < 0 && errno == EINTR)
+                continue;
+            if (rc == 0)
+                errno = EIO;
+            close(fd);
+            return -1;
+        }
+        p += rc;
+        len -= rc;
+    }
+    close(fd);
+
+    return 0;
+#endif
+}
+
+
+/* ----
+ * CardRead()
+ *
+ *  Read one HID report from an open card. In case of a local card, DeviceRead()
+ *  is used. In the case of a remote card, this function handles the TCP/IP
+ *  communication with the server.
+ * ----
+ */
+static int
+CardRead(Open8055_card_t *card, void *buffer, int timeout)
+{
+    /* ----
+     * Reports that were received earlier are handed out first.
+     * They have been recorded when they were queued.
+     * ----
+     */
+    if (card->reportQueueCount > 0)
+        return ReportQueueGet(card, buffer);
+
+#ifndef _WIN32
+    /* ----
+     * With the I/O thread running, it is the only one allowed to
+     * read from the device. We wait for it to queue something.
+     * ----
+     */
+    if (card->isLocal && card->pollThreadStarted)
+        return PollWait(card, buffer, timeout);
+#endif
+
+    return CardReceive(card, buffer, timeout);
+}
+
+
+/* ----
+ * CardReceive()
+ *
+ *  Helper function for CardRead() that gets the next report from the
+ *  device or the server.
+ * ----
+ */
+static int
+CardReceive(Open8055_card_t *card, void *buffer, int timeout)
+{
+    int64_t     deadline = TimeNowUsec() + (int64_t)timeout * 1000;
+    int64_t     now;
+    int         rc;
+
+    /* ----
+     * Messages that are not reports, like PONG and ACK, are handled
+     * on the way and don't extend the timeout. On a shared link
+     * CardFillInput() only waits a short while at a time, since
+     * other cards' readers may receive our reports for us.
+     * ----
+     */
+    for (;;)
+    {
+        if (!card->isLocal && card->channelFailed)
+        {
+            card->channelFailed = FALSE;
+            return -1;
+        }
+
+        rc = CardReceiveMessage(card, buffer, timeout);
+        if (rc == 1 && card->recorder != NULL)
+            RecorderPut(card->recorder, OPEN8055_RECORD_RECEIVED, buffer);
+        if (rc == 1 || rc < 0)
+            return rc;
+
+        if (card->reportQueueCount > 0)
+            return ReportQueueGet(card, buffer);
+
+        now = TimeNowUsec();
+        if (rc == 0 && (card->isLocal || card->link->cardCount < 2 || now >= deadline))
+            return 0;
+        timeout = (now < deadline) ? (int)((deadline - now + 999) / 1000) : 0;
+    }
+}
+
+
+/* ----
+ * CardReceiveMessage()
+ *
+ *  Receive one message. Returns 1 for a report, 2 if some other
+ *  message from the server has been handled, 0 on timeout and -1 on
+ *  error.
+ * ----
+ */
+static int
+CardReceiveMessage(Open8055_card_t *card, void *buffer, int timeout)
+{
+    char	line[256];
+    int		rc;
+    int		msgType;
+    int		values[24];
+    int		nvalues;
+    Open8055_hidMessage_t *message;
+    Open8055_hidMessage_t other;
+    Open8055_card_t *owner;
+    unsigned char *payload;
+    int         type;
+    int         channel;
+    int         len;
+
+    if (card->isLocal)
+    	return DeviceRead(card, buffer, timeout);
+
+    /* ----
+     * Keep the RTT estimate fresh while reports are being consumed.
+     * ----
+     */
+    if (!card->pingUnsupported &&
+        TimeNowUsec() - card->pingSentAt >= OPEN8055_PING_INTERVAL)
+    {
+        if (CardSendPing(card) < 0)
+            return -1;
+    }
+
+    /* ----
+     * With binary framing the report arrives as is.
+     * ----
+     */
+    if (card->link->binaryProtocol)
+    {
+        if ((rc = CardReadFrame(card, &type, &channel, &payload, &len, timeout)) <= 0)
+            return rc;
+
+        /* ----
+         * On a shared link the frame may be for another card. Its
+         * lock is the link's lock, which we hold, so we process the
+         * frame for it right here and queue a report for it.
+         * ----
+         */
+        if (card->link->multiplex && channel != card->channel)
+        {
+            if ((owner = card->link->channels[channel]) == NULL)
+                return 2;
+
+            memset(&other, 0, sizeof(other));
+            rc = CardHandleFrame(owner, type, payload, len, &other);
+            if (rc == 1)
+                ReportQueuePut(owner, &other);
+            else if (rc < 0)
+                owner->channelFailed = TRUE;
+            return 2;
+        }
+
+        return CardHandleFrame(card, type, payload, len, buffer);
+    }
+
+    if ((rc = CardReadLine(card, line, sizeof(line), timeout)) <= 0)
+	return rc;
+
+    /* ----
+     * RECV lines are by far the most frequent, so they are checked
+     * for first.
+     * ----
+     */
+    if (strncmp(line, "RECV ", 5) != 0)
+    {
+	if (CardHandlePong(card, line) || CardHandleAckLine(card, line) ||
+	    CardHandleUnsupported(card, line) || CardHandleHold(card, line))
+	    return 2;
+	if ((rc = CardHandleDeltaLine(card, line, buffer)) != 0)
+	    return rc;
+
+	if (strncmp(line, "ERROR ", 6) == 0)
+	    SetError(card, "%s", line);
+	else
+	    SetError(card, "Expected RECV - got '%s'", line);
+	return -1;
+    }
+    if ((nvalues = ParseInts(line + 5, values, 24)) < 1)
+    {
+	SetError(card, "Expected RECV - got '%s'", line);
+	return -1;
+    }
+    msgType = values[0];
+
+    memset(buffer, 0, OPEN8055_HID_MESSAGE_SIZE);
+    message = (Open8055_hidMessage_t *)buffer;
+
+    switch (msgType)
+    {
+	case OPEN8055_HID_MESSAGE_INPUT:
+		if (nvalues < 9)
+		{
+		    SetError(card, "CardRead(): incomplete INPUT message");
+		    return -1;
+		}
+		message->msgType = values[0];
+		message->inputBits = values[1];
+		message->inputCounter[0] = ntohs(values[2]);
+		message->inputCounter[1] = ntohs(values[3]);
+		message->inputCounter[2] = ntohs(values[4]);
+		message->inputCounter[3] = ntohs(values[5]);
+		message->inputCounter[4] = ntohs(values[6]);
+		message->inputAdcValue[0] = ntohs(values[7]);
+		message->inputAdcValue[1] = ntohs(values[8]);
+		memcpy(&(card->streamInput), message, OPEN8055_HID_MESSAGE_SIZE);
+		return 1;
+
+	case OPEN8055_HID_MESSAGE_OUTPUT:
+		if (nvalues < 13)
+		{
+		    SetError(card, "CardRead(): incomplete INPUT message");
+		    return -1;
+		}
+		message->msgType = values[0];
+		message->outputBits = values[1];
+		message->outputValue[0] = ntohs(values[2]);
+		message->outputValue[1] = ntohs(values[3]);
+		message->outputValue[2] = ntohs(values[4]);
+		message->outputValue[3] = ntohs(values[5]);
+		message->outputValue[4] = ntohs(values[6]);
+		message->outputValue[5] = ntohs(values[7]);
+		message->outputValue[6] = ntohs(values[8]);
+		message->outputValue[7] = ntohs(values[9]);
+		message->outputPwmValue[0] = ntohs(values[10]);
+		message->outputPwmValue[1] = ntohs(values[11]);
+		message->resetCounter = values[12];
+		return 1;
+
+	case OPEN8055_HID_MESSAGE_SETCONFIG1:
+		if (nvalues < 24)
+		{
+		    SetError(card, "CardRead(): incomplete SETCONFIG1 message");
+		    return -1;
+		}
+		message->msgType = values[0];
+		message->modeADC[0] = values[1];
+		message->modeADC[1] = values[2];
+		message->modeInput[0] = values[3];
+		message->modeInput[1] = values[4];
+		message->modeInput[2] = values[5];
+		message->modeInput[3] = values[6];
+		message->modeInput[4] = values[7];
+		message->modeOutput[0] = values[8];
+		message->modeOutput[1] = values[9];
+		message->modeOutput[2] = values[10];
+		message->modeOutput[3] = values[11];
+		message->modeOutput[4] = values[12];
+		message->modeOutput[5] = values[13];
+		message->modeOutput[6] = values[14];
+		message->modeOutput[7] = values[15];
+		message->modePWM[0] = values[16];
+		message->modePWM[1] = values[17];
+		message->debounceValue[0] = ntohs(values[18]);
+		message->debounceValue[1] = ntohs(values[19]);
+		message->debounceValue[2] = ntohs(values[20]);
+		message->debounceValue[3] = ntohs(values[21]);
+		message->debounceValue[4] = ntohs(values[22]);
+		message->cardAddress = values[23];
+		return 1;
+
+    	default:
+		// SetError(card, "CardRead(): unknown message type 0x%02x", msgType);
+		SetError(card, "CardRead(): line='%s'", line);
+		return -1;
+    }
+}
+
+
+/* ----
+ * CardHandleFrame()
+ *
+ *  Process one binary frame for a card. Returns like
+ *  CardReceiveMessage().
+ * ----
+ */
+static int
+CardHandleFrame(Open8055_card_t *card, int type, unsigned char *payload,
+                int len, void *buffer)
+{
+    char        line[256];
+    int         rc;
+    int         values[OPEN8055_DELTA_FIELDS];
+    int         n;
+    int         i;
+    int         pos;
+
+    switch (type)
+    {
+        case OPEN8055_FRAME_RECV:
+            memset(buffer, 0, OPEN8055_HID_MESSAGE_SIZE);
+            memcpy(buffer, payload, (len < OPEN8055_HID_MESSAGE_SIZE) ?
+                    len : OPEN8055_HID_MESSAGE_SIZE);
+            if (((Open8055_hidMessage_t *)buffer)->msgType == OPEN8055_HID_MESSAGE_INPUT)
+                memcpy(&(card->streamInput), buffer, OPEN8055_HID_MESSAGE_SIZE);
+            return 1;
+
+        case OPEN8055_FRAME_DELTA:
+            /* ----
+             * Mask byte, then one byte for the input bits and
+             * two for every other field present.
+             * ----
+             */
+            n = 0;
+            pos = 1;
+            for (i = 0; len > 0 && i < OPEN8055_DELTA_FIELDS; i++)
+            {
+                if ((payload[0] & (1 << i)) == 0)
+                    continue;
+                if (pos + ((i == 0) ? 1 : 2) > len)
+                    break;
+                if (i == 0)
+                    values[n++] = payload[pos++];
+                else
+                {
+                    values[n++] = (payload[pos] << 8) | payload[pos + 1];
+                    pos += 2;
+                }
+            }
+            if (len == 0 || i < OPEN8055_DELTA_FIELDS)
+            {
+                SetError(card, "CardRead(): short DELTA frame");
+                return -1;
+            }
+            return CardApplyDelta(card, payload[0], values, buffer);
+
+        case OPEN8055_FRAME_ACK:
+            if (len < 8)
+            {
+                SetError(card, "CardRead(): short ACK frame");
+                return -1;
+            }
+            if (len >= sizeof(line) + 8)
+                len = sizeof(line) + 7;
+            memcpy(line, payload + 8, len - 8);
+            line[len - 8] = '\0';
+            CardHandleAck(card,
+                    ((uint32_t)payload[0] << 24) | ((uint32_t)payload[1] << 16) |
+                    ((uint32_t)payload[2] << 8) | (uint32_t)payload[3],
+                    ((uint32_t)payload[4] << 24) | ((uint32_t)payload[5] << 16) |
+                    ((uint32_t)payload[6] << 8) | (uint32_t)payload[7],
+                    (len > 8) ? line : NULL);
+            return 2;
+
+        case OPEN8055_FRAME_TEXT:
+            if (len >= sizeof(line))
+                len = sizeof(line) - 1;
+            memcpy(line, payload, len);
+            line[len] = '\0';
+            if (CardHandlePong(card, line) || CardHandleAckLine(card, line) ||
+                CardHandleUnsupported(card, line) || CardHandleHold(card, line))
+                return 2;
+            if ((rc = CardHandleDeltaLine(card, line, buffer)) != 0)
+                return rc;
+            if (strncmp(line, "ERROR ", 6) == 0)
+                SetError(card, "%s", line);
+            else
+                SetError(card, "Expected RECV - got '%s'", line);
+            return -1;
+
+        default:
+            SetError(card, "CardRead(): unexpected frame type 0x%02x", type);
+            return -1;
+    }
+}
+
+
+/* ----
+ * CardReadLine()
+ *
+ *  Helper function for CardRead() to receive one single line at a time
+ *  with IO buffering.
+ * ----
+ */
+static int
+CardReadLine(Open8055_card_t *card, char *buffer, int buflen, int timeout)
+{
+    Open8055_link_t    *link = card->link;
+    char               *eol;
+    int                 have;
+    int                 n;
+    int                 rc;
+
+    /* ----
+     * Don't allow the caller to request more than what we can handle with
+     * the cards line buffering.
+     * ----
+     */
+    if (buflen > sizeof(link->net_input_line))
+    	buflen = sizeof(link->net_input_line);
+
+    /* ----
+     * Receive one line from the server. The receive buffer usually
+     * holds many lines, so look for the end of this one with memchr()
+     * and copy it in one go. Only a line that continues in the next
+     * recv() is collected in the link's line buffer.
+     * ----
+     */
+    for (;;)
+    {
+	if (link->net_input_have > 0)
+	{
+	    have = link->net_input_out - link->net_input_line;
+	    eol = memchr(link->net_input_pos, '\n', link->net_input_have);
+	    n = (eol != NULL) ? eol - link->net_input_pos : link->net_input_have;
+	    if (have + n >= buflen)
+	    {
+	    	SetError(card, "Server sent oversize line");
+		return -1;
+	    }
+
+	    if (eol != NULL && have == 0)
+	    {
+		memcpy(buffer, link->net_input_pos, n);
+	    }
+	    else
+	    {
+		memcpy(link->net_input_out, link->net_input_pos, n);
+		link->net_input_out += n;
+		if (eol != NULL)
+		{
+		    n += have;
+		    memcpy(buffer, link->net_input_line, n);
+		    link->net_input_out = link->net_input_line;
+		}
+	    }
+
+	    if (eol == NULL)
+	    {
+		link->net_input_have = 0;
+		continue;
+	    }
+
+	    /* ----
+	     * Got a complete line. Consume the line feed and drop a
+	     * carriage return in front of it.
+	     * ----
+	     */
+	    link->net_input_have -= (eol + 1) - link->net_input_pos;
+	    link->net_input_pos   = eol + 1;
+	    if (n > 0 && buffer[n - 1] == '\r')
+		n--;
+	    buffer[n] = '\0';
+	    return 1;
+    	}
+
+	/* ----
+	 * We ran out of data from the server. Check if there is more
+	 * according to our timeout requirements.
+	 * ----
+	 */
+	if ((rc = CardFillInput(card, timeout)) <= 0)
+	    return rc;
+    }
+}
+
+
+/* ----
+ * ParseInts()
+ *
+ *  Parse up to maxValues space separated decimal integers, as found
+ *  in RECV lines. Returns how many there were. This is the hot path
+ *  of the text protocol and a lot cheaper than sscanf().
+ * ----
+ */
+static int
+ParseInts(char *cp, int *values, int maxValues)
+{
+    int         n = 0;
+    int         neg;
+    int         val;
+
+    while (n < maxValues)
+    {
+        while (*cp == ' ')
+            cp++;
+        if ((neg = (*cp == '-')))
+            cp++;
+        if (*cp < '0' || *cp > '9')
+            break;
+
+        val = 0;
+        while (*cp >= '0' && *cp <= '9')
+            val = val * 10 + (*cp++ - '0');
+        values[n++] = neg ? -val : val;
+    }
+
+    return n;
+}
+
+
+/* ----
+ * CardReadFrame()
+ *
+ *  Receive one binary frame. The frame is assembled in the card's line
+ *  buffer and *payload points into it until the next read.
+ * ----
+ */
+static int
+CardReadFrame(Open8055_card_t *card, int *type, int *channel,
+              unsigned char **payload, int *len, int timeout)
+{
+    unsigned char  *frame = (unsigned char *)card->link->net_input_line;
+    int             have;
+    int             need;
+    int             n;
+    int             rc;
+
+    for (;;)
+    {
+        have = card->link->net_input_out - card->link->net_input_line;
+        need = OPEN8055_FRAME_HEADER_SIZE;
+
+        if (have >= OPEN8055_FRAME_HEADER_SIZE)
+        {
+            need += (frame[0] << 8) | frame[1];
+            if (need > sizeof(card->link->net_input_line))
+            {
+                SetError(card, "Server sent oversize frame");
+                return -1;
+            }
+            if (have == need)
+            {
+                *len     = need - OPEN8055_FRAME_HEADER_SIZE;
+                *type    = frame[2];
+                *channel = frame[3];
+                card->link->recvSeq = ((uint32_t)frame[4] << 24) | ((uint32_t)frame[5] << 16) |
+                                ((uint32_t)frame[6] << 8) | (uint32_t)frame[7];
+                *payload = frame + OPEN8055_FRAME_HEADER_SIZE;
+
+                card->link->net_input_out = card->link->net_input_line;
+                return 1;
+            }
+        }
+
+        /* ----
+         * Take what we need from the receive buffer, or get more.
+         * ----
+         */
+        if (card->link->net_input_have > 0)
+        {
+            n = need - have;
+            if (n > card->link->net_input_have)
+                n = card->link->net_input_have;
+            memcpy(card->link->net_input_out, card->link->net_input_pos, n);
+            card->link->net_input_out  += n;
+            card->link->net_input_pos  += n;
+            card->link->net_input_have -= n;
+            continue;
+        }
+
+        if ((rc = CardFillInput(card, timeout)) <= 0)
+            return rc;
+    }
+}
+
+
+/* ----
+ * CardFillInput()
+ *
+ *  Wait up to timeout milliseconds for data from the server and
+ *  receive it into the card's input buffer. The socket is
+ *  non-blocking, so we always try to receive first and only wait
+ *  if nothing is there yet.
+ * ----
+ */
+static int
+CardFillInput(Open8055_card_t *card, int timeout)
+{
+    Open8055_link_t    *link = card->link;
+    fd_set		rfds;
+    struct timeval	tv;
+    int64_t		spinUntil;
+    SOCKET		maxfd;
+    char		peek;
+    int			rc;
+
+    /* ----
+     * INPUT datagrams go straight into the report queue. If one is
+     * for us, CardReceive() finds it there.
+     * ----
+     */
+    if (link->udpSock != INVALID_SOCKET && LinkRecvUDP(card) > 0)
+        return 0;
+
+    if ((rc = CardRecvInput(card)) != 0 || timeout <= 0)
+        return rc;
+
+    /* ----
+     * On a shared link another card's reader may receive what we
+     * are waiting for. Don't sleep too long without looking.
+     * ----
+     */
+    if (card->link->cardCount > 1 && timeout > OPEN8055_LINK_SLICE)
+        timeout = OPEN8055_LINK_SLICE;
+
+    /* ----
+     * In busy-poll mode peek at the socket until data shows up or the
+     * busy-poll time is used up. The actual receive happens with the
+     * card locked again.
+     * ----
+     */
+    if (card->busyPoll > 0)
+    {
+        spinUntil = TimeNowUsec() + ((card->busyPoll < (int64_t)timeout * 1000) ?
+                card->busyPoll : (int64_t)timeout * 1000);
+        LockRelease(card->lock);
+        do
+        {
+            rc = recv(card->link->sock, &peek, 1, MSG_PEEK);
+        } while (rc < 0 && SocketWouldBlock() && TimeNowUsec() < spinUntil);
+        LockAcquire(card->lock);
+
+        if ((rc = CardRecvInput(card)) != 0)
+            return rc;
+    }
+
+    FD_ZERO(&rfds);
+    FD_SET(link->sock, &rfds);
+    maxfd = link->sock;
+    if (link->udpSock != INVALID_SOCKET)
+    {
+        FD_SET(link->udpSock, &rfds);
+        if (link->udpSock > maxfd)
+            maxfd = link->udpSock;
+    }
+    tv.tv_sec  = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    LockRelease(card->lock);
+    rc = select(maxfd + 1, &rfds, NULL, NULL, &tv);
+    LockAcquire(card->lock);
+    if (rc < 0)
+    {
+        SetError(card, "select(): %s", ErrorString());
+        return -1;
+    }
+    if (rc == 0)
+        return 0;
+    if (link->udpSock != INVALID_SOCKET && FD_ISSET(link->udpSock, &rfds) &&
+        LinkRecvUDP(card) > 0 && !FD_ISSET(link->sock, &rfds))
+        return 0;
+
+    /* ----
+     * More data is available. Receive it. Another thread may have
+     * beaten us to it, in which case this is a timeout too.
+     * ----
+     */
+    return CardRecvInput(card);
+}
+
+
+/* ----
+ * CardRecvInput()
+ *
+ *  Receive whatever the server has sent into the card's input buffer
+ *  without waiting. Returns 1 if something was received, 0 if there
+ *  is nothing and -1 on error or EOF.
+ * ----
+ */
+static int
+CardRecvInput(Open8055_card_t *card)
+{
+    int			rc;
+
+    rc = recv(card->link->sock, card->link->net_input_buffer, sizeof(card->link->net_input_buffer), 0);
+    if (rc < 0)
+    {
+        if (SocketWouldBlock())
+            return 0;
+        SetError(card, "%s", ErrorString());
+        LinkBroken(card->link);
+        return -1;
+    }
+    if (rc == 0)
+    {
+        SetError(card, "Server closed connection");
+        LinkBroken(card->link);
+        return -1;
+    }
+    card->link->net_input_have = rc;
+    card->link->net_input_pos = card->link->net_input_buffer;
+
+    return 1;
+}
+
+
+/* ----
+ * CardWrite()
+ *
+ *  Write an HID command message to the card.
+ * ----
+ */
+static int
+CardWrite(Open8055_card_t *card, void *buffer)
+{
+    int         rc;
+
+    if (card->readOnly)
+    {
+        SetError(card, "card is open read-only");
+        return -1;
+    }
+
+    rc = CardSend(card, buffer);
+    if (rc >= 0 && card->recorder != NULL)
+        RecorderPut(card->recorder, OPEN8055_RECORD_SENT, buffer);
+
+    return rc;
+}
+
+
+/* ----
+ * CardMirror()
+ *
+ *  A read-only card follows the outputs and configuration its
+ *  controller writes, which the server forwards to us. Any other
+ *  card keeps what it wrote itself.
+ * ----
+ */
+static void
+CardMirror(Open8055_card_t *card, Open8055_hidMessage_t *message)
+{
+    if (!card->readOnly)
+        return;
+
+    if (message->msgType == OPEN8055_HID_MESSAGE_OUTPUT)
+        memcpy(&(card->currentOutput), message, sizeof(card->currentOutput));
+    else
+        memcpy(&(card->currentConfig1), message, sizeof(card->currentConfig1));
+}
+
+
+/* ----
+ * CardSend()
+ *
+ *  Helper function for CardWrite(). For local cards use DeviceWrite().
+ *  For remote cards translate it into the SEND command and send it to the server.
+ *  With an ACK window the command is sent as SENDACK instead and
+ *  remembered until the server acknowledges it.
+ * ----
+ */
+static int
+CardSend(Open8055_card_t *card, void *buffer)
+{
+    char        verb[32];
+    uint32_t    id;
+    int         rc;
+
+    card->stats.commandsSent++;
+
+    if (card->isLocal)
+    	return DeviceWrite(card, buffer);
+
+    /* ----
+     * Make room in the window. Reports arriving meanwhile are queued.
+     * ----
+     */
+    if (card->ackWindow > 0 &&
+        (rc = CardAckWait(card, card->ackWindow - 1, OPEN8055_ACK_TIMEOUT)) <= 0)
+    {
+        if (rc == 0)
+            SetError(card, "timeout waiting for ACK");
+        return -1;
+    }
+
+    if (CardAckCheck(card) < 0)
+        return -1;
+
+    if (card->ackWindow == 0)
+    {
+        if (card->link->binaryProtocol)
+            return CardSendFrame(card, OPEN8055_FRAME_SEND, card->channel, buffer,
+                    OPEN8055_HID_MESSAGE_SIZE);
+        return CardSendText(card, "SEND", buffer);
+    }
+
+    /* ----
+     * The command id is our send sequence number. In binary mode
+     * CardSendFrame() puts it into the frame header.
+     * ----
+     */
+    id = card->link->sendSeq;
+    if (card->link->binaryProtocol)
+        rc = CardSendFrame(card, OPEN8055_FRAME_SENDACK, card->channel, buffer,
+                OPEN8055_HID_MESSAGE_SIZE);
+    else
+    {
+        card->link->sendSeq++;
+        snprintf(verb, sizeof(verb), "SENDACK %u", id);
+        rc = CardSendText(card, verb, buffer);
+    }
+    if (rc < 0)
+        return -1;
+
+    card->ackId[card->ackOutstanding] = id;
+    card->ackSentAt[card->ackOutstanding] = TimeNowUsec();
+    card->ackOutstanding++;
+
+    return 0;
+}
+
+
+/* ----
+ * CardSendText()
+ *
+ *  Format an HID command message as text protocol line starting
+ *  with verb and send it.
+ * ----
+ */
+static int
+CardSendText(Open8055_card_t *card, char *verb, void *buffer)
+{
+    Open8055_hidMessage_t  *message;
+
+    message = (Open8055_hidMessage_t *)buffer;
+    switch (message->msgType)
+    {
+	case OPEN8055_HID_MESSAGE_OUTPUT:
+		return CardWriteLine(card, "%s %d %d %d %d %d %d %d %d %d %d %d %d %d\n",
+			verb, message->msgType, message->outputBits,
+			htons(message->outputValue[0]), htons(message->outputValue[1]),
+			htons(message->outputValue[2]), htons(message->outputValue[3]),
+			htons(message->outputValue[4]), htons(message->outputValue[5]),
+			htons(message->outputValue[6]), htons(message->outputValue[7]),
+			htons(message->outputPwmValue[0]), htons(message->outputPwmValue[1]),
+			message->resetCounter);
+
+	case OPEN8055_HID_MESSAGE_SETCONFIG1:
+		return CardWriteLine(card, "%s %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d\n",
+			verb, message->msgType,
+			message->modeADC[0], message->modeADC[1],
+			message->modeInput[0], message->modeInput[1], message->modeInput[2],
+			message->modeInput[3], message->modeInput[4],
+			message->modeOutput[0], message->modeOutput[1],
+			message->modeOutput[2], message->modeOutput[3],
+			message->modeOutput[4], message->modeOutput[5],
+			message->modeOutput[6], message->modeOutput[7],
+			message->modePWM[0], message->modePWM[1],
+			htons(message->debounceValue[0]), htons(message->debounceValue[1]),
+			htons(message->debounceValue[2]), htons(message->debounceValue[3]),
+			htons(message->debounceValue[4]),
+			message->cardAddress);
+
+	case OPEN8055_HID_MESSAGE_GETINPUT:
+	case OPEN8055_HID_MESSAGE_GETCONFIG:
+	case OPEN8055_HID_MESSAGE_SAVECONFIG:
+	case OPEN8055_HID_MESSAGE_SAVEALL:
+	case OPEN8055_HID_MESSAGE_RESET:
+		return CardWriteLine(card, "%s %d\n", verb, message->msgType);
+
+    	default:	
+		SetError(card, "CardWrite(): unknown message type 0x%02x", message->msgType);
+		return -1;
+
+    }
+
+    return 0;
+}
 
-        case OPEN8055_MODE_SERVO:
-        case OPEN8055_MODE_ISERVO:
-            /* ----
-             * When we enter SERVO mode, we set the pulse width to center.
-             * Otherwise we constrain the pulse width to 0.5 .. 2.5 ms.
-             * ----
-             */
-            if (card->currentConfig1.modeOutput[port] != OPEN8055_MODE_SERVO &&
-                card->currentConfig1.modeOutput[port] != OPEN8055_MODE_ISERVO)
+
+/* ----
+ * CardWriteLine()
+ *
+ *  Helper function for CardWrite() to format and send a server message.
+ * ----
+ */
+static int
+CardWriteLine(Open8055_card_t *card, char *fmt, ...)
+{
+    char	buf[256];
+    va_list     ap;
+
+    if (card->link->sock == INVALID_SOCKET)
+    {
+    	SetError(card, "CardWriteLine(): card is closed");
+	return -1;
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    /* ----
+     * In binary mode the line goes into a TEXT frame without
+     * its newline.
+     * ----
+     */
+    if (card->link->binaryProtocol)
+        return CardSendFrame(card, OPEN8055_FRAME_TEXT, card->channel, buf,
+                strcspn(buf, "\n"));
+
+    return CardSendAll(card, buf, strlen(buf));
+}
+
+
+/* ----
+ * CardSendFrame()
+ *
+ *  Send one binary frame to the server.
+ * ----
+ */
+static int
+CardSendFrame(Open8055_card_t *card, int type, int channel, void *payload, int len)
+{
+    unsigned char   frame[OPEN8055_FRAME_HEADER_SIZE + 256];
+    uint32_t        seq = card->link->sendSeq++;
+
+    if (card->link->sock == INVALID_SOCKET)
+    {
+    	SetError(card, "CardSendFrame(): card is closed");
+	return -1;
+    }
+    if (len > sizeof(frame) - OPEN8055_FRAME_HEADER_SIZE)
+    {
+    	SetError(card, "CardSendFrame(): payload too large");
+	return -1;
+    }
+
+    frame[0] = (unsigned char)(len >> 8);
+    frame[1] = (unsigned char)len;
+    frame[2] = (unsigned char)type;
+    frame[3] = (unsigned char)channel;
+    frame[4] = (unsigned char)(seq >> 24);
+    frame[5] = (unsigned char)(seq >> 16);
+    frame[6] = (unsigned char)(seq >> 8);
+    frame[7] = (unsigned char)seq;
+    memcpy(frame + OPEN8055_FRAME_HEADER_SIZE, payload, len);
+
+    return CardSendAll(card, (char *)frame, len + OPEN8055_FRAME_HEADER_SIZE);
+}
+
+
+/* ----
+ * CardSendAll()
+ *
+ *  Send a buffer to the server. The socket is non-blocking, so if
+ *  the kernel's send buffer is full we wait for room.
+ * ----
+ */
+static int
+CardSendAll(Open8055_card_t *card, char *buf, int len)
+{
+    fd_set      wfds;
+    int         rc;
+
+    while (len > 0)
+    {
+        rc = send(card->link->sock, buf, len, MSG_NOSIGNAL);
+        if (rc < 0)
+        {
+            if (!SocketWouldBlock())
             {
-                val = 18000;
+                SetError(card, "send(): %s", ErrorString());
+                LinkBroken(card->link);
+                return -1;
             }
-            else
+            FD_ZERO(&wfds);
+            FD_SET(card->link->sock, &wfds);
+            if (select(card->link->sock + 1, NULL, &wfds, NULL, NULL) < 0)
             {
-                if (val < 6000)
-                    val = 6000;
-                if (val > 30000)
-                    val = 30000;
+                SetError(card, "select(): %s", ErrorString());
+                return -1;
             }
-            break;
+            continue;
+        }
+        buf += rc;
+        len -= rc;
+    }
 
-        default:
-            val = 0;
+    return 0;
+}
+
+
+/* ----
+ * CardSendPing()
+ *
+ *  Send a PING carrying our clock. The server echoes it in the PONG
+ *  together with its own receive and send times.
+ * ----
+ */
+static int
+CardSendPing(Open8055_card_t *card)
+{
+    card->pingSentAt = TimeNowUsec();
+
+    return CardWriteLine(card, "ping %lld\n", (long long)card->pingSentAt);
+}
+
+
+/* ----
+ * CardHandlePong()
+ *
+ *  Check if a line from the server is the answer to a PING and if so
+ *  update the smoothed RTT from it. The time the server sat on the
+ *  PING is not part of the network round trip and is subtracted.
+ *  Returns 1 if the line has been consumed here.
+ * ----
+ */
+static int
+CardHandlePong(Open8055_card_t *card, char *line)
+{
+    long long   sentAt;
+    long long   serverRecv;
+    long long   serverSend;
+    int64_t     sample;
+
+    /* ----
+     * Servers before PING was added tell us once and we stop asking.
+     * ----
+     */
+    if (strcmp(line, "ERROR unknown command 'PING'") == 0)
+    {
+        card->pingUnsupported = TRUE;
+        return 1;
+    }
+
+    if (strncmp(line, "PONG ", 5) != 0)
+        return 0;
+    if (sscanf(line, "PONG %lld %lld %lld", &sentAt, &serverRecv, &serverSend) != 3)
+        return 1;
+
+    sample = TimeNowUsec() - sentAt;
+    if (serverSend > serverRecv && serverSend - serverRecv < sample)
+        sample -= serverSend - serverRecv;
+    if (sample < 0)
+        return 1;
+
+    /* ----
+     * Same smoothing as TCP (RFC 6298).
+     * ----
+     */
+    if (card->rttSamples == 0)
+        card->rttSmoothed = sample;
+    else
+        card->rttSmoothed += (sample - card->rttSmoothed) / 8;
+    card->rttSamples++;
+
+    return 1;
+}
+
+
+/* ----
+ * CardPump()
+ *
+ *  Receive from the server for up to timeout milliseconds on behalf
+ *  of someone waiting for a PONG or an ACK. A report that arrives is
+ *  queued for the next Open8055_Wait() or Open8055_Dispatch().
+ * ----
+ */
+static int
+CardPump(Open8055_card_t *card, int timeout)
+{
+    Open8055_hidMessage_t   inputMessage;
+    int                     rc;
+
+    if (card->channelFailed)
+    {
+        card->channelFailed = FALSE;
+        return -1;
+    }
+
+    memset(&inputMessage, 0, sizeof(inputMessage));
+    rc = CardReceiveMessage(card, &inputMessage, timeout);
+    if (rc == 1)
+        ReportQueuePut(card, &inputMessage);
+    if (card->cardClosed)
+        return -1;
+
+    return rc;
+}
+
+
+/* ----
+ * CardAckWait()
+ *
+ *  Wait until no more than limit commands are waiting for their ACK.
+ *  Returns 1 when there, 0 on timeout and -1 on error.
+ * ----
+ */
+static int
+CardAckWait(Open8055_card_t *card, int limit, int timeout)
+{
+    int64_t     deadline = TimeNowUsec() + (int64_t)timeout * 1000;
+    int64_t     now;
+
+    while (card->ackOutstanding > limit)
+    {
+        if ((now = TimeNowUsec()) >= deadline)
+            return 0;
+        if (CardPump(card, (int)((deadline - now + 999) / 1000)) < 0)
+            return -1;
+    }
+
+    return 1;
+}
+
+
+/* ----
+ * CardAckCheck()
+ *
+ *  Report a failed acknowledged command. The failure is noticed while
+ *  receiving, so it is reported by the next write or Open8055_WaitAck().
+ * ----
+ */
+static int
+CardAckCheck(Open8055_card_t *card)
+{
+    if (!card->ackFailed)
+        return 0;
+
+    SetError(card, "%s", card->ackErrorMessage);
+    card->ackFailed = FALSE;
+    return -1;
+}
+
+
+/* ----
+ * CardHandleAck()
+ *
+ *  Retire an acknowledged command from the window and account for it.
+ *  error is NULL if the command was written to the card.
+ * ----
+ */
+static void
+CardHandleAck(Open8055_card_t *card, uint32_t id, uint32_t usec, char *error)
+{
+    double      latency;
+    int         i;
+
+    for (i = 0; i < card->ackOutstanding; i++)
+    {
+        if (card->ackId[i] == id)
             break;
     }
-    val = htons(val);
+    if (i == card->ackOutstanding)
+        return;
 
-    if (mode == OPEN8055_MODE_OUTPUT || mode == OPEN8055_MODE_SERVO || mode == OPEN8055_MODE_ISERVO)
+    latency = (double)(TimeNowUsec() - card->ackSentAt[i]) / 1000.0;
+    card->ackOutstanding--;
+    card->ackId[i] = card->ackId[card->ackOutstanding];
+    card->ackSentAt[i] = card->ackSentAt[card->ackOutstanding];
+
+    if (error != NULL)
     {
-        card->currentConfig1.modeOutput[port] = mode;
-        if (card->autoFlush)
-        {
-            if (CardWrite(card, &(card->currentConfig1)) < 0)
-                rc = -1;
-            else
-                card->pendingConfig1 = FALSE;
-        }
-        else
+        card->stats.commandsFailed++;
+        if (!card->ackFailed)
         {
-            card->pendingConfig1 = TRUE;
+            snprintf(card->ackErrorMessage, sizeof(card->ackErrorMessage),
+                    "command %u failed: %s", id, error);
+            card->ackFailed = TRUE;
         }
+        return;
+    }
 
-        if (val != card->currentOutput.outputValue[port])
+    if (card->stats.commandsAcked == 0 || latency < card->stats.ackLatencyMin)
+        card->stats.ackLatencyMin = latency;
+    if (latency > card->stats.ackLatencyMax)
+        card->stats.ackLatencyMax = latency;
+    card->stats.ackLatencyLast = latency;
+    card->stats.usbWriteLast = (double)usec / 1000.0;
+    card->ackLatencySum += latency;
+    card->stats.commandsAcked++;
+}
+
+
+/* ----
+ * CardHandleAckLine()
+ *
+ *  Check if a line from the server is an ACK and if so handle it.
+ *  Returns 1 if the line has been consumed here.
+ * ----
+ */
+static int
+CardHandleAckLine(Open8055_card_t *card, char *line)
+{
+    unsigned int    id;
+    unsigned int    usec;
+    int             n = 0;
+
+    /* ----
+     * A text mode server that doesn't know SENDACK won't ever
+     * acknowledge anything. Fail what is outstanding and go back to
+     * plain SEND. (In binary mode such a server drops the connection.)
+     * ----
+     */
+    if (strcmp(line, "ERROR unknown command 'SENDACK'") == 0)
+    {
+        card->stats.commandsFailed += card->ackOutstanding;
+        card->ackOutstanding = 0;
+        card->ackWindow = 0;
+        snprintf(card->ackErrorMessage, sizeof(card->ackErrorMessage),
+                "server does not support acknowledged SEND");
+        card->ackFailed = TRUE;
+        return 1;
+    }
+
+    if (strncmp(line, "ACK ", 4) != 0)
+        return 0;
+
+    if (sscanf(line, "ACK %u OK %u", &id, &usec) == 2)
+        CardHandleAck(card, id, usec, NULL);
+    else if (sscanf(line, "ACK %u ERROR %n", &id, &n) == 1 && n > 0)
+        CardHandleAck(card, id, 0, line + n);
+
+    return 1;
+}
+
+
+/* ----
+ * CardHandleDeltaLine()
+ *
+ *  Check if a line from the server is a text protocol DELTA. Returns
+ *  0 if it is not, otherwise the result of CardApplyDelta().
+ * ----
+ */
+static int
+CardHandleDeltaLine(Open8055_card_t *card, char *line, void *buffer)
+{
+    int     values[OPEN8055_DELTA_FIELDS];
+    int     mask;
+    int     nvalues = 0;
+    char   *cp;
+    char   *end;
+    int     i;
+
+    /* ----
+     * A server without delta encoding just keeps sending full reports.
+     * ----
+     */
+    if (strcmp(line, "ERROR unknown command 'INPUTDELTA'") == 0 ||
+        strcmp(line, "ERROR unknown command 'KEYFRAME'") == 0)
+    {
+        card->inputDelta = 0;
+        return 2;
+    }
+
+    if (strncmp(line, "DELTA ", 6) != 0)
+        return 0;
+
+    mask = (int)strtol(line + 6, &end, 10);
+    cp = end;
+    for (i = 0; i < OPEN8055_DELTA_FIELDS; i++)
+    {
+        if ((mask & (1 << i)) == 0)
+            continue;
+        values[nvalues] = (int)strtol(cp, &end, 10);
+        if (end == cp)
         {
-            card->currentOutput.outputValue[port] = val;
-            if (card->autoFlush)
-            {
-                if (CardWrite(card, &(card->currentOutput)) < 0)
-                    rc = -1;
-                else
-                    card->pendingOutput = FALSE;
-            }
-            else
-            {
-                card->pendingOutput = TRUE;
-            }
+            SetError(card, "CardRead(): incomplete DELTA message");
+            return -1;
         }
+        cp = end;
+        nvalues++;
+    }
+
+    return CardApplyDelta(card, mask, values, buffer);
+}
+
+
+/* ----
+ * CardHandleUnsupported()
+ *
+ *  Older servers answer UDP and SUBSCRIBE with an error and simply
+ *  keep sending all INPUT reports over TCP. Returns TRUE if the line
+ *  was such an answer.
+ * ----
+ */
+static int
+CardHandleUnsupported(Open8055_card_t *card, char *line)
+{
+    if (strcmp(line, "ERROR unknown command 'UDP'") == 0)
+    {
+        card->udpInput = FALSE;
+        return TRUE;
     }
+    if (strcmp(line, "ERROR unknown command 'SUBSCRIBE'") == 0)
+        return TRUE;
 
-    UnlockAndRefcount(card);
-    return rc;
+    return FALSE;
 }
 
 
-/* ----------------------------------------------------------------------
- * Local functions follow
- * ----------------------------------------------------------------------
+/* ----
+ * CardHandleHold()
+ *
+ *  Remember the resume token of a HOLD response. A server that does
+ *  not hold cards, or has it disabled, answers HOLD with an error and
+ *  the card simply has no token. Returns 1 if the line has been
+ *  consumed here.
+ * ----
  */
-
 static int
-Open8055_Init(void)
+CardHandleHold(Open8055_card_t *card, char *line)
 {
-    if (initialized)
-        return 0;
-
-    LockCreate(&connectionsLock);
-
-    connectionsSize = 16;
-    connections = (Open8055_card_t **)malloc(sizeof(Open8055_card_t *) * 16);
-    if (connections == NULL)
-    {
-        SetError(NULL, "out of memory");
-        return -1;
-    }
-
-    if (DeviceInit() < 0)
-        return -1;
+    char        token[64];
 
-#ifdef _WIN32
-    if (WSAStartup(MAKEWORD(2,2), &WSAData) != 0)
+    if (strcmp(line, "ERROR unknown command 'HOLD'") == 0 ||
+        strcmp(line, "ERROR session resume disabled") == 0)
     {
-    	SetError(NULL, "WSAStartup() failed");
-	return -1;
+        card->resumeToken[0] = '\0';
+        return 1;
     }
-#endif
 
-    initialized = TRUE;
-    return 0;
+    if (strncmp(line, "HOLD ", 5) != 0)
+        return 0;
+    if (sscanf(line, "HOLD %63s", token) == 1)
+        strcpy(card->resumeToken, token);
+    return 1;
 }
 
 
-static Open8055_card_t *
-LockAndRefcount(int h)
+/* ----
+ * CardApplyDelta()
+ *
+ *  Apply the changed INPUT fields to the last INPUT report received
+ *  and return the result as a complete report in buffer. This is done
+ *  here, not when the report is consumed, so that everything behind
+ *  CardReceive() still only deals with complete reports. Returns 1,
+ *  or 2 if there is no report to apply it to yet.
+ * ----
+ */
+static int
+CardApplyDelta(Open8055_card_t *card, int mask, int *values, void *buffer)
 {
-    Open8055_card_t     *card;
+    Open8055_hidMessage_t  *message = &(card->streamInput);
+    int                     n = 0;
+    int                     i;
 
-    if (!initialized)
+    if (message->msgType != OPEN8055_HID_MESSAGE_INPUT)
     {
-        if (Open8055_Init() < 0)
-            return NULL;
+        if (CardWriteLine(card, "keyframe\n") < 0)
+            return -1;
+        return 2;
     }
 
-    LockAcquire(&connectionsLock);
-
-    if (h < 0 || h >= connectionsUsed || connections[h] == NULL)
+    if (mask & 0x01)
+        message->inputBits = values[n++];
+    for (i = 0; i < 5; i++)
     {
-        SetError(NULL, "invalid card handle %d", h);
-        LockRelease(&connectionsLock);
-        return NULL;
+        if (mask & (0x02 << i))
+            message->inputCounter[i] = ntohs(values[n++]);
+    }
+    for (i = 0; i < 2; i++)
+    {
+        if (mask & (0x40 << i))
+            message->inputAdcValue[i] = ntohs(values[n++]);
     }
 
-    card = connections[h];
-    LockAcquire(&(card->cardLock));
-    LockRelease(&connectionsLock);
-    card->cardRefcount++;
-
-    return card;
-}
-
+    memcpy(buffer, message, OPEN8055_HID_MESSAGE_SIZE);
+    card->stats.reportsDelta++;
 
-static void
-UnlockAndRefcount(Open8055_card_t *card)
-{
-    card->cardRefcount--;
-    LockRelease(&(card->cardLock));
-    return;
+    return 1;
 }
 
 
 /* ----
- * SetError()
+ * CardClose()
  *
- *  Save an error message in the lastErrorMessage buffer.
+ *  Local/Remote card abstraction for close.
  * ----
  */
-static void
-SetError(Open8055_card_t *card, char *fmt, ...)
+static int
+CardClose(Open8055_card_t *card)
 {
-    va_list     ap;
+    Open8055_link_t *link = card->link;
+    char buf[256];
 
-    va_start(ap, fmt);
-    if (card == NULL)
-        vsnprintf(lastErrorMessage, sizeof(lastErrorMessage), fmt, ap);
+    if (card->recorder != NULL)
+        RecorderStop(card);
+
+    if (card->isLocal)
+    {
+#ifndef _WIN32
+        PollStop(card);
+#endif
+    	return DeviceClose(card);
+    }
+
+    /* ----
+     * If other cards still use the connection, only our channel
+     * is closed.
+     * ----
+     */
+    if (link->multiplex && link->cardCount > 1)
+        CardWriteLine(card, "close\n");
+    if (LinkDetach(card) > 0)
+        return 0;
+
+    if (link->sock != INVALID_SOCKET)
+    {
+	CardWriteLine(card, "quit\n");
+	SocketSetNonBlocking(link->sock, FALSE);
+	while (recv(link->sock, buf, sizeof(buf), 0) > 0) {}
+	closesocket(link->sock);
+	link->sock = INVALID_SOCKET;
+	return 0;
+    }
     else
-        vsnprintf(card->errorMessage, sizeof(card->errorMessage), fmt, ap);
-    va_end(ap);
+    {
+    	SetError(card, "Card already closed");
+	return -1;
+    }
 }
 
 
 /* ----
- * CardRead()
+ * InputChangedMask()
  *
- *  Read one HID report from an open card. In case of a local card, DeviceRead()
- *  is used. In the case of a remote card, this function handles the TCP/IP
- *  communication with the server.
+ *  Compare two INPUT reports and return the OPEN8055_INPUT_* bits
+ *  of all items that differ.
  * ----
  */
 static int
-CardRead(Open8055_card_t *card, void *buffer, int timeout)
+InputChangedMask(Open8055_hidMessage_t *oldInput, Open8055_hidMessage_t *newInput)
 {
-    char	line[256];
-    int		rc;
-    int		msgType;
-    int		values[24];
-    Open8055_hidMessage_t *message;
-
-    if (card->isLocal)
-    	return DeviceRead(card, buffer, timeout);
-
-    if ((rc = CardReadLine(card, line, sizeof(line), timeout)) <= 0)
-	return rc;
+    int     mask;
+    int     i;
 
-    if (sscanf(line, "RECV %d ", &msgType) != 1)
+    mask = (oldInput->inputBits ^ newInput->inputBits) & OPEN8055_INPUT_I_ANY;
+    for (i = 0; i < 5; i++)
     {
-	if (strncmp(line, "ERROR ", 6) == 0)
-	    SetError(card, "%s", line);
-	else
-	    SetError(card, "Expected RECV - got '%s'", line);
-	return -1;
+        if (oldInput->inputCounter[i] != newInput->inputCounter[i])
+            mask |= (OPEN8055_INPUT_COUNT1 << i);
     }
-
-    memset(buffer, 0, OPEN8055_HID_MESSAGE_SIZE);
-    message = (Open8055_hidMessage_t *)buffer;
-
-    switch (msgType)
+    for (i = 0; i < 2; i++)
     {
-	case OPEN8055_HID_MESSAGE_INPUT:
-		if (sscanf(line, "RECV %d %d %d %d %d %d %d %d %d",
-			&values[0], &values[1], &values[2], &values[3],
-			&values[4], &values[5], &values[6], &values[7],
-			&values[8]) != 9)
-		{
-		    SetError(card, "CardRead(): incomplete INPUT message");
-		    return -1;
-		}
-		message->msgType = values[0];
-		message->inputBits = values[1];
-		message->inputCounter[0] = ntohs(values[2]);
-		message->inputCounter[1] = ntohs(values[3]);
-		message->inputCounter[2] = ntohs(values[4]);
-		message->inputCounter[3] = ntohs(values[5]);
-		message->inputCounter[4] = ntohs(values[6]);
-		message->inputAdcValue[0] = ntohs(values[7]);
-		message->inputAdcValue[1] = ntohs(values[8]);
-		return 1;
+        if (oldInput->inputAdcValue[i] != newInput->inputAdcValue[i])
+            mask |= (OPEN8055_INPUT_ADC1 << i);
+    }
 
-	case OPEN8055_HID_MESSAGE_OUTPUT:
-		if (sscanf(line, "RECV %d %d %d %d %d %d %d %d %d %d %d %d %d",
-			&values[0], &values[1], &values[2], &values[3],
-			&values[4], &values[5], &values[6], &values[7],
-			&values[8], &values[9], &values[10], &values[11],
-			&values[12]) != 13)
-		{
-		    SetError(card, "CardRead(): incomplete INPUT message");
-		    return -1;
-		}
-		message->msgType = values[0];
-		message->outputBits = values[1];
-		message->outputValue[0] = ntohs(values[2]);
-		message->outputValue[1] = ntohs(values[3]);
-		message->outputValue[2] = ntohs(values[4]);
-		message->outputValue[3] = ntohs(values[5]);
-		message->outputValue[4] = ntohs(values[6]);
-		message->outputValue[5] = ntohs(values[7]);
-		message->outputValue[6] = ntohs(values[8]);
-		message->outputValue[7] = ntohs(values[9]);
-		message->outputPwmValue[0] = ntohs(values[10]);
-		message->outputPwmValue[1] = ntohs(values[11]);
-		message->resetCounter = values[12];
-		return 1;
+    return mask;
+}
 
-	case OPEN8055_HID_MESSAGE_SETCONFIG1:
-		if (sscanf(line, "RECV %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d",
-			&values[0], &values[1], &values[2], &values[3],
-			&values[4], &values[5], &values[6], &values[7],
-			&values[8], &values[9], &values[10], &values[11],
-			&values[12], &values[13], &values[14], &values[15],
-			&values[16], &values[17], &values[18], &values[19],
-			&values[20], &values[21], &values[22], &values[23]) != 24)
-		{
-		    SetError(card, "CardRead(): incomplete SETCONFIG1 message");
-		    return -1;
-		}
-		message->msgType = values[0];
-		message->modeADC[0] = values[1];
-		message->modeADC[1] = values[2];
-		message->modeInput[0] = values[3];
-		message->modeInput[1] = values[4];
-		message->modeInput[2] = values[5];
-		message->modeInput[3] = values[6];
-		message->modeInput[4] = values[7];
-		message->modeOutput[0] = values[8];
-		message->modeOutput[1] = values[9];
-		message->modeOutput[2] = values[10];
-		message->modeOutput[3] = values[11];
-		message->modeOutput[4] = values[12];
-		message->modeOutput[5] = values[13];
-		message->modeOutput[6] = values[14];
-		message->modeOutput[7] = values[15];
-		message->modePWM[0] = values[16];
-		message->modePWM[1] = values[17];
-		message->debounceValue[0] = ntohs(values[18]);
-		message->debounceValue[1] = ntohs(values[19]);
-		message->debounceValue[2] = ntohs(values[20]);
-		message->debounceValue[3] = ntohs(values[21]);
-		message->debounceValue[4] = ntohs(values[22]);
-		message->cardAddress = values[23];
-		return 1;
 
-    	default:
-		// SetError(card, "CardRead(): unknown message type 0x%02x", msgType);
-		SetError(card, "CardRead(): line='%s'", line);
-		return -1;
+/* ----
+ * ReportQueuePut()
+ *
+ *  Add a report to the card's queue of received reports. All reports
+ *  carry complete state, so if the consumer falls behind we drop the
+ *  oldest one rather than blocking the producer.
+ * ----
+ */
+static void
+ReportQueuePut(Open8055_card_t *card, void *buffer)
+{
+    int     slot;
+
+    if (card->reportQueueCount == OPEN8055_REPORT_QUEUE_SIZE)
+    {
+        card->reportQueueHead = (card->reportQueueHead + 1) % OPEN8055_REPORT_QUEUE_SIZE;
+        card->reportQueueCount--;
+        card->reportQueueDropped++;
     }
+
+    slot = (card->reportQueueHead + card->reportQueueCount) % OPEN8055_REPORT_QUEUE_SIZE;
+    memcpy(&(card->reportQueue[slot]), buffer, OPEN8055_HID_MESSAGE_SIZE);
+    card->reportQueueCount++;
+
+    if (card->recorder != NULL)
+        RecorderPut(card->recorder, OPEN8055_RECORD_RECEIVED, buffer);
 }
 
 
 /* ----
- * CardReadLine()
+ * ReportQueueGet()
  *
- *  Helper function for CardRead() to receive one single line at a time
- *  with IO buffering.
+ *  Remove the oldest report from the card's queue. Returns 1 if
+ *  there was one, 0 if the queue is empty.
  * ----
  */
 static int
-CardReadLine(Open8055_card_t *card, char *buffer, int buflen, int timeout)
+ReportQueueGet(Open8055_card_t *card, void *buffer)
 {
-    fd_set		rfds;
-    struct timeval	tv;
-    int			rc;
+    if (card->reportQueueCount == 0)
+        return 0;
 
-    /* ----
-     * Don't allow the caller to request more than what we can handle with
-     * the cards line buffering.
-     * ----
-     */
-    if (buflen > sizeof(card->net_input_line))
-    	buflen = sizeof(card->net_input_line);
+    memcpy(buffer, &(card->reportQueue[card->reportQueueHead]), OPEN8055_HID_MESSAGE_SIZE);
+    card->reportQueueHead = (card->reportQueueHead + 1) % OPEN8055_REPORT_QUEUE_SIZE;
+    card->reportQueueCount--;
 
-    /* ----
-     * Receive one line from the server.
-     * ----
-     */
-    for (;;)
-    {
-	while (card->net_input_have > 0)
-	{
-	    /* ----
-	     * Discard any carriage return characters.
-	     * ----
-	     */
-	    if (*(card->net_input_pos) == '\r')
-	    {
-		card->net_input_pos++;
-		card->net_input_have--;
-		continue;
-	    }
+    return 1;
+}
 
-	    /* ----
-	     * If we found a line feed, we got a complete line. Terminate
-	     * the line buffer, copy the content to the user buffer and
-	     * reset it.
-	     * ----
-	     */
-	    if (*(card->net_input_pos) == '\n')
-	    {
-		card->net_input_pos++;
-		card->net_input_have--;
-		*(card->net_input_out) = '\0';
-		strncpy(buffer, card->net_input_line, buflen);
 
-		card->net_input_out = card->net_input_line;
-		return 1;
-	    }
+/* ----
+ * RecorderPut()
+ *
+ *  Hand a report to the recorder's writer thread. Called with the
+ *  card locked. Never blocks; if the ring is full the report is
+ *  counted as dropped.
+ * ----
+ */
+static void
+RecorderPut(Open8055_recorder_t *rec, int direction, void *buffer)
+{
+    uint32_t                tail = rec->ringTail;
+    Open8055_recordEntry_t *entry;
 
-	    /* ----
-	     * Ordinary character. Just copy it into the line buffer
-	     * and keep moving, unless we run out of space.
-	     * ----
-	     */
-	    *(card->net_input_out++) = *(card->net_input_pos++);
-	    card->net_input_have--;
+    if (tail - AtomicLoad(&(rec->ringHead)) >= OPEN8055_RECORDER_RING_SIZE)
+    {
+        AtomicStore(&(rec->ringDropped), rec->ringDropped + 1);
+        return;
+    }
+
+    entry = &(rec->ring[tail & (OPEN8055_RECORDER_RING_SIZE - 1)]);
+    entry->timestamp = TimeNowRealNsec();
+    entry->direction = direction;
+    memcpy(&(entry->message), buffer, OPEN8055_HID_MESSAGE_SIZE);
 
-	    if (card->net_input_out >= (card->net_input_line + buflen))
-	    {
-	    	SetError(card, "Server sent oversize line");
-		return -1;
-	    }
-    	}
+    AtomicStore(&(rec->ringTail), tail + 1);
+}
 
-	/* ----
-	 * We ran out of data from the server. Check if there is more
-	 * according to our timeout requirements.
-	 * ----
-	 */
-	if (timeout < 0)
-	    timeout = 0;
-	FD_ZERO(&rfds);
-	FD_SET(card->sock, &rfds);
-	tv.tv_sec  = timeout / 1000;
-	tv.tv_usec = (timeout % 1000) * 1000;
-	LockRelease(&(card->cardLock));
-	rc = select(card->sock + 1, &rfds, NULL, NULL, &tv);
-	LockAcquire(&(card->cardLock));
-	if (rc < 0)
-	{
-	    SetError(card, "select(): %s", ErrorString());
-	    return -1;
-	}
-	if (rc == 0)
-	    return 0;
 
-	/* ----
-	 * More data is available. Receive it.
-	 * ----
-	 */
-	rc = recv(card->sock, card->net_input_buffer, sizeof(card->net_input_buffer), 0);
-	if (rc < 0)
-	{
-	    SetError(card, "%s", ErrorString());
-	    return -1;
-	}
-	if (rc == 0)
-	{
-	    SetError(card, "Server closed connection");
-	    return -1;
-	}
-	card->net_input_have = rc;
-	card->net_input_pos = card->net_input_buffer;
+/* ----
+ * RecorderStop()
+ *
+ *  Tell the writer thread to finish, wait for it and free the
+ *  recorder. The writer never touches the card, so we can wait with
+ *  the card locked. Returns -1 if any write failed, including the
+ *  final one done while stopping.
+ * ----
+ */
+static int
+RecorderStop(Open8055_card_t *card)
+{
+    Open8055_recorder_t *rec = card->recorder;
+    int                 rc = 0;
+
+    AtomicStore(&(rec->stop), 1);
+#ifdef _WIN32
+    WaitForSingleObject(rec->thread, INFINITE);
+    CloseHandle(rec->thread);
+#else
+    pthread_join(rec->thread, NULL);
+#endif
+    if (rec->failed)
+    {
+        SetError(card, "%s", rec->errorMessage);
+        rc = -1;
+    }
+    if (fclose(rec->fp) != 0 && rc == 0)
+    {
+        SetError(card, "recording close failed: %s", strerror(errno));
+        rc = -1;
     }
+    free(rec);
+    card->recorder = NULL;
+
+    return rc;
 }
 
 
 /* ----
- * CardWrite()
+ * RecorderThreadMain()
  *
- *  Write an HID command message to the card. For local cards use DeviceWrite().
- *  For remote cards translate it into the SEND command and send it to the server.
+ *  OS specific entry point of the writer thread.
  * ----
  */
-static int
-CardWrite(Open8055_card_t *card, void *buffer)
+#ifdef _WIN32
+static DWORD WINAPI
+RecorderThreadMain(LPVOID arg)
 {
-    Open8055_hidMessage_t  *message;
+    RecorderRun((Open8055_recorder_t *)arg);
+    return 0;
+}
+#else
+static void *
+RecorderThreadMain(void *arg)
+{
+    RecorderRun((Open8055_recorder_t *)arg);
+    return NULL;
+}
+#endif
 
-    if (card->isLocal)
-    	return DeviceWrite(card, buffer);
 
-    message = (Open8055_hidMessage_t *)buffer;
-    switch (message->msgType)
+/* ----
+ * RecorderRun()
+ *
+ *  The writer thread. Collects entries from the ring into a block and
+ *  writes the block when it is full, or when nothing new arrived for
+ *  a while so that a crash loses little history.
+ * ----
+ */
+static void
+RecorderRun(Open8055_recorder_t *rec)
+{
+    Open8055_recordEntry_t *entry;
+    unsigned char          *out;
+    uint32_t                head = rec->ringHead;
+    uint32_t                tail;
+    int                     nrecords = 0;
+    int                     idle = 0;
+    int                     stopping;
+
+    for (;;)
     {
-	case OPEN8055_HID_MESSAGE_OUTPUT:
-		return CardWriteLine(card, "SEND %d %d %d %d %d %d %d %d %d %d %d %d %d\n",
-			message->msgType, message->outputBits,
-			htons(message->outputValue[0]), htons(message->outputValue[1]),
-			htons(message->outputValue[2]), htons(message->outputValue[3]),
-			htons(message->outputValue[4]), htons(message->outputValue[5]),
-			htons(message->outputValue[6]), htons(message->outputValue[7]),
-			htons(message->outputPwmValue[0]), htons(message->outputPwmValue[1]),
-			message->resetCounter);
+        stopping = AtomicLoad(&(rec->stop));
+        tail = AtomicLoad(&(rec->ringTail));
 
-	case OPEN8055_HID_MESSAGE_SETCONFIG1:
-		return CardWriteLine(card, "SEND %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d\n",
-			message->msgType,
-			message->modeADC[0], message->modeADC[1],
-			message->modeInput[0], message->modeInput[1], message->modeInput[2],
-			message->modeInput[3], message->modeInput[4],
-			message->modeOutput[0], message->modeOutput[1],
-			message->modeOutput[2], message->modeOutput[3],
-			message->modeOutput[4], message->modeOutput[5],
-			message->modeOutput[6], message->modeOutput[7],
-			message->modePWM[0], message->modePWM[1],
-			htons(message->debounceValue[0]), htons(message->debounceValue[1]),
-			htons(message->debounceValue[1]), htons(message->debounceValue[3]),
-			htons(message->debounceValue[4]),
-			message->cardAddress);
+        while (head != tail && nrecords < OPEN8055_RECORDING_BLOCK_MAX)
+        {
+            entry = &(rec->ring[head & (OPEN8055_RECORDER_RING_SIZE - 1)]);
+            out = rec->block + OPEN8055_RECORDING_BLOCK_SIZE +
+                  nrecords * OPEN8055_RECORDING_RECORD_SIZE;
+
+            memset(out, 0, 16);
+            PutLE64(out, entry->timestamp);
+            out[8] = (unsigned char)entry->direction;
+            memcpy(out + 16, &(entry->message), OPEN8055_HID_MESSAGE_SIZE);
+
+            head++;
+            nrecords++;
+            AtomicStore(&(rec->ringHead), head);
+        }
 
-	case OPEN8055_HID_MESSAGE_GETINPUT:
-	case OPEN8055_HID_MESSAGE_GETCONFIG:
-	case OPEN8055_HID_MESSAGE_SAVECONFIG:
-	case OPEN8055_HID_MESSAGE_SAVEALL:
-	case OPEN8055_HID_MESSAGE_RESET:
-		return CardWriteLine(card, "SEND %d\n", message->msgType);
+        /* ----
+         * After a write error we keep draining the ring but discard
+         * everything. Open8055_StopRecording() reports the error.
+         * ----
+         */
+        if (nrecords == OPEN8055_RECORDING_BLOCK_MAX ||
+            (nrecords > 0 && head == tail && (idle >= 10 || stopping)))
+        {
+            if (!rec->failed && RecorderWriteBlock(rec, nrecords) < 0)
+                rec->failed = TRUE;
+            nrecords = 0;
+            idle = 0;
+        }
 
-    	default:	
-		SetError(card, "CardWrite(): unknown message type 0x%02x", message->msgType);
-		return -1;
+        if (head != tail)
+            continue;
+        if (stopping && nrecords == 0)
+            break;
 
+        Open8055_Sleep(10);
+        idle++;
     }
-
-    return 0;
 }
 
 
 /* ----
- * CardWriteLine()
+ * RecorderWriteBlock()
  *
- *  Helper function for CardWrite() to format and send a server message.
+ *  Write the collected records as one block.
  * ----
  */
 static int
-CardWriteLine(Open8055_card_t *card, char *fmt, ...)
+RecorderWriteBlock(Open8055_recorder_t *rec, int nrecords)
 {
-    char	buf[256];
-    va_list     ap;
-
-    if (card->sock == INVALID_SOCKET)
-    {
-    	SetError(card, "CardWriteLine(): card is closed");
-	return -1;
-    }
+    uint32_t    dropped = AtomicLoad(&(rec->ringDropped));
+    size_t      len;
 
-    va_start(ap, fmt);
-    vsnprintf(buf, sizeof(buf), fmt, ap);
-    va_end(ap);
+    memcpy(rec->block, OPEN8055_RECORDING_BLOCK_MAGIC, 4);
+    PutLE32(rec->block + 4, rec->blockSeq++);
+    PutLE32(rec->block + 8, (uint32_t)nrecords);
+    PutLE32(rec->block + 12, dropped - rec->droppedWritten);
+    rec->droppedWritten = dropped;
 
-    if (send(card->sock, buf, strlen(buf), 0) != strlen(buf))
+    len = OPEN8055_RECORDING_BLOCK_SIZE + nrecords * OPEN8055_RECORDING_RECORD_SIZE;
+    if (fwrite(rec->block, len, 1, rec->fp) != 1 || fflush(rec->fp) != 0)
     {
-    	SetError(card, "send(): %s", ErrorString());
-	return -1;
+        snprintf(rec->errorMessage, sizeof(rec->errorMessage),
+                "recording write failed: %s", strerror(errno));
+        return -1;
     }
 
     return 0;
@@ -2443,32 +6433,30 @@ CardWriteLine(Open8055_card_t *card, char *fmt, ...)
 
 
 /* ----
- * CardClose()
+ * PutLE16(), PutLE32(), PutLE64()
  *
- *  Local/Remote card abstraction for close.
+ *  Store integers little endian.
  * ----
  */
-static int
-CardClose(Open8055_card_t *card)
+static void
+PutLE16(unsigned char *p, uint16_t val)
 {
-    char buf[256];
+    p[0] = (unsigned char)(val);
+    p[1] = (unsigned char)(val >> 8);
+}
 
-    if (card->isLocal)
-    	return DeviceClose(card);
+static void
+PutLE32(unsigned char *p, uint32_t val)
+{
+    PutLE16(p, (uint16_t)val);
+    PutLE16(p + 2, (uint16_t)(val >> 16));
+}
 
-    if (card->sock != INVALID_SOCKET)
-    {
-	send(card->sock, "quit\n", 5, 0);
-	while (recv(card->sock, buf, sizeof(buf), 0) > 0) {}
-	closesocket(card->sock);
-	card->sock = INVALID_SOCKET;
-	return 0;
-    }
-    else
-    {
-    	SetError(card, "Card already closed");
-	return -1;
-    }
+static void
+PutLE64(unsigned char *p, uint64_t val)
+{
+    PutLE32(p, (uint32_t)val);
+    PutLE32(p + 4, (uint32_t)(val >> 32));
 }
 
 
@@ -3363,6 +7351,228 @@ DeviceWrite(Open8055_card_t *card, void *buffer)
 }
 
 
+/* ----
+ * PollStart()
+ *
+ *  Create the wakeup descriptor of a local card and start the I/O
+ *  thread that reads the card on behalf of Open8055_Dispatch().
+ *  Called with the card locked.
+ * ----
+ */
+static int
+PollStart(Open8055_card_t *card)
+{
+#ifdef __linux__
+    if ((card->pollFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    {
+        SetError(card, "eventfd(): %s", ErrorString());
+        return -1;
+    }
+    card->pollFdWrite = card->pollFd;
+#else
+    int     fds[2];
+
+    if (pipe(fds) != 0)
+    {
+        SetError(card, "pipe(): %s", ErrorString());
+        return -1;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    card->pollFd = fds[0];
+    card->pollFdWrite = fds[1];
+#endif
+
+    pthread_cond_init(&(card->pollCond), NULL);
+
+    /* ----
+     * The thread holds a reference on the card until it sees
+     * cardClosed. This keeps Open8055_Close() waiting for it.
+     * ----
+     */
+    card->cardRefcount++;
+    card->pollThreadRunning = TRUE;
+    if (pthread_create(&(card->pollThread), NULL, PollThreadMain, (void *)card) != 0)
+    {
+        SetError(card, "pthread_create(): %s", ErrorString());
+        card->cardRefcount--;
+        card->pollThreadRunning = FALSE;
+        pthread_cond_destroy(&(card->pollCond));
+        close(card->pollFd);
+        if (card->pollFdWrite != card->pollFd)
+            close(card->pollFdWrite);
+        return -1;
+    }
+    card->pollThreadStarted = TRUE;
+
+    return 0;
+}
+
+
+/* ----
+ * PollStop()
+ *
+ *  Wait for the I/O thread to end and release its resources. The
+ *  thread ends on its own once cardClosed is set, and has dropped its
+ *  card reference when Open8055_Close() or Open8055_Reset() get here.
+ * ----
+ */
+static void
+PollStop(Open8055_card_t *card)
+{
+    if (!card->pollThreadStarted)
+        return;
+
+    pthread_join(card->pollThread, NULL);
+    pthread_cond_destroy(&(card->pollCond));
+    close(card->pollFd);
+    if (card->pollFdWrite != card->pollFd)
+        close(card->pollFdWrite);
+    card->pollThreadStarted = FALSE;
+}
+
+
+/* ----
+ * PollThreadMain()
+ *
+ *  I/O thread of a local card in poll mode. It keeps the interrupt
+ *  transfer going, queues every report and signals the wakeup
+ *  descriptor.
+ * ----
+ */
+static void *
+PollThreadMain(void *arg)
+{
+    Open8055_card_t         *card = (Open8055_card_t *)arg;
+    Open8055_hidMessage_t   message;
+    int                     rc;
+
+    LockAcquire(&(card->cardLock));
+    while (!card->cardClosed)
+    {
+        /* ----
+         * DeviceRead() releases the card lock while it waits, so
+         * the application can keep using the card meanwhile.
+         * ----
+         */
+        rc = DeviceRead(card, &message, 100);
+        if (rc < 0)
+            break;
+        if (rc > 0)
+        {
+            ReportQueuePut(card, &message);
+            PollSignal(card);
+        }
+    }
+
+    /* ----
+     * Wake up anyone waiting so they see the error or the close.
+     * ----
+     */
+    card->pollThreadRunning = FALSE;
+    PollSignal(card);
+    card->cardRefcount--;
+    LockRelease(&(card->cardLock));
+
+    return NULL;
+}
+
+
+/* ----
+ * PollWait()
+ *
+ *  CardRead() for a local card whose I/O thread is running. Waits
+ *  up to timeout milliseconds for the thread to queue a report.
+ * ----
+ */
+static int
+PollWait(Open8055_card_t *card, void *buffer, int timeout)
+{
+    struct timespec     deadline;
+
+    if (timeout < 0)
+        timeout = 0;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec  += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    while (card->reportQueueCount == 0)
+    {
+        /* ----
+         * If the thread died, DeviceRead() left the reason in the
+         * card's error message.
+         * ----
+         */
+        if (!card->pollThreadRunning)
+            return -1;
+        if (timeout == 0)
+            return 0;
+        if (pthread_cond_timedwait(&(card->pollCond), &(card->cardLock), &deadline) == ETIMEDOUT)
+        {
+            if (card->reportQueueCount == 0)
+                return 0;
+        }
+    }
+
+    return ReportQueueGet(card, buffer);
+}
+
+
+/* ----
+ * PollSignal()
+ *
+ *  Make the wakeup descriptor readable and wake up waiters.
+ * ----
+ */
+static void
+PollSignal(Open8055_card_t *card)
+{
+#ifdef __linux__
+    uint64_t    one = 1;
+
+    if (write(card->pollFdWrite, &one, sizeof(one)) < 0)
+    {
+        /* counter overflow (EAGAIN) just means it is readable already */
+    }
+#else
+    if (write(card->pollFdWrite, "x", 1) < 0)
+    {
+        /* a full pipe is readable as well */
+    }
+#endif
+    pthread_cond_broadcast(&(card->pollCond));
+}
+
+
+/* ----
+ * PollDrain()
+ *
+ *  Reset the wakeup descriptor before the queue is consumed.
+ * ----
+ */
+static void
+PollDrain(Open8055_card_t *card)
+{
+#ifdef __linux__
+    uint64_t    count;
+
+    if (read(card->pollFd, &count, sizeof(count)) < 0)
+    {
+        /* EAGAIN - nothing signaled */
+    }
+#else
+    char        buf[64];
+
+    while (read(card->pollFd, buf, sizeof(buf)) > 0) {}
+#endif
+}
+
+
 /* ----
  * ErrorString()
  *
@@ -42,8 +42,13 @@
 #include "open8055_hid_protocol.h"
 
 #include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 
 /* ----
@@ -54,30 +59,112 @@
 #define OPEN8055_VID    0x10cf
 #define OPEN8055_PID    0x55f0
 
+#define DEVICE_READ_RING		8		/* IN transfers kept submitted */
+#define DEVICE_REPORT_QUEUE		256		/* reports waiting to be read */
+#define DEVICE_WRITE_QUEUE		16		/* reports waiting to be written */
+#define DEVICE_WRITE_TIMES		256		/* write latencies kept */
+
+/* ----
+ * Every open card has an I/O thread that runs the libusb event
+ * handling. A ring of IN transfers stays submitted all the time, and
+ * whatever they receive goes into the reports queue until read() or
+ * read_many() picks it up. Writes go into the writes queue and are
+ * sent one after another through writeTransfer. Each finished one
+ * up to notifyDone writes a byte to the notify file descriptor, and
+ * the time from queueing it to being done goes into writeTimes. The
+ * lock protects all of it and cond is broadcast on every change.
+ * ----
+ */
 typedef struct Open8055Card
 {
 	pthread_mutex_t			lock;
+	pthread_cond_t			cond;
 	libusb_device_handle   *handle;
 	int						hadKernelDriver;
-	struct libusb_transfer *readTransfer;
-	int						readCompleted;
+
+	pthread_t				ioThread;
+	int						ioDone;			/* I/O thread may exit */
+	int						stopping;		/* the card is being closed */
+	int						inFlight;		/* transfers submitted */
+
+	struct libusb_transfer *readRing[DEVICE_READ_RING];
+	int						readActive[DEVICE_READ_RING];
+	unsigned char			readBuf[DEVICE_READ_RING][OPEN8055_HID_MESSAGE_SIZE];
+	int						readsActive;
+	unsigned char			reports[DEVICE_REPORT_QUEUE][OPEN8055_HID_MESSAGE_SIZE];
+	int						reportFirst;
+	int						reportCount;
+	char					readError[256];
+
 	struct libusb_transfer *writeTransfer;
-	int						writeCompleted;
+	unsigned char			writeBuf[OPEN8055_HID_MESSAGE_SIZE];
+	struct timeval			writeBufQueued;	/* when writeBuf was queued */
+	int						writeBusy;		/* writeTransfer submitted */
+	unsigned char			writes[DEVICE_WRITE_QUEUE][OPEN8055_HID_MESSAGE_SIZE];
+	struct timeval			writesQueued[DEVICE_WRITE_QUEUE];
+	int						writesKeep[DEVICE_WRITE_QUEUE];	/* not to be merged */
+	int						writeFirst;
+	int						writeCount;
+	unsigned long			writeQueued;	/* number of the last write queued */
+	unsigned long			writeDone;		/* number of the last one done */
+	unsigned long			notifyDone;		/* notify up to this one done */
+	char					writeError[256];
+	double					writeTimes[DEVICE_WRITE_TIMES];
+	int						writeTimeFirst;
+	int						writeTimeCount;
 } Open8055Card;
 
+/* ----
+ * The field layout of one HID report type for the text protocol.
+ * Each character of fields is one value, 'B' a byte and 'H' two
+ * bytes in network order.
+ * ----
+ */
+typedef struct
+{
+	long					msgType;
+	const char			   *fields;
+} DeviceReportLayout;
+
 
 /* ----
  * Local functions
  * ----
  */
 static int device_init(void);
-static int device_handle_events(Open8055Card *card, int *complete);
-static void device_transfer_callback(struct libusb_transfer *transfer);
+static void *device_io_thread(void *arg);
+static void device_stop(Open8055Card *card);
+static void device_release(Open8055Card *card, int interface);
+static int device_alloc_transfers(Open8055Card *card);
+static void device_free_transfers(Open8055Card *card);
+static void device_submit_reads_locked(Open8055Card *card);
+static void device_submit_write_locked(Open8055Card *card);
+static void device_check_done_locked(Open8055Card *card);
+static void device_write_done_locked(Open8055Card *card);
+static void device_read_callback(struct libusb_transfer *transfer);
+static void device_write_callback(struct libusb_transfer *transfer);
+static int device_get_reports(Open8055Card *card, unsigned char *buf,
+			int max, double timeout, char *errbuf, int errlen);
+static int device_put_write(Open8055Card *card, unsigned char *data,
+			int wait, int notify, unsigned long *number,
+			char *errbuf, int errlen);
+static const char *device_transfer_status(int status);
+static Open8055Card *device_get_card(int cardNumber);
 static PyObject *device_present(PyObject *self, PyObject *args);
 static PyObject *device_open(PyObject *self, PyObject *args);
 static PyObject *device_close(PyObject *self, PyObject *args);
 static PyObject *device_read(PyObject *self, PyObject *args);
+static PyObject *device_read_many(PyObject *self, PyObject *args);
 static PyObject *device_write(PyObject *self, PyObject *args);
+static PyObject *device_write_nowait(PyObject *self, PyObject *args);
+static PyObject *device_write_status(PyObject *self, PyObject *args);
+static PyObject *device_write_times(PyObject *self, PyObject *args);
+static PyObject *device_set_write_notify(PyObject *self, PyObject *args);
+static const char *device_find_layout(const DeviceReportLayout *layouts,
+			long msgType);
+static int device_parse_value(PyObject *item, long *value);
+static PyObject *device_format_recv(PyObject *self, PyObject *arg);
+static PyObject *device_parse_send(PyObject *self, PyObject *arg);
 
 #ifndef HAVE_LIBUSB_STRERROR
 static char *libusb_strerror(int errnum);
@@ -90,9 +177,33 @@ static char *libusb_strerror(int errnum);
  */
 static int				initialized = 0;
 static libusb_context  *libusbCxt;
+static int				deviceNotifyFd = -1;
 pthread_mutex_t			deviceGlobalLock = PTHREAD_MUTEX_INITIALIZER;
 Open8055Card			deviceCard[OPEN8055_MAX_CARDS];
 
+/* ----
+ * Report layouts for format_recv() and parse_send(). These must match
+ * RECV_FORMATS and SEND_FORMATS in open8055proto.py.
+ * ----
+ */
+static const DeviceReportLayout deviceRecvLayouts[] = {
+	{OPEN8055_HID_MESSAGE_INPUT,		"BBHHHHHHH"},
+	{OPEN8055_HID_MESSAGE_OUTPUT,		"BBHHHHHHHHHHB"},
+	{OPEN8055_HID_MESSAGE_SETCONFIG1,	"BBBBBBBBBBBBBBBBBBHHHHHB"},
+	{0, NULL}
+};
+
+static const DeviceReportLayout deviceSendLayouts[] = {
+	{OPEN8055_HID_MESSAGE_OUTPUT,		"BBHHHHHHHHHHB"},
+	{OPEN8055_HID_MESSAGE_GETINPUT,		"B"},
+	{OPEN8055_HID_MESSAGE_SETCONFIG1,	"BBBBBBBBBBBBBBBBBBHHHHHB"},
+	{OPEN8055_HID_MESSAGE_GETCONFIG,	"B"},
+	{OPEN8055_HID_MESSAGE_SAVECONFIG,	"B"},
+	{OPEN8055_HID_MESSAGE_SAVEALL,		"B"},
+	{OPEN8055_HID_MESSAGE_RESET,		"B"},
+	{0, NULL}
+};
+
 
 static PyMethodDef device_methods[] = {
 	{"present", device_present, METH_VARARGS, 
@@ -103,8 +214,22 @@ static PyMethodDef device_methods[] = {
 			"Close a Open8055"},
 	{"read", device_read, METH_VARARGS, 
 			"Read an HID report from a Open8055"},
+	{"read_many", device_read_many, METH_VARARGS,
+			"Read all waiting HID reports from a Open8055, up to a maximum"},
 	{"write", device_write, METH_VARARGS, 
 			"Write an HID report to a Open8055"},
+	{"write_nowait", device_write_nowait, METH_VARARGS,
+			"Queue an HID report for a Open8055 without waiting"},
+	{"write_status", device_write_status, METH_VARARGS,
+			"Get the number of the last write done and its error"},
+	{"write_times", device_write_times, METH_VARARGS,
+			"Get the seconds from queueing to done of the writes since the last call"},
+	{"set_write_notify", device_set_write_notify, METH_VARARGS,
+			"Set the file descriptor write completions are signaled on"},
+	{"format_recv", device_format_recv, METH_O,
+			"Format an HID report as text protocol RECV line"},
+	{"parse_send", device_parse_send, METH_O,
+			"Convert the arguments of a text protocol SEND line into an HID report"},
 	{NULL, NULL, 0, NULL}
 };
 
@@ -141,9 +266,11 @@ device_init(void)
 
 	for (i = 0; i < OPEN8055_MAX_CARDS; i++)
 	{
-		if (pthread_mutex_init(&(deviceCard[i].lock), NULL) != 0)
+		if (pthread_mutex_init(&(deviceCard[i].lock), NULL) != 0 ||
+			pthread_cond_init(&(deviceCard[i].cond), NULL) != 0)
 		{
 			PyErr_SetString(PyExc_RuntimeError, "pthread_mutex_init() failed");
+			pthread_mutex_unlock(&deviceGlobalLock);
 			return -1;
 		}
 	}
@@ -155,250 +282,743 @@ device_init(void)
 
 
 /* ----
- * device_handle_events()
+ * device_io_thread()
  *
- *	Function called by device_read() and device_write() to perform
- *	the multi-thread correct event handling.
+ *	Handle libusb events until the card is closed. Whichever of the
+ *	card threads gets the libusb event lock runs the callbacks of all
+ *	cards; the others wait for it and only check if they are done.
  * ----
  */
-static int
-device_handle_events(Open8055Card *card, int *completed)
+static void *
+device_io_thread(void *arg)
 {
-	int				rc = 0;
+	Open8055Card   *card = (Open8055Card *)arg;
 	struct timeval	tv;
+	int				done;
+	int				rc;
 
-	Py_BEGIN_ALLOW_THREADS
-
-	while (!*completed && rc == 0)
+	for (;;)
 	{
-		if (libusb_try_lock_events(libusbCxt) == 0)
-		{
-			/* ----
-			 * We got the event lock, so we are the event handler.
-			 * ----
-			 */
-			while(!*completed)
-			{
-				if (!libusb_event_handling_ok(libusbCxt))
-				{
-					libusb_unlock_events(libusbCxt);
-					break;
-				}
-
-				tv.tv_sec = 1;
-				tv.tv_usec = 0;
-				rc = libusb_handle_events_locked(libusbCxt, &tv);
-				if (rc != 0)
-					break;
-			}
-			libusb_unlock_events(libusbCxt);
-		}
-		else
+		pthread_mutex_lock(&(card->lock));
+		done = card->ioDone;
+		pthread_mutex_unlock(&(card->lock));
+		if (done)
+			break;
+
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		rc = libusb_handle_events_timeout_completed(libusbCxt, &tv,
+				&(card->ioDone));
+		if (rc != 0 && rc != LIBUSB_ERROR_INTERRUPTED &&
+			rc != LIBUSB_ERROR_TIMEOUT)
 		{
-			/* ----
-			 * Somebody else is handling events ... wait for them.
-			 * ----
-			 */
-			libusb_lock_event_waiters(libusbCxt);
-			while (!completed)
-			{
-				/* ----
-				 * Now that we have the waiters lock, recheck that
-				 * somebody is really processing events.
-				 * ----
-				 */
-				if (!libusb_event_handler_active(libusbCxt))
-					break;
-				
-				/* ----
-				 * OK to really wait now.
-				 * ----
-				 */
-				libusb_wait_for_event(libusbCxt, NULL);
-			}
-			libusb_unlock_event_waiters(libusbCxt);
+			pthread_mutex_lock(&(card->lock));
+			if (card->readError[0] == '\0')
+				snprintf(card->readError, sizeof(card->readError),
+						"libusb_handle_events(): %s", libusb_strerror(rc));
+			pthread_cond_broadcast(&(card->cond));
+			pthread_mutex_unlock(&(card->lock));
 		}
 	}
 
-	Py_END_ALLOW_THREADS
+	return NULL;
+}
 
-	return rc;
+
+/* ----
+ * device_stop()
+ *
+ *	Let the writes still queued finish, cancel the reads and stop the
+ *	I/O thread. Called without the GIL.
+ * ----
+ */
+static void
+device_stop(Open8055Card *card)
+{
+	int		i;
+
+	pthread_mutex_lock(&(card->lock));
+	while ((card->writeBusy || card->writeCount > 0) &&
+		   card->writeError[0] == '\0')
+		pthread_cond_wait(&(card->cond), &(card->lock));
+
+	card->stopping = TRUE;
+	for (i = 0; i < DEVICE_READ_RING; i++)
+	{
+		if (card->readActive[i])
+			libusb_cancel_transfer(card->readRing[i]);
+	}
+	if (card->writeBusy)
+		libusb_cancel_transfer(card->writeTransfer);
+	device_check_done_locked(card);
+	pthread_cond_broadcast(&(card->cond));
+
+	while (!card->ioDone)
+		pthread_cond_wait(&(card->cond), &(card->lock));
+	pthread_mutex_unlock(&(card->lock));
+
+	pthread_join(card->ioThread, NULL);
 }
 
 
 /* ----
- * device_transfer_callback()
+ * device_release()
  *
- *	Function called by libusb when a transfer has finished.
+ *	Give the device back to the system and free the transfers.
  * ----
  */
 static void
-device_transfer_callback(struct libusb_transfer *transfer)
+device_release(Open8055Card *card, int interface)
 {
-	int *completed = (int *)(transfer->user_data);
+	libusb_release_interface(card->handle, interface);
+	if (card->hadKernelDriver)
+		libusb_attach_kernel_driver(card->handle, interface);
+	libusb_close(card->handle);
+	device_free_transfers(card);
 
-	*completed = TRUE;
+	card->handle = NULL;
 }
 
 
 /* ----
- * device_present()
+ * device_alloc_transfers()
  *
- *	Check if a given Open8055 card is present in the system without
- *	actually opening it.
+ *	Allocate the libusb asynchronous transfer structures of a card and
+ *	reset its queues.
  * ----
  */
-static PyObject *
-device_present(PyObject *self, PyObject *args)
+static int
+device_alloc_transfers(Open8055Card *card)
 {
-	int								cardNumber = 0;
-	int								cardFound = 0;
-	int								numDevices;
-	struct libusb_device		  **deviceList;
-	struct libusb_device_descriptor	deviceDesc;
-	int								i;
-	char							errbuf[1024];
+	int		i;
 
-	/* ----
-	 * Parse command args
-	 * ----
-	 */
-	if (!PyArg_ParseTuple(args, "i", &cardNumber))
-		return NULL;
+	for (i = 0; i < DEVICE_READ_RING; i++)
+	{
+		card->readActive[i] = FALSE;
+		if ((card->readRing[i] = libusb_alloc_transfer(0)) == NULL)
+		{
+			device_free_transfers(card);
+			return -1;
+		}
+	}
+	if ((card->writeTransfer = libusb_alloc_transfer(0)) == NULL)
+	{
+		device_free_transfers(card);
+		return -1;
+	}
 
-	/* ----
-	 * Get the list of USB devices in the system.
-	 * ----
-	 */
-	numDevices = libusb_get_device_list(libusbCxt, &deviceList);
-	if (numDevices < 0)
+	card->ioDone = FALSE;
+	card->stopping = FALSE;
+	card->inFlight = 0;
+	card->readsActive = 0;
+	card->reportFirst = 0;
+	card->reportCount = 0;
+	card->readError[0] = '\0';
+	card->writeBusy = FALSE;
+	card->writeFirst = 0;
+	card->writeCount = 0;
+	card->writeQueued = 0;
+	card->writeDone = 0;
+	card->notifyDone = 0;
+	card->writeError[0] = '\0';
+	card->writeTimeFirst = 0;
+	card->writeTimeCount = 0;
+
+	return 0;
+}
+
+
+/* ----
+ * device_free_transfers()
+ * ----
+ */
+static void
+device_free_transfers(Open8055Card *card)
+{
+	int		i;
+
+	for (i = 0; i < DEVICE_READ_RING; i++)
 	{
-		snprintf(errbuf, sizeof(errbuf),
-				"libusb_get_device_list() failed - %s", 
-				libusb_strerror(numDevices));
-		PyErr_SetString(PyExc_RuntimeError, errbuf);
-		return NULL;
+		if (card->readRing[i] != NULL)
+			libusb_free_transfer(card->readRing[i]);
+		card->readRing[i] = NULL;
 	}
+	if (card->writeTransfer != NULL)
+		libusb_free_transfer(card->writeTransfer);
+	card->writeTransfer = NULL;
+}
 
-	/* ----
-	 * See if any of them is the Open8055 we are looking for.
-	 * ----
-	 */
-	for (i = 0; i < numDevices; i++)
+
+/* ----
+ * device_submit_reads_locked()
+ *
+ *	Submit every IN transfer of the ring that isn't, as long as the
+ *	reports queue has room for what they will bring. A reader that
+ *	falls behind thus leaves the reports in the card instead of
+ *	having them dropped here.
+ * ----
+ */
+static void
+device_submit_reads_locked(Open8055Card *card)
+{
+	int		i;
+	int		rc;
+
+	for (i = 0; i < DEVICE_READ_RING; i++)
 	{
-		if (libusb_get_device_descriptor(deviceList[i], &deviceDesc) != 0)
+		if (card->stopping || card->readError[0] != '\0' ||
+			card->reportCount + card->readsActive >= DEVICE_REPORT_QUEUE)
+			return;
+		if (card->readActive[i])
+			continue;
+
+		libusb_fill_interrupt_transfer(card->readRing[i], card->handle,
+				LIBUSB_ENDPOINT_IN | 1, card->readBuf[i],
+				OPEN8055_HID_MESSAGE_SIZE,
+				device_read_callback, (void *)card, 0);
+		if ((rc = libusb_submit_transfer(card->readRing[i])) != 0)
 		{
-			snprintf(errbuf, sizeof(errbuf),
-					"libusb_get_device_descriptor() failed - %s", 
-					libusb_strerror(numDevices));
-			PyErr_SetString(PyExc_RuntimeError, errbuf);
-			libusb_free_device_list(deviceList, 1);
-			return NULL;
+			snprintf(card->readError, sizeof(card->readError),
+					"libusb_submit_transfer(): %s", libusb_strerror(rc));
+			pthread_cond_broadcast(&(card->cond));
+			return;
 		}
-		
-		if (deviceDesc.idVendor == OPEN8055_VID &&
-			deviceDesc.idProduct == OPEN8055_PID + cardNumber)
+		card->readActive[i] = TRUE;
+		card->readsActive++;
+		card->inFlight++;
+	}
+}
+
+
+/* ----
+ * device_submit_write_locked()
+ *
+ *	Start sending the oldest queued write unless one is on its way.
+ * ----
+ */
+static void
+device_submit_write_locked(Open8055Card *card)
+{
+	int		rc;
+
+	while (!card->writeBusy && card->writeCount > 0 && !card->stopping)
+	{
+		memcpy(card->writeBuf, card->writes[card->writeFirst],
+				OPEN8055_HID_MESSAGE_SIZE);
+		card->writeBufQueued = card->writesQueued[card->writeFirst];
+		card->writeFirst = (card->writeFirst + 1) % DEVICE_WRITE_QUEUE;
+		card->writeCount--;
+
+		libusb_fill_interrupt_transfer(card->writeTransfer, card->handle,
+				LIBUSB_ENDPOINT_OUT | 1, card->writeBuf,
+				OPEN8055_HID_MESSAGE_SIZE,
+				device_write_callback, (void *)card, 0);
+		if ((rc = libusb_submit_transfer(card->writeTransfer)) != 0)
 		{
-			cardFound = 1;
-			break;
+			snprintf(card->writeError, sizeof(card->writeError),
+					"libusb_submit_transfer(): %s", libusb_strerror(rc));
+			device_write_done_locked(card);
+			pthread_cond_broadcast(&(card->cond));
+			continue;
 		}
+		card->writeBusy = TRUE;
+		card->inFlight++;
 	}
+}
 
-	/* ----
-	 * Cleanup and return result.
-	 * ----
-	 */
-	libusb_free_device_list(deviceList, 1);
-	return Py_BuildValue("i", cardFound);
+
+/* ----
+ * device_check_done_locked()
+ *
+ *	Once a card being closed has no more transfers in flight, its
+ *	I/O thread is done.
+ * ----
+ */
+static void
+device_check_done_locked(Open8055Card *card)
+{
+	if (card->stopping && card->inFlight == 0)
+		card->ioDone = TRUE;
 }
 
 
 /* ----
- * device_open()
+ * device_write_done_locked()
  *
- *	Open a specific Open8055 by board number.
+ *	Count one more write as done, and tell whoever asked for it
+ *	through the notify file descriptor. That is non-blocking, a full
+ *	one has a wakeup pending anyway.
  * ----
  */
-static PyObject *
-device_open(PyObject *self, PyObject *args)
+static void
+device_write_done_locked(Open8055Card *card)
 {
-	int						cardNumber;
-	Open8055Card		   *card;
-	libusb_device_handle   *dev;
-	int						rc;
-	int						interface = 0;
-	char					errbuf[1024];
+	card->writeDone++;
+	if (card->writeDone <= card->notifyDone && deviceNotifyFd >= 0)
+	{
+		if (write(deviceNotifyFd, "x", 1) != 1)
+			return;		/* full, so a wakeup is pending */
+	}
+}
 
-	/* ----
-	 * Parse command arguments
-	 * ----
-	 */
-	if (!PyArg_ParseTuple(args, "i", &cardNumber))
-		return NULL;
-	if (cardNumber < 0 || cardNumber >= OPEN8055_MAX_CARDS)
+
+/* ----
+ * device_read_callback()
+ *
+ *	Called by libusb when an IN transfer of the ring has finished.
+ *	Queues the report and submits the transfer again.
+ * ----
+ */
+static void
+device_read_callback(struct libusb_transfer *transfer)
+{
+	Open8055Card   *card = (Open8055Card *)(transfer->user_data);
+	int				slot;
+	int				i;
+
+	pthread_mutex_lock(&(card->lock));
+
+	for (i = 0; i < DEVICE_READ_RING; i++)
 	{
-		PyErr_SetString(PyExc_ValueError, "invalid card number");
-		return NULL;
+		if (card->readRing[i] == transfer)
+			card->readActive[i] = FALSE;
 	}
+	card->readsActive--;
+	card->inFlight--;
 
-	/* ----
-	 * Sanity checks
-	 * ----
-	 */
-	if (deviceCard[cardNumber].handle != NULL)
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
 	{
-		PyErr_SetString(PyExc_RuntimeError, "card already open");
-		return NULL;
+		slot = (card->reportFirst + card->reportCount) % DEVICE_REPORT_QUEUE;
+		memcpy(card->reports[slot], transfer->buffer,
+				OPEN8055_HID_MESSAGE_SIZE);
+		card->reportCount++;
+		device_submit_reads_locked(card);
+	}
+	else if (!card->stopping && card->readError[0] == '\0')
+	{
+		snprintf(card->readError, sizeof(card->readError),
+				"asynchronous transfer failed: %s",
+				device_transfer_status(transfer->status));
 	}
 
-	if (device_present(self, args) == NULL)
-		return NULL;
+	device_check_done_locked(card);
+	pthread_cond_broadcast(&(card->cond));
+	pthread_mutex_unlock(&(card->lock));
+}
 
-	/* ----
-	 * Allocate the libusb asynchronous transfer structures.
-	 * ----
-	 */
-	card = &deviceCard[cardNumber];
-	if ((card->readTransfer = libusb_alloc_transfer(0)) == NULL)
+
+/* ----
+ * device_write_callback()
+ *
+ *	Called by libusb when the OUT transfer has finished. Sends the
+ *	next queued write, if any.
+ * ----
+ */
+static void
+device_write_callback(struct libusb_transfer *transfer)
+{
+	Open8055Card   *card = (Open8055Card *)(transfer->user_data);
+	struct timeval	now;
+	int				slot;
+
+	gettimeofday(&now, NULL);
+	pthread_mutex_lock(&(card->lock));
+
+	card->writeBusy = FALSE;
+	card->inFlight--;
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
 	{
-		PyErr_SetString(PyExc_RuntimeError, "libusb_alloc_transfer() failed");
-		return NULL;
+		if (card->writeTimeCount == DEVICE_WRITE_TIMES)
+		{
+			card->writeTimeFirst = (card->writeTimeFirst + 1) %
+					DEVICE_WRITE_TIMES;
+			card->writeTimeCount--;
+		}
+		slot = (card->writeTimeFirst + card->writeTimeCount) %
+				DEVICE_WRITE_TIMES;
+		card->writeTimes[slot] =
+				(double)(now.tv_sec - card->writeBufQueued.tv_sec) +
+				(double)(now.tv_usec - card->writeBufQueued.tv_usec) / 1000000.0;
+		card->writeTimeCount++;
 	}
-	if ((card->writeTransfer = libusb_alloc_transfer(0)) == NULL)
+	else if (!card->stopping)
 	{
-		PyErr_SetString(PyExc_RuntimeError, "libusb_alloc_transfer() failed");
-		libusb_free_transfer(card->readTransfer);
-		return NULL;
+		snprintf(card->writeError, sizeof(card->writeError),
+				"asynchronous transfer failed: %s",
+				device_transfer_status(transfer->status));
 	}
+	device_write_done_locked(card);
+	device_submit_write_locked(card);
 
-	/* ----
-	 * Open the device.
-	 * ----
-	 */
-	dev = libusb_open_device_with_vid_pid(
-			libusbCxt, OPEN8055_VID, OPEN8055_PID + cardNumber);
-	if (dev == NULL)
+	device_check_done_locked(card);
+	pthread_cond_broadcast(&(card->cond));
+	pthread_mutex_unlock(&(card->lock));
+}
+
+
+/* ----
+ * device_get_reports()
+ *
+ *	Take up to max reports off the queue of a card, waiting up to
+ *	timeout seconds (forever if negative) for the first one. Returns
+ *	their number, 0 on timeout, or -1 with the message in errbuf once
+ *	the queue is empty and reading failed. Called without the GIL.
+ * ----
+ */
+static int
+device_get_reports(Open8055Card *card, unsigned char *buf, int max,
+			double timeout, char *errbuf, int errlen)
+{
+	struct timeval	now;
+	struct timespec	deadline;
+	int				n = 0;
+
+	if (timeout >= 0.0)
 	{
-		PyErr_SetString(PyExc_RuntimeError,
-				"libusb_open_device_with_vid_pid() failed");
-		libusb_free_transfer(card->readTransfer);
-		libusb_free_transfer(card->writeTransfer);
-		return NULL;
+		gettimeofday(&now, NULL);
+		deadline.tv_sec = now.tv_sec + (time_t)timeout;
+		deadline.tv_nsec = now.tv_usec * 1000 +
+				(long)((timeout - (time_t)timeout) * 1000000000.0);
+		if (deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
 	}
 
-	/* ----
-	 * If a kernel driver is active, detach it.
-	 * ----
-	 */
-	if ((rc = libusb_kernel_driver_active(dev, interface)) < 0)
+	pthread_mutex_lock(&(card->lock));
+
+	while (card->reportCount == 0 && card->readError[0] == '\0' &&
+		   !card->stopping)
 	{
-		snprintf(errbuf, sizeof(errbuf),
-				"libusb_kernel_driver_active() failed - %s", 
-				libusb_strerror(rc));
-		PyErr_SetString(PyExc_RuntimeError, errbuf);
-		libusb_close(dev);
-		libusb_free_transfer(card->readTransfer);
-		libusb_free_transfer(card->writeTransfer);
+		if (timeout < 0.0)
+			pthread_cond_wait(&(card->cond), &(card->lock));
+		else if (pthread_cond_timedwait(&(card->cond), &(card->lock),
+					&deadline) == ETIMEDOUT)
+			break;
+	}
+
+	while (n < max && card->reportCount > 0)
+	{
+		memcpy(buf + n * OPEN8055_HID_MESSAGE_SIZE,
+				card->reports[card->reportFirst], OPEN8055_HID_MESSAGE_SIZE);
+		card->reportFirst = (card->reportFirst + 1) % DEVICE_REPORT_QUEUE;
+		card->reportCount--;
+		n++;
+	}
+
+	if (n > 0)
+		device_submit_reads_locked(card);
+	else if (card->stopping)
+	{
+		snprintf(errbuf, errlen, "card closed");
+		n = -1;
+	}
+	else if (card->readError[0] != '\0')
+	{
+		snprintf(errbuf, errlen, "%s", card->readError);
+		n = -1;
+	}
+
+	pthread_mutex_unlock(&(card->lock));
+	return n;
+}
+
+
+/* ----
+ * device_put_write()
+ *
+ *	Queue one report for the card. If the newest queued one is of the
+ *	same type, it is replaced instead, since the card would only have
+ *	acted on it to be overridden right after. That is not done to a
+ *	report someone waits to be notified of, or an OUTPUT that resets
+ *	counters, since those have to reach the card. The write's number is
+ *	returned in *number. With wait the call returns once the report
+ *	was sent. Without it a full queue returns 0 with nothing queued,
+ *	and the notify file descriptor is signaled once there is room.
+ *	With notify it is also signaled when this write is done. Returns
+ *	1 once queued, -1 with the message in errbuf on failure. A failure
+ *	of a write that was not waited for is returned by the next call.
+ *	Called without the GIL.
+ * ----
+ */
+static int
+device_put_write(Open8055Card *card, unsigned char *data, int wait,
+			int notify, unsigned long *number, char *errbuf, int errlen)
+{
+	struct timeval	queued;
+	int				keep;
+	int				last;
+	int				rc = 1;
+
+	keep = notify || (data[0] == OPEN8055_HID_MESSAGE_OUTPUT &&
+			data[offsetof(Open8055_hidMessage_t, resetCounter)] != 0);
+	gettimeofday(&queued, NULL);
+	pthread_mutex_lock(&(card->lock));
+
+	for (;;)
+	{
+		if (card->writeError[0] != '\0')
+		{
+			snprintf(errbuf, errlen, "%s", card->writeError);
+			card->writeError[0] = '\0';
+			pthread_mutex_unlock(&(card->lock));
+			return -1;
+		}
+		if (card->stopping)
+		{
+			snprintf(errbuf, errlen, "card closed");
+			pthread_mutex_unlock(&(card->lock));
+			return -1;
+		}
+
+		last = (card->writeFirst + card->writeCount - 1) % DEVICE_WRITE_QUEUE;
+		if (card->writeCount > 0 && card->writes[last][0] == data[0] &&
+			!card->writesKeep[last])
+		{
+			memcpy(card->writes[last], data, OPEN8055_HID_MESSAGE_SIZE);
+			card->writesQueued[last] = queued;
+			card->writesKeep[last] = keep;
+			*number = card->writeQueued;
+			break;
+		}
+		if (card->writeCount < DEVICE_WRITE_QUEUE)
+		{
+			last = (card->writeFirst + card->writeCount) % DEVICE_WRITE_QUEUE;
+			memcpy(card->writes[last], data, OPEN8055_HID_MESSAGE_SIZE);
+			card->writesQueued[last] = queued;
+			card->writesKeep[last] = keep;
+			card->writeCount++;
+			*number = ++card->writeQueued;
+			break;
+		}
+		if (!wait)
+		{
+			if (card->notifyDone < card->writeDone + 1)
+				card->notifyDone = card->writeDone + 1;
+			*number = 0;
+			pthread_mutex_unlock(&(card->lock));
+			return 0;
+		}
+		pthread_cond_wait(&(card->cond), &(card->lock));
+	}
+
+	if (notify && card->notifyDone < *number)
+		card->notifyDone = *number;
+	device_submit_write_locked(card);
+
+	if (wait)
+	{
+		while (card->writeDone < *number && card->writeError[0] == '\0' &&
+			   !card->stopping)
+			pthread_cond_wait(&(card->cond), &(card->lock));
+		if (card->writeError[0] != '\0')
+		{
+			snprintf(errbuf, errlen, "%s", card->writeError);
+			card->writeError[0] = '\0';
+			rc = -1;
+		}
+	}
+
+	pthread_mutex_unlock(&(card->lock));
+	return rc;
+}
+
+
+/* ----
+ * device_transfer_status()
+ * ----
+ */
+static const char *
+device_transfer_status(int status)
+{
+	switch (status)
+	{
+		case LIBUSB_TRANSFER_ERROR:			return "transfer error";
+		case LIBUSB_TRANSFER_TIMED_OUT:		return "timed out";
+		case LIBUSB_TRANSFER_CANCELLED:		return "cancelled";
+		case LIBUSB_TRANSFER_STALL:			return "endpoint stalled";
+		case LIBUSB_TRANSFER_NO_DEVICE:		return "device disconnected";
+		case LIBUSB_TRANSFER_OVERFLOW:		return "overflow";
+		default:							return "unknown reason";
+	}
+}
+
+
+/* ----
+ * device_get_card()
+ *
+ *	Check a card number given by Python and return the open card.
+ * ----
+ */
+static Open8055Card *
+device_get_card(int cardNumber)
+{
+	if (cardNumber < 0 || cardNumber >= OPEN8055_MAX_CARDS)
+	{
+		PyErr_SetString(PyExc_ValueError, "invalid card number");
+		return NULL;
+	}
+	if (deviceCard[cardNumber].handle == NULL)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "card not open");
+		return NULL;
+	}
+	return &deviceCard[cardNumber];
+}
+
+/* ----
+ * device_present()
+ *
+ *	Check if a given Open8055 card is present in the system without
+ *	actually opening it.
+ * ----
+ */
+static PyObject *
+device_present(PyObject *self, PyObject *args)
+{
+	int								cardNumber = 0;
+	int								cardFound = 0;
+	int								numDevices;
+	struct libusb_device		  **deviceList;
+	struct libusb_device_descriptor	deviceDesc;
+	int								i;
+	char							errbuf[1024];
+
+	/* ----
+	 * Parse command args
+	 * ----
+	 */
+	if (!PyArg_ParseTuple(args, "i", &cardNumber))
+		return NULL;
+
+	/* ----
+	 * Get the list of USB devices in the system.
+	 * ----
+	 */
+	numDevices = libusb_get_device_list(libusbCxt, &deviceList);
+	if (numDevices < 0)
+	{
+		snprintf(errbuf, sizeof(errbuf),
+				"libusb_get_device_list() failed - %s", 
+				libusb_strerror(numDevices));
+		PyErr_SetString(PyExc_RuntimeError, errbuf);
+		return NULL;
+	}
+
+	/* ----
+	 * See if any of them is the Open8055 we are looking for.
+	 * ----
+	 */
+	for (i = 0; i < numDevices; i++)
+	{
+		if (libusb_get_device_descriptor(deviceList[i], &deviceDesc) != 0)
+		{
+			snprintf(errbuf, sizeof(errbuf),
+					"libusb_get_device_descriptor() failed - %s", 
+					libusb_strerror(numDevices));
+			PyErr_SetString(PyExc_RuntimeError, errbuf);
+			libusb_free_device_list(deviceList, 1);
+			return NULL;
+		}
+		
+		if (deviceDesc.idVendor == OPEN8055_VID &&
+			deviceDesc.idProduct == OPEN8055_PID + cardNumber)
+		{
+			cardFound = 1;
+			break;
+		}
+	}
+
+	/* ----
+	 * Cleanup and return result.
+	 * ----
+	 */
+	libusb_free_device_list(deviceList, 1);
+	return Py_BuildValue("i", cardFound);
+}
+
+
+
+/* ----
+ * device_open()
+ *
+ *	Open a specific Open8055 by board number and start its I/O
+ *	thread.
+ * ----
+ */
+static PyObject *
+device_open(PyObject *self, PyObject *args)
+{
+	int						cardNumber;
+	Open8055Card		   *card;
+	libusb_device_handle   *dev;
+	int						rc;
+	int						interface = 0;
+	char					errbuf[1024];
+
+	/* ----
+	 * Parse command arguments
+	 * ----
+	 */
+	if (!PyArg_ParseTuple(args, "i", &cardNumber))
+		return NULL;
+	if (cardNumber < 0 || cardNumber >= OPEN8055_MAX_CARDS)
+	{
+		PyErr_SetString(PyExc_ValueError, "invalid card number");
+		return NULL;
+	}
+
+	/* ----
+	 * Sanity checks
+	 * ----
+	 */
+	if (deviceCard[cardNumber].handle != NULL)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "card already open");
+		return NULL;
+	}
+
+	if (device_present(self, args) == NULL)
+		return NULL;
+
+	/* ----
+	 * Allocate the libusb asynchronous transfer structures.
+	 * ----
+	 */
+	card = &deviceCard[cardNumber];
+	if (device_alloc_transfers(card) < 0)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "libusb_alloc_transfer() failed");
+		return NULL;
+	}
+
+	/* ----
+	 * Open the device.
+	 * ----
+	 */
+	dev = libusb_open_device_with_vid_pid(
+			libusbCxt, OPEN8055_VID, OPEN8055_PID + cardNumber);
+	if (dev == NULL)
+	{
+		PyErr_SetString(PyExc_RuntimeError,
+				"libusb_open_device_with_vid_pid() failed");
+		device_free_transfers(card);
+		return NULL;
+	}
+
+	/* ----
+	 * If a kernel driver is active, detach it.
+	 * ----
+	 */
+	if ((rc = libusb_kernel_driver_active(dev, interface)) < 0)
+	{
+		snprintf(errbuf, sizeof(errbuf),
+				"libusb_kernel_driver_active() failed - %s", 
+				libusb_strerror(rc));
+		PyErr_SetString(PyExc_RuntimeError, errbuf);
+		libusb_close(dev);
+		device_free_transfers(card);
 		return NULL;
 	}
 	else
@@ -413,8 +1033,7 @@ device_open(PyObject *self, PyObject *args)
 						libusb_strerror(rc));
 				PyErr_SetString(PyExc_RuntimeError, errbuf);
 				libusb_close(dev);
-				libusb_free_transfer(card->readTransfer);
-				libusb_free_transfer(card->writeTransfer);
+				device_free_transfers(card);
 				return NULL;
 			}
 		}
@@ -433,8 +1052,7 @@ device_open(PyObject *self, PyObject *args)
 		if (deviceCard[cardNumber].hadKernelDriver)
 			libusb_attach_kernel_driver(dev, interface);
 		libusb_close(dev);
-		libusb_free_transfer(card->readTransfer);
-		libusb_free_transfer(card->writeTransfer);
+		device_free_transfers(card);
 		return NULL;
 	}
 
@@ -451,8 +1069,7 @@ device_open(PyObject *self, PyObject *args)
 		if (deviceCard[cardNumber].hadKernelDriver)
 			libusb_attach_kernel_driver(dev, interface);
 		libusb_close(dev);
-		libusb_free_transfer(card->readTransfer);
-		libusb_free_transfer(card->writeTransfer);
+		device_free_transfers(card);
 		return NULL;
 	}
 
@@ -470,13 +1087,38 @@ device_open(PyObject *self, PyObject *args)
 		if (deviceCard[cardNumber].hadKernelDriver)
 			libusb_attach_kernel_driver(dev, interface);
 		libusb_close(dev);
-		libusb_free_transfer(card->readTransfer);
-		libusb_free_transfer(card->writeTransfer);
+		device_free_transfers(card);
 		return NULL;
 	}
 
 	deviceCard[cardNumber].handle = dev;
 
+	/* ----
+	 * Start the I/O thread and fill the ring of IN transfers.
+	 * ----
+	 */
+	if (pthread_create(&(card->ioThread), NULL, device_io_thread, card) != 0)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "pthread_create() failed");
+		device_release(card, interface);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&(card->lock));
+	device_submit_reads_locked(card);
+	snprintf(errbuf, sizeof(errbuf), "%s", card->readError);
+	pthread_mutex_unlock(&(card->lock));
+
+	if (errbuf[0] != '\0')
+	{
+		PyErr_SetString(PyExc_IOError, errbuf);
+		Py_BEGIN_ALLOW_THREADS
+		device_stop(card);
+		Py_END_ALLOW_THREADS
+		device_release(card, interface);
+		return NULL;
+	}
+
 	return Py_BuildValue("i", cardNumber);
 }
 
@@ -490,8 +1132,9 @@ device_open(PyObject *self, PyObject *args)
 static PyObject *
 device_close(PyObject *self, PyObject *args)
 {
-	int		cardNumber = 0;
-	int		interface = 0;
+	int				cardNumber = 0;
+	int				interface = 0;
+	Open8055Card   *card;
 
 	/* ----
 	 * Parse command arguments
@@ -499,25 +1142,14 @@ device_close(PyObject *self, PyObject *args)
 	 */
 	if (!PyArg_ParseTuple(args, "i", &cardNumber))
 		return NULL;
-	if (cardNumber < 0 || cardNumber >= OPEN8055_MAX_CARDS)
-	{
-		PyErr_SetString(PyExc_ValueError, "invalid card number");
+	if ((card = device_get_card(cardNumber)) == NULL)
 		return NULL;
-	}
-	if (deviceCard[cardNumber].handle == NULL)
-	{
-		PyErr_SetString(PyExc_RuntimeError, "card not open");
-		return NULL;
-	}
 
-	libusb_free_transfer(deviceCard[cardNumber].readTransfer);
-	libusb_free_transfer(deviceCard[cardNumber].writeTransfer);
-	libusb_release_interface(deviceCard[cardNumber].handle, interface);
-	if (deviceCard[cardNumber].hadKernelDriver)
-		libusb_attach_kernel_driver(deviceCard[cardNumber].handle, interface);
-	libusb_close(deviceCard[cardNumber].handle);
+	Py_BEGIN_ALLOW_THREADS
+	device_stop(card);
+	Py_END_ALLOW_THREADS
 
-	deviceCard[cardNumber].handle = NULL;
+	device_release(card, interface);
 
 	return Py_BuildValue("i", cardNumber);
 }
@@ -538,63 +1170,101 @@ device_read(PyObject *self, PyObject *args)
 	unsigned char	ioBuf[OPEN8055_HID_MESSAGE_SIZE];
 	char			errbuf[1024];
 
-
 	/* ----
 	 * Parse command arguments
 	 * ----
 	 */
 	if (!PyArg_ParseTuple(args, "i", &cardNumber))
 		return NULL;
-	if (cardNumber < 0 || cardNumber >= OPEN8055_MAX_CARDS)
-	{
-		PyErr_SetString(PyExc_ValueError, "invalid card number");
+	if ((card = device_get_card(cardNumber)) == NULL)
 		return NULL;
-	}
-	if (deviceCard[cardNumber].handle == NULL)
+
+	Py_BEGIN_ALLOW_THREADS
+	rc = device_get_reports(card, ioBuf, 1, -1.0, errbuf, sizeof(errbuf));
+	Py_END_ALLOW_THREADS
+
+	if (rc < 0)
 	{
-		PyErr_SetString(PyExc_RuntimeError, "card not open");
+		PyErr_SetString(PyExc_IOError, errbuf);
 		return NULL;
 	}
-	card = &deviceCard[cardNumber];
 
-	libusb_fill_interrupt_transfer(card->readTransfer, card->handle,
-			LIBUSB_ENDPOINT_IN | 1, ioBuf, 
-			OPEN8055_HID_MESSAGE_SIZE,
-			device_transfer_callback, (void *)&(card->readCompleted), 0);
-	card->readCompleted = FALSE;
-	if ((rc = libusb_submit_transfer(card->readTransfer)) != 0)
+	return Py_BuildValue("s#", &ioBuf, OPEN8055_HID_MESSAGE_SIZE);
+}
+
+
+/* ----
+ * device_read_many()
+ *
+ *	Receive all messages the Open8055 sent since the last call, up to
+ *	max_reports of them, as a list. Waits up to timeout seconds for the
+ *	first one (forever if negative) and returns an empty list if none
+ *	came.
+ * ----
+ */
+static PyObject *
+device_read_many(PyObject *self, PyObject *args)
+{
+	int				cardNumber;
+	Open8055Card   *card;
+	int				maxReports = DEVICE_REPORT_QUEUE;
+	double			timeout = -1.0;
+	int				rc;
+	int				i;
+	unsigned char	ioBuf[DEVICE_REPORT_QUEUE][OPEN8055_HID_MESSAGE_SIZE];
+	char			errbuf[1024];
+	PyObject	   *result;
+	PyObject	   *report;
+
+	/* ----
+	 * Parse command arguments
+	 * ----
+	 */
+	if (!PyArg_ParseTuple(args, "i|id", &cardNumber, &maxReports, &timeout))
+		return NULL;
+	if ((card = device_get_card(cardNumber)) == NULL)
+		return NULL;
+	if (maxReports < 1)
 	{
-		snprintf(errbuf, sizeof(errbuf),
-				"libusb_submit_transfer(): %s", 
-				libusb_strerror(rc));
-		PyErr_SetString(PyExc_IOError, errbuf);
+		PyErr_SetString(PyExc_ValueError, "invalid max_reports");
 		return NULL;
 	}
+	if (maxReports > DEVICE_REPORT_QUEUE)
+		maxReports = DEVICE_REPORT_QUEUE;
+
+	Py_BEGIN_ALLOW_THREADS
+	rc = device_get_reports(card, (unsigned char *)ioBuf, maxReports,
+			timeout, errbuf, sizeof(errbuf));
+	Py_END_ALLOW_THREADS
 
-	if ((rc = device_handle_events(card, &(card->readCompleted))) < 0)
+	if (rc < 0)
 	{
-		snprintf(errbuf, sizeof(errbuf),
-				"device_handle_transfer(): %s", 
-				libusb_strerror(rc));
 		PyErr_SetString(PyExc_IOError, errbuf);
 		return NULL;
 	}
 
-	if (card->readTransfer->status != LIBUSB_TRANSFER_COMPLETED)
-	{
-		PyErr_SetString(PyExc_IOError, 
-				"asynchronous transfer failed: unknown reason");
+	if ((result = PyList_New(rc)) == NULL)
 		return NULL;
+	for (i = 0; i < rc; i++)
+	{
+		report = PyString_FromStringAndSize((char *)ioBuf[i],
+				OPEN8055_HID_MESSAGE_SIZE);
+		if (report == NULL)
+		{
+			Py_DECREF(result);
+			return NULL;
+		}
+		PyList_SET_ITEM(result, i, report);
 	}
 
-	return Py_BuildValue("s#", &ioBuf, OPEN8055_HID_MESSAGE_SIZE);
+	return result;
 }
 
 
 /* ----
  * device_write()
  *
- *	Send one message to the Open8055.
+ *	Send one message to the Open8055 and wait until it was sent.
  * ----
  */
 static PyObject *
@@ -605,6 +1275,7 @@ device_write(PyObject *self, PyObject *args)
 	unsigned char  *data;
 	unsigned char	ioBuf[OPEN8055_HID_MESSAGE_SIZE];
 	int				data_len;
+	unsigned long	number;
 	char			errbuf[1024];
 	int				rc;
 
@@ -612,61 +1283,393 @@ device_write(PyObject *self, PyObject *args)
 	 * Parse command args and check card number
 	 * ----
 	 */
-	if (!PyArg_ParseTuple(args, "is#", &cardNumber, 
+	if (!PyArg_ParseTuple(args, "is#", &cardNumber,
 			&data, &data_len))
 		return NULL;
-
-	if (cardNumber < 0 || cardNumber >= OPEN8055_MAX_CARDS)
-	{
-		PyErr_SetString(PyExc_ValueError, "invalid card number");
+	if ((card = device_get_card(cardNumber)) == NULL)
 		return NULL;
-	}
-	if (deviceCard[cardNumber].handle == NULL)
+
+	memset(ioBuf, 0, sizeof(ioBuf));
+	memcpy(ioBuf, data, (data_len > sizeof(ioBuf)) ? sizeof(ioBuf) : data_len);
+
+	Py_BEGIN_ALLOW_THREADS
+	rc = device_put_write(card, ioBuf, TRUE, FALSE, &number,
+			errbuf, sizeof(errbuf));
+	Py_END_ALLOW_THREADS
+
+	if (rc < 0)
 	{
-		PyErr_SetString(PyExc_RuntimeError, "card not open");
+		PyErr_SetString(PyExc_IOError, errbuf);
 		return NULL;
 	}
-	card = &deviceCard[cardNumber];
+
+	return Py_BuildValue("i", 0);
+}
+
+
+/* ----
+ * device_write_nowait()
+ *
+ *	Queue one message for the Open8055 and return its write number
+ *	right away, or 0 if DEVICE_WRITE_QUEUE writes are pending already.
+ *	With notify a byte is written to the set_write_notify() file
+ *	descriptor once it is done. After a 0 that happens once there is
+ *	room.
+ * ----
+ */
+static PyObject *
+device_write_nowait(PyObject *self, PyObject *args)
+{
+	int				cardNumber;
+	Open8055Card   *card;
+	unsigned char  *data;
+	unsigned char	ioBuf[OPEN8055_HID_MESSAGE_SIZE];
+	int				data_len;
+	int				notify = FALSE;
+	unsigned long	number;
+	char			errbuf[1024];
+	int				rc;
 
 	/* ----
-	 * Send it via interrupt transfer.
+	 * Parse command args and check card number
 	 * ----
 	 */
+	if (!PyArg_ParseTuple(args, "is#|i", &cardNumber,
+			&data, &data_len, &notify))
+		return NULL;
+	if ((card = device_get_card(cardNumber)) == NULL)
+		return NULL;
+
 	memset(ioBuf, 0, sizeof(ioBuf));
 	memcpy(ioBuf, data, (data_len > sizeof(ioBuf)) ? sizeof(ioBuf) : data_len);
-	libusb_fill_interrupt_transfer(card->writeTransfer, card->handle,
-			LIBUSB_ENDPOINT_OUT | 1, ioBuf, 
-			OPEN8055_HID_MESSAGE_SIZE,
-			device_transfer_callback, (void *)&(card->writeCompleted), 0);
-	card->writeCompleted = FALSE;
-	if ((rc = libusb_submit_transfer(card->writeTransfer)) != 0)
+
+	Py_BEGIN_ALLOW_THREADS
+	rc = device_put_write(card, ioBuf, FALSE, notify, &number,
+			errbuf, sizeof(errbuf));
+	Py_END_ALLOW_THREADS
+
+	if (rc < 0)
 	{
-		snprintf(errbuf, sizeof(errbuf),
-				"libusb_submit_transfer(): %s", 
-				libusb_strerror(rc));
 		PyErr_SetString(PyExc_IOError, errbuf);
 		return NULL;
 	}
 
-	if (device_handle_events(card, &(card->writeCompleted)) < 0)
+	return Py_BuildValue("k", number);
+}
+
+
+/* ----
+ * device_write_status()
+ *
+ *	Return the number of the last write done and the error of a write
+ *	that failed since the last call, or None. The error is not
+ *	returned again by the next write.
+ * ----
+ */
+static PyObject *
+device_write_status(PyObject *self, PyObject *args)
+{
+	int				cardNumber;
+	Open8055Card   *card;
+	unsigned long	done;
+	char			errbuf[256];
+
+	if (!PyArg_ParseTuple(args, "i", &cardNumber))
+		return NULL;
+	if ((card = device_get_card(cardNumber)) == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&(card->lock));
+	done = card->writeDone;
+	snprintf(errbuf, sizeof(errbuf), "%s", card->writeError);
+	card->writeError[0] = '\0';
+	pthread_mutex_unlock(&(card->lock));
+
+	if (errbuf[0] == '\0')
+		return Py_BuildValue("(kO)", done, Py_None);
+	return Py_BuildValue("(ks)", done, errbuf);
+}
+
+
+/* ----
+ * device_write_times()
+ *
+ *	Return the seconds each write took from being queued to being
+ *	done, for those done since the last call, as a list. Only the
+ *	last DEVICE_WRITE_TIMES are kept.
+ * ----
+ */
+static PyObject *
+device_write_times(PyObject *self, PyObject *args)
+{
+	int				cardNumber;
+	Open8055Card   *card;
+	double			times[DEVICE_WRITE_TIMES];
+	int				count;
+	int				i;
+	PyObject	   *result;
+	PyObject	   *item;
+
+	if (!PyArg_ParseTuple(args, "i", &cardNumber))
+		return NULL;
+	if ((card = device_get_card(cardNumber)) == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&(card->lock));
+	count = card->writeTimeCount;
+	for (i = 0; i < count; i++)
+		times[i] = card->writeTimes[(card->writeTimeFirst + i) %
+				DEVICE_WRITE_TIMES];
+	card->writeTimeFirst = 0;
+	card->writeTimeCount = 0;
+	pthread_mutex_unlock(&(card->lock));
+
+	if ((result = PyList_New(count)) == NULL)
+		return NULL;
+	for (i = 0; i < count; i++)
+	{
+		if ((item = PyFloat_FromDouble(times[i])) == NULL)
+		{
+			Py_DECREF(result);
+			return NULL;
+		}
+		PyList_SET_ITEM(result, i, item);
+	}
+
+	return result;
+}
+
+
+/* ----
+ * device_set_write_notify()
+ *
+ *	Set the file descriptor that write_nowait() callers are notified
+ *	on, or -1 for none. It must not block. This is done once, before
+ *	any card is opened.
+ * ----
+ */
+static PyObject *
+device_set_write_notify(PyObject *self, PyObject *args)
+{
+	int				fd;
+
+	if (!PyArg_ParseTuple(args, "i", &fd))
+		return NULL;
+
+	deviceNotifyFd = fd;
+
+	return Py_BuildValue("i", 0);
+}
+
+
+/* ----
+ * device_find_layout()
+ *
+ *	Return the field layout of an HID report type or NULL if the type
+ *	is not in the given table.
+ * ----
+ */
+static const char *
+device_find_layout(const DeviceReportLayout *layouts, long msgType)
+{
+	for (; layouts->fields != NULL; layouts++)
+	{
+		if (layouts->msgType == msgType)
+			return layouts->fields;
+	}
+	return NULL;
+}
+
+
+/* ----
+ * device_parse_value()
+ *
+ *	Convert one decimal argument of a SEND line.
+ * ----
+ */
+static int
+device_parse_value(PyObject *item, long *value)
+{
+	char   *str;
+	char   *end;
+
+	if ((str = PyString_AsString(item)) == NULL)
+		return -1;
+
+	errno = 0;
+	*value = strtol(str, &end, 10);
+	while (end != str && (*end == ' ' || *end == '\t' ||
+				*end == '\r' || *end == '\n'))
+		end++;
+	if (end == str || *end != '\0' || errno != 0)
+	{
+		PyErr_Format(PyExc_ValueError,
+				"invalid literal for int() with base 10: '%.100s'", str);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* ----
+ * device_format_recv()
+ *
+ *	Format a raw report from the card as text protocol RECV line.
+ *	This is the C version of format_recv_text() in open8055proto.py,
+ *	which the server calls for every report and every client.
+ * ----
+ */
+static PyObject *
+device_format_recv(PyObject *self, PyObject *arg)
+{
+	char		   *data;
+	Py_ssize_t		dataLen;
+	const char	   *fields;
+	char			line[8 + 6 * OPEN8055_HID_MESSAGE_SIZE];
+	char			digits[8];
+	char		   *cp;
+	int				pos = 0;
+	unsigned int	value;
+	int				n;
+	char			errbuf[128];
+
+	if (PyString_AsStringAndSize(arg, &data, &dataLen) < 0)
+		return NULL;
+
+	if (dataLen < 1 || (fields = device_find_layout(deviceRecvLayouts,
+				(unsigned char)data[0])) == NULL)
 	{
 		snprintf(errbuf, sizeof(errbuf),
-				"device_handle_transfer(): %s", 
-				libusb_strerror(rc));
-		PyErr_SetString(PyExc_IOError, errbuf);
+				"unknown HID packet type 0x%02X received from card",
+				(dataLen < 1) ? 0 : (unsigned char)data[0]);
+		PyErr_SetString(PyExc_ValueError, errbuf);
 		return NULL;
 	}
 
-	if (card->writeTransfer->status != LIBUSB_TRANSFER_COMPLETED)
+	memcpy(line, "RECV", 4);
+	cp = line + 4;
+	for (; *fields != '\0'; fields++)
+	{
+		if (*fields == 'H')
+		{
+			if (pos + 2 > dataLen)
+				break;
+			value = ((unsigned char)data[pos] << 8) |
+					(unsigned char)data[pos + 1];
+			pos += 2;
+		}
+		else
+		{
+			if (pos + 1 > dataLen)
+				break;
+			value = (unsigned char)data[pos++];
+		}
+
+		/* ----
+		 * Digits are produced backwards, then copied in order.
+		 * ----
+		 */
+		n = 0;
+		do {
+			digits[n++] = '0' + value % 10;
+			value /= 10;
+		} while (value != 0);
+		*cp++ = ' ';
+		while (n > 0)
+			*cp++ = digits[--n];
+	}
+	if (*fields != '\0')
 	{
 		snprintf(errbuf, sizeof(errbuf),
-				"asynchronous transfer failed: %s", 
-				libusb_strerror(rc));
-		PyErr_SetString(PyExc_IOError, errbuf);
+				"short HID packet of type 0x%02X received from card",
+				(unsigned char)data[0]);
+		PyErr_SetString(PyExc_ValueError, errbuf);
 		return NULL;
 	}
+	*cp++ = '\n';
 
-	return Py_BuildValue("i", 0);
+	return PyString_FromStringAndSize(line, cp - line);
+}
+
+
+/* ----
+ * device_parse_send()
+ *
+ *	Convert the arguments of a text protocol SEND line, the command
+ *	word included, into the raw report for the card. Missing values
+ *	at the end are taken as zero. This is the C version of
+ *	parse_send_text() in open8055proto.py.
+ * ----
+ */
+static PyObject *
+device_parse_send(PyObject *self, PyObject *arg)
+{
+	PyObject	   *seq;
+	PyObject	  **items;
+	Py_ssize_t		numItems;
+	Py_ssize_t		i;
+	const char	   *fields;
+	unsigned char	report[OPEN8055_HID_MESSAGE_SIZE];
+	int				pos = 0;
+	long			value;
+	char			errbuf[128];
+
+	if ((seq = PySequence_Fast(arg, "parse_send() expects a list")) == NULL)
+		return NULL;
+	numItems = PySequence_Fast_GET_SIZE(seq);
+	items = PySequence_Fast_ITEMS(seq);
+
+	if (numItems < 2)
+	{
+		PyErr_SetString(PyExc_ValueError, "missing HID command type");
+		Py_DECREF(seq);
+		return NULL;
+	}
+	if (device_parse_value(items[1], &value) < 0)
+	{
+		Py_DECREF(seq);
+		return NULL;
+	}
+	if ((fields = device_find_layout(deviceSendLayouts, value)) == NULL)
+	{
+		snprintf(errbuf, sizeof(errbuf), "invalid HID command type 0x%02lX",
+				value);
+		PyErr_SetString(PyExc_ValueError, errbuf);
+		Py_DECREF(seq);
+		return NULL;
+	}
+	if (numItems - 1 > (Py_ssize_t)strlen(fields))
+	{
+		snprintf(errbuf, sizeof(errbuf),
+				"too many values for HID command type 0x%02lX", value);
+		PyErr_SetString(PyExc_ValueError, errbuf);
+		Py_DECREF(seq);
+		return NULL;
+	}
+
+	for (i = 1; fields[i - 1] != '\0'; i++)
+	{
+		value = 0;
+		if (i < numItems && device_parse_value(items[i], &value) < 0)
+		{
+			Py_DECREF(seq);
+			return NULL;
+		}
+		if (value < 0 || value > ((fields[i - 1] == 'H') ? 0xFFFF : 0xFF))
+		{
+			snprintf(errbuf, sizeof(errbuf),
+					"value %ld out of range for field %d", value, (int)i);
+			PyErr_SetString(PyExc_ValueError, errbuf);
+			Py_DECREF(seq);
+			return NULL;
+		}
+		if (fields[i - 1] == 'H')
+			report[pos++] = (unsigned char)(value >> 8);
+		report[pos++] = (unsigned char)value;
+	}
+	Py_DECREF(seq);
+
+	return PyString_FromStringAndSize((char *)report, pos);
 }
 
 
@@ -689,5 +1692,3 @@ initopen8055device(void)
 
 	device_init();
 }
-
-
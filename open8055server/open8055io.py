@@ -39,13 +39,25 @@ libusb on Unix.
 # ----------------------------------------------------------------------
 import os
 
+# ----------
+# With OPEN8055_REPLAY set, simulated cards play back the reports of
+# capture files instead. See open8055replay.py. The files are read
+# right away, before the server is up and anything can change them.
+# ----------
+if os.environ.get('OPEN8055_REPLAY'):
+    import open8055replay
+    from open8055replay import *
+
+    open8055replay.replay_load()
+
 # ----------
 # On Windows platforms we use PyWIN32 to do the IO.
 # ----------
-if os.name == 'nt':
+elif os.name == 'nt':
 
     import _winreg as winreg
     import itertools
+    import time
     import win32file
 
     OPEN8055_GUID = '4d1e55b2-f16f-11cf-88cb-001111000030'
@@ -54,6 +66,8 @@ if os.name == 'nt':
 
     recv_handles = {}
     send_handles = {}
+    write_counts = {}
+    write_times_done = {}
 
     # ----------
     # present()
@@ -125,6 +139,16 @@ if os.name == 'nt':
 
         return iobuf[1: 33]
 
+    # ----------
+    # read_many()
+    #
+    #   Read the HID reports an open card sent, up to max_reports. The
+    #   Unix module queues them in the background. Here we read one at
+    #   a time, so this is read() and ignores the timeout.
+    # ----------
+    def read_many(card_num, max_reports = 256, timeout = -1.0):
+        return [read(card_num)]
+
     # ----------
     # write()
     #
@@ -144,6 +168,54 @@ if os.name == 'nt':
         win32file.WriteFile(send_handles[card_num], iobuf, None)
         return 32
 
+    # ----------
+    # write_nowait()
+    #
+    #   Send one HID command to an open card and return its write
+    #   number. The Unix module returns before it was sent, here we
+    #   wait like write(), so it is done when this returns.
+    # ----------
+    def write_nowait(card_num, data, notify = False):
+        start = time.time()
+        write(card_num, data)
+        card_num = int(card_num)
+        write_counts[card_num] = write_counts.get(card_num, 0) + 1
+        times = write_times_done.setdefault(card_num, [])
+        times.append(time.time() - start)
+        del times[:-256]
+        return write_counts[card_num]
+
+    # ----------
+    # write_status()
+    #
+    #   The number of the last write done and the error of a failed
+    #   one. write_nowait() raises its errors right away here.
+    # ----------
+    def write_status(card_num):
+        card_num = int(card_num)
+        if card_num not in recv_handles:
+            raise Exception('card not open')
+        return (write_counts.get(card_num, 0), None)
+
+    # ----------
+    # write_times()
+    #
+    #   The seconds each write_nowait() took since the last call.
+    # ----------
+    def write_times(card_num):
+        card_num = int(card_num)
+        if card_num not in recv_handles:
+            raise Exception('card not open')
+        return write_times_done.pop(card_num, [])
+
+    # ----------
+    # set_write_notify()
+    #
+    #   Nothing is ever left to notify about.
+    # ----------
+    def set_write_notify(fd):
+        pass
+
     # ----------
     # _open_card()
     #
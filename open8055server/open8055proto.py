@@ -0,0 +1,486 @@
+"""
+Encoding and decoding of the Open8055Server network protocol, shared
+by the server and its tools.
+"""
+
+# ----------------------------------------------------------------------
+# open8055proto.py
+#
+#	Text and binary message formats of the Open8055 server protocol
+#
+# ----------------------------------------------------------------------
+#
+#  Copyright (c) 2012, Jan Wieck
+#  All rights reserved.
+#  
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of the <organization> nor the
+#        names of its contributors may be used to endorse or promote products
+#        derived from this software without specific prior written permission.
+#  
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+#  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+#  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+#  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+#  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+#  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+#  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+#  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#  
+# ----------------------------------------------------------------------
+import struct
+
+# ----
+# HID report formats by message type. These are the layouts of the
+# raw 32 byte reports as the card sends and receives them.
+# ----
+HID_OUTPUT = 0x01
+HID_GETINPUT = 0x02
+HID_SETCONFIG1 = 0x03
+HID_GETCONFIG = 0x04
+HID_SAVECONFIG = 0x05
+HID_SAVEALL = 0x06
+HID_RESET = 0x7F
+HID_INPUT = 0x81
+
+HID_REPORT_SIZE = 32
+
+RECV_FORMATS = {
+    HID_INPUT:      struct.Struct('!BB5H2H'),
+    HID_OUTPUT:     struct.Struct('!BB8H2HB'),
+    HID_SETCONFIG1: struct.Struct('!B2B5B8B2B5HB'),
+}
+
+SEND_FORMATS = {
+    HID_OUTPUT:     struct.Struct('!BB8H2HB'),
+    HID_GETINPUT:   struct.Struct('!B'),
+    HID_SETCONFIG1: struct.Struct('!B2B5B8B2B5HB'),
+    HID_GETCONFIG:  struct.Struct('!B'),
+    HID_SAVECONFIG: struct.Struct('!B'),
+    HID_SAVEALL:    struct.Struct('!B'),
+    HID_RESET:      struct.Struct('!B'),
+}
+
+# ----
+# Binary framing, negotiated with "BINARY 1" right after HELLO/SALT.
+# After the server's "BINARY 1" response line, both directions carry
+# only frames:
+#
+#   uint16  payload length
+#   uint8   frame type
+#   uint8   channel
+#   uint32  sequence number, per direction
+#   payload
+#
+# All integers are in network byte order.
+#
+# The channel lets one connection serve several cards. The server
+# says it supports this by answering "BINARY 1 CHANNELS". An OPEN sent
+# on channel N opens the card on that channel; all frames about it,
+# in both directions, carry N from then on. CLOSE, answered with
+# CLOSED, frees the channel again. Text mode only has channel 0.
+# ----
+BINARY_VERSION = 1
+
+FRAME_TEXT = 0x01           # a protocol line without the newline
+FRAME_RECV = 0x02           # server->client raw HID report
+FRAME_SEND = 0x03           # client->server raw HID report
+FRAME_SENDACK = 0x04        # client->server raw HID report, answer with ACK
+FRAME_ACK = 0x05            # server->client result of a SENDACK
+FRAME_DELTA = 0x06          # server->client changed INPUT fields
+
+FRAME_HEADER = struct.Struct('!HBBI')
+FRAME_MAX_PAYLOAD = 1024
+
+# ----
+# Acknowledged SEND. In text mode the client sends
+#
+#   SENDACK <id> <values as for SEND>
+#
+# and the server answers "ACK <id> OK <usec>" once the report has
+# been written to the card, or "ACK <id> ERROR <message>". In binary
+# mode the command id is the sequence number of the SENDACK frame and
+# the ACK frame carries
+#
+#   uint32  command id
+#   uint32  microseconds the USB write took
+#   error message, empty on success
+# ----
+ACK_HEADER = struct.Struct('!II')
+
+# ----
+# Delta encoded INPUT reports, enabled with "INPUTDELTA <keyframe ms>".
+# The eight value fields of an INPUT report (input bits, 5 counters,
+# 2 ADCs) are numbered 0..7. A delta carries a bitmask of the fields
+# that changed since the previous INPUT report and their new values:
+#
+#   text:   DELTA <mask> <value> ...
+#   binary: uint8 mask, then uint8 input bits and uint16 for the
+#           others, for each bit set in the mask
+#
+# Full RECV reports (keyframes) are sent every <keyframe ms> and in
+# response to the KEYFRAME command.
+# ----
+DELTA_FIELDS = 8
+DELTA_BINARY_FORMATS = ('B', 'H', 'H', 'H', 'H', 'H', 'H', 'H')
+
+# ----
+# INPUT reports over UDP, enabled with "UDP <port> <token>" on the
+# channel of an open card. The server then sends that card's INPUT
+# reports as datagrams to <port> at the client's address instead of
+# over the TCP connection. Everything else, including OUTPUT and
+# CONFIG1 reports, stays on TCP. Each datagram is
+#
+#   uint32  token from the UDP command
+#   uint8   channel
+#   uint32  sequence number, starting at 1 for every UDP command
+#   raw HID report
+#
+# A lost datagram is not resent; the client only cares for the newest
+# and counts the gaps. "UDP 0" switches back to TCP.
+# ----
+UDP_HEADER = struct.Struct('!IBI')
+
+# ----
+# Rate limited INPUT reports, requested with
+#
+#   SUBSCRIBE <max_rate> [<adc1_deadband> <adc2_deadband>]
+#
+# or the same values as extra arguments of OPEN. The server sends at
+# most <max_rate> INPUT reports per second, each time the newest state,
+# and none at all for ADC changes within the deadbands. A change of the
+# digital inputs is sent right away. <max_rate> 0 means no limit.
+# ----
+
+# ----
+# Session resume. "HOLD" on the channel of an open card is answered
+# with
+#
+#   HOLD <token> <grace seconds>
+#
+# If the connection is then lost, without CLOSE or QUIT, the server
+# keeps the card open for the grace period. A new connection can take
+# it over with
+#
+#   RESUME <token> [<max_rate> [<adc1_deadband> <adc2_deadband>]]
+#
+# instead of OPEN. No password is needed and the card's last CONFIG1,
+# OUTPUT and INPUT reports follow right away, from the server's cache.
+# Delta encoding and the subscription carry over, UDP input does not.
+# An OPEN of a held card by anyone allowed to open it ends the hold.
+# ----
+
+# ----
+# Read-only sessions. Any number of clients can
+#
+#   WATCH <card> <user> <password> [<max_rate> [<adc1_deadband> ...]]
+#
+# a card, besides the one client that has it OPEN. The card is read
+# once and every report goes to all of them. A client joining a card
+# that is already open gets its last CONFIG1, OUTPUT and INPUT reports
+# right away. SEND and SENDACK are refused on a watched card.
+# ----
+
+# ----
+# Card state cache. The server keeps the last CONFIG1, OUTPUT and INPUT
+# report of each card it has open, or closed less than state_cache
+# seconds ago, and answers an OPEN or WATCH of such a card from there
+# instead of asking the card with GETCONFIG. How current that is can be
+# checked with "STATE" on the card's channel, answered by
+#
+#   STATE <seq> <age>
+#
+# <seq> changes whenever the card's CONFIG1 or OUTPUT do, or the server
+# forgot them after a reset or failure of the card. <age> is the seconds
+# since the card last sent a report, or -1 if it has not yet. A client
+# that finds the state older than it likes can SEND a GETCONFIG.
+# ----
+
+# ----
+# Outbound queue. What the server sends to a client is queued, up to
+# a depth, and the oldest or a same kind report is given up when the
+# client falls behind. A client picks how with
+#
+#   QUEUE block|drop_oldest|merge [<depth>]
+#
+# answered by "QUEUE <policy> <depth>". The defaults are send_policy
+# and send_queue of the server configuration. Replies, ACKs and errors
+# are never given up. A dropped or merged INPUT report makes the next
+# one a keyframe for clients using INPUTDELTA.
+#
+#   STATUS <user> <password>
+#
+# needs the same access as LIST and lists every connected client as
+#
+#   CLIENT <address> queue <n> max <n> depth <n> policy <policy>
+#          dropped <n> merged <n>
+#
+# (one line), followed by "STATUS <number of clients>".
+# ----
+
+# ----
+# Server metrics.
+#
+#   STATS <user> <password>
+#
+# needs the same access as LIST and answers with one line per sample
+# of the Prometheus text format, as served on metrics_port,
+#
+#   STAT open8055_card_reports_total{card="0"} 12345
+#
+# followed by "STATS <number of samples>".
+# ----
+
+# ----
+# Capture files, written by the server when capture_dir is set and
+# played back by open8055replay.py. A file starts with
+#
+#   8 bytes "O8055CAP"
+#   uint16  format version
+#
+# followed by records of
+#
+#   double  time.time() of the record
+#   uint8   record type, CAPTURE_* below
+#   uint8   card number, or the channel for client commands
+#   uint32  connection number, 0 for the server itself
+#   uint16  data length
+#   data
+#
+# Reports read in one batch from the card share the time they were
+# read at. Passwords and resume tokens in commands are replaced by
+# "*****". Data longer than CAPTURE_MAX_DATA is cut off there. A record
+# cut short at the end of a file is ignored.
+# ----
+CAPTURE_MAGIC = 'O8055CAP'
+CAPTURE_VERSION = 1
+
+CAPTURE_CARD_READ = 0x01    # report the card sent
+CAPTURE_CARD_WRITE = 0x02   # report written to the card
+CAPTURE_TEXT = 0x03         # client command line, or TEXT frame
+CAPTURE_SEND = 0x04         # payload of a SEND or SENDACK frame
+CAPTURE_CONNECT = 0x05      # client connected, data is its address
+CAPTURE_DISCONNECT = 0x06   # client's session ended
+
+CAPTURE_HEADER = struct.Struct('!8sH')
+CAPTURE_RECORD = struct.Struct('!dBBIH')
+CAPTURE_MAX_DATA = 0xFFFF
+
+
+class ProtocolError(Exception):
+    pass
+
+
+# ----------
+# pack_frame()
+#
+#   Build one binary frame.
+# ----------
+def pack_frame(ftype, seq, payload, channel = 0):
+    return FRAME_HEADER.pack(len(payload), ftype, channel,
+            seq & 0xFFFFFFFF) + payload
+
+
+# ----------
+# unpack_frame()
+#
+#   Split the first complete frame off buf. Returns the tuple
+#   (ftype, channel, seq, payload, rest) or None if buf does not
+#   hold a complete frame yet.
+# ----------
+def unpack_frame(buf):
+    if len(buf) < FRAME_HEADER.size:
+        return None
+    length, ftype, channel, seq = FRAME_HEADER.unpack_from(buf)
+    if length > FRAME_MAX_PAYLOAD:
+        raise ProtocolError('oversize frame of {0} bytes'.format(length))
+    end = FRAME_HEADER.size + length
+    if len(buf) < end:
+        return None
+    return ftype, channel, seq, buf[FRAME_HEADER.size:end], buf[end:]
+
+
+# ----------
+# format_recv_text()
+#
+#   Format a raw report from the card as text protocol RECV line.
+# ----------
+def format_recv_text(data):
+    fmt = RECV_FORMATS.get(ord(data[0]))
+    if fmt is None:
+        raise ProtocolError('unknown HID packet type ' +
+                '0x{0:02X} received from card'.format(ord(data[0])))
+    return 'RECV ' + ' '.join(str(elem) for elem in
+            fmt.unpack_from(data)) + '\n'
+
+
+# ----------
+# parse_send_text()
+#
+#   Convert the arguments of a text protocol SEND line into the
+#   raw report for the card. Missing values at the end are taken as
+#   zero (telnet debugging aid).
+# ----------
+def parse_send_text(args):
+    hid_type = int(args[1])
+    fmt = SEND_FORMATS.get(hid_type)
+    if fmt is None:
+        raise ProtocolError('invalid HID command type 0x{0:02X}'.format(
+                hid_type))
+
+    vals = [int(x) for x in args[1:]]
+    while len(vals) < len(fmt.unpack(b'\0' * fmt.size)):
+        vals.append(0)
+    return fmt.pack(*vals)
+
+
+# ----------
+# format_ack_text()
+#
+#   Format the text protocol ACK line for a SENDACK command.
+# ----------
+def format_ack_text(cmd_id, usec, error = None):
+    if error is not None:
+        return 'ACK {0} ERROR {1}\n'.format(cmd_id,
+                error.replace('\n', ' '))
+    return 'ACK {0} OK {1}\n'.format(cmd_id, usec)
+
+
+# ----------
+# pack_ack_payload()
+#
+#   Build the payload of an ACK frame.
+# ----------
+def pack_ack_payload(cmd_id, usec, error = None):
+    payload = ACK_HEADER.pack(cmd_id & 0xFFFFFFFF, min(usec, 0xFFFFFFFF))
+    if error is not None:
+        payload += (error or 'error')[:FRAME_MAX_PAYLOAD - ACK_HEADER.size]
+    return payload
+
+
+# ----------
+# input_values()
+#
+#   Return the eight delta encoded fields of an INPUT report.
+# ----------
+def input_values(data):
+    return RECV_FORMATS[HID_INPUT].unpack_from(data)[1:]
+
+
+# ----------
+# input_delta()
+#
+#   Compare two tuples from input_values(). Returns the bitmask of
+#   the changed fields and the list of their new values.
+# ----------
+def input_delta(old, new):
+    mask = 0
+    changed = []
+    for i in range(DELTA_FIELDS):
+        if old[i] != new[i]:
+            mask |= 1 << i
+            changed.append(new[i])
+    return mask, changed
+
+
+# ----------
+# format_delta_text()
+# ----------
+def format_delta_text(mask, changed):
+    return 'DELTA ' + ' '.join(str(elem) for elem in [mask] + changed) + '\n'
+
+
+# ----------
+# pack_delta_payload()
+# ----------
+def pack_delta_payload(mask, changed):
+    fmt = '!B' + ''.join(DELTA_BINARY_FORMATS[i]
+            for i in range(DELTA_FIELDS) if mask & (1 << i))
+    return struct.pack(fmt, mask, *changed)
+
+
+# ----------
+# pack_udp_report()
+#
+#   Build one INPUT report datagram.
+# ----------
+def pack_udp_report(token, channel, seq, data):
+    return UDP_HEADER.pack(token, channel, seq & 0xFFFFFFFF) + data
+
+
+# ----------
+# check_send_binary()
+#
+#   Validate the payload of a SEND frame and return the report data
+#   for the card.
+# ----------
+def check_send_binary(payload):
+    if len(payload) == 0:
+        raise ProtocolError('empty SEND frame')
+    fmt = SEND_FORMATS.get(ord(payload[0]))
+    if fmt is None:
+        raise ProtocolError('invalid HID command type 0x{0:02X}'.format(
+                ord(payload[0])))
+    if len(payload) < fmt.size:
+        raise ProtocolError('short SEND frame for type 0x{0:02X}'.format(
+                ord(payload[0])))
+    return payload[:fmt.size]
+
+
+# ----------
+# pack_capture_record()
+# ----------
+def pack_capture_record(when, rtype, card, conn, data):
+    return CAPTURE_RECORD.pack(when, rtype, card, conn, len(data)) + data
+
+
+# ----------
+# read_capture()
+#
+#   Return the records of a capture file as a list of tuples
+#   (time, type, card, conn, data).
+# ----------
+def read_capture(fd):
+    buf = fd.read()
+    if len(buf) < CAPTURE_HEADER.size:
+        raise ProtocolError('not a capture file')
+    magic, version = CAPTURE_HEADER.unpack_from(buf)
+    if magic != CAPTURE_MAGIC:
+        raise ProtocolError('not a capture file')
+    if version != CAPTURE_VERSION:
+        raise ProtocolError('unsupported capture version ' + str(version))
+
+    records = []
+    pos = CAPTURE_HEADER.size
+    while pos + CAPTURE_RECORD.size <= len(buf):
+        when, rtype, card, conn, length = CAPTURE_RECORD.unpack_from(buf, pos)
+        pos += CAPTURE_RECORD.size
+        if pos + length > len(buf):
+            break
+        records.append((when, rtype, card, conn, buf[pos:pos + length]))
+        pos += length
+    return records
+
+
+# ----
+# The device module on Unix has C versions of the two conversions the
+# server does for every report. The Python versions above stay
+# available under these names for where it is missing (Windows) and
+# for comparison.
+# ----
+format_recv_text_python = format_recv_text
+parse_send_text_python = parse_send_text
+try:
+    import open8055device
+    format_recv_text = open8055device.format_recv
+    parse_send_text = open8055device.parse_send
+except (ImportError, AttributeError):
+    pass
@@ -0,0 +1,484 @@
+#!/usr/bin/env python
+"""
+Simulated Open8055 cards that play back the card reports of capture
+files written by open8055server, and a tool to list and play back
+such captures.
+"""
+
+# ----------------------------------------------------------------------
+# open8055replay.py
+#
+#	Capture playback for Open8055
+#
+# ----------------------------------------------------------------------
+#
+#  Copyright (c) 2012, Jan Wieck
+#  All rights reserved.
+#  
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of the <organization> nor the
+#        names of its contributors may be used to endorse or promote products
+#        derived from this software without specific prior written permission.
+#  
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+#  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+#  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+#  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+#  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+#  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+#  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+#  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#  
+# ----------------------------------------------------------------------
+import errno
+import getopt
+import io
+import os
+import sys
+import threading
+import time
+
+import open8055proto
+
+# ----
+# open8055io uses the device functions below in place of the real
+# ones when OPEN8055_REPLAY is set, to a capture file or directory or
+# a list of them separated like PATH. OPEN8055_REPLAY_SPEED is the
+# playback speed, 1 for the original timing (default) and 0 for as
+# fast as the server takes the reports.
+# ----
+__all__ = ['present', 'open', 'close', 'read', 'read_many', 'write',
+        'write_nowait', 'write_status', 'write_times', 'set_write_notify']
+
+replay_lock = threading.Lock()
+replay_cards = None                 # Open8055ReplayCard by card number
+
+
+# ----------------------------------------------------------------------
+# Open8055ReplayCard
+#
+#   One simulated card. It sends the INPUT reports its card sent in
+#   the capture, as far apart in time as they were there divided by
+#   the speed, counted from when it is opened. Like a real card it
+#   answers GETCONFIG with its current CONFIG1 and OUTPUT. The CONFIG1
+#   and OUTPUT reports in the capture, which were answers to GETCONFIG
+#   back then, only change those. At the end of the capture it fails
+#   like an unplugged card; opening it again starts over.
+# ----------------------------------------------------------------------
+class Open8055ReplayCard:
+    def __init__(self, cardid, speed):
+        self.cardid = cardid
+        self.speed = speed
+        self.reports = []               # (time, data) the card sent
+        self.first_config1 = None
+        self.first_output = None
+
+        self.cond = threading.Condition()
+        self.start = None               # time it was opened
+        self.pos = 0                    # next report to send
+        self.config1 = None
+        self.output = None
+        self.answers = []               # reports to send right away
+        self.written = 0
+
+    # ----------
+    # add()
+    #
+    #   Take a record of the capture. The first CONFIG1 and OUTPUT in
+    #   it, sent or written, are what the card starts out with.
+    # ----------
+    def add(self, when, rtype, data):
+        hid_type = ord(data[0])
+        if rtype == open8055proto.CAPTURE_CARD_READ:
+            self.reports.append((when, data))
+        if hid_type == open8055proto.HID_SETCONFIG1:
+            if self.first_config1 is None:
+                self.first_config1 = pad_report(data)
+        elif hid_type == open8055proto.HID_OUTPUT:
+            if self.first_output is None:
+                self.first_output = pad_report(data[:-1] + '\0')
+
+    def open(self):
+        self.cond.acquire()
+        try:
+            if self.start is not None:
+                raise Exception('card already open')
+            self.start = time.time()
+            self.pos = 0
+            self.config1 = self.first_config1
+            self.output = self.first_output
+            self.answers = []
+        finally:
+            self.cond.release()
+
+    def close(self):
+        self.cond.acquire()
+        try:
+            if self.start is None:
+                raise Exception('card not open')
+            self.start = None
+            self.cond.notify_all()
+        finally:
+            self.cond.release()
+
+    # ----------
+    # read_many()
+    #
+    #   Wait for the next report to be due, up to timeout seconds
+    #   unless that is negative, and return the INPUT reports among
+    #   those due by then, at most max_reports.
+    # ----------
+    def read_many(self, max_reports, timeout):
+        self.cond.acquire()
+        try:
+            deadline = None
+            if timeout >= 0:
+                deadline = time.time() + timeout
+            while True:
+                if self.start is None:
+                    raise IOError('card not open')
+                if len(self.answers) > 0:
+                    result = self.answers[:max_reports]
+                    del self.answers[:max_reports]
+                    return result
+                if self.pos >= len(self.reports):
+                    raise IOError('end of capture')
+
+                now = time.time()
+                wait = 0.0
+                if self.speed > 0:
+                    wait = self.start + (self.reports[self.pos][0] -
+                            self.reports[0][0]) / self.speed - now
+                if wait <= 0:
+                    break
+                if deadline is not None:
+                    if now >= deadline:
+                        return []
+                    wait = min(wait, deadline - now)
+                self.cond.wait(wait)
+
+            end = min(len(self.reports), self.pos + max_reports)
+            if self.speed > 0:
+                limit = self.reports[0][0] + (now - self.start) * self.speed
+                while end > self.pos + 1 and self.reports[end - 1][0] > limit:
+                    end -= 1
+            result = []
+            for when, data in self.reports[self.pos:end]:
+                if ord(data[0]) == open8055proto.HID_INPUT:
+                    result.append(data)
+                else:
+                    self.keep_state(data)
+            self.pos = end
+            return result
+        finally:
+            self.cond.release()
+
+    # ----------
+    # write()
+    #
+    #   Take a report written to the card. What the server writes does
+    #   not change the reports played back, only the CONFIG1 and OUTPUT
+    #   a GETCONFIG is answered with.
+    # ----------
+    def write(self, data):
+        if len(data) == 0 or len(data) > 64:
+            raise ValueError('invalid HID packet data')
+        self.cond.acquire()
+        try:
+            if self.start is None:
+                raise IOError('card not open')
+            self.written += 1
+            if ord(data[0]) == open8055proto.HID_GETCONFIG:
+                if self.config1 is None or self.output is None:
+                    raise IOError('capture has no CONFIG1 and OUTPUT ' +
+                            'of card {0}'.format(self.cardid))
+                self.answers += [self.config1, self.output]
+                self.cond.notify_all()
+            else:
+                self.keep_state(data)
+        finally:
+            self.cond.release()
+        return open8055proto.HID_REPORT_SIZE
+
+    def keep_state(self, data):
+        hid_type = ord(data[0])
+        if hid_type == open8055proto.HID_SETCONFIG1:
+            self.config1 = pad_report(data)
+        elif hid_type == open8055proto.HID_OUTPUT:
+            self.output = pad_report(data[:-1] + '\0')
+
+
+# ----------
+# pad_report()
+# ----------
+def pad_report(data):
+    return data.ljust(open8055proto.HID_REPORT_SIZE, '\0')
+
+
+# ----------
+# capture_files()
+#
+#   The given capture files, with directories replaced by the capture
+#   files in them, in the order they were written.
+# ----------
+def capture_files(paths):
+    result = []
+    for path in paths:
+        if os.path.isdir(path):
+            result += sorted([os.path.join(path, name)
+                    for name in os.listdir(path)
+                    if name.startswith('open8055-') and name.endswith('.cap')])
+        else:
+            result.append(path)
+    return result
+
+
+# ----------
+# load_capture()
+#
+#   Read all records of the capture files.
+# ----------
+def load_capture(paths):
+    records = []
+    for fname in capture_files(paths):
+        fd = io.open(fname, 'rb')
+        try:
+            records += open8055proto.read_capture(fd)
+        except open8055proto.ProtocolError as err:
+            raise open8055proto.ProtocolError('{0}: {1}'.format(
+                    fname, str(err)))
+        finally:
+            fd.close()
+    return records
+
+
+# ----------
+# replay_load()
+#
+#   Set up the simulated cards from OPEN8055_REPLAY, once. open8055io
+#   does that when it is imported.
+# ----------
+def replay_load():
+    global replay_cards
+
+    replay_lock.acquire()
+    try:
+        if replay_cards is None:
+            paths = os.environ.get('OPEN8055_REPLAY', '').split(os.pathsep)
+            speed = float(os.environ.get('OPEN8055_REPLAY_SPEED', '1'))
+            cards = {}
+            for when, rtype, card, conn, data in load_capture(paths):
+                if len(data) == 0 or rtype not in (
+                        open8055proto.CAPTURE_CARD_READ,
+                        open8055proto.CAPTURE_CARD_WRITE):
+                    continue
+                if card not in cards:
+                    cards[card] = Open8055ReplayCard(card, speed)
+                cards[card].add(when, rtype, data)
+            replay_cards = cards
+        return replay_cards
+    finally:
+        replay_lock.release()
+
+
+def replay_card(card_num):
+    card = replay_load().get(int(card_num))
+    if card is None or len(card.reports) == 0:
+        raise Exception('card not present')
+    return card
+
+
+# ----------
+# present() ... set_write_notify()
+#
+#   The device functions of open8055io.
+# ----------
+def present(card_num):
+    card = replay_load().get(int(card_num))
+    if card is None or len(card.reports) == 0:
+        return 0
+    return 1
+
+
+def open(card_num):
+    replay_card(card_num).open()
+
+
+def close(card_num):
+    replay_card(card_num).close()
+
+
+def read(card_num):
+    card = replay_card(card_num)
+    while True:
+        reports = card.read_many(1, -1.0)
+        if len(reports) > 0:
+            return reports[0]
+
+
+def read_many(card_num, max_reports = 256, timeout = -1.0):
+    return replay_card(card_num).read_many(max_reports, timeout)
+
+
+def write(card_num, data):
+    return replay_card(card_num).write(data)
+
+
+def write_nowait(card_num, data, notify = False):
+    card = replay_card(card_num)
+    card.write(data)
+    return card.written
+
+
+def write_status(card_num):
+    return (replay_card(card_num).written, None)
+
+
+def write_times(card_num):
+    replay_card(card_num)
+    return []
+
+
+def set_write_notify(fd):
+    pass
+
+
+# ----------
+# format_record()
+#
+#   One capture record as text, for dump.
+# ----------
+def format_record(rtype, card, conn, data):
+    if rtype == open8055proto.CAPTURE_CARD_READ:
+        try:
+            report = open8055proto.format_recv_text(data).strip()
+        except (open8055proto.ProtocolError, ValueError):
+            # ----
+            # The device module's version raises ValueError.
+            # ----
+            report = data.encode('hex')
+        return 'card {0} READ {1}'.format(card, report)
+    if rtype == open8055proto.CAPTURE_CARD_WRITE:
+        return 'card {0} conn {1} WRITE {2}'.format(card, conn,
+                format_send(data))
+    if rtype == open8055proto.CAPTURE_TEXT:
+        return 'conn {0} chan {1} TEXT {2}'.format(conn, card, data)
+    if rtype == open8055proto.CAPTURE_SEND:
+        return 'conn {0} chan {1} FRAME {2}'.format(conn, card,
+                format_send(data))
+    if rtype == open8055proto.CAPTURE_CONNECT:
+        return 'conn {0} CONNECT {1}'.format(conn, data)
+    if rtype == open8055proto.CAPTURE_DISCONNECT:
+        return 'conn {0} DISCONNECT'.format(conn)
+    return 'unknown record type {0}'.format(rtype)
+
+
+# ----------
+# format_send()
+#
+#   A report written to the card as text protocol SEND line.
+# ----------
+def format_send(data):
+    fmt = None
+    if len(data) > 0:
+        fmt = open8055proto.SEND_FORMATS.get(ord(data[0]))
+    if fmt is None or len(data) < fmt.size:
+        return data.encode('hex')
+    return 'SEND ' + ' '.join(str(elem) for elem in fmt.unpack_from(data))
+
+
+def main(argv):
+    speed = '1'
+    try:
+        opts, args = getopt.getopt(argv, 'h?s:', ['help', 'speed=', ])
+    except getopt.GetoptError as err:
+        sys.stderr.write(str(err) + '\n')
+        usage()
+        return 1
+
+    for opt, arg in opts:
+        if opt in ('-h', '-?', '--help', ):
+            usage()
+            return 0
+        elif opt in ('-s', '--speed', ):
+            try:
+                if float(arg) < 0:
+                    raise ValueError()
+            except ValueError:
+                sys.stderr.write('invalid speed ' + arg + '\n')
+                return 1
+            speed = arg
+
+    if len(args) < 2 or args[0] not in ('dump', 'run', ):
+        usage()
+        return 1
+    paths = [os.path.abspath(path) for path in args[1:]]
+
+    try:
+        records = load_capture(paths)
+    except (IOError, open8055proto.ProtocolError) as err:
+        sys.stderr.write(str(err) + '\n')
+        return 2
+    if len(records) == 0:
+        sys.stderr.write('no records in capture\n')
+        return 2
+
+    # ----
+    # dump lists the records, with their time since the first one.
+    # ----
+    if args[0] == 'dump':
+        start = records[0][0]
+        try:
+            for when, rtype, card, conn, data in records:
+                print '{0:12.6f} {1}'.format(when - start,
+                        format_record(rtype, card, conn, data))
+        except IOError as err:
+            if err.errno != errno.EPIPE:
+                raise
+        return 0
+
+    # ----
+    # run starts the server with the simulated cards in place of the
+    # real ones. It reads its usual config file, but captures nothing.
+    # ----
+    cards = {}
+    for when, rtype, card, conn, data in records:
+        if rtype == open8055proto.CAPTURE_CARD_READ:
+            cards.setdefault(card, []).append(when)
+    for card, times in sorted(cards.items()):
+        print 'card {0}: {1} reports over {2:.1f} seconds'.format(card,
+                len(times), times[-1] - times[0])
+    os.environ['OPEN8055_REPLAY'] = os.pathsep.join(paths)
+    os.environ['OPEN8055_REPLAY_SPEED'] = speed
+    server = os.path.join(os.path.dirname(os.path.realpath(__file__)),
+            'open8055server.py')
+    sys.stdout.flush()
+    os.execv(sys.executable, [sys.executable, server])
+
+
+def usage():
+    sys.stderr.write("""usage: {0} [OPTIONS] dump|run CAPTURE ...
+
+    List the records of open8055server capture files (dump), or run
+    open8055server with simulated cards that play back the reports
+    the cards sent in them (run). A CAPTURE is a capture file or a
+    capture_dir; its files are taken in the order they were written.
+
+Options:
+    -s, --speed=FACTOR      playback speed for run, 1 is the original
+                            timing (default), 0 as fast as the server
+                            takes the reports
+    -h, --help              print this message
+\n""".format(os.path.basename(__file__)))
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
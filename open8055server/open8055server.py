@@ -1,10 +1,15 @@
 #!/usr/bin/env python
 
+import BaseHTTPServer
+import bisect
+import collections
 import ConfigParser
+import errno
 import hashlib
+import heapq
 import netaddr
+import operator
 import os
-import random
 import re
 import select
 import socket
@@ -14,8 +19,11 @@ import threading
 import time
 
 import open8055io
+import open8055proto
 
 if os.name == 'posix':
+    import grp
+    import pwd
     import signal
 elif os.name == 'nt':
     import win32service
@@ -31,6 +39,29 @@ MODE_RUN = 1
 MODE_STOP = 2
 MODE_STOPPED = 3
 
+# ----
+# Python 2 does not define SO_PEERCRED. This is its value on Linux,
+# the only platform where we ask for it.
+# ----
+SO_PEERCRED = getattr(socket, 'SO_PEERCRED', 17)
+
+# ----
+# Most reports a card's reader takes from the device module at once.
+# ----
+READ_BATCH = 64
+
+# ----
+# Seconds between checks whether the config file changed.
+# ----
+CONFIG_CHECK_INTERVAL = 5
+
+# ----
+# Position of the password, or resume token, in commands written to
+# capture files. It is replaced by "*****" there.
+# ----
+CAPTURE_SECRET_ARGS = {'LIST': 2, 'OPEN': 3, 'WATCH': 3, 'STATUS': 2,
+        'STATS': 2, 'RESUME': 1}
+
 # ----------------------------------------------------------------------
 # Open8055Server
 # ----------------------------------------------------------------------
@@ -54,7 +85,40 @@ class Open8055Server(threading.Thread):
 
         self.status = MODE_RUN
         self.lock = threading.Lock()
-        self.clients = []
+        self.clients = {}               # all connections by socket fd
+        self.poller = Open8055Poller()
+        self.unix_sock = None
+        self.unix_path = None
+        self.held = {}                  # channels of lost clients by token
+        self.held_lock = threading.Lock()
+        self.cards = {}                 # reader of each open card
+        self.card_states = {}           # last known state of each card
+        self.stopping = {}              # readers closing their card
+        self.card_waiters = {}          # clients waiting for that by card
+        self.write_waiting = set()      # readers with writes not done
+        self.cards_lock = threading.Lock()
+        self.access = {}                # compiled [Access] lists by name
+        self.rules = {}                 # compiled [Rules] by card
+        self.users = Open8055Users()
+        self.config_stamp = None
+        self.metrics = Open8055Metrics()
+        self.metrics_httpd = None
+        self.capture = None             # capture file writer
+        self.connections = 0            # numbers client connections
+
+        # ----
+        # Other threads wake up the event loop by writing a byte to
+        # wake_w. What they want done is left in the fields below.
+        # ----
+        self.wake_r, self.wake_w = make_wakeup_pair()
+        self.wake_lock = threading.Lock()
+        self.wake_pending = False
+        self.flush_wanted = []          # clients with data queued
+        self.readers_failed = False     # a reader stopped on its own
+        self.readers_stopped = []       # readers that closed their card
+        self.reload_wanted = False      # SIGHUP received
+        self.timers = []                # heap of (time, seq, func)
+        self.timer_seq = 0
 
     def create_server_socket(self):
         # ----
@@ -78,6 +142,37 @@ class Open8055Server(threading.Thread):
             self.sock.bind(('', port))
             self.sock.listen(10)
 
+        # ----
+        # Local clients can also connect through a Unix domain socket,
+        # saving them the TCP stack. A socket file left behind by an
+        # earlier server is replaced.
+        # ----
+        path = self.config.get('General', 'unix_socket')
+        if path:
+            if not hasattr(socket, 'AF_UNIX'):
+                raise Exception('unix_socket is not supported on this platform')
+            if os.path.exists(path):
+                os.unlink(path)
+            self.unix_sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            self.unix_sock.bind(path)
+            os.chmod(path, int(self.config.get('General',
+                    'unix_socket_mode'), 8))
+            self.unix_sock.listen(10)
+            self.unix_path = path
+            log_info('listening on ' + path)
+
+        # ----
+        # The metrics are served over HTTP on the loopback interface
+        # only, for a Prometheus scraper or an exporter running on
+        # this host.
+        # ----
+        port = self.config.get('General', 'metrics_port')
+        if port:
+            self.metrics_httpd = BaseHTTPServer.HTTPServer(
+                    ('127.0.0.1', int(port)), Open8055MetricsHandler)
+            self.metrics_httpd.open8055server = self
+            log_info('metrics on http://127.0.0.1:{0}/metrics'.format(port))
+
     # ----
     # load_config()
     # ----
@@ -87,14 +182,27 @@ class Open8055Server(threading.Thread):
         self.config.add_section('General')
         self.config.set('General', 'server_port', '8055')
         self.config.set('General', 'users_file', 'open8055.users')
+        self.config.set('General', 'unix_socket', '')
+        self.config.set('General', 'unix_socket_mode', '0666')
+        self.config.set('General', 'resume_grace', '10')
+        self.config.set('General', 'send_queue', '256')
+        self.config.set('General', 'send_policy', 'merge')
+        self.config.set('General', 'send_timeout', '5')
+        self.config.set('General', 'state_cache', '30')
+        self.config.set('General', 'metrics_port', '')
+        self.config.set('General', 'capture_dir', '')
+        self.config.set('General', 'capture_file_size', '64')
+        self.config.set('General', 'capture_files', '16')
 
         self.config.add_section('Access')
         self.config.set('Access', 'connect', """127.0.0.1/32    all     trust
                         ::1/128     all     trust
+                        unix        all     trust
                         0.0.0.0/0   all     deny
                         ::/0        all     deny""")
         self.config.set('Access', 'default', """127.0.0.1/32    all     trust
                         ::1/128     all     trust
+                        unix        all     trust
                         0.0.0.0/0   all     deny
                         ::/0        all     deny""")
 
@@ -115,94 +223,413 @@ class Open8055Server(threading.Thread):
         else:
             if self.config_fname is not None:
                 self.config.read(self.config_fname)
-                
+        if self.config_fname is not None:
+            self.config_stamp = file_stamp(self.config_fname)
+
+        # ----
+        # Complain about bad queue and capture settings now rather than
+        # on the first connect.
+        # ----
+        self.send_queue_config()
+        self.capture_config()
+
+        # ----
+        # Compile the access lists. Checking a client then takes a few
+        # dictionary lookups instead of parsing the lists again.
+        # ----
+        access = {}
+        for name in self.config.options('Access'):
+            try:
+                access[name] = Open8055AccessList(
+                        self.config.get('Access', name))
+            except Exception as err:
+                raise Exception('[Access] {0}: {1}'.format(name, str(err)))
+
+        # ----
+        # The same for the rules. Each card's reader picks up the list
+        # of its card on every INPUT report.
+        # ----
+        rules = {}
+        if self.config.has_section('Rules'):
+            for name in sorted(self.config.options('Rules')):
+                try:
+                    rule = Open8055Rule(name, self.config.get('Rules', name))
+                except Exception as err:
+                    raise Exception('[Rules] {0}: {1}'.format(name, str(err)))
+                rules.setdefault(rule.cardid, []).append(rule)
+
+        self.access = access
+        self.rules = rules
+        self.users_fname = self.users_file()
 
     # ----------
-    # run()
+    # reload_config()
+    #
+    #   Load the config file again, on SIGHUP or when it changed. If
+    #   that fails, the old configuration stays in effect. The server
+    #   sockets are not created again, so server_port and unix_socket
+    #   only change with a restart.
     # ----------
-    def run(self):
-        while True:
-            self.lock.acquire()
-            if self.status != MODE_RUN:
-                # ----
-                # On STOP notify all existing clients to close and
-                # wait for them to finish.
-                # ----
-                for client in self.clients:
-                    client.set_status(MODE_STOP)
+    def reload_config(self):
+        old_config, old_access = self.config, self.access
+        try:
+            self.load_config(None, True)
+        except Exception as err:
+            self.config, self.access = old_config, old_access
+            log_error('reloading {0} failed: {1}'.format(
+                    self.config_fname, str(err)))
+            return
+        log_info('configuration reloaded from {0}'.format(self.config_fname))
 
-                for client in self.clients:
-                    client.join()
+    # ----------
+    # request_reload()
+    #
+    #   Have the event loop reload the config file. Called from the
+    #   SIGHUP handler.
+    # ----------
+    def request_reload(self):
+        self.wake_lock.acquire()
+        self.reload_wanted = True
+        self.wakeup_locked()
+        self.wake_lock.release()
 
-                # ----
-                # Close the server socket.
-                # ----
-                self.sock.shutdown(socket.SHUT_RDWR)
-                self.sock.close()
+    # ----------
+    # check_config_file()
+    #
+    #   Timer that reloads the config file when it changed.
+    # ----------
+    def check_config_file(self):
+        self.schedule(time.time() + CONFIG_CHECK_INTERVAL,
+                self.check_config_file)
+        if self.config_fname is None:
+            return
+        stamp = file_stamp(self.config_fname)
+        if stamp is not None and stamp != self.config_stamp:
+            self.reload_config()
 
-                # ----
-                # Finally set the status to STOPPED and end this thread.
-                # ----
-                self.status = MODE_STOPPED
-                self.lock.release()
-                return
-            self.lock.release()
+    # ----------
+    # run()
+    #
+    #   The event loop. One thread waits for the server sockets, all
+    #   client connections and the wakeup socket at once, and handles
+    #   whatever is ready. Only the card readers have threads of their
+    #   own, since reading a card blocks.
+    # ----------
+    def run(self):
+        listeners = {self.sock.fileno(): self.sock}
+        if self.unix_sock is not None:
+            listeners[self.unix_sock.fileno()] = self.unix_sock
+        for fd, lsock in listeners.items():
+            lsock.setblocking(0)
+            self.poller.register(fd)
+        self.poller.register(self.wake_r.fileno())
+        open8055io.set_write_notify(self.wake_w.fileno())
+        self.schedule(time.time() + CONFIG_CHECK_INTERVAL,
+                self.check_config_file)
+        if self.metrics_httpd is not None:
+            thread = threading.Thread(target = self.metrics_httpd.serve_forever,
+                    args = (0.5, ))
+            thread.daemon = True
+            thread.start()
+        directory, file_size, files = self.capture_config()
+        if directory:
+            self.capture = Open8055Capture(directory, file_size, files)
+            self.capture.start()
+            log_info('capturing to ' + directory)
 
+        while self.get_status() == MODE_RUN:
             # ----
-            # We are still in RUN mode. Wait for a new client to connect.
+            # Sleep until something is ready, the next timer is due
+            # or the next held card expires.
             # ----
+            timeout = self.run_timers()
+            held = self.expire_held()
+            if timeout is None or (held is not None and held < timeout):
+                timeout = held
             try:
-                rdy, _dummy, _dummy = select.select((self.sock,), (), (), 2.0)
+                events = self.poller.poll(timeout)
             except Exception as err:
-                log_error('select() on server socket failed:' + str(err))
-                self.lock.acquire()
-                self.status = MODE_STOPPED
-                self.lock.release()
-                return
+                log_error('poll() failed: ' + str(err))
+                break
 
-            # ----
-            # Whenever we get a new client connection or the select() has
-            # timed out we try to clean up after terminated clients.
-            # ----
-            self.reaper()
+            for fd, readable, writable in events:
+                if fd == self.wake_r.fileno():
+                    self.handle_wakeup()
+                elif fd in listeners:
+                    self.accept_client(listeners[fd])
+                else:
+                    client = self.clients.get(fd)
+                    if client is not None and writable:
+                        client.flush()
+                    if client is not None and readable:
+                        client.handle_input()
 
-            # ----
-            # If no client connected, just loop.
-            # ----
-            if len(rdy) == 0:
-                continue
+        # ----
+        # Asked to STOP, or the loop failed. End all sessions, without
+        # holding any cards, and close the held ones.
+        # ----
+        for client in self.clients.values():
+            client.end_session(False)
+        self.expire_held(True)
 
-            # ----
-            # Accept new client connection.
-            # ----
+        # ----
+        # Close the server sockets.
+        # ----
+        try:
+            self.sock.shutdown(socket.SHUT_RDWR)
+        except Exception:
+            pass
+        self.sock.close()
+        if self.unix_sock is not None:
+            self.unix_sock.close()
             try:
-                conn, addr = self.sock.accept()
+                os.unlink(self.unix_path)
             except Exception as err:
-                log_error('accept() on server socket failed:' + str(err))
-                self.lock.acquire()
-                self.status = MODE_STOPPED
-                self.lock.release()
-                return
+                log_error('cannot remove {0}: {1}'.format(
+                        self.unix_path, str(err)))
+        if self.metrics_httpd is not None:
+            self.metrics_httpd.shutdown()
+            self.metrics_httpd.server_close()
+        self.poller.close()
+        if self.capture is not None:
+            self.capture.stop()
 
-            # ----
-            # Check the client address against the [Access] config section.
-            # ----
-            if not self.check_connect_access(addr):
-                log_error('client {0}: connect denied'.format(addr))
-                try:
-                    conn.send('ERROR access denied\n')
-                    conn.shutdown(socket.SHUT_RDWR)
-                    conn.close()
-                    continue
-                except:
-                    continue
+        # ----
+        # Finally set the status to STOPPED and end this thread.
+        # ----
+        self.lock.acquire()
+        self.status = MODE_STOPPED
+        self.lock.release()
 
-            # ----
-            # Create a client thread for it and add it to the list.
-            # ----
-            client = Open8055Client(self, conn, addr)
-            self.clients.append(client)
-            client.start()
+    # ----------
+    # accept_client()
+    #
+    #   Accept a new connection on one of the server sockets and start
+    #   a session for it.
+    # ----------
+    def accept_client(self, lsock):
+        # ----
+        # A Unix domain client is identified by its peer credentials
+        # instead of an address.
+        # ----
+        try:
+            conn, addr = lsock.accept()
+            if lsock is self.unix_sock:
+                addr = ('unix', ) + self.get_peer_credentials(conn)
+        except socket.error as err:
+            if err.errno not in (errno.EAGAIN, errno.EWOULDBLOCK,
+                    errno.ECONNABORTED, errno.EINTR):
+                log_error('accept() on server socket failed: ' + str(err))
+            return
+
+        # ----
+        # Check the client address against the [Access] config section.
+        # ----
+        start = time.time()
+        allowed = self.check_connect_access(addr)
+        self.metrics.observe('open8055_auth_check_seconds',
+                (('check', 'connect'), ), time.time() - start)
+        if not allowed:
+            log_error('client {0}: connect denied'.format(addr))
+            try:
+                conn.send('ERROR access denied\n')
+                conn.shutdown(socket.SHUT_RDWR)
+                conn.close()
+            except:
+                pass
+            return
+
+        # ----
+        # Client messages are small and latency sensitive. Don't
+        # let Nagle's algorithm delay them.
+        # ----
+        if addr[0] != 'unix':
+            try:
+                conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            except Exception as err:
+                log_error('client {0}: TCP_NODELAY: {1}'.format(
+                        addr, str(err)))
+
+        # ----
+        # From here on the connection is only ever read and written
+        # without blocking.
+        # ----
+        conn.setblocking(0)
+        client = Open8055Client(self, conn, addr)
+        self.clients[client.fd] = client
+        self.poller.register(client.fd)
+        if self.capture is not None:
+            self.capture.put(open8055proto.CAPTURE_CONNECT, 0,
+                    client.number, str(addr))
+        client.hello()
+
+    # ----------
+    # remove_client()
+    #
+    #   Forget a client whose session ended. Called by the client.
+    # ----------
+    def remove_client(self, client):
+        if self.clients.pop(client.fd, None) is not None:
+            self.poller.unregister(client.fd)
+            if self.capture is not None:
+                self.capture.put(open8055proto.CAPTURE_DISCONNECT, 0,
+                        client.number, '')
+
+    # ----------
+    # wakeup()
+    #
+    #   Make the event loop look at what other threads left for it.
+    # ----------
+    def wakeup(self):
+        self.wake_lock.acquire()
+        self.wakeup_locked()
+        self.wake_lock.release()
+
+    # ----------
+    # wakeup_locked()
+    #
+    #   The same for callers holding wake_lock. One byte in the socket
+    #   is enough, however many things are waiting.
+    # ----------
+    def wakeup_locked(self):
+        if not self.wake_pending:
+            self.wake_pending = True
+            try:
+                self.wake_w.send('x')
+            except socket.error:
+                pass
+
+    # ----------
+    # handle_wakeup()
+    #
+    #   Take over what other threads left for the event loop.
+    # ----------
+    def handle_wakeup(self):
+        try:
+            self.wake_r.recv(4096)
+        except socket.error:
+            pass
+
+        self.wake_lock.acquire()
+        self.wake_pending = False
+        flush_wanted = self.flush_wanted
+        self.flush_wanted = []
+        readers_failed = self.readers_failed
+        self.readers_failed = False
+        readers_stopped = self.readers_stopped
+        self.readers_stopped = []
+        reload_wanted = self.reload_wanted
+        self.reload_wanted = False
+        self.wake_lock.release()
+
+        if reload_wanted:
+            self.reload_config()
+
+        for client in flush_wanted:
+            if self.clients.get(client.fd) is client:
+                client.flush()
+        if readers_failed:
+            for client in self.clients.values():
+                client.check_readers()
+        for reader in readers_stopped:
+            self.reap_reader(reader)
+
+        # ----
+        # The device module wakes us up as well once a write we wait
+        # for is done, or there is room for one.
+        # ----
+        for reader in list(self.write_waiting):
+            if not reader.check_writes():
+                self.write_waiting.discard(reader)
+
+    # ----------
+    # want_flush()
+    #
+    #   Called when data for a client is left queued, so that the
+    #   event loop writes it once the connection can take it.
+    # ----------
+    def want_flush(self, client):
+        self.wake_lock.acquire()
+        self.flush_wanted.append(client)
+        self.wakeup_locked()
+        self.wake_lock.release()
+
+    # ----------
+    # reader_failed()
+    #
+    #   Called by a card reader that ended on its own.
+    # ----------
+    def reader_failed(self):
+        self.wake_lock.acquire()
+        self.readers_failed = True
+        self.wakeup_locked()
+        self.wake_lock.release()
+
+    # ----------
+    # reader_stopped()
+    #
+    #   Called by a card reader that was stopped, once it closed the
+    #   card.
+    # ----------
+    def reader_stopped(self, reader):
+        self.wake_lock.acquire()
+        self.readers_stopped.append(reader)
+        self.wakeup_locked()
+        self.wake_lock.release()
+
+    # ----------
+    # schedule()
+    #
+    #   Have the event loop call func() at the given time. Can be
+    #   called from any thread.
+    # ----------
+    def schedule(self, when, func):
+        self.wake_lock.acquire()
+        self.timer_seq += 1
+        heapq.heappush(self.timers, (when, self.timer_seq, func))
+        if self.timers[0][1] == self.timer_seq:
+            self.wakeup_locked()
+        self.wake_lock.release()
+
+    # ----------
+    # run_timers()
+    #
+    #   Call the timers that are due. Returns the seconds until the
+    #   next one, or None if there is none.
+    # ----------
+    def run_timers(self):
+        while True:
+            self.wake_lock.acquire()
+            if len(self.timers) == 0:
+                self.wake_lock.release()
+                return None
+            delay = self.timers[0][0] - time.time()
+            if delay > 0.0:
+                self.wake_lock.release()
+                return delay
+            _when, _seq, func = heapq.heappop(self.timers)
+            self.wake_lock.release()
+
+            try:
+                func()
+            except Exception as err:
+                log_error('timer: ' + str(err))
+
+    # ----------
+    # get_peer_credentials()
+    #
+    #   Return (pid, uid, gid) of the process at the other end of a
+    #   Unix domain connection, or -1s where the platform can't tell.
+    # ----------
+    def get_peer_credentials(self, conn):
+        if not sys.platform.startswith('linux'):
+            return (-1, -1, -1)
+        try:
+            return struct.unpack('3i', conn.getsockopt(socket.SOL_SOCKET,
+                    SO_PEERCRED, struct.calcsize('3i')))
+        except Exception as err:
+            log_error('SO_PEERCRED: ' + str(err))
+            return (-1, -1, -1)
 
     # ----------
     # check_connect_access()
@@ -212,8 +639,7 @@ class Open8055Server(threading.Thread):
     # ----------
     def check_connect_access(self, addr):
         try:
-            result = self.lookup_auth_method(addr[0], None,
-                    self.config.get('Access', 'connect'))
+            result = self.lookup_auth_method(addr, None, 'connect')
         except Exception as err:
             log_error('lookup_auth_method() failed: ' + str(err))
             return False
@@ -233,8 +659,7 @@ class Open8055Server(threading.Thread):
         # Get the required authentication method based on client address.
         # ----
         try:
-            auth_required = self.lookup_auth_method(addr[0], user,
-                    self.config.get('Access', 'connect'))
+            auth_required = self.lookup_auth_method(addr, user, 'connect')
         except Exception as err:
             log_error('lookup_auth_method() failed: ' + str(err))
             return False
@@ -277,14 +702,13 @@ class Open8055Server(threading.Thread):
         # ----
         # Get the required authentication method based on client address.
         # ----
-        if self.config.has_option('Access', 'card_' + str(cardid)):
+        if 'card_' + str(cardid) in self.access:
             access_list = 'card_' + str(cardid)
         else:
             access_list = 'default'
 
         try:
-            auth_required = self.lookup_auth_method(addr[0], user,
-                    self.config.get('Access', access_list))
+            auth_required = self.lookup_auth_method(addr, user, access_list)
         except Exception as err:
             log_error('lookup_auth_method() failed: ' + str(err))
             return False
@@ -321,594 +745,3118 @@ class Open8055Server(threading.Thread):
     # ----
     def check_user_password(self, user, password, salt):
         try:
-            # ----
-            # Locate the users file
-            # ----
-            fname = self.config.get('General', 'users_file')
-            if not os.path.isabs(fname):
-                if self.config_fname is not None:
-                    fname = os.path.realpath(os.path.join(
-                            os.path.dirname(
-                            os.path.realpath(self.config_fname)), fname))
-                else:
-                    fname = os.path.realpath(os.path.join(
-                            os.path.dirname(os.path.realpath(__file__)), fname))
-
-            # ----
-            # Read the users file.
-            # ----
-            fd = open(fname, 'r')
-            while True:
-                line = fd.readline()
-                if len(line) == 0:
-                    break
-                auth_user, auth_issuper, auth_password = line.strip().split(':')
-                if auth_user != user:
-                    continue
-                if len(auth_password) != 35 or auth_password[0:3] != 'md5':
-                    auth_password = 'md5' + hashlib.md5(
-                            auth_password).hexdigest()
-                # ----
-                # This is the user. If the given password starts with 'md5'
-                # and is 35 characters long, we expect it to be the md5 hash
-                # of the SALT and the hashed real user password (double hash).
-                # This is done to prevent password repeat attacks.
-                # ----
-                if len(password) == 35 and password[0:3] == 'md5':
-                    salt_password = hashlib.md5(
-                            salt + auth_password[3:]).hexdigest()
-                    if password[3:] == salt_password:
-                        # ----
-                        # That matched. This is a double hashed md5.
-                        # ----
-                        fd.close()
-                        return True, bool(auth_issuper), 'md5'
-                # ----
-                # This is certainly not a double hashed md5. Test if it
-                # is a plain password.
-                # ----
-                if hashlib.md5(password).hexdigest() == auth_password[3:]:
-                    # ----
-                    # This matched, but is only 'plain' authentication.
-                    # ----
-                    fd.close()
-                    return True, bool(auth_issuper), 'plain'
-
-                # ----
-                # Password mismatch
-                # ----
-                fd.close()
-                return False, False, 'none'
-
-            # ----
-            # User not found in users file.
-            # ----
-            fd.close()
-            return False, False, 'none'
+            entry = self.users.lookup(self.users_fname, user)
         except Exception as err:
             log_error('{0}: {1}'.format(
                     self.config.get('General', 'users_file'), err))
             return False, False, 'none'
-            
-    # ----------
-    # lookup_auth_method()
-    #
-    #   Try to match the give IP address to the narrowest network or
-    #   host address in the access list. 
-    # ----------
-    def lookup_auth_method(self, ipaddr, user, access_list):
+
         # ----
-        # We work everything IPV6 mapped
+        # User not found in users file.
         # ----
-        ipaddr = netaddr.IPAddress(ipaddr).ipv6()
-
-        re_comment = re.compile('^[ \t]*[#;]')
-        re_lines = re.compile('[ \t\r]*\n[ \t\r]*')
-        re_blank = re.compile('[ \t]+')
+        if entry is None:
+            return False, False, 'none'
+        auth_issuper, auth_hash = entry
 
         # ----
-        # Process the access list line by line, stop at the first match.
+        # This is the user. If the given password starts with 'md5'
+        # and is 35 characters long, we expect it to be the md5 hash
+        # of the SALT and the hashed real user password (double hash).
+        # This is done to prevent password repeat attacks.
         # ----
-        for line in re_lines.split(access_list.strip()):
-            # ----
-            # Ignore empty lines and comments.
-            # ----
-            if len(line) == 0:
-                continue
-            if re_comment.match(line):
-                continue
-            
+        if len(password) == 35 and password[0:3] == 'md5':
+            salt_password = hashlib.md5(salt + auth_hash).hexdigest()
+            if password[3:] == salt_password:
+                # ----
+                # That matched. This is a double hashed md5.
+                # ----
+                return True, auth_issuper, 'md5'
+        # ----
+        # This is certainly not a double hashed md5. Test if it
+        # is a plain password.
+        # ----
+        if hashlib.md5(password).hexdigest() == auth_hash:
             # ----
-            # Split the line into network address, auth-user  and auth-result.
-            # Return the result if the ipaddr falls into the network.
+            # This matched, but is only 'plain' authentication.
             # ----
-            network, auth_user, result = re_blank.split(line)
-            network = netaddr.IPNetwork(network).ipv6()
-            if user is not None and auth_user != 'all':
-                if user != auth_user:
-                    continue
-
-            if len(netaddr.all_matching_cidrs(ipaddr, (network, ))) > 0:
-                return result
+            return True, auth_issuper, 'plain'
 
         # ----
-        # No match at all? This should not happen. The detault config
-        # contains "deny" lines for INADDR_ANY and its IPV6 counterpart.
+        # Password mismatch
         # ----
-        return 'deny'
+        return False, False, 'none'
+
+    # ----------
+    # users_file()
+    #
+    #   The path of the users file. A relative name is taken relative
+    #   to the config file, or to the server without one.
+    # ----------
+    def users_file(self):
+        fname = self.config.get('General', 'users_file')
+        if os.path.isabs(fname):
+            return fname
+        if self.config_fname is not None:
+            return os.path.realpath(os.path.join(os.path.dirname(
+                    os.path.realpath(self.config_fname)), fname))
+        return os.path.realpath(os.path.join(
+                os.path.dirname(os.path.realpath(__file__)), fname))
+            
+    # ----------
+    # lookup_auth_method()
+    #
+    #   Find the first entry of the named access list that matches the
+    #   client address and user. Unix domain clients match the "unix"
+    #   entries instead.
+    # ----------
+    def lookup_auth_method(self, addr, user, access_list):
+        acl = self.access[access_list]
+        if addr[0] == 'unix':
+            return acl.lookup_unix(self, addr, user)
+        return acl.lookup_ip(ip_address_value(addr[0]), user)
         
     # ----------
-    # reaper()
+    # match_unix_peer()
     #
-    #   Check if any client threads have ended. Join them and
-    #   remove them from the list of clients.
+    #   Check the peer credentials of a Unix domain client against
+    #   an access list entry "unix", "unix:uid=N", "unix:gid=N",
+    #   "unix:user=NAME" or "unix:group=NAME". A group matches the
+    #   peer's primary group and the groups its user is listed in.
     # ----------
-    def reaper(self):
-        clients = []
-        for client in self.clients:
-            if client.get_status() == MODE_STOPPED:
-                client.join()
-            else:
-                clients.append(client)
-        self.clients = clients
+    def match_unix_peer(self, network, addr):
+        _kind, _pid, uid, gid = addr
+        if network == 'unix':
+            return True
+
+        key, _sep, value = network[5:].partition('=')
+        if key == 'uid':
+            return uid == int(value)
+        if key == 'gid':
+            return gid == int(value)
+        try:
+            if key == 'user':
+                return uid == pwd.getpwnam(value).pw_uid
+            if key == 'group':
+                group = grp.getgrnam(value)
+                if gid == group.gr_gid:
+                    return True
+                return pwd.getpwuid(uid).pw_name in group.gr_mem
+        except KeyError:
+            # ----
+            # Unknown user or group names simply don't match.
+            # ----
+            return False
+        raise Exception('invalid access entry ' + network)
 
     # ----------
-    # get_status()
+    # hold_channel()
     #
-    #   Get the current run status of the server.
+    #   Keep the card of a client that lost its connection open for
+    #   resume_grace seconds, so that the client can RESUME it with
+    #   its token. The reader goes on caching the card's reports.
     # ----------
-    def get_status(self):
-        self.lock.acquire()
-        ret = self.status
-        self.lock.release()
-        return ret
+    def hold_channel(self, chan, addr):
+        self.held_lock.acquire()
+        chan.hold_until = time.time() + self.resume_grace()
+        self.held[chan.token] = chan
+        self.held_lock.release()
+        log_info('client {0}: holding card {1} for {2} seconds'.format(
+                addr, chan.cardid, self.resume_grace()))
 
     # ----------
-    # shutdown()
+    # take_held()
     #
-    #   Set the run status of the server to STOP and wait for
-    #   the thread accepting client connections to end. This
-    #   also implies that all client connections have been
-    #   terminated.
+    #   Remove a held channel by token, or the controlling one of a
+    #   card if token is None, and return it.
     # ----------
-    def shutdown(self):
-        self.lock.acquire()
-        self.status = MODE_STOP
-        self.lock.release()
-        self.join()
+    def take_held(self, token, cardid = None):
+        self.held_lock.acquire()
+        try:
+            if token is None:
+                for chan in self.held.values():
+                    if chan.cardid == cardid and not chan.readonly:
+                        token = chan.token
+            return self.held.pop(token, None)
+        finally:
+            self.held_lock.release()
 
-        
-# ----------------------------------------------------------------------
-# Open8055Client
-#
-#   Class implementing the thread handling one client connection.
-# ----------------------------------------------------------------------
-class Open8055Client(threading.Thread):
     # ----------
-    # __init__()
+    # expire_held()
+    #
+    #   Close held channels whose grace period is over, or all of them.
+    #   Returns the number of seconds until the next one expires, or
+    #   None if no card is held.
     # ----------
-    def __init__(self, server, conn, addr):
-        threading.Thread.__init__(self)
+    def expire_held(self, expire_all = False):
+        now = time.time()
+        expired = []
+        timeout = None
+
+        self.held_lock.acquire()
+        for token, chan in self.held.items():
+            if expire_all or chan.hold_until <= now:
+                expired.append(chan)
+                del self.held[token]
+            elif timeout is None or chan.hold_until - now < timeout:
+                timeout = chan.hold_until - now
+        self.held_lock.release()
+
+        for chan in expired:
+            log_info('closing held card {0}'.format(chan.cardid))
+            chan.close('held card {0}'.format(chan.cardid))
+        return timeout
 
-        self.server = server
-        self.status = MODE_RUN
+    # ----------
+    # resume_grace()
+    #
+    #   Seconds a card is held after its client lost the connection.
+    # ----------
+    def resume_grace(self):
+        return float(self.config.get('General', 'resume_grace'))
 
-        self.lock = threading.Lock()
+    # ----------
+    # state_cache()
+    #
+    #   Seconds the last known state of a closed card is trusted when
+    #   the card is opened again.
+    # ----------
+    def state_cache(self):
+        return float(self.config.get('General', 'state_cache'))
+
+    # ----------
+    # send_queue_config()
+    #
+    #   Default depth, overflow policy and block timeout of the
+    #   outbound queue of new clients.
+    # ----------
+    def send_queue_config(self):
+        depth = int(self.config.get('General', 'send_queue'))
+        policy = self.config.get('General', 'send_policy')
+        timeout = float(self.config.get('General', 'send_timeout'))
+        if depth < 1:
+            raise Exception('invalid send_queue ' + str(depth))
+        if policy not in Open8055Outbox.POLICIES:
+            raise Exception('invalid send_policy ' + policy)
+        return (depth, policy, timeout)
+
+    # ----------
+    # capture_config()
+    #
+    #   Directory, size in bytes at which to start a new file and the
+    #   number of files to keep of the capture. The directory is empty
+    #   when capturing is off, which it always is while replaying one,
+    #   so that rotation can't remove what is played back. A relative
+    #   one is taken relative to the config file, like users_file.
+    # ----------
+    def capture_config(self):
+        directory = self.config.get('General', 'capture_dir')
+        if os.environ.get('OPEN8055_REPLAY'):
+            directory = ''
+        file_size = int(self.config.get('General', 'capture_file_size'))
+        files = int(self.config.get('General', 'capture_files'))
+        if file_size < 1:
+            raise Exception('invalid capture_file_size ' + str(file_size))
+        if files < 1:
+            raise Exception('invalid capture_files ' + str(files))
+        if directory and not os.path.isabs(directory):
+            if self.config_fname is not None:
+                base = os.path.dirname(os.path.realpath(self.config_fname))
+            else:
+                base = os.path.dirname(os.path.realpath(__file__))
+            directory = os.path.join(base, directory)
+        return (directory, file_size * 1024 * 1024, files)
+
+    # ----------
+    # attach_card()
+    #
+    #   Give a new channel its card's reader. The first channel of a
+    #   card opens it and starts the reader, later ones share that,
+    #   so the card is read once for all of them. Only one channel
+    #   that is not read-only may have it at a time. A card closed
+    #   less than state_cache seconds ago starts out with the state it
+    #   had then. Returns True if the card was just opened and its
+    #   state is not known, so it has to be asked for with GETCONFIG.
+    #   Reports are sent to the channel once the client calls the
+    #   reader's join_channel().
+    # ----------
+    def attach_card(self, chan):
+        self.cards_lock.acquire()
+        try:
+            reader = self.cards.get(chan.cardid)
+            if reader is not None:
+                if reader.get_status() == MODE_STOPPED:
+                    raise Exception('card {0} failed'.format(chan.cardid))
+                if not chan.readonly and reader.controller is not None:
+                    raise Exception('card already open')
+                chan.cardio = reader
+                unknown = False
+            else:
+                open8055io.open(chan.cardid)
+                state = self.card_states.get(chan.cardid)
+                if state is None:
+                    state = Open8055CardState()
+                    self.card_states[chan.cardid] = state
+                elif time.time() - state.closed > self.state_cache():
+                    state.forget()
+                state.closed = None
+
+                chan.cardio = Open8055Reader(self, chan.cardid, state)
+                chan.cardio.start()
+                self.cards[chan.cardid] = chan.cardio
+                unknown = not state.complete()
+            chan.cardio.attach(chan)
+            return unknown
+        finally:
+            self.cards_lock.release()
+
+    # ----------
+    # detach_card()
+    #
+    #   Take a channel off its card's reader. The last one to go
+    #   stops the reader, which closes the card. Nothing here waits
+    #   for that, the reader may be stuck on a client's full queue.
+    #   The card's state is kept for when it is opened again.
+    # ----------
+    def detach_card(self, chan, addr):
+        self.cards_lock.acquire()
+        try:
+            reader = chan.cardio
+            if reader.detach(chan) > 0:
+                return
+            del self.cards[chan.cardid]
+            if not reader.stop():
+                reader.close_card()
+                return
+
+            # ----
+            # The reader closes the card itself. Have the card send an
+            # INPUT report, so that it notices without waiting for its
+            # read timeout. Until reap_reader() is called the card can't
+            # be opened again.
+            # ----
+            self.stopping[chan.cardid] = reader
+            try:
+                open8055io.write_nowait(chan.cardid,
+                        struct.pack('B', open8055proto.HID_GETINPUT))
+            except Exception as err:
+                log_error('client {0}: {1}'.format(str(addr), str(err)))
+        finally:
+            self.cards_lock.release()
+
+    # ----------
+    # card_stopping()
+    #
+    #   Check if a card is still being closed by its reader. If so the
+    #   client is resumed by reap_reader() once that is done.
+    # ----------
+    def card_stopping(self, cardid, client):
+        self.cards_lock.acquire()
+        try:
+            if cardid not in self.stopping:
+                return False
+            self.card_waiters.setdefault(cardid, []).append(client)
+            return True
+        finally:
+            self.cards_lock.release()
+
+    # ----------
+    # reap_reader()
+    #
+    #   Forget a reader that closed its card and let the clients that
+    #   wanted to open the card go on.
+    # ----------
+    def reap_reader(self, reader):
+        self.cards_lock.acquire()
+        if self.stopping.get(reader.cardid) is reader:
+            del self.stopping[reader.cardid]
+        waiters = self.card_waiters.pop(reader.cardid, [])
+        self.cards_lock.release()
+
+        for client in waiters:
+            if self.clients.get(client.fd) is client:
+                client.unpark()
+
+    # ----------
+    # get_status()
+    #
+    #   Get the current run status of the server.
+    # ----------
+    def get_status(self):
+        self.lock.acquire()
+        ret = self.status
+        self.lock.release()
+        return ret
+
+    # ----------
+    # get_metrics()
+    #
+    #   The counters and histograms, plus what is looked up right now:
+    #   the rate of each card and the queue of each client. Returns
+    #   the list of samples for Open8055Metrics.format().
+    # ----------
+    def get_metrics(self):
+        gauges = []
+        clients = self.clients.values()
+        self.cards_lock.acquire()
+        readers = self.cards.items()
+        self.cards_lock.release()
+
+        for cardid, reader in readers:
+            gauges.append(('open8055_card_reports_per_second',
+                    (('card', str(cardid)), ), reader.rate))
+        for client in clients:
+            labels = (('client', '/'.join([str(x) for x in client.addr])), )
+            depth, high_water, dropped, merged = client.outbox.get_counts()
+            gauges.append(('open8055_client_queue_depth', labels, depth))
+            gauges.append(('open8055_client_queue_high_water', labels,
+                    high_water))
+            gauges.append(('open8055_client_dropped_total', labels, dropped))
+            gauges.append(('open8055_client_merged_total', labels, merged))
+        for cardid, rules in self.rules.items():
+            for rule in rules:
+                labels = (('card', str(cardid)), ('rule', rule.name))
+                gauges.append(('open8055_rule_evaluations_total', labels,
+                        rule.evaluations))
+                gauges.append(('open8055_rule_hits_total', labels, rule.hits))
+                gauges.append(('open8055_rule_seconds_total', labels,
+                        rule.seconds))
+        if self.capture is not None:
+            records, nbytes, dropped = self.capture.get_counts()
+            gauges.append(('open8055_capture_records_total', (), records))
+            gauges.append(('open8055_capture_bytes_total', (), nbytes))
+            gauges.append(('open8055_capture_dropped_total', (), dropped))
+        gauges.append(('open8055_clients', (), len(clients)))
+        gauges.append(('open8055_reader_threads', (), len(readers)))
+        gauges.append(('open8055_threads', (), threading.active_count()))
+        return self.metrics.samples(gauges)
+
+    # ----------
+    # shutdown()
+    #
+    #   Set the run status of the server to STOP and wait for
+    #   the event loop to end. This also implies that all client
+    #   connections have been terminated.
+    # ----------
+    def shutdown(self):
+        self.lock.acquire()
+        self.status = MODE_STOP
+        self.lock.release()
+        self.wakeup()
+        self.join()
+
+        
+# ----------------------------------------------------------------------
+# Open8055Client
+#
+#   Class implementing one client connection. It has no thread of its
+#   own. The server's event loop calls handle_input() when data came in
+#   and flush() when queued data can be written.
+# ----------------------------------------------------------------------
+class Open8055Client:
+    # ----------
+    # __init__()
+    # ----------
+    def __init__(self, server, conn, addr):
+        self.server = server
+        self.status = MODE_RUN
+
+        self.lock = threading.Lock()
         self.conn = conn
+        self.fd = conn.fileno()
         self.inbuf = ''
         self.addr = addr
+        server.connections += 1
+        self.number = server.connections    # in capture files
 
         self.user = None
-        self.salt = '{0:016x}'.format(random.getrandbits(64))
+        self.salt = os.urandom(8).encode('hex')
 
-        self.cardid = -1
-        self.cardio = None
+        self.channels = {}              # open cards by channel number
+        self.msg_channel = 0            # channel of the current command
+
+        self.binary = False
+        self.send_seq = 0
+        self.recv_time = 0.0
+
+        self.udp_sock = None            # for INPUT reports over UDP
+
+        depth, policy, timeout = server.send_queue_config()
+        self.outbox = Open8055Outbox(self, depth, policy, timeout)
+        self.flush_wanted = False       # event loop told about queued data
+        self.write_wanted = False       # registered for writability
+        self.parked = None              # (channel, func) waiting for a card
 
     # ----------
-    # run()
+    # hello()
+    #
+    #   Send HELLO and SALT messages to new client.
     # ----------
-    def run(self):
+    def hello(self):
+        self.send('HELLO {0} {1}\n'.format(
+            Open8055Server.SERVERNAME, Open8055Server.VERSION))
+        self.send('SALT ' + self.salt + '\n')
+
+    # ----------
+    # handle_input()
+    #
+    #   Receive what the client sent and process all complete commands
+    #   in it. Ends the session on QUIT or when the remote disconnects.
+    # ----------
+    def handle_input(self):
+        try:
+            data = self.conn.recv(65536)
+        except socket.error as err:
+            if err.errno in (errno.EAGAIN, errno.EWOULDBLOCK, errno.EINTR):
+                return
+            log_error('client {0}: {1}'.format(str(self.addr), str(err)))
+            data = ''
+
         # ----
-        # Send HELLO and SALT messages to new client.
+        # Check of EOF
         # ----
+        if len(data) == 0:
+            self.end_session(True)
+            return
+
+        self.recv_time = time.time()
+        self.inbuf += data
+        self.process_input()
+
+    # ----------
+    # process_input()
+    #
+    #   Process the complete commands received so far. A command that
+    #   has to wait for a card being closed holds up the ones after it.
+    # ----------
+    def process_input(self):
+        while self.get_status() == MODE_RUN and self.parked is None:
+            try:
+                msg = self.next_message()
+            except Exception as err:
+                log_error('client {0}: {1}'.format(str(self.addr), str(err)))
+                self.end_session(True)
+                return
+            if msg is None:
+                break
+            self.dispatch(msg)
+
+        if self.get_status() == MODE_STOP:
+            self.end_session(False)
+
+    # ----------
+    # unpark()
+    #
+    #   Finish the command that waited for a card to be closed, then
+    #   go on with the input received meanwhile.
+    # ----------
+    def unpark(self):
+        self.msg_channel, func = self.parked
+        self.parked = None
         try:
-            self.send('HELLO {0} {1}\n'.format(
-                Open8055Server.SERVERNAME, Open8055Server.VERSION))
-            self.send('SALT ' + self.salt + '\n')
+            func()
         except Exception as err:
             log_error('client {0}: {1}'.format(str(self.addr), str(err)))
-            self.set_status(MODE_STOPPED)
-            return
+            try:
+                self.reply('ERROR ' + str(err) + '\n')
+            except:
+                pass
+        self.process_input()
+
+    # ----------
+    # dispatch()
+    #
+    #   Process one command.
+    # ----------
+    def dispatch(self, msg):
+        self.msg_channel = msg[3]
+        try:
+            # ----
+            # A SEND frame carries the raw report. For SENDACK the
+            # frame's sequence number is the command id.
+            # ----
+            capture = self.server.capture
+            if msg[0] == open8055proto.FRAME_SEND:
+                if capture is not None:
+                    capture.put(open8055proto.CAPTURE_SEND, msg[3],
+                            self.number, msg[1])
+                self.cmd_send_binary(msg[1])
+                return
+            if msg[0] == open8055proto.FRAME_SENDACK:
+                if capture is not None:
+                    capture.put(open8055proto.CAPTURE_SEND, msg[3],
+                            self.number, msg[1])
+                self.cmd_send_binary(msg[1], msg[2])
+                return
 
-        # ----
-        # Run until the main server thread tells us to STOP or
-        # the remote disconnects.
-        # ----
-        while self.get_status() == MODE_RUN:
             # ----
-            # See if we still have another command in the input buffer.
+            # Split the command line by spaces and process it.
             # ----
+            args = msg[1].strip().split(' ')
+            if capture is not None:
+                self.capture_command(capture, args)
+
+            if args[0].upper() == 'SEND':
+                self.cmd_send(args)
+
+            elif args[0].upper() == 'SENDACK':
+                self.cmd_sendack(args)
+
+            elif args[0].upper() == 'LIST':
+                self.cmd_list(args)
+
+            elif args[0].upper() == 'OPEN':
+                self.cmd_open(args)
+
+            elif args[0].upper() == 'WATCH':
+                self.cmd_open(args, True)
+
+            elif args[0].upper() == 'CLOSE':
+                self.cmd_close(args)
+
+            elif args[0].upper() == 'BINARY':
+                self.cmd_binary(args)
+
+            elif args[0].upper() == 'PING':
+                self.cmd_ping(args)
+
+            elif args[0].upper() == 'INPUTDELTA':
+                self.cmd_inputdelta(args)
+
+            elif args[0].upper() == 'KEYFRAME':
+                self.cmd_keyframe(args)
+
+            elif args[0].upper() == 'UDP':
+                self.cmd_udp(args)
+
+            elif args[0].upper() == 'SUBSCRIBE':
+                self.cmd_subscribe(args)
+
+            elif args[0].upper() == 'HOLD':
+                self.cmd_hold(args)
+
+            elif args[0].upper() == 'RESUME':
+                self.cmd_resume(args)
+
+            elif args[0].upper() == 'QUEUE':
+                self.cmd_queue(args)
+
+            elif args[0].upper() == 'STATUS':
+                self.cmd_status(args)
+
+            elif args[0].upper() == 'STATS':
+                self.cmd_stats(args)
+
+            elif args[0].upper() == 'STATE':
+                self.cmd_state(args)
+
+            elif args[0].upper() == 'QUIT':
+                self.set_status(MODE_STOP)
+
+            else:
+                self.reply('ERROR unknown command \'' +
+                        args[0].upper() + '\'\n')
+
+        except Exception as err:
+            log_error('client {0}: {1}'.format(str(self.addr), str(err)))
+            try:
+                self.reply('ERROR ' + str(err) + '\n')
+            except:
+                pass
+
+
+    # ----------
+    # capture_command()
+    #
+    #   Write a command line to the capture, without its password.
+    # ----------
+    def capture_command(self, capture, args):
+        secret = CAPTURE_SECRET_ARGS.get(args[0].upper())
+        if secret is not None and len(args) > secret:
+            args = args[:secret] + ['*****'] + args[secret + 1:]
+        capture.put(open8055proto.CAPTURE_TEXT, self.msg_channel,
+                self.number, ' '.join(args))
+
+    # ----------
+    # end_session()
+    #
+    #   Stop sending, close the cards and the connection. If the client
+    #   just lost the connection, cards it asked to HOLD stay open for
+    #   it to RESUME.
+    # ----------
+    def end_session(self, lost):
+        self.outbox.stop()
+        for chan in self.channels.values():
+            if lost and chan.token is not None:
+                self.lock.acquire()
+                chan.udp_addr = None
+                self.lock.release()
+                self.server.hold_channel(chan, self.addr)
+            else:
+                chan.close(self.addr)
+        self.channels = {}
+
+        if self.udp_sock is not None:
+            self.udp_sock.close()
+            self.udp_sock = None
+
+        # ----
+        # Write what is still queued, as far as the connection takes it
+        # without waiting, and close it. The reader of a held card still
+        # sends to us, into nothing from now on.
+        # ----
+        self.server.remove_client(self)
+        self.lock.acquire()
+        self.outbox.flush_locked()
+        try:
+            self.conn.shutdown(socket.SHUT_RDWR)
+        except Exception:
+            pass
+        self.conn.close()
+        self.conn = None
+        self.status = MODE_STOPPED
+        self.lock.release()
+        if self.outbox.dropped or self.outbox.merged:
+            log_info('client {0}: {1} reports dropped, {2} merged'.format(
+                    self.addr, self.outbox.dropped, self.outbox.merged))
+
+    # ----------
+    # next_message()
+    #
+    #   Take the next complete command off the input buffer. Returns
+    #   (FRAME_TEXT, line, seq, channel), (FRAME_SEND, report, seq,
+    #   channel) or (FRAME_SENDACK, report, seq, channel), or None if
+    #   more data is needed. In text mode seq is None and the channel
+    #   is always 0.
+    # ----------
+    def next_message(self):
+        if not self.binary:
             idx = self.inbuf.find('\n')
             if idx < 0:
-                # ----
-                # No NEWLINE in there, wait for more data.
-                # ----
-                try:
-                    rdy, _dummy, _dummy = select.select(
-                            (self.conn,), (), (), 2.0)
-                except Exception as err:
-                    log_error('client {0}: {1}'.format(
-                            str(self.addr), str(err)))
-                    break
+                return None
+            line = self.inbuf[0:idx]
+            self.inbuf = self.inbuf[idx + 1:]
+            return (open8055proto.FRAME_TEXT, line, None, 0)
+
+        frame = open8055proto.unpack_frame(self.inbuf)
+        if frame is None:
+            return None
+        ftype, channel, seq, payload, self.inbuf = frame
+        if ftype not in (open8055proto.FRAME_TEXT, open8055proto.FRAME_SEND,
+                open8055proto.FRAME_SENDACK):
+            raise open8055proto.ProtocolError(
+                    'unexpected frame type 0x{0:02X}'.format(ftype))
+        return (ftype, payload, seq, channel)
 
-                if self.cardio:
-                    if self.cardio.get_status() == MODE_STOPPED:
-                        log_error('client {0}: {1}'.format(
-                                str(self.addr), 'cardio stopped unexpected'))
-                        break
+    # ----------
+    # check_readers()
+    #
+    #   Look for reader threads that ended on their own. Such a card
+    #   is closed. On channel 0 the whole session ends, which is what
+    #   old clients expect.
+    # ----------
+    def check_readers(self):
+        for chan in self.channels.values():
+            if chan.cardio.get_status() != MODE_STOPPED:
+                continue
+            log_error('client {0}: card {1}: {2}'.format(
+                    str(self.addr), chan.cardid, 'cardio stopped unexpected'))
+            if chan.number == 0:
+                self.end_session(True)
+                return
+            del self.channels[chan.number]
+            chan.close(self.addr)
 
-                # ----
-                # If rdy is empty then this was just a timeout to check
-                # for STOP flag.
-                # ----
-                if len(rdy) == 0:
-                    continue
+    # ----------
+    # current_channel()
+    #
+    #   Return the card opened on the channel of the current command.
+    # ----------
+    def current_channel(self):
+        chan = self.channels.get(self.msg_channel)
+        if chan is None:
+            raise Exception('not connected to a card')
+        return chan
 
-                # ----
-                # Receive new data
-                # ----
-                try:
-                    data = self.conn.recv(256)
-                except Exception as err:
-                    log_error('client {0}: {1}'.format(
-                            str(self.addr), str(err)))
-                    break
+    # ----------
+    # cmd_list()
+    #
+    #   Reports available cards
+    # ----------
+    def cmd_list(self, args):
+        if len(args) != 3:
+            raise Exception('usage: LIST username password')
 
-                # ----
-                # Check of EOF
-                # ----
-                if len(data) == 0:
-                    break
-                
-                # ----
-                # Add the data to the input buffer. If there's still
-                # no NEWLINE, wait for more.
-                # ----
-                self.inbuf += data
-                idx = self.inbuf.find('\n')
-                if idx < 0:
-                    continue
+        start = time.time()
+        allowed = self.server.check_list_access(self.addr, 
+                args[1], args[2], self.salt)
+        self.server.metrics.observe('open8055_auth_check_seconds',
+                (('check', 'list'), ), time.time() - start)
+        if not allowed:
+            log_error('client {0}: LIST {1} ***** - permission denied'.format(
+                    self.addr, args[1]))
+            self.reply('ERROR permission denied\n')
+            return
+
+        response = 'LIST'
+        for cardid in range(0, Open8055Server.MAX_CARDS):
+            if open8055io.present(cardid):
+                response += ' ' + str(cardid)
+        self.reply(response + '\n')
+
+    # ----------
+    # cmd_open()
+    #
+    #   Open a card on the channel the command came in on. In binary
+    #   mode every channel can have its own card. Optional arguments
+    #   are those of SUBSCRIBE. WATCH opens it read-only, which any
+    #   number of clients can do besides the one that has it OPEN.
+    # ----------
+    def cmd_open(self, args, readonly = False):
+        if len(args) not in (4, 5, 7):
+            raise Exception('usage: {0} cardid username password '.format(
+                    args[0].upper()) +
+                    '[max_rate [adc1_deadband adc2_deadband]]')
+        if self.msg_channel in self.channels:
+            raise Exception('already connected to card ' +
+                    str(self.channels[self.msg_channel].cardid))
+
+        cardid = int(args[1])
+        start = time.time()
+        allowed = self.server.check_open_access(cardid, self.addr, 
+                args[2], args[3], self.salt)
+        self.server.metrics.observe('open8055_auth_check_seconds',
+                (('check', 'open'), ), time.time() - start)
+        if not allowed:
+            log_error('client {0}: {1} {2} {3} ***** - permission denied'.format(
+                    self.addr, args[0].upper(), args[1], args[2]))
+            self.reply('ERROR permission denied\n')
+            return
+
+        # ----
+        # A card still held for a client that lost its connection is
+        # given up now. Whoever is allowed to open it wins.
+        # ----
+        if not readonly:
+            held = self.server.take_held(None, cardid)
+            if held is not None:
+                log_info('client {0}: OPEN {1} ends its hold'.format(
+                        self.addr, cardid))
+                held.close(self.addr)
+
+        # ----
+        # A card whose last channel just left is being closed by its
+        # reader. It is opened once that is done.
+        # ----
+        if self.server.card_stopping(cardid, self):
+            self.parked = (self.msg_channel,
+                    lambda: self.open_channel(cardid, args, readonly))
+            return
+        self.open_channel(cardid, args, readonly)
+
+    # ----------
+    # open_channel()
+    #
+    #   The second half of cmd_open(), once the client may have the
+    #   card.
+    # ----------
+    def open_channel(self, cardid, args, readonly):
+        chan = Open8055Channel(self, self.msg_channel, cardid)
+        chan.readonly = readonly
+        try:
+            if len(args) > 4:
+                self.set_subscription(chan, args[4:])
+            unknown = self.server.attach_card(chan)
+        except:
+            chan.close(self.addr)
+            raise
+        self.channels[chan.number] = chan
+
+        if unknown:
+            # ----
+            # We send a GETCONFIG message to the card and the reader
+            # is going to suppress INPUT messages until OUTPUT and
+            # CONFIG1 have been reported.
+            # ----
+            chan.cardio.join_channel(chan)
+            data = struct.pack('B', 0x04)
+            open8055io.write_nowait(cardid, data)
+            if self.server.capture is not None:
+                self.server.capture.put(open8055proto.CAPTURE_CARD_WRITE,
+                        cardid, self.number, data)
+        else:
+            # ----
+            # The card is being read for others already, or was open
+            # a moment ago. Its current state comes from the cache.
+            # ----
+            self.lock.acquire()
+            try:
+                for data in chan.cardio.join_channel(chan):
+                    self.queue_report_locked(chan, data)
+            finally:
+                self.lock.release()
+
+    # ----------
+    # cmd_hold()
+    #
+    #   Have the card on the current channel held open for a while
+    #   should the connection be lost, and give the client the token
+    #   to RESUME it with.
+    # ----------
+    def cmd_hold(self, args):
+        if len(args) != 1:
+            raise Exception('usage: HOLD')
+        chan = self.current_channel()
+        grace = self.server.resume_grace()
+        if grace <= 0:
+            raise Exception('session resume disabled')
+
+        if chan.token is None:
+            chan.token = os.urandom(16).encode('hex')
+        self.reply('HOLD {0} {1:g}\n'.format(chan.token, grace))
+
+    # ----------
+    # cmd_resume()
+    #
+    #   Take over a held card on the current channel instead of opening
+    #   it. The token is the proof of having opened it before, so no
+    #   password is checked, and the card's current state comes from
+    #   the reader's cache instead of another GETCONFIG. Optional
+    #   arguments are those of SUBSCRIBE.
+    # ----------
+    def cmd_resume(self, args):
+        if len(args) not in (2, 3, 5):
+            raise Exception('usage: RESUME token ' +
+                    '[max_rate [adc1_deadband adc2_deadband]]')
+        if self.msg_channel in self.channels:
+            raise Exception('already connected to card ' +
+                    str(self.channels[self.msg_channel].cardid))
+
+        chan = self.server.take_held(args[1])
+        if chan is None:
+            raise Exception('unknown resume token')
+        if chan.cardio.get_status() == MODE_STOPPED:
+            chan.close(self.addr)
+            raise Exception('card {0} failed while held'.format(chan.cardid))
+
+        # ----
+        # Move the channel over. The reader and the channel's timer send
+        # to us from now on. Holding our lock while doing so keeps
+        # their reports behind the cached ones.
+        # ----
+        self.lock.acquire()
+        try:
+            chan.number = self.msg_channel
+            chan.delta_base = None
+            chan.input_sent = None
+            chan.input_held = None
+            chan.client = self
+            self.channels[chan.number] = chan
+            for data in chan.cardio.cached_reports():
+                self.queue_report_locked(chan, data)
+        finally:
+            self.lock.release()
+        log_info('client {0}: resumed card {1}'.format(self.addr, chan.cardid))
+
+        if len(args) > 2:
+            self.set_subscription(chan, args[2:])
+
+    # ----------
+    # cmd_close()
+    #
+    #   Close the card on the current channel and free the channel
+    #   for another OPEN.
+    # ----------
+    def cmd_close(self, args):
+        if len(args) != 1:
+            raise Exception('usage: CLOSE')
+        chan = self.current_channel()
+
+        del self.channels[chan.number]
+        chan.close(self.addr)
+        self.reply('CLOSED\n')
+
+    # ----------
+    # cmd_state()
+    #
+    #   Tell how fresh the card's state is, which an OPEN may have
+    #   answered from the server's cache.
+    # ----------
+    def cmd_state(self, args):
+        if len(args) != 1:
+            raise Exception('usage: STATE')
+        chan = self.current_channel()
+
+        seq, age = chan.cardio.get_state()
+        self.reply('STATE {0} {1:.3f}\n'.format(seq, age))
+
+    # ----------
+    # cmd_binary()
+    #
+    #   Switch this connection to binary framing.
+    # ----------
+    def cmd_binary(self, args):
+        if len(args) != 2:
+            raise Exception('usage: BINARY version')
+        if int(args[1]) != open8055proto.BINARY_VERSION:
+            raise Exception('unsupported binary protocol version ' + args[1])
+
+        # ----
+        # The response is the last text line. Sending it and switching
+        # happens under the lock so that no report from the reader
+        # can get in between. CHANNELS tells the client that it may
+        # open more than one card.
+        # ----
+        self.lock.acquire()
+        try:
+            self.queue_locked('BINARY {0} CHANNELS\n'.format(
+                    open8055proto.BINARY_VERSION))
+            self.binary = True
+        finally:
+            self.lock.release()
+
+    # ----------
+    # cmd_ping()
+    #
+    #   Echo the client's timestamp together with the times, in
+    #   microseconds, at which we received the PING and send the PONG.
+    #   The client subtracts the difference of the latter two from its
+    #   round trip measurement.
+    # ----------
+    def cmd_ping(self, args):
+        if len(args) != 2:
+            raise Exception('usage: PING timestamp')
+
+        self.reply('PONG {0} {1} {2}\n'.format(args[1],
+                int(self.recv_time * 1000000), int(time.time() * 1000000)))
+
+    # ----------
+    # cmd_inputdelta()
+    #
+    #   Switch INPUT reports to delta encoding with a full keyframe
+    #   every so many milliseconds, or back to full reports with 0.
+    # ----------
+    def cmd_inputdelta(self, args):
+        if len(args) != 2:
+            raise Exception('usage: INPUTDELTA keyframe_ms')
+        interval = int(args[1])
+        if interval < 0:
+            raise Exception('invalid keyframe interval ' + args[1])
+        chan = self.current_channel()
+
+        self.lock.acquire()
+        chan.input_delta = interval / 1000.0
+        chan.delta_base = None
+        self.lock.release()
+
+    # ----------
+    # cmd_keyframe()
+    #
+    #   Send the last INPUT report in full right away.
+    # ----------
+    def cmd_keyframe(self, args):
+        if len(args) != 1:
+            raise Exception('usage: KEYFRAME')
+        chan = self.current_channel()
+
+        self.lock.acquire()
+        try:
+            if chan.delta_base is not None:
+                self.queue_report_locked(chan, chan.delta_base, True)
+        finally:
+            self.lock.release()
+
+    # ----------
+    # cmd_udp()
+    #
+    #   Send the INPUT reports of the current card as datagrams to
+    #   the given port at the client's address, or over TCP again
+    #   if the port is 0.
+    # ----------
+    def cmd_udp(self, args):
+        if len(args) != 3 and not (len(args) == 2 and args[1] == '0'):
+            raise Exception('usage: UDP port token')
+        port = int(args[1])
+        if port < 0 or port > 65535:
+            raise Exception('invalid UDP port ' + args[1])
+        if port != 0 and self.addr[0] == 'unix':
+            raise Exception('UDP is not available on local connections')
+        chan = self.current_channel()
+
+        if port != 0 and self.udp_sock is None:
+            self.udp_sock = socket.socket(self.conn.family, socket.SOCK_DGRAM)
+
+        self.lock.acquire()
+        if port == 0:
+            chan.udp_addr = None
+        else:
+            chan.udp_addr = (self.addr[0], port) + tuple(self.addr[2:])
+            chan.udp_token = int(args[2]) & 0xFFFFFFFF
+            chan.udp_seq = 0
+        chan.delta_base = None
+        self.lock.release()
+
+    # ----------
+    # cmd_subscribe()
+    #
+    #   Limit the INPUT reports of the current card to max_rate per
+    #   second and ignore ADC changes within the deadbands.
+    # ----------
+    def cmd_subscribe(self, args):
+        if len(args) not in (2, 4):
+            raise Exception('usage: SUBSCRIBE max_rate ' +
+                    '[adc1_deadband adc2_deadband]')
+        self.set_subscription(self.current_channel(), args[1:])
+
+    # ----------
+    # set_subscription()
+    #
+    #   Parse and apply the SUBSCRIBE arguments max_rate and the
+    #   optional ADC deadbands. A max_rate of 0 means no limit.
+    # ----------
+    def set_subscription(self, chan, args):
+        max_rate = float(args[0])
+        if max_rate < 0.0:
+            raise Exception('invalid max_rate ' + args[0])
+        deadband = [0, 0]
+        if len(args) > 1:
+            deadband = [int(x) for x in args[1:3]]
+            if deadband[0] < 0 or deadband[1] < 0:
+                raise Exception('invalid ADC deadband')
+
+        self.lock.acquire()
+        try:
+            chan.input_interval = (max_rate and 1.0 / max_rate) or 0.0
+            chan.deadband = deadband
+            chan.input_next = 0.0
+            if chan.input_held is not None:
+                self.schedule_held_input_locked(chan)
+        finally:
+            self.lock.release()
+
+    # ----------
+    # cmd_queue()
+    #
+    #   Set what happens to reports when this client falls behind and
+    #   its outbound queue is full, and optionally the queue's depth.
+    # ----------
+    def cmd_queue(self, args):
+        if len(args) not in (2, 3):
+            raise Exception('usage: QUEUE block|drop_oldest|merge [depth]')
+        policy = args[1].lower()
+        if policy not in Open8055Outbox.POLICIES:
+            raise Exception('unknown queue policy ' + args[1])
+        depth = self.outbox.depth
+        if len(args) > 2:
+            depth = int(args[2])
+            if depth < 1 or depth > Open8055Outbox.MAX_DEPTH:
+                raise Exception('invalid queue depth ' + args[2])
+
+        self.lock.acquire()
+        self.outbox.policy = policy
+        self.outbox.depth = depth
+        self.lock.release()
+        self.reply('QUEUE {0} {1}\n'.format(policy, depth))
+
+    # ----------
+    # cmd_status()
+    #
+    #   Report the outbound queue of every connected client. Who may
+    #   LIST the cards may see this.
+    # ----------
+    def cmd_status(self, args):
+        if len(args) != 3:
+            raise Exception('usage: STATUS username password')
+
+        allowed = self.server.check_list_access(self.addr,
+                args[1], args[2], self.salt)
+        if not allowed:
+            log_error('client {0}: STATUS {1} ***** - permission denied'.format(
+                    self.addr, args[1]))
+            self.reply('ERROR permission denied\n')
+            return
+
+        response = ''
+        clients = self.server.clients.values()
+        for client in clients:
+            response += 'CLIENT {0} {1}\n'.format(
+                    '/'.join([str(x) for x in client.addr]),
+                    client.outbox.get_status())
+        self.reply(response + 'STATUS {0}\n'.format(len(clients)))
+
+    # ----------
+    # cmd_stats()
+    #
+    #   The server metrics, one STAT line per sample.
+    # ----------
+    def cmd_stats(self, args):
+        if len(args) != 3:
+            raise Exception('usage: STATS username password')
+
+        allowed = self.server.check_list_access(self.addr,
+                args[1], args[2], self.salt)
+        if not allowed:
+            log_error('client {0}: STATS {1} ***** - permission denied'.format(
+                    self.addr, args[1]))
+            self.reply('ERROR permission denied\n')
+            return
+
+        samples = self.server.get_metrics()
+        response = ''.join(['STAT ' + line + '\n' for line in
+                Open8055Metrics.format(samples, False)])
+        self.reply(response + 'STATS {0}\n'.format(len(samples)))
+
+    # ----------
+    # cmd_send()
+    # ----------
+    def cmd_send(self, args):
+        chan = self.current_channel()
+
+        self.write_card(chan, open8055proto.parse_send_text(args))
+
+    # ----------
+    # cmd_sendack()
+    #
+    #   SEND with a command id that is acknowledged once the report
+    #   has been written to the card.
+    # ----------
+    def cmd_sendack(self, args):
+        if len(args) < 3:
+            raise Exception('usage: SENDACK id type [values ...]')
+        chan = self.current_channel()
+
+        cmd_id = int(args[1])
+        self.write_card(chan,
+                open8055proto.parse_send_text(['SEND'] + args[2:]), cmd_id)
+
+    # ----------
+    # cmd_send_binary()
+    # ----------
+    def cmd_send_binary(self, payload, cmd_id = None):
+        chan = self.current_channel()
+
+        self.write_card(chan, open8055proto.check_send_binary(payload), cmd_id)
+
+    # ----------
+    # write_card()
+    #
+    #   Send an HID command message to the card. If the command has
+    #   an id, the result is reported back to the client in an ACK.
+    # ----------
+    def write_card(self, chan, data, cmd_id = None):
+        if chan.readonly:
+            msg = 'card {0} is open read-only'.format(chan.cardid)
+            if cmd_id is None:
+                raise Exception(msg)
+            self.send_ack(chan, cmd_id, 0, msg)
+            return
+
+        if ord(data[0]) == open8055proto.HID_RESET:
+            log_info('client {0} sent RESET command'.format(self.addr))
+
+        # ----
+        # The device module queues the write, skipping those overridden
+        # by a newer one of the same type before their turn. Nothing
+        # here waits for the card. A SENDACK is answered once the card
+        # has the report, a failure of other writes is reported by the
+        # next.
+        # ----
+        chan.cardio.queue_write(chan, data, cmd_id)
+
+    # ----------
+    # write_queued()
+    #
+    #   Called by the reader once the device module took a report
+    #   written by the client. Those watching the card are told what
+    #   the reader remembered of it.
+    # ----------
+    def write_queued(self, chan, data, cmd_id, stored):
+        capture = self.server.capture
+        if capture is not None:
+            capture.put(open8055proto.CAPTURE_CARD_WRITE, chan.cardid,
+                    self.number, data)
+        if stored is not None:
+            chan.cardio.report_written(stored)
+
+    # ----------
+    # write_done()
+    #
+    #   Called by the reader when a SENDACK write is done, or failed.
+    # ----------
+    def write_done(self, chan, cmd_id, seconds, error = None):
+        if self.get_status() == MODE_STOPPED:
+            return
+        if error is not None:
+            log_error('client {0}: write: {1}'.format(str(self.addr), error))
+            self.send_ack(chan, cmd_id, 0, error)
+            return
+        self.server.metrics.observe('open8055_usb_write_seconds',
+                (('card', str(chan.cardid)), ('mode', 'ack')), seconds)
+        self.send_ack(chan, cmd_id, int(seconds * 1000000))
+
+    # ----------
+    # write_failed()
+    #
+    #   Called by the reader when the device module refused a write.
+    #   A failed write of a command without id ends the session, since
+    #   the client has no other way of knowing which command was lost.
+    #   On a channel other than 0 only that card is closed.
+    # ----------
+    def write_failed(self, chan, cmd_id, err):
+        if cmd_id is not None:
+            self.write_done(chan, cmd_id, 0.0, str(err))
+            return
+        if self.channels.get(chan.number) is not chan:
+            return
+        log_error('client {0}: write: {1}'.format(str(self.addr), str(err)))
+        if chan.number != 0:
+            del self.channels[chan.number]
+            chan.close(self.addr)
+        try:
+            self.send('ERROR from write ' + str(err) + '\n', chan.number)
+        except:
+            pass
+        if chan.number == 0:
+            self.set_status(MODE_STOP)
+            self.end_session(False)
+
+    # ----------
+    # send_ack()
+    #
+    #   Send the result of a SENDACK command to the client.
+    # ----------
+    def send_ack(self, chan, cmd_id, usec, error = None):
+        self.lock.acquire()
+        try:
+            if self.binary:
+                msg = open8055proto.pack_frame(open8055proto.FRAME_ACK,
+                        self.send_seq, open8055proto.pack_ack_payload(
+                            cmd_id, usec, error), chan.number)
+                self.send_seq += 1
+            else:
+                msg = open8055proto.format_ack_text(cmd_id, usec, error)
+            self.queue_locked(msg)
+        finally:
+            self.lock.release()
+
+    # ----------
+    # send()
+    #
+    #   Send one message to the remote client.
+    # ----------
+    def send(self, msg, channel = 0):
+        self.lock.acquire()
+        try:
+            if self.binary:
+                data = ''
+                for line in msg.rstrip('\n').split('\n'):
+                    data += open8055proto.pack_frame(open8055proto.FRAME_TEXT,
+                            self.send_seq, line, channel)
+                    self.send_seq += 1
+                self.queue_locked(data)
+            else:
+                self.queue_locked(msg)
+        finally:
+            self.lock.release()
+
+    # ----------
+    # reply()
+    #
+    #   Send a response on the channel of the current command.
+    # ----------
+    def reply(self, msg):
+        self.send(msg, self.msg_channel)
+
+    # ----------
+    # send_report()
+    #
+    #   Send a report received from the card to the remote client,
+    #   as RECV line or frame depending on the protocol in use.
+    # ----------
+    def send_report(self, chan, data):
+        self.lock.acquire()
+        try:
+            if ord(data[0]) != open8055proto.HID_INPUT:
+                self.queue_report_locked(chan, data)
+            elif self.throttle_input_locked(chan, data):
+                self.send_input_locked(chan, data)
+        finally:
+            self.lock.release()
+
+    # ----------
+    # send_held_input()
+    #
+    #   Called by the event loop when the next INPUT report is due.
+    #   Sends the newest one held back, if any.
+    # ----------
+    def send_held_input(self, chan):
+        self.lock.acquire()
+        try:
+            chan.held_scheduled = False
+            if chan.cardio is None:
+                return
+            if time.time() < chan.input_next:
+                self.schedule_held_input_locked(chan)
+                return
+            data = chan.input_held
+            if data is not None:
+                chan.input_held = None
+                chan.input_sent = data
+                chan.input_next = time.time() + chan.input_interval
+                self.send_input_locked(chan, data)
+        finally:
+            self.lock.release()
+
+    # ----------
+    # schedule_held_input_locked()
+    #
+    #   Have send_held_input() called once the rate limit allows the
+    #   next INPUT report, unless that is arranged already. Caller
+    #   holds self.lock.
+    # ----------
+    def schedule_held_input_locked(self, chan):
+        if not chan.held_scheduled:
+            chan.held_scheduled = True
+            self.server.schedule(chan.input_next, chan.held_input_due)
+
+    # ----------
+    # throttle_input_locked()
+    #
+    #   Decide whether an INPUT report goes out now. A change of the
+    #   digital inputs always does. Otherwise nothing is sent unless
+    #   a counter changed or an ADC moved by more than its deadband,
+    #   and not before the rate limit allows it; until then the report
+    #   is held and replaced by newer ones. Caller holds self.lock.
+    # ----------
+    def throttle_input_locked(self, chan, data):
+        if not chan.input_interval and chan.deadband == [0, 0]:
+            return True
+
+        now = time.time()
+        if chan.input_sent is not None:
+            old = open8055proto.input_values(chan.input_sent)
+            new = open8055proto.input_values(data)
+            if old[0] == new[0]:
+                if (old[1:6] == new[1:6] and
+                        abs(new[6] - old[6]) <= chan.deadband[0] and
+                        abs(new[7] - old[7]) <= chan.deadband[1]):
+                    chan.input_held = None
+                    return False
+                if now < chan.input_next:
+                    chan.input_held = data
+                    self.schedule_held_input_locked(chan)
+                    return False
+
+        chan.input_held = None
+        chan.input_sent = data
+        chan.input_next = now + chan.input_interval
+        return True
+
+    # ----------
+    # send_input_locked()
+    #
+    #   Send an INPUT report over UDP or queue it for the connection.
+    #   Caller holds self.lock.
+    # ----------
+    def send_input_locked(self, chan, data):
+        if chan.udp_addr:
+            self.send_udp_locked(chan, data)
+        else:
+            self.queue_report_locked(chan, data)
+
+    # ----------
+    # send_udp_locked()
+    #
+    #   Send an INPUT report as datagram. A datagram that cannot be
+    #   sent is as good as lost on the way, which the client notices
+    #   by the gap in the sequence numbers. Caller holds self.lock.
+    # ----------
+    def send_udp_locked(self, chan, data):
+        chan.udp_seq += 1
+        try:
+            self.udp_sock.sendto(open8055proto.pack_udp_report(
+                    chan.udp_token, chan.number, chan.udp_seq, data),
+                    chan.udp_addr)
+        except socket.error:
+            pass
+
+    # ----------
+    # encode_report_locked()
+    #
+    #   Encode a full report for the client. Caller holds self.lock.
+    # ----------
+    def encode_report_locked(self, chan, data):
+        if self.binary:
+            msg = open8055proto.pack_frame(open8055proto.FRAME_RECV,
+                    self.send_seq, data, chan.number)
+            self.send_seq += 1
+            return msg
+        return open8055proto.format_recv_text(data)
+
+    # ----------
+    # encode_delta_locked()
+    #
+    #   Encode an INPUT report as the difference to the previous one,
+    #   or as keyframe if it is the first or the keyframe interval
+    #   has passed. Caller holds self.lock.
+    # ----------
+    def encode_delta_locked(self, chan, data):
+        now = time.time()
+        base = chan.delta_base
+        chan.delta_base = data
+        if base is None or now - chan.delta_keyframe_time >= chan.input_delta:
+            chan.delta_keyframe_time = now
+            return self.encode_report_locked(chan, data)
+
+        mask, changed = open8055proto.input_delta(
+                open8055proto.input_values(base),
+                open8055proto.input_values(data))
+        if self.binary:
+            msg = open8055proto.pack_frame(open8055proto.FRAME_DELTA,
+                    self.send_seq,
+                    open8055proto.pack_delta_payload(mask, changed),
+                    chan.number)
+            self.send_seq += 1
+            return msg
+        return open8055proto.format_delta_text(mask, changed)
+
+    # ----------
+    # queue_report_locked()
+    #
+    #   Queue a report from the card for the client, an INPUT report
+    #   delta encoded if the client asked for that and unless keyframe
+    #   is set. Room for it is made first, as the client's overflow
+    #   policy says. A delta depends on the INPUT report queued before
+    #   it, so if that is gone the next one must be a keyframe.
+    #   Caller holds self.lock.
+    # ----------
+    def queue_report_locked(self, chan, data, keyframe = False):
+        key = (chan.number, ord(data[0]))
+        for lost in self.outbox.make_room_locked(key):
+            if lost[0][1] == open8055proto.HID_INPUT:
+                lost[2].delta_base = None
+
+        delta = key[1] == open8055proto.HID_INPUT and chan.input_delta
+        if delta and not keyframe:
+            msg = self.encode_delta_locked(chan, data)
+        else:
+            if delta:
+                chan.delta_base = data
+                chan.delta_keyframe_time = time.time()
+            msg = self.encode_report_locked(chan, data)
+        self.outbox.put_locked(msg, key, chan, bool(delta))
+
+    # ----------
+    # queue_locked()
+    #
+    #   Queue anything but a report for the client. Such messages are
+    #   never dropped. Caller holds self.lock.
+    # ----------
+    def queue_locked(self, data):
+        self.outbox.put_locked(data)
+
+    # ----------
+    # flush()
+    #
+    #   Called by the event loop when queued data may be written. Asks
+    #   for writability for as long as some is left.
+    # ----------
+    def flush(self):
+        self.lock.acquire()
+        try:
+            more = self.outbox.flush_locked()
+            if more != self.write_wanted:
+                self.server.poller.modify(self.fd, more)
+                self.write_wanted = more
+            self.flush_wanted = more
+        finally:
+            self.lock.release()
+
+    # ----------
+    # drop_connection_locked()
+    #
+    #   Give up on the client connection after it failed or the client
+    #   stopped reading. Nothing is sent anymore. The event loop sees
+    #   the EOF and ends the session. Caller holds self.lock.
+    # ----------
+    def drop_connection_locked(self):
+        self.outbox.stopped = True
+        self.outbox.entries.clear()
+        self.outbox.cond.notify_all()
+        try:
+            self.conn.shutdown(socket.SHUT_RDWR)
+        except Exception:
+            pass
+
+    # ----------
+    # get_status()
+    # ----------
+    def get_status(self):
+        self.lock.acquire()
+        ret = self.status
+        self.lock.release()
+        return ret
+
+    # ----------
+    # get_status()
+    # ----------
+    def set_status(self, status):
+        self.lock.acquire()
+        self.status = status
+        self.lock.release()
+
+
+# ----------------------------------------------------------------------
+# Open8055Channel
+#
+#   One card opened by a client. Text mode clients only have channel 0,
+#   binary clients can open one card per channel of the frame header.
+# ----------------------------------------------------------------------
+class Open8055Channel:
+    def __init__(self, client, number, cardid):
+        self.client = client
+        self.number = number
+        self.cardid = cardid
+        self.cardio = None
+        self.readonly = False           # WATCH instead of OPEN
+        self.joined = False             # getting the card's reports
+
+        self.input_delta = 0.0          # keyframe interval, 0 = off
+        self.delta_base = None          # last INPUT report sent
+        self.delta_keyframe_time = 0.0
+
+        self.udp_addr = None            # where INPUT datagrams go, if any
+        self.udp_token = 0
+        self.udp_seq = 0
+
+        self.input_interval = 0.0       # min. seconds between INPUTs
+        self.deadband = [0, 0]          # ADC changes ignored up to this
+        self.input_sent = None          # last INPUT report sent
+        self.input_held = None          # newer one waiting for its turn
+        self.input_next = 0.0           # earliest time for the next one
+        self.held_scheduled = False     # timer for input_held is set
+
+        self.token = None               # for RESUME, once asked to HOLD
+        self.hold_until = 0.0
+
+    # ----------
+    # close()
+    #
+    #   Leave the card. The last channel on it stops the reader thread
+    #   and closes the card.
+    # ----------
+    def close(self, addr):
+        if self.cardio is not None:
+            self.client.server.detach_card(self, addr)
+            self.cardio = None
+
+    # ----------
+    # held_input_due()
+    #
+    #   Timer callback. Sends an INPUT report held back by the rate
+    #   limit once its time has come, even if the card sends nothing
+    #   newer.
+    # ----------
+    def held_input_due(self):
+        self.client.send_held_input(self)
+
+
+# ----------------------------------------------------------------------
+# Open8055Outbox
+#
+#   Bounded queue of data for one client. Whoever sends to the client
+#   writes right away as far as the connection takes it without
+#   waiting, the rest is queued and written by the event loop once the
+#   connection can take more. Nobody waits on the client's socket, so
+#   a client that doesn't read can't hold up a card's reader. Once the
+#   queue is full, reports are made room for by the client's policy:
+#
+#   block       - wait for the event loop up to timeout seconds, then
+#                 drop the connection
+#   drop_oldest - discard the oldest queued report
+#   merge       - replace the newest queued report of the same type on
+#                 the same channel, or else discard the oldest one
+#
+#   Other messages are always queued. The queue shares the client's
+#   lock and entries are (key, data, channel, chained) tuples, where
+#   key is (channel number, HID type) for reports and None otherwise.
+# ----------------------------------------------------------------------
+class Open8055Outbox:
+    POLICIES = ('block', 'drop_oldest', 'merge')
+    MAX_DEPTH = 65536
+    WRITE_SIZE = 65536
+
+    def __init__(self, client, depth, policy, timeout):
+        self.client = client
+        self.cond = threading.Condition(client.lock)
+        self.entries = collections.deque()
+        self.depth = depth
+        self.policy = policy
+        self.timeout = timeout
+        self.stopped = False
+
+        self.high_water = 0             # most entries queued at once
+        self.dropped = 0                # reports discarded
+        self.merged = 0                 # reports replaced by newer ones
+
+    # ----------
+    # put_locked()
+    #
+    #   Send data to the client. Call make_room_locked() first for a
+    #   report. If nothing is queued, as much as the connection takes
+    #   is written right away, the rest is queued. A partly written
+    #   report can't be given up anymore. Caller holds the client's
+    #   lock.
+    # ----------
+    def put_locked(self, data, key = None, chan = None, chained = False):
+        if self.stopped:
+            return
+        if len(self.entries) == 0:
+            sent = self.send_locked(data)
+            if sent == len(data):
+                return
+            if sent > 0:
+                data = data[sent:]
+                key = None
+
+        self.entries.append((key, data, chan, chained))
+        self.high_water = max(self.high_water, len(self.entries))
+        if not self.client.flush_wanted:
+            self.client.flush_wanted = True
+            self.client.server.want_flush(self.client)
+
+    # ----------
+    # flush_locked()
+    #
+    #   Write queued entries until the connection takes no more.
+    #   Returns True if some are left. Caller holds the client's lock.
+    # ----------
+    def flush_locked(self):
+        while len(self.entries) > 0:
+            data = ''
+            for entry in self.entries:
+                if data and len(data) + len(entry[1]) > self.WRITE_SIZE:
+                    break
+                data += entry[1]
+
+            sent = self.send_locked(data)
+            left = sent
+            while len(self.entries) > 0 and left >= len(self.entries[0][1]):
+                left -= len(self.entries.popleft()[1])
+            if left > 0:
+                self.entries[0] = (None, self.entries[0][1][left:], None,
+                        False)
+            if sent < len(data):
+                break
+
+        self.cond.notify_all()
+        return len(self.entries) > 0
+
+    # ----------
+    # make_room_locked()
+    #
+    #   Make room for a report with the given key if the queue is full
+    #   and return the entries taken out for it. Taking out a chained
+    #   entry, an INPUT report a later delta depends on, takes out all
+    #   queued INPUT reports of that channel. The event loop itself
+    #   can't wait for room, it just writes what it can. Caller holds
+    #   the client's lock.
+    # ----------
+    def make_room_locked(self, key):
+        if len(self.entries) < self.depth or self.stopped:
+            return []
+
+        if self.policy == 'block':
+            if threading.current_thread() is self.client.server:
+                self.flush_locked()
+                return []
+            deadline = time.time() + self.timeout
+            while len(self.entries) >= self.depth and not self.stopped:
+                remaining = deadline - time.time()
+                if remaining <= 0.0:
+                    log_error('client {0}: not reading, send queue full'.format(
+                            str(self.client.addr)))
+                    self.client.drop_connection_locked()
+                    break
+                self.cond.wait(remaining)
+            return []
+
+        if self.policy == 'merge':
+            for idx in range(len(self.entries) - 1, -1, -1):
+                if self.entries[idx][0] == key:
+                    entry = self.entries[idx]
+                    del self.entries[idx]
+                    self.merged += 1
+                    return [entry]
+
+        for entry in self.entries:
+            if entry[0] is None:
+                continue
+            if not entry[3]:
+                self.entries.remove(entry)
+                self.dropped += 1
+                return [entry]
+            lost = [e for e in self.entries if e[0] == entry[0]]
+            self.entries = collections.deque(
+                    [e for e in self.entries if e[0] != entry[0]])
+            self.dropped += len(lost)
+            return lost
+        return []
+
+    # ----------
+    # stop()
+    #
+    #   Queue nothing from now on and release anyone waiting for room.
+    # ----------
+    def stop(self):
+        self.cond.acquire()
+        self.stopped = True
+        self.cond.notify_all()
+        self.cond.release()
+
+    # ----------
+    # get_status()
+    #
+    #   Queue state and counters as they appear in STATUS.
+    # ----------
+    def get_status(self):
+        self.cond.acquire()
+        try:
+            return ('queue {0} max {1} depth {2} policy {3} '
+                    'dropped {4} merged {5}').format(len(self.entries),
+                    self.high_water, self.depth, self.policy,
+                    self.dropped, self.merged)
+        finally:
+            self.cond.release()
+
+    # ----------
+    # get_counts()
+    #
+    #   The same as numbers for the metrics: entries queued, most
+    #   queued at once, reports dropped and merged.
+    # ----------
+    def get_counts(self):
+        self.cond.acquire()
+        try:
+            return (len(self.entries), self.high_water, self.dropped,
+                    self.merged)
+        finally:
+            self.cond.release()
+
+    # ----------
+    # send_locked()
+    #
+    #   Write to the connection without waiting. Returns the number of
+    #   bytes it took. After an error nothing is sent anymore and the
+    #   event loop ends the session on the following EOF.
+    # ----------
+    def send_locked(self, data):
+        conn = self.client.conn
+        if conn is None:
+            return len(data)
+        try:
+            return conn.send(data)
+        except socket.error as err:
+            if err.errno in (errno.EAGAIN, errno.EWOULDBLOCK, errno.EINTR):
+                return 0
+            log_error('client {0}: {1}'.format(str(self.client.addr),
+                    str(err)))
+            self.client.drop_connection_locked()
+            return len(data)
+
+# ----------------------------------------------------------------------
+# Open8055CardState
+#
+#   The last CONFIG1, OUTPUT and INPUT report of a card. The server
+#   keeps it for every card it has or recently had open, so that an
+#   OPEN is answered right away instead of after a GETCONFIG round
+#   trip to the card. seq counts the changes of CONFIG1 and OUTPUT,
+#   and of the state being forgotten, so a client can tell if the
+#   card was changed since it last looked. While the card is open its
+#   reader's lock protects this, otherwise the server's cards_lock.
+# ----------------------------------------------------------------------
+class Open8055CardState:
+    def __init__(self):
+        self.reports = {}               # last report of each type
+        self.seq = 0
+        self.heard = None               # when the card last sent one
+        self.closed = None              # when the card was closed
+
+    # ----------
+    # store()
+    #
+    #   Remember a report read from the card, or written to it.
+    # ----------
+    def store(self, data, from_card = True):
+        # Reports written by clients are shorter than what the card
+        # sends back; pad them so that an unchanged echo compares equal.
+        data = data.ljust(open8055proto.HID_REPORT_SIZE, '\0')
+        hid_type = ord(data[0])
+        if (hid_type != open8055proto.HID_INPUT and
+                self.reports.get(hid_type) != data):
+            self.seq += 1
+        self.reports[hid_type] = data
+        if from_card:
+            self.heard = time.time()
+
+    # ----------
+    # forget()
+    # ----------
+    def forget(self):
+        if len(self.reports) > 0:
+            self.seq += 1
+        self.reports = {}
+        self.heard = None
+
+    # ----------
+    # complete()
+    #
+    #   True if CONFIG1 and OUTPUT are known, which is what a client
+    #   needs besides the INPUT reports the card sends by itself.
+    # ----------
+    def complete(self):
+        return (open8055proto.HID_SETCONFIG1 in self.reports and
+                open8055proto.HID_OUTPUT in self.reports)
+
+    # ----------
+    # cached_reports()
+    # ----------
+    def cached_reports(self):
+        return [self.reports[hid_type] for hid_type in
+                (open8055proto.HID_SETCONFIG1, open8055proto.HID_OUTPUT,
+                 open8055proto.HID_INPUT) if hid_type in self.reports]
+
+    # ----------
+    # age()
+    #
+    #   Seconds since the card last sent a report, -1 if never.
+    # ----------
+    def age(self):
+        if self.heard is None:
+            return -1.0
+        return time.time() - self.heard
+
+
+# ----------------------------------------------------------------------
+# Open8055Reader
+#
+#   Class implementing a thread that reads data from an Open8055 card
+#   and sends it to the channels of all clients that have it open.
+# ----------------------------------------------------------------------
+class Open8055Reader(threading.Thread):
+    def __init__(self, server, cardid, state):
+        threading.Thread.__init__(self)
+
+        self.server = server
+        self.cardid = cardid
+        self.startup = not state.complete()
+        self.had_config1 = False
+        self.had_output = False
+        self.lock = threading.Lock()
+        self.write_lock = threading.Lock()  # OUTPUT read-modify-write
+        self.status = MODE_RUN
+
+        self.chans = []                 # all channels on this card
+        self.controller = None          # the one that may write to it
+        self.state = state              # last report of each type
+
+        self.backlog = collections.deque()  # client writes not yet queued
+        self.acks = collections.deque()     # SENDACK writes not yet done
+
+        self.labels = (('card', str(cardid)), )
+        self.write_labels = (('card', str(cardid)), ('mode', 'queued'))
+        self.rate = 0.0                 # reports per second
+        self.rate_start = time.time()
+        self.rate_count = 0
+
+    def run(self):
+        ok = True
+        while ok and self.get_status() == MODE_RUN:
+            # ----
+            # Take all reports the card sent since the last time. The
+            # timeout lets us notice being stopped where the device
+            # module can do that.
+            # ----
+            start = time.time()
+            try:
+                reports = open8055io.read_many(self.cardid, READ_BATCH, 1.0)
+            except Exception as err:
+                log_error('card {0}: {1}'.format(self.cardid, str(err)))
+                self.send_all('ERROR ' + str(err) + '\n')
+                break
+
+            # ----
+            # Count the reports and how long we waited for them. The
+            # rate is taken over about a second.
+            # ----
+            now = time.time()
+            if len(reports) > 0:
+                self.server.metrics.observe('open8055_usb_read_seconds',
+                        self.labels, now - start)
+                self.server.metrics.count('open8055_card_reports_total',
+                        self.labels, len(reports))
+                self.rate_count += len(reports)
+            if now - self.rate_start >= 1.0:
+                self.rate = self.rate_count / (now - self.rate_start)
+                self.rate_start = now
+                self.rate_count = 0
+            self.observe_writes()
+            capture = self.server.capture
+            if capture is not None and len(reports) > 0:
+                capture.put_reports(open8055proto.CAPTURE_CARD_READ,
+                        self.cardid, reports, now)
+
+            for data in reports:
+                ok = self.forward(data)
+                if not ok:
+                    break
+
+        # ----
+        # The reader loop exited. Terminate this thread. A reader that
+        # was stopped closes the card and tells the event loop. If
+        # nobody asked it to, the event loop closes the card for its
+        # clients. What we know of a card that failed may be gone with
+        # a replug.
+        # ----
+        self.lock.acquire()
+        failed = self.status == MODE_RUN
+        self.status = MODE_STOPPED
+        self.lock.release()
+        if failed:
+            self.forget_state()
+            self.server.reader_failed()
+            return
+        self.close_card()
+        self.server.reader_stopped(self)
+
+    # ----------
+    # observe_writes()
+    #
+    #   Count the time the writes done since the last time took, from
+    #   being queued in the device module to the card having them.
+    # ----------
+    def observe_writes(self):
+        try:
+            times = open8055io.write_times(self.cardid)
+        except Exception:
+            return
+        for seconds in times:
+            self.server.metrics.observe('open8055_usb_write_seconds',
+                    self.write_labels, seconds)
+
+    # ----------
+    # stop()
+    #
+    #   Ask the reader to end, without waiting for it. Returns False
+    #   if it ended on its own already, in which case the caller
+    #   closes the card.
+    # ----------
+    def stop(self):
+        self.lock.acquire()
+        try:
+            if self.status == MODE_STOPPED:
+                return False
+            self.status = MODE_STOP
+            return True
+        finally:
+            self.lock.release()
+
+    # ----------
+    # close_card()
+    #
+    #   Close the card once nothing reads it any more. Its state is
+    #   kept for when it is opened again.
+    # ----------
+    def close_card(self):
+        try:
+            open8055io.close(self.cardid)
+        except Exception as err:
+            log_error('card {0}: {1}'.format(self.cardid, str(err)))
+        self.lock.acquire()
+        self.state.closed = time.time()
+        self.lock.release()
+
+    # ----------
+    # forward()
+    #
+    #   Process one report from the card. Returns False if the card
+    #   sent something we don't understand.
+    # ----------
+    def forward(self, data):
+        # ----
+        # In client startup mode we suppress all messages until
+        # we sent the CONFIG1 and OUTPUT messages.
+        # ----
+        hid_type = ord(data[0])
+        if self.startup:
+            if hid_type == 0x03:
+                self.had_config1 = True
+            elif hid_type == 0x01:
+                self.had_output = True
+            else:
+                if self.had_output and self.had_config1:
+                    self.startup = False
+                else:
+                    return True
+
+        # ----
+        # Forward the report to every channel in its client's
+        # protocol. The last one of each type is kept for clients
+        # joining or resuming the card.
+        # ----
+        if hid_type not in open8055proto.RECV_FORMATS:
+            self.send_all('ERROR unknown HID packet type ' +
+                    '0x{0:02X} received from card\n'.format(hid_type))
+            return False
+
+        self.lock.acquire()
+        self.state.store(data)
+        chans = [chan for chan in self.chans if chan.joined]
+        self.lock.release()
+
+        if hid_type == open8055proto.HID_INPUT:
+            rules = self.server.rules.get(self.cardid)
+            if rules:
+                self.run_rules(rules, data)
+
+        for chan in chans:
+            # ----
+            # A client that lost its connection ends its session
+            # on its own. The card goes on for the others, and for
+            # the client itself if it asked to HOLD it.
+            # ----
+            try:
+                chan.client.send_report(chan, data)
+            except Exception as err:
+                log_error(str(err))
+        return True
+
+    # ----------
+    # run_rules()
+    #
+    #   Evaluate the card's rules for an INPUT report. The outputs they
+    #   change are written in one OUTPUT report, without waiting, and
+    #   all channels are told. Nothing is done as long as the card's
+    #   outputs are not known.
+    # ----------
+    def run_rules(self, rules, data):
+        self.write_lock.acquire()
+        try:
+            report = self.apply_rules(rules, data)
+        finally:
+            self.write_lock.release()
+        if report is None:
+            return
+
+        capture = self.server.capture
+        if capture is not None:
+            capture.put(open8055proto.CAPTURE_CARD_WRITE, self.cardid, 0,
+                    report)
+        self.report_written(report, True)
+
+    # ----------
+    # apply_rules()
+    #
+    #   Change the outputs last written to the card and write them.
+    #   Returns the OUTPUT report written, or None. The caller holds
+    #   write_lock, so that no client OUTPUT gets in between reading
+    #   the outputs and writing them.
+    # ----------
+    def apply_rules(self, rules, data):
+        self.lock.acquire()
+        current = self.state.reports.get(open8055proto.HID_OUTPUT)
+        self.lock.release()
+        if current is None:
+            return None
+
+        inputs = open8055proto.RECV_FORMATS[open8055proto.HID_INPUT].unpack_from(
+                data)
+        outputs = list(open8055proto.RECV_FORMATS[
+                open8055proto.HID_OUTPUT].unpack_from(current))
+        changed = False
+        now = time.time()
+        for rule in rules:
+            if rule.evaluate(inputs, outputs, now):
+                changed = True
+            done = time.time()
+            rule.seconds += done - now
+            now = done
+        if not changed:
+            return None
+
+        outputs[-1] = 0                 # don't reset any counters
+        report = open8055proto.SEND_FORMATS[open8055proto.HID_OUTPUT].pack(
+                *outputs)
+        try:
+            if open8055io.write_nowait(self.cardid, report) == 0:
+                raise Exception('write queue full')
+        except Exception as err:
+            log_error('card {0}: rule output: {1}'.format(self.cardid,
+                    str(err)))
+            return None
+        self.store_written(report)
+        return report
+
+    # ----------
+    # queue_write()
+    #
+    #   Hand a report from a client to the device module. Writes the
+    #   device module has no room for wait here, in order, until it
+    #   tells the event loop there is. Only called by the event loop.
+    # ----------
+    def queue_write(self, chan, data, cmd_id):
+        self.backlog.append((chan, data, cmd_id, time.time()))
+        if self.check_writes():
+            self.server.write_waiting.add(self)
+
+    # ----------
+    # check_writes()
+    #
+    #   Queue what waits for room and answer the SENDACK writes that
+    #   are done, which on Windows they are right away. Returns True
+    #   while any of that is left.
+    # ----------
+    def check_writes(self):
+        while len(self.backlog) > 0:
+            chan, data, cmd_id, start = self.backlog[0]
+            self.write_lock.acquire()
+            try:
+                number = open8055io.write_nowait(self.cardid, data,
+                        cmd_id is not None)
+                stored = None
+                if number != 0:
+                    stored = self.store_written(data)
+            except Exception as err:
+                self.backlog.popleft()
+                chan.client.write_failed(chan, cmd_id, err)
+                continue
+            finally:
+                self.write_lock.release()
+            if number == 0:
+                break
+            self.backlog.popleft()
+            chan.client.write_queued(chan, data, cmd_id, stored)
+            if cmd_id is not None:
+                self.acks.append((number, chan, cmd_id, start))
+
+        if len(self.acks) > 0:
+            try:
+                done, error = open8055io.write_status(self.cardid)
+            except Exception as err:
+                done, error = self.acks[-1][0], str(err)
+            now = time.time()
+            while len(self.acks) > 0 and self.acks[0][0] <= done:
+                _number, chan, cmd_id, start = self.acks.popleft()
+                chan.client.write_done(chan, cmd_id, now - start, error)
+
+        return len(self.acks) > 0 or len(self.backlog) > 0
+
+    # ----------
+    # send_all()
+    #
+    #   Send a message to all channels on the card, ignoring errors.
+    # ----------
+    def send_all(self, msg):
+        for chan in self.chans:
+            try:
+                chan.client.send(msg, chan.number)
+            except:
+                pass
+
+    # ----------
+    # attach()
+    #
+    #   Add a channel to the card. Called by the server while it holds
+    #   its cards_lock, so the card can't be closed meanwhile.
+    # ----------
+    def attach(self, chan):
+        self.lock.acquire()
+        self.chans = self.chans + [chan]
+        if not chan.readonly:
+            self.controller = chan
+        self.lock.release()
+
+    # ----------
+    # join_channel()
+    #
+    #   Start sending the card's reports to an attached channel.
+    #   Returns the cached ones, which the caller sends first. The
+    #   caller holds the client's lock, so that no new report can
+    #   overtake those.
+    # ----------
+    def join_channel(self, chan):
+        self.lock.acquire()
+        try:
+            chan.joined = True
+            return self.cached_reports_locked()
+        finally:
+            self.lock.release()
+
+    # ----------
+    # detach()
+    #
+    #   Remove a channel. Returns the number of channels left.
+    # ----------
+    def detach(self, chan):
+        self.lock.acquire()
+        try:
+            self.chans = [c for c in self.chans if c is not chan]
+            if self.controller is chan:
+                self.controller = None
+            return len(self.chans)
+        finally:
+            self.lock.release()
+
+    # ----------
+    # store_written()
+    #
+    #   The card does not report outputs and configuration back after
+    #   a change. Remember an OUTPUT or SETCONFIG1 written to it for
+    #   clients joining or resuming it, and forget everything after a
+    #   RESET. Returns the report as remembered, or None. Called with
+    #   write_lock held, right after queueing the report.
+    # ----------
+    def store_written(self, data):
+        hid_type = ord(data[0])
+        if hid_type == open8055proto.HID_RESET:
+            self.forget_state()
+            return None
+        if hid_type == open8055proto.HID_OUTPUT:
+            data = data[:-1] + '\0'
+        elif hid_type != open8055proto.HID_SETCONFIG1:
+            return None
+        self.lock.acquire()
+        self.state.store(data, False)
+        self.lock.release()
+        return data
+
+    # ----------
+    # report_written()
+    #
+    #   Forward a report remembered by store_written() to the
+    #   read-only channels. A report written by the rules goes to all
+    #   channels, since no client knows of it.
+    # ----------
+    def report_written(self, data, to_all = False):
+        self.lock.acquire()
+        chans = [chan for chan in self.chans
+                if chan.joined and (to_all or chan.readonly)]
+        self.lock.release()
+
+        for chan in chans:
+            try:
+                chan.client.send_report(chan, data)
+            except Exception as err:
+                log_error(str(err))
+
+    # ----------
+    # cached_reports()
+    #
+    #   The last CONFIG1, OUTPUT and INPUT reports, as far as known.
+    # ----------
+    def cached_reports(self):
+        self.lock.acquire()
+        try:
+            return self.cached_reports_locked()
+        finally:
+            self.lock.release()
+
+    def cached_reports_locked(self):
+        return self.state.cached_reports()
+
+    # ----------
+    # get_state()
+    #
+    #   The sequence number and age of the card's state, for STATE.
+    # ----------
+    def get_state(self):
+        self.lock.acquire()
+        try:
+            return self.state.seq, self.state.age()
+        finally:
+            self.lock.release()
+
+    # ----------
+    # forget_state()
+    #
+    #   Drop the cached reports after the card was reset or failed.
+    # ----------
+    def forget_state(self):
+        self.lock.acquire()
+        self.state.forget()
+        self.lock.release()
+
+    def get_status(self):
+        #self.lock.acquire()
+        ret = self.status
+        #self.lock.release()
+        return ret
+
+    def set_status(self, status):
+        #self.lock.acquire()
+        self.status = status
+        #self.lock.release()
+
+
+# ----------------------------------------------------------------------
+# Open8055Poller
+#
+#   Waits for any of a set of file descriptors to become readable, or
+#   writable where asked for. Uses epoll where Python has it and
+#   select() everywhere else, which is what Windows sockets support.
+# ----------------------------------------------------------------------
+class Open8055Poller:
+    def __init__(self):
+        self.epoll = None
+        if hasattr(select, 'epoll'):
+            self.epoll = select.epoll()
+        self.rfds = set()
+        self.wfds = set()
+
+    # ----------
+    # register()
+    # ----------
+    def register(self, fd, want_write = False):
+        if self.epoll is not None:
+            self.epoll.register(fd, self.event_mask(want_write))
+        self.rfds.add(fd)
+        if want_write:
+            self.wfds.add(fd)
+
+    # ----------
+    # modify()
+    #
+    #   Start or stop waiting for fd to become writable.
+    # ----------
+    def modify(self, fd, want_write):
+        if self.epoll is not None:
+            self.epoll.modify(fd, self.event_mask(want_write))
+        if want_write:
+            self.wfds.add(fd)
+        else:
+            self.wfds.discard(fd)
+
+    # ----------
+    # unregister()
+    # ----------
+    def unregister(self, fd):
+        if self.epoll is not None:
+            self.epoll.unregister(fd)
+        self.rfds.discard(fd)
+        self.wfds.discard(fd)
+
+    # ----------
+    # poll()
+    #
+    #   Wait up to timeout seconds, forever if None. Returns a list of
+    #   (fd, readable, writable). An error or hangup on a descriptor
+    #   counts as readable, so that the next recv() reports it.
+    # ----------
+    def poll(self, timeout):
+        try:
+            if self.epoll is not None:
+                if timeout is None:
+                    timeout = -1
+                return [(fd, (ev & ~select.EPOLLOUT) != 0,
+                        (ev & select.EPOLLOUT) != 0)
+                        for fd, ev in self.epoll.poll(timeout)]
+
+            rdy, wrt, _dummy = select.select(list(self.rfds),
+                    list(self.wfds), (), timeout)
+        except (IOError, OSError, select.error) as err:
+            if err.args[0] == errno.EINTR:
+                return []
+            raise
+        events = dict([(fd, [fd, True, False]) for fd in rdy])
+        for fd in wrt:
+            events.setdefault(fd, [fd, False, False])[2] = True
+        return [tuple(ev) for ev in events.values()]
+
+    def event_mask(self, want_write):
+        if want_write:
+            return select.EPOLLIN | select.EPOLLOUT
+        return select.EPOLLIN
+
+    def close(self):
+        if self.epoll is not None:
+            self.epoll.close()
+
+
+# ----------------------------------------------------------------------
+# Open8055AccessList
+#
+#   One option of the [Access] section, compiled. The IP networks are
+#   kept in one dictionary per prefix length, keyed by the network
+#   bits, so that checking an address costs one lookup per prefix
+#   length used in the list. Of all the entries matching, the one
+#   listed first wins, as it always did.
+# ----------------------------------------------------------------------
+class Open8055AccessList:
+    re_comment = re.compile('^[ \t]*[#;]')
+    re_lines = re.compile('[ \t\r]*\n[ \t\r]*')
+    re_blank = re.compile('[ \t]+')
 
+    def __init__(self, text):
+        self.levels = []                # (shift, {network bits: entries})
+        self.unix = []                  # (network, auth_user, result)
+        levels = {}
+
+        for index, line in enumerate(self.re_lines.split(text.strip())):
             # ----
-            # We have a NEWLINE in the input buffer. Consume the
-            # first line.
+            # Ignore empty lines and comments.
             # ----
-            line = self.inbuf[0:idx]
-            self.inbuf = self.inbuf[idx + 1:]
+            if len(line) == 0 or self.re_comment.match(line):
+                continue
 
             # ----
-            # Split the command line by spaces and process it.
+            # Split the line into network address, auth-user and
+            # auth-result.
             # ----
-            args = line.strip().split(' ')
-
-            try:
-                if args[0].upper() == 'SEND':
-                    self.cmd_send(args)
+            fields = self.re_blank.split(line)
+            if len(fields) != 3:
+                raise Exception('invalid access entry ' + line)
+            network, auth_user, result = fields
+
+            if network == 'unix' or network.startswith('unix:'):
+                key, _sep, value = network[5:].partition('=')
+                if network != 'unix' and (
+                        key not in ('uid', 'gid', 'user', 'group') or
+                        (key in ('uid', 'gid') and not value.isdigit())):
+                    raise Exception('invalid access entry ' + line)
+                self.unix.append((network, auth_user, result))
+                continue
 
-                elif args[0].upper() == 'LIST':
-                    self.cmd_list(args)
+            # ----
+            # We work everything IPV6 mapped.
+            # ----
+            network = netaddr.IPNetwork(network).ipv6()
+            shift = 128 - network.prefixlen
+            levels.setdefault(shift, {}).setdefault(network.value >> shift,
+                    []).append((index, auth_user, result))
 
-                elif args[0].upper() == 'OPEN':
-                    self.cmd_open(args)
+        self.levels = sorted(levels.items())
 
-                elif args[0].upper() == 'QUIT':
-                    self.set_status(MODE_STOP)
+    # ----------
+    # lookup_ip()
+    #
+    #   Return the method of the first entry matching an IPV6 mapped
+    #   address and the user, or 'deny' if there is none. A user of
+    #   None matches all entries.
+    # ----------
+    def lookup_ip(self, value, user):
+        best = None
+        for shift, networks in self.levels:
+            entries = networks.get(value >> shift)
+            if entries is None:
+                continue
+            for entry in entries:
+                if user is None or entry[1] == 'all' or entry[1] == user:
+                    if best is None or entry[0] < best[0]:
+                        best = entry
                     break
 
-                else:
-                    self.send('ERROR unknown command \'' +
-                            args[0].upper() + '\'\n')
-
-            except Exception as err:
-                log_error('client {0}: {1}'.format(str(self.addr), str(err)))
-                try:
-                    self.send('ERROR ' + str(err) + '\n')
-                except:
-                    pass
-
         # ----
-        # Stop the reader thread if one exists.
+        # No match at all? This should not happen. The default config
+        # contains "deny" lines for INADDR_ANY and its IPV6 counterpart.
         # ----
-        if self.cardio is not None:
-            try:
-                if self.cardio.get_status() != MODE_STOPPED:
-                    self.cardio.set_status(MODE_STOP)
-                    try:
-                        open8055io.write(self.cardid, struct.pack('B', 0x02))
-                    except Exception as err:
-                        log_error('client {0}: {1}'.format(
-                                str(self.addr), str(err)))
-                self.cardio.join()
-            except Exception as err:
-                log_error('client {0}: {1}'.format(str(self.addr), str(err)))
-                try:
-                    self.send('ERROR ' + str(err))
-                except:
-                    pass
+        if best is None:
+            return 'deny'
+        return best[2]
 
-        # ----
-        # Close the Open8055
-        # ----
-        try:
-            if self.cardid >= 0:
-                open8055io.close(self.cardid)
-        except Exception as err:
-            log_error('client {0}: {1}'.format(self.addr, str(err)))
+    # ----------
+    # lookup_unix()
+    #
+    #   The same for a Unix domain client, whose peer credentials are
+    #   checked by the server's match_unix_peer().
+    # ----------
+    def lookup_unix(self, server, addr, user):
+        for network, auth_user, result in self.unix:
+            if user is not None and auth_user != 'all' and auth_user != user:
+                continue
+            if server.match_unix_peer(network, addr):
+                return result
+        return 'deny'
 
-        # ----
-        # Close the remote connection.
-        # ----
-        try:
-            if self.conn is not None:
-                self.conn.shutdown(socket.SHUT_RDWR)
-                self.conn.close()
-        except Exception as err:
-            log_error('client {0}: {1}'.format(self.addr, str(err)))
 
-        # ----
-        # Set the run status to STOPPED and end this thread.
-        # ----
-        self.set_status(MODE_STOPPED)
-        return
+# ----------------------------------------------------------------------
+# Open8055Users
+#
+#   The users file, read into a dictionary. It is read again whenever
+#   it changed, like after open8055user added a user.
+# ----------------------------------------------------------------------
+class Open8055Users:
+    def __init__(self):
+        self.fname = None
+        self.stamp = None
+        self.users = {}                 # (issuper, md5 hexdigest) by name
 
     # ----------
-    # cmd_list()
+    # lookup()
     #
-    #   Reports available cards
+    #   Return (issuper, md5 hexdigest of the password) of a user, or
+    #   None if the file does not list it.
     # ----------
-    def cmd_list(self, args):
-        if len(args) != 3:
-            raise Exception('usage: LIST username password')
+    def lookup(self, fname, user):
+        st = os.stat(fname)
+        stamp = (st.st_mtime, st.st_size, st.st_ino)
+        if fname != self.fname or stamp != self.stamp:
+            self.load(fname, stamp)
+        return self.users.get(user)
 
-        allowed = self.server.check_list_access(self.addr, 
-                args[1], args[2], self.salt)
-        if not allowed:
-            log_error('client {0}: LIST {1} ***** - permission denied'.format(
-                    self.addr, args[1]))
-            self.send('ERROR permission denied\n')
+    # ----------
+    # load()
+    #
+    #   Read the file. Plain text passwords are hashed here, once.
+    #   The first line of a user counts.
+    # ----------
+    def load(self, fname, stamp):
+        users = {}
+        fd = open(fname, 'r')
+        try:
+            for lineno, line in enumerate(fd):
+                line = line.strip()
+                if len(line) == 0:
+                    continue
+                try:
+                    auth_user, auth_issuper, auth_password = line.split(':')
+                except ValueError:
+                    log_error('{0}: invalid entry in line {1}'.format(
+                            fname, lineno + 1))
+                    continue
+                if auth_user in users:
+                    continue
+                if len(auth_password) != 35 or auth_password[0:3] != 'md5':
+                    auth_password = 'md5' + hashlib.md5(
+                            auth_password).hexdigest()
+                users[auth_user] = (bool(auth_issuper), auth_password[3:])
+        finally:
+            fd.close()
+
+        self.fname = fname
+        self.stamp = stamp
+        self.users = users
+
+
+# ----------------------------------------------------------------------
+# Open8055Rule
+#
+#   One option of the [Rules] section, compiled. A rule is one of
+#
+#       card <n> when <input> <op> <number> [for <ms>] then <output> <value>
+#       card <n> copy <input> to <output>
+#
+#   and is evaluated by the card's reader for every INPUT report. A
+#   "when" rule sets the output once its condition held for the given
+#   time, and again only after the condition was false in between. A
+#   "copy" rule keeps the output equal to the input.
+# ----------------------------------------------------------------------
+class Open8055Rule:
+    # ----
+    # Inputs as (field of the INPUT report, bit or None, kind) and
+    # outputs as (field of the OUTPUT report, bit or None, maximum).
+    # ----
+    INPUTS = dict([('I{0}'.format(i + 1), (1, 1 << i, 'digital'))
+                for i in range(5)] +
+            [('C{0}'.format(i + 1), (2 + i, None, 'counter'))
+                for i in range(5)] +
+            [('A{0}'.format(i + 1), (7 + i, None, 'analog'))
+                for i in range(2)])
+    OUTPUTS = dict([('O{0}'.format(i + 1), (1, 1 << i, 1))
+                for i in range(8)] +
+            [('PWM{0}'.format(i + 1), (10 + i, None, 1023))
+                for i in range(2)])
+    OPERATORS = {
+        '<': operator.lt, '<=': operator.le,
+        '>': operator.gt, '>=': operator.ge,
+        '==': operator.eq, '!=': operator.ne,
+    }
+
+    def __init__(self, name, text):
+        self.name = name
+        self.evaluations = 0
+        self.hits = 0
+        self.seconds = 0.0
+        self.since = None               # when the condition became true
+        self.fired = False
+
+        words = text.split()
+        if len(words) < 3 or words[0].lower() != 'card':
+            raise Exception('rule must start with "card <n>"')
+        self.cardid = int(words[1])
+        self.kind = words[2].lower()
+
+        if self.kind == 'copy':
+            if len(words) != 6 or words[4].lower() != 'to':
+                raise Exception('usage: card <n> copy <input> to <output>')
+            self.source = self.lookup(self.INPUTS, words[3], 'input')
+            self.target = self.lookup(self.OUTPUTS, words[5], 'output')
+            if (self.source[2] == 'digital') != (self.target[1] is not None):
+                raise Exception('can only copy an input to an output '
+                        'of the same kind')
+            if self.source[2] == 'counter':
+                raise Exception('can\'t copy a counter')
             return
 
-        response = 'LIST'
-        for cardid in range(0, Open8055Server.MAX_CARDS):
-            if open8055io.present(cardid):
-                response += ' ' + str(cardid)
-        self.send(response + '\n')
+        if self.kind != 'when':
+            raise Exception('unknown rule type "{0}"'.format(words[2]))
+        if len(words) == 11 and words[6].lower() == 'for':
+            self.hold = int(words[7]) / 1000.0
+            del words[6:8]
+        else:
+            self.hold = 0.0
+        if len(words) != 9 or words[6].lower() != 'then':
+            raise Exception('usage: card <n> when <input> <op> <number> '
+                    '[for <ms>] then <output> <value>')
+        self.source = self.lookup(self.INPUTS, words[3], 'input')
+        if words[4] not in self.OPERATORS:
+            raise Exception('unknown operator "{0}"'.format(words[4]))
+        self.compare = self.OPERATORS[words[4]]
+        self.threshold = int(words[5])
+        self.target = self.lookup(self.OUTPUTS, words[7], 'output')
+        self.value = int(words[8])
+        if self.value < 0 or self.value > self.target[2]:
+            raise Exception('value must be 0 to {0}'.format(self.target[2]))
 
     # ----------
-    # cmd_open()
+    # lookup()
     # ----------
-    def cmd_open(self, args):
-        if len(args) != 4:
-            raise Exception('usage: OPEN cardid username password')
-        if self.cardid >= 0:
-            raise Exception('already connected to card ' + str(self.cardid))
-
-        cardid = int(args[1])
+    @staticmethod
+    def lookup(table, name, what):
+        if name.upper() not in table:
+            raise Exception('unknown {0} "{1}"'.format(what, name))
+        return table[name.upper()]
 
-        allowed = self.server.check_open_access(cardid, self.addr, 
-                args[2], args[3], self.salt)
-        if not allowed:
-            log_error('client {0}: OPEN {1} {2} ***** - permission denied'.format(
-                    self.addr, args[1], args[2]))
-            self.send('ERROR permission denied\n')
-            return
+    # ----------
+    # evaluate()
+    #
+    #   Check the rule against the values of an INPUT report and apply
+    #   it to the list of OUTPUT values. Returns True if that changed.
+    # ----------
+    def evaluate(self, inputs, outputs, now):
+        self.evaluations += 1
+        field, bit, _kind = self.source
+        value = inputs[field]
+        if bit is not None:
+            value = int(value & bit != 0)
+
+        if self.kind == 'when':
+            if not self.compare(value, self.threshold):
+                self.since = None
+                self.fired = False
+                return False
+            if self.since is None:
+                self.since = now
+            if self.fired or now - self.since < self.hold:
+                return False
+            self.fired = True
+            value = self.value
+
+        field, bit, _maximum = self.target
+        if bit is not None:
+            new = (outputs[field] | bit) if value else (outputs[field] & ~bit)
+        else:
+            new = value
+        if new == outputs[field]:
+            return False
+        outputs[field] = new
+        self.hits += 1
+        return True
 
-        open8055io.open(cardid)
 
-        cardio = Open8055Reader(self, cardid)
-        cardio.start()
+# ----------------------------------------------------------------------
+# Open8055Capture
+#
+#   Writes card reports and client commands to the capture files. The
+#   event loop and the card readers only queue the records; a thread of
+#   its own writes them out every FLUSH_INTERVAL, so the disk never
+#   holds up a card. A new file is started when one reaches file_size
+#   bytes, and the oldest are removed to keep the given number.
+# ----------------------------------------------------------------------
+class Open8055Capture(threading.Thread):
+    FLUSH_INTERVAL = 0.25
+    MAX_PENDING = 65536                 # records queued before dropping
 
-        self.cardid = cardid
-        self.cardio = cardio
+    def __init__(self, directory, file_size, files):
+        threading.Thread.__init__(self)
 
-        # ----
-        # We send a GETCONFIG message to the card and the reader
-        # is going to suppress INPUT messages until OUTPUT and CONFIG1
-        # have been reported.
-        # ----
-        open8055io.write(cardid, struct.pack('B', 0x04))
+        self.directory = directory
+        self.file_size = file_size
+        self.files = files
+        self.lock = threading.Lock()
+        self.stopping = threading.Event()
+        self.pending = []               # records not yet written
+        self.fd = None
+        self.fsize = 0
+        self.fseq = 0
+        self.records = 0
+        self.nbytes = 0
+        self.dropped = 0
 
     # ----------
-    # cmd_send()
+    # put()
+    #
+    #   Queue one record. Called by any thread. A client's command line
+    #   can be longer than a record holds, what doesn't fit is left out.
     # ----------
-    def cmd_send(self, args):
-        if self.cardid < 0:
-            raise Exception('not connected to a card')
-
-        # ----
-        # Get the HID command message format by type
-        # ----
-        hid_type = int(args[1])
-        if hid_type == 0x01:            # OUTPUT
-            msg_fmt = '!BB8H2HB'
-            num_val = 13
-        elif hid_type == 0x02:          # GETINPUT
-            msg_fmt = '!B'
-            num_val = 1
-        elif hid_type == 0x03:          # SETCONFIG1
-            msg_fmt = '!B2B5B8B2B5HB'
-            num_val = 24
-        elif hid_type == 0x04:          # GETCONFIG
-            msg_fmt = '!B'
-            num_val = 1
-        elif hid_type == 0x05:          # SAVECONFIG
-            msg_fmt = '!B'
-            num_val = 1
-        elif hid_type == 0x06:          # SAVEALL
-            msg_fmt = '!B'
-            num_val = 1
-        elif hid_type == 0x7F:          # RESET
-            log_info('client {0} sent RESET command'.format(self.addr))
-            msg_fmt = '!B'
-            num_val = 1
+    def put(self, rtype, card, conn, data):
+        now = time.time()
+        data = data[:open8055proto.CAPTURE_MAX_DATA]
+        self.lock.acquire()
+        if len(self.pending) < self.MAX_PENDING:
+            self.pending.append((now, rtype, card, conn, data))
         else:
-            raise Exception('invalid HID command type 0x{0:02X}'.format(
-                    hid_type))
+            self.dropped += 1
+        self.lock.release()
 
+    # ----------
+    # put_reports()
+    #
+    #   Queue a batch of reports read from a card at time now.
+    # ----------
+    def put_reports(self, rtype, card, reports, now):
+        self.lock.acquire()
+        room = self.MAX_PENDING - len(self.pending)
+        for data in reports[:room]:
+            self.pending.append((now, rtype, card, 0, data))
+        if len(reports) > room:
+            self.dropped += len(reports) - room
+        self.lock.release()
 
-        # ----
-        # Create a sequence of integers for that format. Add zeroes
-        # for missing members at the end (telnet debugging aid)
-        # ----
-        vals = [int(x) for x in args[1:]]
-        while len(vals) < num_val:
-            vals.append(0)
+    def run(self):
+        pack = open8055proto.pack_capture_record
+        while True:
+            stop = self.stopping.wait(self.FLUSH_INTERVAL)
 
-        # ----
-        # Pack this into the binary message and send it to the card.
-        # ----
-        data = struct.pack(msg_fmt, *vals)
+            self.lock.acquire()
+            pending = self.pending
+            self.pending = []
+            self.lock.release()
 
-        try:
-            open8055io.write(self.cardid, data)
-        except Exception as err:
-            self.set_status(MODE_STOP)
-            try:
-                self.client.send('ERROR from write ' + str(err) + '\n')
-            except:
-                pass
+            # ----
+            # A record that can't be packed is dropped, not the others
+            # and not this thread.
+            # ----
+            packed = []
+            for rec in pending:
+                try:
+                    packed.append(pack(*rec))
+                except struct.error as err:
+                    log_error('capture: ' + str(err))
+                    self.lock.acquire()
+                    self.dropped += 1
+                    self.lock.release()
+            pending = packed
+
+            if len(pending) > 0:
+                chunk = ''.join(pending)
+                try:
+                    if self.fd is None:
+                        self.open_file()
+                    self.fd.write(chunk)
+                    self.fd.flush()
+                except (IOError, OSError) as err:
+                    log_error('capture: ' + str(err))
+                    self.close_file()
+                    self.lock.acquire()
+                    self.dropped += len(pending)
+                    self.lock.release()
+                else:
+                    self.fsize += len(chunk)
+                    self.lock.acquire()
+                    self.records += len(pending)
+                    self.nbytes += len(chunk)
+                    self.lock.release()
+                    if self.fsize >= self.file_size:
+                        self.close_file()
+            if stop:
+                break
+        self.close_file()
 
     # ----------
-    # send()
+    # open_file()
     #
-    #   Send one message to the remote client. If that fails, log the
-    #   error, close the connection and re-raise the exception.
+    #   Start a new capture file and remove the oldest ones. The names
+    #   sort in the order the files were written.
     # ----------
-    def send(self, msg):
-        self.lock.acquire()
-        try:
-            if self.conn:
-                self.conn.sendall(msg)
-        except Exception as err:
-            log_error('client {0}: {1}'.format(str(self.addr), str(err)))
+    def open_file(self):
+        if not os.path.isdir(self.directory):
+            os.makedirs(self.directory)
+        self.fseq += 1
+        fname = os.path.join(self.directory, 'open8055-{0}-{1:04d}.cap'.format(
+                time.strftime('%Y%m%d-%H%M%S'), self.fseq))
+        self.fd = open(fname, 'wb')
+        self.fd.write(open8055proto.CAPTURE_HEADER.pack(
+                open8055proto.CAPTURE_MAGIC, open8055proto.CAPTURE_VERSION))
+        self.fsize = open8055proto.CAPTURE_HEADER.size
+
+        old = sorted([name for name in os.listdir(self.directory)
+                if name.startswith('open8055-') and name.endswith('.cap')])
+        for name in old[:-self.files]:
             try:
-                self.conn.shutdown(socket.SHUT_RDWR)
-                self.conn.close()
-            except:
-                pass
-            self.conn = None
-            self.lock.release()
-            raise err
+                os.unlink(os.path.join(self.directory, name))
+            except OSError as err:
+                log_error('capture: ' + str(err))
 
-        self.lock.release()
+    def close_file(self):
+        if self.fd is not None:
+            try:
+                self.fd.close()
+            except (IOError, OSError) as err:
+                log_error('capture: ' + str(err))
+            self.fd = None
 
     # ----------
-    # get_status()
+    # stop()
+    #
+    #   Write what is queued, close the file and end the thread.
     # ----------
-    def get_status(self):
-        self.lock.acquire()
-        ret = self.status
-        self.lock.release()
-        return ret
+    def stop(self):
+        self.stopping.set()
+        self.join()
 
     # ----------
-    # get_status()
+    # get_counts()
+    #
+    #   Records and bytes written and records dropped, for the metrics.
     # ----------
-    def set_status(self, status):
+    def get_counts(self):
         self.lock.acquire()
-        self.status = status
-        self.lock.release()
+        try:
+            return (self.records, self.nbytes, self.dropped)
+        finally:
+            self.lock.release()
 
 
 # ----------------------------------------------------------------------
-# Open8055Reader
+# Open8055Metrics
 #
-#   Class implementing a thread that reads data from an Open8055 card
-#   and sends it to the associated client.
+#   Counters and histograms kept by the event loop and the card readers,
+#   shown by the STATS command and on metrics_port in the Prometheus
+#   text format. Labels are tuples of (name, value) pairs.
 # ----------------------------------------------------------------------
-class Open8055Reader(threading.Thread):
-    def __init__(self, client, cardid):
-        threading.Thread.__init__(self)
+class Open8055Metrics:
+    BUCKETS = (0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+            0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5)
+
+    HELP = {
+        'open8055_card_reports_total': ('counter',
+                'Reports read from the card'),
+        'open8055_card_reports_per_second': ('gauge',
+                'Reports read from the card over the last second'),
+        'open8055_usb_read_seconds': ('histogram',
+                'Time the reader waited for reports from the card'),
+        'open8055_usb_write_seconds': ('histogram',
+                'Time from queueing a report to the card having it, ' +
+                'or from SENDACK to its ACK'),
+        'open8055_auth_check_seconds': ('histogram',
+                'Time an access check of a client took'),
+        'open8055_client_queue_depth': ('gauge',
+                'Messages queued for the client'),
+        'open8055_client_queue_high_water': ('gauge',
+                'Most messages queued for the client at once'),
+        'open8055_client_dropped_total': ('counter',
+                'Reports discarded for the client'),
+        'open8055_client_merged_total': ('counter',
+                'Reports replaced by newer ones for the client'),
+        'open8055_rule_evaluations_total': ('counter',
+                'INPUT reports the rule was evaluated for'),
+        'open8055_rule_hits_total': ('counter',
+                'Times the rule changed an output'),
+        'open8055_rule_seconds_total': ('counter',
+                'Time spent evaluating the rule'),
+        'open8055_capture_records_total': ('counter',
+                'Records written to capture files'),
+        'open8055_capture_bytes_total': ('counter',
+                'Bytes written to capture files'),
+        'open8055_capture_dropped_total': ('counter',
+                'Records lost because the capture writer fell behind'),
+        'open8055_clients': ('gauge',
+                'Client connections'),
+        'open8055_reader_threads': ('gauge',
+                'Card reader threads'),
+        'open8055_threads': ('gauge',
+                'Threads of the server process'),
+    }
 
-        self.client = client
-        self.cardid = cardid
-        self.startup = True
-        self.had_config1 = False
-        self.had_output = False
+    def __init__(self):
         self.lock = threading.Lock()
-        self.status = MODE_RUN
+        self.counters = {}              # value by (name, labels)
+        self.histograms = {}            # [buckets, sum, count] by same
 
-    def run(self):
-        while self.get_status() == MODE_RUN:
-            try:
-                data = open8055io.read(self.cardid)
-            except Exception as err:
-                try:
-                    log_error('client {0}: {1}'.format(
-                            str(self.client.addr), str(err)))
-                    self.client.send('ERROR ' + str(err) + '\n')
-                    break
-                except:
-                    pass
+    # ----------
+    # count()
+    # ----------
+    def count(self, name, labels, n = 1):
+        key = (name, labels)
+        self.lock.acquire()
+        self.counters[key] = self.counters.get(key, 0) + n
+        self.lock.release()
 
-            # ----
-            # In client startup mode we suppress all messages until
-            # we sent the CONFIG1 and OUTPUT messages.
-            # ----
-            hid_type = ord(data[0])
-            if self.startup:
-                if hid_type == 0x03:
-                    self.had_config1 = True
-                elif hid_type == 0x01:
-                    self.had_output = True
-                else:
-                    if self.had_output and self.had_config1:
-                        self.startup = False
-                    else:
-                        continue
+    # ----------
+    # observe()
+    #
+    #   Add a time in seconds to a histogram.
+    # ----------
+    def observe(self, name, labels, seconds):
+        key = (name, labels)
+        bucket = bisect.bisect_left(self.BUCKETS, seconds)
+        self.lock.acquire()
+        hist = self.histograms.get(key)
+        if hist is None:
+            hist = [[0] * (len(self.BUCKETS) + 1), 0.0, 0]
+            self.histograms[key] = hist
+        hist[0][bucket] += 1
+        hist[1] += seconds
+        hist[2] += 1
+        self.lock.release()
 
-            # ----
-            # Format the client message according to the report type.
-            # ----
-            if hid_type == 0x81:
-                msg_fmt = '!BB5H2H'
-            elif hid_type == 0x01:
-                msg_fmt = '!BB8H2HB'
-            elif hid_type == 0x03:
-                msg_fmt = '!B2B5B8B2B5HB'
-            else:
-                try:
-                    self.client.send('ERROR unknown HID packet type ' +
-                            '0x{0:02X} received from card'.format(hid_type))
-                except:
-                    pass
-                break
+    # ----------
+    # samples()
+    #
+    #   All counters, histograms and the given gauges as a sorted list
+    #   of (name, labels, value). Histograms become their cumulative
+    #   buckets, sum and count.
+    # ----------
+    def samples(self, gauges):
+        self.lock.acquire()
+        counters = self.counters.items()
+        histograms = [(key, list(hist[0]), hist[1], hist[2])
+                for key, hist in self.histograms.items()]
+        self.lock.release()
 
-            message = ' '.join(str(elem) for elem in 
-                    struct.unpack(msg_fmt, data[0:struct.calcsize(msg_fmt)]))
+        result = [(name, labels, value)
+                for (name, labels), value in counters] + gauges
+        for (name, labels), buckets, total, count in histograms:
+            cumulative = 0
+            for i in range(len(buckets)):
+                cumulative += buckets[i]
+                if i < len(self.BUCKETS):
+                    le = repr(self.BUCKETS[i])
+                else:
+                    le = '+Inf'
+                result.append((name + '_bucket', labels + (('le', le), ),
+                        cumulative))
+            result.append((name + '_sum', labels, total))
+            result.append((name + '_count', labels, count))
 
-            try:
-                self.client.send('RECV ' + message + '\n')
-            except Exception as err:
-                log_error(str(err))
-                break
-            
         # ----
-        # The reader loop exited. Terminate this thread.
+        # Keep the buckets of a histogram in order of their bounds.
         # ----
-        self.set_status(MODE_STOPPED)
-        return
+        def sort_key(sample):
+            name, labels, _value = sample
+            if name.endswith('_bucket'):
+                bound = labels[-1][1]
+                return (name, labels[:-1],
+                        float('inf') if bound == '+Inf' else float(bound))
+            return (name, labels, 0.0)
+        result.sort(key = sort_key)
+        return result
 
-    def get_status(self):
-        #self.lock.acquire()
-        ret = self.status
-        #self.lock.release()
-        return ret
+    # ----------
+    # format()
+    #
+    #   The sample lines of samples(), with the HELP and TYPE lines of
+    #   each metric if with_help.
+    # ----------
+    @staticmethod
+    def format(samples, with_help = True):
+        lines = []
+        family = None
+        for name, labels, value in samples:
+            if with_help:
+                base = name
+                if base not in Open8055Metrics.HELP:
+                    base = base.rpartition('_')[0]
+                if base != family and base in Open8055Metrics.HELP:
+                    family = base
+                    mtype, text = Open8055Metrics.HELP[base]
+                    lines.append('# HELP {0} {1}'.format(base, text))
+                    lines.append('# TYPE {0} {1}'.format(base, mtype))
+            if labels:
+                name += '{' + ','.join(['{0}="{1}"'.format(key,
+                        str(val).replace('\\', '\\\\').replace('"', '\\"'))
+                        for key, val in labels]) + '}'
+            if isinstance(value, float):
+                value = repr(value)
+            lines.append('{0} {1}'.format(name, value))
+        return lines
 
-    def set_status(self, status):
-        #self.lock.acquire()
-        self.status = status
-        #self.lock.release()
+
+# ----------------------------------------------------------------------
+# Open8055MetricsHandler
+#
+#   Answers GET /metrics on metrics_port.
+# ----------------------------------------------------------------------
+class Open8055MetricsHandler(BaseHTTPServer.BaseHTTPRequestHandler):
+    timeout = 5
+
+    def do_GET(self):
+        if self.path != '/metrics':
+            self.send_error(404)
+            return
+        body = '\n'.join(Open8055Metrics.format(
+                self.server.open8055server.get_metrics())) + '\n'
+        self.send_response(200)
+        self.send_header('Content-Type', 'text/plain; version=0.0.4')
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, format, *args):
+        pass
+
+
+# ----------
+# make_wakeup_pair()
+#
+#   Return two connected sockets. Other threads write to the second
+#   one to wake up the event loop waiting for the first. Windows can
+#   only select() sockets and has no socketpair(), so there it is a
+#   TCP connection over the loopback interface.
+# ----------
+def make_wakeup_pair():
+    if hasattr(socket, 'socketpair'):
+        rsock, wsock = socket.socketpair()
+    else:
+        lsock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        lsock.bind(('127.0.0.1', 0))
+        lsock.listen(1)
+        wsock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        wsock.connect(lsock.getsockname())
+        rsock, _addr = lsock.accept()
+        lsock.close()
+    rsock.setblocking(0)
+    wsock.setblocking(0)
+    return rsock, wsock
+
+
+# ----------
+# file_stamp()
+#
+#   Modification time, size and inode of a file, to tell whether it
+#   changed, or None if it can't be found.
+# ----------
+def file_stamp(fname):
+    try:
+        st = os.stat(fname)
+    except OSError:
+        return None
+    return (st.st_mtime, st.st_size, st.st_ino)
+
+
+# ----------
+# ip_address_value()
+#
+#   The IPV6 mapped address of a TCP client as a 128 bit integer.
+#   Windows' Python 2 has no inet_pton(), there netaddr does it.
+# ----------
+def ip_address_value(host):
+    if not hasattr(socket, 'inet_pton'):
+        return netaddr.IPAddress(host).ipv6().value
+    if ':' in host:
+        high, low = struct.unpack('!QQ', socket.inet_pton(socket.AF_INET6,
+                host.partition('%')[0]))
+        return (high << 64) | low
+    return 0xFFFF00000000 | struct.unpack('!I', socket.inet_aton(host))[0]
 
 
 # ----------------------------------------------------------------------
@@ -959,6 +3907,12 @@ if os.name == 'posix':
             except Exception as err:
                 log_error('Open8055server failed: ' + str(err))
                 sys.exit(2)
+
+            # ----
+            # SIGHUP reloads the config file.
+            # ----
+            signal.signal(signal.SIGHUP,
+                    lambda signum, frame: server.request_reload())
             
             # ----
             # Wait until either the server stopped on its own due to some
@@ -967,6 +3921,11 @@ if os.name == 'posix':
             while server.get_status() != MODE_STOPPED:
                 try:
                     rdy, _dummy, _dummy = select.select((p_rd,), (), (), 2.0)
+                except select.error as err:
+                    if err.args[0] == errno.EINTR:
+                        continue
+                    log_error('select() failed: ' + str(err))
+                    sys.exit(3)
                 except Exception as err:
                     log_error('select() failed: ' + str(err))
                     sys.exit(3)
@@ -984,22 +3943,37 @@ if os.name == 'posix':
         os.close(p_rd)
 
         # ----
-        # Catch signals.
+        # Catch signals. SIGHUP is passed on to the server process,
+        # the others make it shut down.
         # ----
         signal.signal(signal.SIGINT, main_catch_signal)
         signal.signal(signal.SIGTERM, main_catch_signal)
+        signal.signal(signal.SIGHUP,
+                lambda signum, frame: os.kill(server_pid, signal.SIGHUP))
 
-        try:
-            wpid, status = os.wait()
-        except:
-            os.close(p_wr)
-            wpid, status = os.wait()
+        while True:
+            try:
+                wpid, status = os.wait()
+                break
+            except OSError as err:
+                if err.errno == errno.EINTR and not main_stop_requested:
+                    continue
+                os.close(p_wr)
+                wpid, status = os.wait()
+                break
+            except:
+                os.close(p_wr)
+                wpid, status = os.wait()
+                break
 
         return status
 
 
+    main_stop_requested = False
+
     def main_catch_signal(signum, frame):
-        pass
+        global main_stop_requested
+        main_stop_requested = True
 
 
     def log_info(message):